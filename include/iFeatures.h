@@ -31,10 +31,29 @@ namespace tpcl
 {
 
   class  CRegDictionary;         // registration Dictionary
-  class  CSpatialHash2D;
+  class  ISpatialIndex;
   struct CPtCloud;
 
 
+  /** how DownSample() represents the points of a voxel */
+  enum EDownSampleMode
+  {
+    DOWNSAMPLE_FIRST    = 0,  ///< the first point of the voxel (in cloud order)
+    DOWNSAMPLE_CENTROID = 1,  ///< the average position, normal and color of the voxel's points
+    DOWNSAMPLE_CLOSEST  = 2,  ///< the point closest to the center of the voxel
+  };
+
+
+  /** how FillNormals() estimates the plane around a point */
+  enum ENormalMode
+  {
+    NORMALS_RANSAC     = 0,  ///< RanSaC plane of (up to 100) points in radius
+    NORMALS_PCA        = 1,  ///< least squares plane of the k nearest points (closed form eigen solve)
+    NORMALS_PCA_ROBUST = 2,  ///< as NORMALS_PCA, reweighted to reduce the influence of points off the plane
+    NORMALS_INTEGRAL_IMAGE = 3, ///< organized scans: plane of a window of the scan's grid, from integral images (else NORMALS_PCA)
+  };
+
+
   /** Basic features calculations on point cloud. */
   class IFeatures
   {
@@ -43,14 +62,19 @@ namespace tpcl
     /** Estiamtes the normals for the input points
      *   optional: attfix z value of input points to z in the point's xy from the estimated plane around that point.
      *   also, updates the z value of the points to be on the found plane.
-     * @param io_pcl             point cloud to which normals are calculated
+     * @param io_pcl             point cloud to which normals are calculated. shapes (curvature,
+     *                           planarity, linearity) are also calculated if m_shape is allocated
      * @param in_radius          radius around each position to use for normal estimation
-     * @param in_pclHash         optional spatial hashing of point cloud (used for NN search).
+     * @param in_pclHash         optional spatial index of point cloud (used for NN search).
      *                           can include more points than io_pcl
      * @param in_fixZ            true: points are attached to the tangent plane
+     * @param in_mode            plane estimation method (see ENormalMode)
+     * @param in_numNeighbors    number of nearest neighbors for the NORMALS_PCA modes
+     *                           (NORMALS_INTEGRAL_IMAGE: minimal number of pixels in the window)
      */
     virtual void FillNormals(CPtCloud& io_pcl, float in_radius=10.0f,
-                             CSpatialHash2D* in_pclHash = 0, bool in_fixZ = false) = 0;
+                             ISpatialIndex* in_pclHash = 0, bool in_fixZ = false,
+                             ENormalMode in_mode = NORMALS_RANSAC, int in_numNeighbors = 20) = 0;
 
 
     /** denoise by range a point cloud. 
@@ -63,13 +87,40 @@ namespace tpcl
     virtual void DenoiseRange(const CPtCloud& in_pcl, CPtCloud& out_pcl,
                              int in_windowSize, float in_noiseTh) = 0;
 
+
+    /** denoise by range an unordered point cloud: the points are binned by azimuth/elevation
+     *  around an origin to a range image, which is filtered as in DenoiseRange.
+     * @param in_pcl            input point cloud
+     * @param out_pcl           denoised point cloud. Can be the same as in_pcl
+     * @param in_windowSize     "averaging" window size
+     * @param in_noiseTh        scale of noise (see DenoiseRange)
+     * @param in_angleRes       angular size of a range image cell (radians)
+     * @param in_origin         center of the projection (e.g. the sensor's position), in the coordinates of in_pcl
+     */
+    virtual void DenoiseRangeOfPointCloud(const CPtCloud& in_pcl, CPtCloud& out_pcl,
+                                          int in_windowSize, float in_noiseTh, float in_angleRes, const CVec3& in_origin) = 0;
+
     /** downsample a point cloud. Divides to grid from minXYZ (of pts) to max XYZ, of size m_voxelSize.
-     *  If more than one point in same grid index, takes the first one encountered.
+     *  Each occupied voxel gives one point (by default the first one encountered).
+     *  Colors and normals are kept if both clouds have them.
      * @param in_pcl             input point cloud.
      * @param out_pcl            downsampled point cloud. Can be the same as in_pcl
      * @param in_voxelSize       size of a voxel in grid. assums bigger than 0
+     * @param in_mode            point kept for each voxel (see EDownSampleMode)
+     */
+    virtual void DownSample(const CPtCloud& in_pcl, CPtCloud& out_pcl, float in_voxelSize,
+                            EDownSampleMode in_mode = DOWNSAMPLE_FIRST) = 0;
+
+
+    /** voxel grid filter: the centroid of each voxel, with the averaged normal and color
+     * @param in_pcl             input point cloud.
+     * @param out_pcl            centroids. Can be the same as in_pcl
+     * @param in_voxelSize       size of a voxel in grid. assums bigger than 0
+     * @param out_numVoxelPts    optional: number of points in each voxel
+     * @param out_cov            optional: covariance of each voxel's points (6 floats: xx, xy, xz, yy, yz, zz)
      */
-    virtual void DownSample(const CPtCloud& in_pcl, CPtCloud& out_pcl, float in_voxelSize) = 0;
+    virtual void VoxelCentroids(const CPtCloud& in_pcl, CPtCloud& out_pcl, float in_voxelSize,
+                                int* out_numVoxelPts = 0, float* out_cov = 0) = 0;
 
 
     /** finds the rotation matrix so that the new z axis will be in the normal direction. to be used: x_rotated = R * x.
@@ -7,7 +7,7 @@
 ******************************************************************************/
 
 #ifndef __tpcl_ptCloud_H
-#define __tpcl_ptcloud_H
+#define __tpcl_ptCloud_H
 
 /******************************************************************************
 *                                   IMPORTED                                  *
@@ -27,6 +27,16 @@ namespace tpcl
   /******************************************************************************
   *                              EXPORTED CLASSES                               *
   ******************************************************************************/
+  /** local shape of the surface around a point, from the eigenvalues l0 >= l1 >= l2
+   *  of the covariance of its neighbors (see IFeatures::FillNormals) */
+  struct CPtShape
+  {
+    float m_curvature;   ///< surface variation: l2 / (l0 + l1 + l2). 0 on a plane, up to 1/3
+    float m_planarity;   ///< (l1 - l2) / l0. 1 on a plane
+    float m_linearity;   ///< (l0 - l1) / l0. 1 on a line (edges, poles, wires)
+  };
+
+
   /******************************************************************************
   *
   *: Class name: PtCloud
@@ -51,6 +61,9 @@ namespace tpcl
     /** normals associated with each point (0 = no color information) */
     CVec3* m_normal;
 
+    /** optional: local shape (curvature, planarity, linearity) of each point (0 = no shape information) */
+    CPtShape* m_shape;
+
     /** number of points in the cloud */
     int m_numPts;
 
@@ -68,6 +81,7 @@ namespace tpcl
       m_numPts = 0;
       m_pos = m_normal = 0;
       m_color = 0; 
+      m_shape = 0;
     }
 
     //// constructor with size
@@ -54,6 +54,17 @@ namespace tpcl
     virtual void SetMainPtCloud(const CPtCloud& in_pcl, bool in_append = false) = 0;
 
 
+    /** Crop main cloud point: remove the points (and anything created from them) outside a 2D (x/y) box.
+     * Used to keep a sliding window of the map (with SetMainPtCloud(.., true) adding new areas).
+     * A main cloud hashed outside the class (e.g. ICP::SetMainPtCloud(ISpatialIndex*)) is not
+     * changed: it is cropped by its owner (CCoarseRegister crops the dictionary it gives ICP).
+     * The default keeps the whole cloud (for registrations that do not support cropping).
+     * @param in_minBox        minimum of the box to keep.
+     * @param in_maxBox        maximum of the box to keep.
+     */
+    virtual void CropMainPtCloud(const CVec3& /*in_minBox*/, const CVec3& /*in_maxBox*/) {};
+
+
     /** Get registration for a secondary point cloud against the main cloud
      * The second cloud is not stored
      * @param out_registration      best registration found.
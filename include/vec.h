@@ -514,7 +514,7 @@ namespace tpcl
   {
     rhs->m[0][1] = rhs->m[0][2]  = rhs->m[0][3]  = 
     rhs->m[1][0] = rhs->m[1][2]  = rhs->m[1][3]  = 
-    rhs->m[2][0] = rhs->m[2][1]  = rhs->m[1][3]  = 
+    rhs->m[2][0] = rhs->m[2][1]  = rhs->m[2][3]  = 
     rhs->m[3][0] = rhs->m[3][1]  = rhs->m[3][2]  = 0;
 
     rhs->m[0][0] = rhs->m[1][1] = rhs->m[2][2] = rhs->m[3][3] = 1;
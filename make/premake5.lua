@@ -78,3 +78,28 @@ project "Tests"
 
 	-- distribute executable in RecastDemo/Bin directory
 	targetdir "bin"
+
+
+
+-- benchmarks: a console application for each test/Bench*.cpp
+for _, l_file in ipairs(os.matchfiles("../test/Bench*.cpp")) do
+	project (path.getbasename(l_file))
+		language "C++"
+		kind "ConsoleApp"
+		flags { "Optimize" }
+
+		includedirs { 
+			"../include",
+			"../src/**",
+		}
+		files { 
+			l_file,
+		}
+
+		-- project dependencies
+		links { 
+			"TinyPCL",
+		}
+
+		targetdir "bin"
+end
@@ -0,0 +1,145 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+// 
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+#include "AbsOrient.h"
+#include "common.h"
+#include <math.h>
+
+
+namespace tpcl
+{
+  /** adjugate of a 4x4 matrix (from its 2x2 minors)
+   * @return          the determinant */
+  static double Adjugate4(const double a[4][4], double out_adj[4][4])
+  {
+    double s0 = a[0][0] * a[1][1] - a[1][0] * a[0][1];
+    double s1 = a[0][0] * a[1][2] - a[1][0] * a[0][2];
+    double s2 = a[0][0] * a[1][3] - a[1][0] * a[0][3];
+    double s3 = a[0][1] * a[1][2] - a[1][1] * a[0][2];
+    double s4 = a[0][1] * a[1][3] - a[1][1] * a[0][3];
+    double s5 = a[0][2] * a[1][3] - a[1][2] * a[0][3];
+    double c5 = a[2][2] * a[3][3] - a[3][2] * a[2][3];
+    double c4 = a[2][1] * a[3][3] - a[3][1] * a[2][3];
+    double c3 = a[2][1] * a[3][2] - a[3][1] * a[2][2];
+    double c2 = a[2][0] * a[3][3] - a[3][0] * a[2][3];
+    double c1 = a[2][0] * a[3][2] - a[3][0] * a[2][2];
+    double c0 = a[2][0] * a[3][1] - a[3][0] * a[2][1];
+
+    out_adj[0][0] =  a[1][1] * c5 - a[1][2] * c4 + a[1][3] * c3;
+    out_adj[0][1] = -a[0][1] * c5 + a[0][2] * c4 - a[0][3] * c3;
+    out_adj[0][2] =  a[3][1] * s5 - a[3][2] * s4 + a[3][3] * s3;
+    out_adj[0][3] = -a[2][1] * s5 + a[2][2] * s4 - a[2][3] * s3;
+    out_adj[1][0] = -a[1][0] * c5 + a[1][2] * c2 - a[1][3] * c1;
+    out_adj[1][1] =  a[0][0] * c5 - a[0][2] * c2 + a[0][3] * c1;
+    out_adj[1][2] = -a[3][0] * s5 + a[3][2] * s2 - a[3][3] * s1;
+    out_adj[1][3] =  a[2][0] * s5 - a[2][2] * s2 + a[2][3] * s1;
+    out_adj[2][0] =  a[1][0] * c4 - a[1][1] * c2 + a[1][3] * c0;
+    out_adj[2][1] = -a[0][0] * c4 + a[0][1] * c2 - a[0][3] * c0;
+    out_adj[2][2] =  a[3][0] * s4 - a[3][1] * s2 + a[3][3] * s0;
+    out_adj[2][3] = -a[2][0] * s4 + a[2][1] * s2 - a[2][3] * s0;
+    out_adj[3][0] = -a[1][0] * c3 + a[1][1] * c1 - a[1][2] * c0;
+    out_adj[3][1] =  a[0][0] * c3 - a[0][1] * c1 + a[0][2] * c0;
+    out_adj[3][2] = -a[3][0] * s3 + a[3][1] * s1 - a[3][2] * s0;
+    out_adj[3][3] =  a[2][0] * s3 - a[2][1] * s1 + a[2][2] * s0;
+
+    return s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+  }
+
+
+  bool AbsoluteOrientation(const double* in_H, CMat4& out_R)
+  {
+    MatrixIdentity(&out_R);
+
+    // the rotation does not depend on the scale of H: normalize it (|H| = 1)
+    double l_normSqr = 0;
+    for (int i = 0; i < 9; i++)
+      l_normSqr += in_H[i] * in_H[i];
+    if (!(l_normSqr > 0))
+      return false;
+    double l_invNorm = 1 / sqrt(l_normSqr);
+    double Sxx = in_H[0] * l_invNorm, Sxy = in_H[1] * l_invNorm, Sxz = in_H[2] * l_invNorm;
+    double Syx = in_H[3] * l_invNorm, Syy = in_H[4] * l_invNorm, Syz = in_H[5] * l_invNorm;
+    double Szx = in_H[6] * l_invNorm, Szy = in_H[7] * l_invNorm, Szz = in_H[8] * l_invNorm;
+
+    // the quaternion q maximizes q^T N q
+    double N[4][4] = {
+      { Sxx + Syy + Szz, Syz - Szy,        Szx - Sxz,        Sxy - Syx       },
+      { Syz - Szy,       Sxx - Syy - Szz,  Sxy + Syx,        Szx + Sxz       },
+      { Szx - Sxz,       Sxy + Syx,       -Sxx + Syy - Szz,  Syz + Szy       },
+      { Sxy - Syx,       Szx + Sxz,        Syz + Szy,       -Sxx - Syy + Szz } };
+
+    // characteristic polynomial of N (trace 0): l^4 + c2 l^2 + c1 l + c0
+    double l_adj[4][4];
+    double c2 = -2.0;   // -2 |H|^2
+    double c1 = -8 * (Sxx * (Syy * Szz - Syz * Szy) - Sxy * (Syx * Szz - Syz * Szx) + Sxz * (Syx * Szy - Syy * Szx));
+    double c0 = Adjugate4(N, l_adj);
+
+    // largest root: Newton from above (the largest eigenvalue is at most the sum of the singular values of H <= sqrt(3) |H|)
+    double l = sqrt(3.0);
+    for (int l_iter = 0; l_iter < 50; l_iter++)
+    {
+      double l2 = l * l;
+      double l_p = (l2 + c2) * l2 + c1 * l + c0;
+      double l_dp = (4 * l2 + 2 * c2) * l + c1;
+      if (!(l_dp > 0))
+        break;
+      double l_step = l_p / l_dp;
+      l -= l_step;
+      if (fabs(l_step) < 1e-13)
+        break;
+    }
+
+    // the columns of adj(N - l*I) are multiples of the eigenvector: take the longest
+    for (int i = 0; i < 4; i++)
+      N[i][i] -= l;
+    Adjugate4(N, l_adj);
+    int l_best = 0;
+    double l_bestSqr = 0;
+    for (int c = 0; c < 4; c++)
+    {
+      double l_sqr = l_adj[0][c] * l_adj[0][c] + l_adj[1][c] * l_adj[1][c] + l_adj[2][c] * l_adj[2][c] + l_adj[3][c] * l_adj[3][c];
+      if (l_sqr > l_bestSqr)
+      {
+        l_bestSqr = l_sqr;
+        l_best = c;
+      }
+    }
+    // (the longest column is about the product of the gaps to the other eigenvalues. For a double eigenvalue
+    //  it is the error of l, about 1e-8: the polynomial is flat there)
+    if (!(l_bestSqr > 1e-12))
+      return false;
+
+    double l_invLen = 1 / sqrt(l_bestSqr);
+    double w = l_adj[0][l_best] * l_invLen, x = l_adj[1][l_best] * l_invLen;
+    double y = l_adj[2][l_best] * l_invLen, z = l_adj[3][l_best] * l_invLen;
+
+    out_R.m[0][0] = float(w * w + x * x - y * y - z * z);
+    out_R.m[0][1] = float(2 * (x * y - w * z));
+    out_R.m[0][2] = float(2 * (x * z + w * y));
+    out_R.m[1][0] = float(2 * (x * y + w * z));
+    out_R.m[1][1] = float(w * w - x * x + y * y - z * z);
+    out_R.m[1][2] = float(2 * (y * z - w * x));
+    out_R.m[2][0] = float(2 * (x * z - w * y));
+    out_R.m[2][1] = float(2 * (y * z + w * x));
+    out_R.m[2][2] = float(w * w - x * x - y * y + z * z);
+    return true;
+  }
+
+} // namespace tpcl
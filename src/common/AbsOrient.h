@@ -0,0 +1,54 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+// 
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+
+/******************************************************************************
+*
+*: Package Name: AbsOrient
+*
+*: Title: absolute orientation: the rotation that best aligns two sets of
+*         matched points (Horn's quaternion method)
+*
+******************************************************************************/
+
+#ifndef __tpcl_AbsOrient_H
+#define __tpcl_AbsOrient_H
+
+
+#include "../../include/vec.h"
+
+namespace tpcl
+{
+/******************************************************************************
+*                            EXPORTED FUNCTIONS                               *
+******************************************************************************/
+
+  /** rotation R minimizing sum |R*a_i - b_i|^2 over the matched points a_i, b_i (relative to their centers).
+   *  Closed form (Horn 1987): R is the unit quaternion of the largest eigenvalue of a symmetric 4x4 matrix built
+   *  from H. The eigenvalue is the largest root of its characteristic polynomial (Newton), and the quaternion a
+   *  column of the adjugate. R is always a proper rotation (no reflection, even for planar or noisy points).
+   * @param in_H      cross-covariance sum(a_i * b_i^T), row major (3x3)
+   * @param out_R     the rotation (the rest of the 4x4 matrix is identity)
+   * @return          false if the rotation is not unique (the points are on a line, or H is 0): out_R is identity */
+  bool AbsoluteOrientation(const double* in_H, CMat4& out_R);
+
+} // namespace tpcl
+
+#endif
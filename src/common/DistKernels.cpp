@@ -0,0 +1,384 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+// 
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+
+
+#include "DistKernels.h"
+
+// x86 kernels are compiled for their instruction set per function, and chosen at run time
+#if !defined(TPCL_NO_SIMD) && (defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__))
+  #define TPCL_SIMD_X86
+  #include <immintrin.h>
+  #ifdef _MSC_VER
+    #include <intrin.h>
+    #define TPCL_TARGET_SSE
+    #define TPCL_TARGET_AVX2
+  #else
+    #define TPCL_TARGET_SSE   __attribute__((target("sse2")))
+    #define TPCL_TARGET_AVX2  __attribute__((target("avx2")))
+  #endif
+#endif
+
+namespace tpcl{
+
+/******************************************************************************
+*                             INTERNAL FUNCTIONS                              *
+******************************************************************************/
+
+#ifdef TPCL_SIMD_X86
+
+  /*****
+  *
+  *: SSE kernels (4 points at a time)
+  *
+  *****/
+  TPCL_TARGET_SSE static int NearestSSE(const float* in_x, const float* in_y, const float* in_z, int in_begin, int in_end,
+                                        const CVec3& in_pos, float in_max2dRadSqr, float& io_minDistSqr)
+  {
+    const __m128 l_px = _mm_set1_ps(in_pos.x), l_py = _mm_set1_ps(in_pos.y), l_pz = _mm_set1_ps(in_pos.z);
+    const __m128 l_rad = _mm_set1_ps(in_max2dRadSqr);
+    int l_best = -1;
+    float l_min = io_minDistSqr;
+    int i = in_begin;
+    for (; i + 4 <= in_end; i += 4)
+    {
+      __m128 dx = _mm_sub_ps(_mm_loadu_ps(in_x + i), l_px);
+      __m128 dy = _mm_sub_ps(_mm_loadu_ps(in_y + i), l_py);
+      __m128 dz = _mm_sub_ps(_mm_loadu_ps(in_z + i), l_pz);
+      __m128 l_d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+      __m128 l_d3 = _mm_add_ps(l_d2, _mm_mul_ps(dz, dz));
+      int l_mask = _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(l_d2, l_rad), _mm_cmplt_ps(l_d3, _mm_set1_ps(l_min))));
+      if (l_mask == 0)
+        continue;
+
+      // rare: resolve the candidates in order
+      float l_dist[4];
+      _mm_storeu_ps(l_dist, l_d3);
+      for (int j = 0; j < 4; ++j)
+        if (((l_mask >> j) & 1) && l_dist[j] < l_min)
+        {
+          l_min = l_dist[j];
+          l_best = i + j;
+        }
+    }
+    int l_tail = NearestScalar(in_x, in_y, in_z, i, in_end, in_pos, in_max2dRadSqr, l_min);
+    io_minDistSqr = l_min;
+    return (l_tail >= 0) ? l_tail : l_best;
+  }
+
+
+  TPCL_TARGET_SSE static int FilterSSE(const float* in_x, const float* in_y, const float* in_z, int in_begin, int in_end,
+                                       const CVec3& in_pos, float in_max2dRadSqr, float in_maxDistSqr, int* out_sel, float* out_distSqr)
+  {
+    const __m128 l_px = _mm_set1_ps(in_pos.x), l_py = _mm_set1_ps(in_pos.y), l_pz = _mm_set1_ps(in_pos.z);
+    const __m128 l_rad = _mm_set1_ps(in_max2dRadSqr), l_max = _mm_set1_ps(in_maxDistSqr);
+    int l_num = 0;
+    int i = in_begin;
+    for (; i + 4 <= in_end; i += 4)
+    {
+      __m128 dx = _mm_sub_ps(_mm_loadu_ps(in_x + i), l_px);
+      __m128 dy = _mm_sub_ps(_mm_loadu_ps(in_y + i), l_py);
+      __m128 dz = _mm_sub_ps(_mm_loadu_ps(in_z + i), l_pz);
+      __m128 l_d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+      __m128 l_d3 = _mm_add_ps(l_d2, _mm_mul_ps(dz, dz));
+      int l_mask = _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(l_d2, l_rad), _mm_cmplt_ps(l_d3, l_max)));
+      if (l_mask == 0)
+        continue;
+
+      float l_dist[4];
+      _mm_storeu_ps(l_dist, l_d3);
+      for (int j = 0; j < 4; ++j)
+      {
+        // branchless compaction
+        out_sel[l_num] = i + j;
+        out_distSqr[l_num] = l_dist[j];
+        l_num += (l_mask >> j) & 1;
+      }
+    }
+    return l_num + FilterScalar(in_x, in_y, in_z, i, in_end, in_pos, in_max2dRadSqr, in_maxDistSqr, out_sel + l_num, out_distSqr + l_num);
+  }
+
+
+  TPCL_TARGET_SSE static void DecodeSSE(const unsigned short* in_q, int in_num, float in_base, float in_step, float* out_v)
+  {
+    const __m128 l_base = _mm_set1_ps(in_base), l_step = _mm_set1_ps(in_step);
+    const __m128i l_zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 8 <= in_num; i += 8)
+    {
+      __m128i l_q = _mm_loadu_si128((const __m128i*)(in_q + i));
+      __m128 l_lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(l_q, l_zero));
+      __m128 l_hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(l_q, l_zero));
+      _mm_storeu_ps(out_v + i, _mm_add_ps(l_base, _mm_mul_ps(l_lo, l_step)));
+      _mm_storeu_ps(out_v + i + 4, _mm_add_ps(l_base, _mm_mul_ps(l_hi, l_step)));
+    }
+    DecodeScalar(in_q + i, in_num - i, in_base, in_step, out_v + i);
+  }
+
+
+  /** offsets of the values of a window (row major), for the median kernels */
+  static void WindowOffsets(int in_stride, int in_size, int* out_off)
+  {
+    for (int r = 0; r < in_size; ++r)
+      for (int dc = 0; dc < in_size; ++dc)
+        out_off[r * in_size + dc] = r * in_stride + dc;
+  }
+
+
+  /** SSE median: 4 windows at a time, one in each lane (see SelectMedian) */
+  TPCL_TARGET_SSE static void MedianSSE(const float* in_img, int in_stride, int in_size, int in_num, float* out_row)
+  {
+    const int l_n = in_size * in_size;
+    int l_off[MEDIAN_KERNEL_MAX_SIZE * MEDIAN_KERNEL_MAX_SIZE];
+    WindowOffsets(in_stride, in_size, l_off);
+    __m128 l_w[MEDIAN_KERNEL_MAX_SIZE * MEDIAN_KERNEL_MAX_SIZE];
+    int c = 0;
+    for (; l_n >= 3 && c + 4 <= in_num; c += 4)
+    {
+      const float* l_img = in_img + c;
+      int l_lo = 0, l_hi = l_n / 2 + 1, l_next = l_hi + 1;
+      for (int i = 0; i <= l_hi; ++i)
+        l_w[i] = _mm_loadu_ps(l_img + l_off[i]);
+      for (;;)
+      {
+        for (int i = l_lo + 1; i <= l_hi; ++i)
+        {
+          __m128 a = l_w[l_lo], b = l_w[i];
+          l_w[l_lo] = _mm_min_ps(a, b);
+          l_w[i] = _mm_max_ps(a, b);
+        }
+        for (int i = l_lo + 1; i < l_hi; ++i)
+        {
+          __m128 a = l_w[i], b = l_w[l_hi];
+          l_w[i] = _mm_min_ps(a, b);
+          l_w[l_hi] = _mm_max_ps(a, b);
+        }
+        if (l_next == l_n)
+          break;
+        l_w[l_hi] = _mm_loadu_ps(l_img + l_off[l_next++]);
+        l_lo++;
+      }
+      _mm_storeu_ps(out_row + c, l_w[l_lo + 1]);
+    }
+    MedianScalar(in_img + c, in_stride, in_size, in_num - c, out_row + c);
+  }
+
+
+  /*****
+  *
+  *: AVX2 kernels (8 points at a time)
+  *
+  *****/
+  TPCL_TARGET_AVX2 static int NearestAVX2(const float* in_x, const float* in_y, const float* in_z, int in_begin, int in_end,
+                                          const CVec3& in_pos, float in_max2dRadSqr, float& io_minDistSqr)
+  {
+    if (in_end - in_begin < 8)
+      return NearestScalar(in_x, in_y, in_z, in_begin, in_end, in_pos, in_max2dRadSqr, io_minDistSqr);
+    const __m256 l_px = _mm256_set1_ps(in_pos.x), l_py = _mm256_set1_ps(in_pos.y), l_pz = _mm256_set1_ps(in_pos.z);
+    const __m256 l_rad = _mm256_set1_ps(in_max2dRadSqr);
+    int l_best = -1;
+    float l_min = io_minDistSqr;
+    int i = in_begin;
+    for (; i + 8 <= in_end; i += 8)
+    {
+      __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(in_x + i), l_px);
+      __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(in_y + i), l_py);
+      __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(in_z + i), l_pz);
+      __m256 l_d2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+      __m256 l_d3 = _mm256_add_ps(l_d2, _mm256_mul_ps(dz, dz));
+      __m256 l_in = _mm256_and_ps(_mm256_cmp_ps(l_d2, l_rad, _CMP_LE_OQ), _mm256_cmp_ps(l_d3, _mm256_set1_ps(l_min), _CMP_LT_OQ));
+      int l_mask = _mm256_movemask_ps(l_in);
+      if (l_mask == 0)
+        continue;
+
+      // rare: resolve the candidates in order
+      float l_dist[8];
+      _mm256_storeu_ps(l_dist, l_d3);
+      for (int j = 0; j < 8; ++j)
+        if (((l_mask >> j) & 1) && l_dist[j] < l_min)
+        {
+          l_min = l_dist[j];
+          l_best = i + j;
+        }
+    }
+    // the remaining points (less than 8)
+    _mm256_zeroupper();
+    int l_tail = NearestSSE(in_x, in_y, in_z, i, in_end, in_pos, in_max2dRadSqr, l_min);
+    io_minDistSqr = l_min;
+    return (l_tail >= 0) ? l_tail : l_best;
+  }
+
+
+  TPCL_TARGET_AVX2 static int FilterAVX2(const float* in_x, const float* in_y, const float* in_z, int in_begin, int in_end,
+                                         const CVec3& in_pos, float in_max2dRadSqr, float in_maxDistSqr, int* out_sel, float* out_distSqr)
+  {
+    if (in_end - in_begin < 8)
+      return FilterScalar(in_x, in_y, in_z, in_begin, in_end, in_pos, in_max2dRadSqr, in_maxDistSqr, out_sel, out_distSqr);
+    const __m256 l_px = _mm256_set1_ps(in_pos.x), l_py = _mm256_set1_ps(in_pos.y), l_pz = _mm256_set1_ps(in_pos.z);
+    const __m256 l_rad = _mm256_set1_ps(in_max2dRadSqr), l_max = _mm256_set1_ps(in_maxDistSqr);
+    int l_num = 0;
+    int i = in_begin;
+    for (; i + 8 <= in_end; i += 8)
+    {
+      __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(in_x + i), l_px);
+      __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(in_y + i), l_py);
+      __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(in_z + i), l_pz);
+      __m256 l_d2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+      __m256 l_d3 = _mm256_add_ps(l_d2, _mm256_mul_ps(dz, dz));
+      __m256 l_in = _mm256_and_ps(_mm256_cmp_ps(l_d2, l_rad, _CMP_LE_OQ), _mm256_cmp_ps(l_d3, l_max, _CMP_LT_OQ));
+      int l_mask = _mm256_movemask_ps(l_in);
+      if (l_mask == 0)
+        continue;
+
+      float l_dist[8];
+      _mm256_storeu_ps(l_dist, l_d3);
+      for (int j = 0; j < 8; ++j)
+      {
+        // branchless compaction
+        out_sel[l_num] = i + j;
+        out_distSqr[l_num] = l_dist[j];
+        l_num += (l_mask >> j) & 1;
+      }
+    }
+    _mm256_zeroupper();
+    return l_num + FilterSSE(in_x, in_y, in_z, i, in_end, in_pos, in_max2dRadSqr, in_maxDistSqr, out_sel + l_num, out_distSqr + l_num);
+  }
+
+
+  /** AVX2 median: 8 windows at a time (see MedianSSE) */
+  TPCL_TARGET_AVX2 static void MedianAVX2(const float* in_img, int in_stride, int in_size, int in_num, float* out_row)
+  {
+    const int l_n = in_size * in_size;
+    int l_off[MEDIAN_KERNEL_MAX_SIZE * MEDIAN_KERNEL_MAX_SIZE];
+    WindowOffsets(in_stride, in_size, l_off);
+    __m256 l_w[MEDIAN_KERNEL_MAX_SIZE * MEDIAN_KERNEL_MAX_SIZE];
+    int c = 0;
+    for (; l_n >= 3 && c + 8 <= in_num; c += 8)
+    {
+      const float* l_img = in_img + c;
+      int l_lo = 0, l_hi = l_n / 2 + 1, l_next = l_hi + 1;
+      for (int i = 0; i <= l_hi; ++i)
+        l_w[i] = _mm256_loadu_ps(l_img + l_off[i]);
+      for (;;)
+      {
+        for (int i = l_lo + 1; i <= l_hi; ++i)
+        {
+          __m256 a = l_w[l_lo], b = l_w[i];
+          l_w[l_lo] = _mm256_min_ps(a, b);
+          l_w[i] = _mm256_max_ps(a, b);
+        }
+        for (int i = l_lo + 1; i < l_hi; ++i)
+        {
+          __m256 a = l_w[i], b = l_w[l_hi];
+          l_w[i] = _mm256_min_ps(a, b);
+          l_w[l_hi] = _mm256_max_ps(a, b);
+        }
+        if (l_next == l_n)
+          break;
+        l_w[l_hi] = _mm256_loadu_ps(l_img + l_off[l_next++]);
+        l_lo++;
+      }
+      _mm256_storeu_ps(out_row + c, l_w[l_lo + 1]);
+    }
+    // the remaining windows (less than 8)
+    _mm256_zeroupper();
+    MedianSSE(in_img + c, in_stride, in_size, in_num - c, out_row + c);
+  }
+
+
+  /** does the CPU (and the OS) support AVX2 */
+  static bool HasAVX2()
+  {
+#ifdef _MSC_VER
+    int l_regs[4];
+    __cpuid(l_regs, 0);
+    if (l_regs[0] < 7)
+      return false;
+    __cpuid(l_regs, 1);
+    const int l_osxsave = 1 << 27, l_avx = 1 << 28;
+    if ((l_regs[2] & (l_osxsave | l_avx)) != (l_osxsave | l_avx))
+      return false;
+    if ((_xgetbv(0) & 6) != 6)     // the OS saves the YMM registers
+      return false;
+    __cpuidex(l_regs, 7, 0);
+    return (l_regs[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+  }
+
+
+  /** does the CPU support SSE2 */
+  static bool HasSSE2()
+  {
+#if defined(_M_X64) || defined(__x86_64__)
+    return true;                  // part of x64
+#elif defined(_MSC_VER)
+    int l_regs[4];
+    __cpuid(l_regs, 1);
+    return (l_regs[3] & (1 << 26)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2") != 0;
+#endif
+  }
+
+#endif // TPCL_SIMD_X86
+
+
+/******************************************************************************
+*                            EXPORTED FUNCTIONS                               *
+******************************************************************************/
+
+  const CDistKernels& GetDistKernels()
+  {
+    static const CDistKernels s_kernels = GetSupportedDistKernels()[0];
+    return s_kernels;
+  }
+
+
+  const CDistKernels& GetScalarDistKernels()
+  {
+    static const CDistKernels s_kernels = { NearestScalar, FilterScalar, DecodeScalar, MedianScalar, "scalar" };
+    return s_kernels;
+  }
+
+
+  std::vector<CDistKernels> GetSupportedDistKernels()
+  {
+    std::vector<CDistKernels> l_kernels;
+#ifdef TPCL_SIMD_X86
+    if (HasAVX2())
+    {
+      CDistKernels l_avx2 = { NearestAVX2, FilterAVX2, DecodeSSE, MedianAVX2, "AVX2" };   // (decoding is bound by the loads)
+      l_kernels.push_back(l_avx2);
+    }
+    if (HasSSE2())
+    {
+      CDistKernels l_sse = { NearestSSE, FilterSSE, DecodeSSE, MedianSSE, "SSE" };
+      l_kernels.push_back(l_sse);
+    }
+#endif
+    l_kernels.push_back(GetScalarDistKernels());
+    return l_kernels;
+  }
+
+} // namespace tpcl
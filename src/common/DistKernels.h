@@ -0,0 +1,245 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+// 
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+
+/******************************************************************************
+*
+*: Package Name: DistKernels
+*
+*: Title: vectorized kernels: distances over points kept as a structure of arrays,
+*         and medians of image windows
+*
+******************************************************************************/
+
+#ifndef __tpcl_DistKernels_H
+#define __tpcl_DistKernels_H
+
+
+#include "../../include/vec.h"
+#include <vector>
+
+/******************************************************************************
+*                             EXPORTED CONSTANTS                              *
+******************************************************************************/
+
+namespace tpcl
+{
+  const int DIST_KERNEL_MIN_PTS = 8;      ///< shorter ranges are scanned faster by the inline scalar kernels (no call, no vector setup)
+  const int MEDIAN_KERNEL_MAX_SIZE = 9;   ///< largest window of the median kernels
+
+/******************************************************************************
+*                               EXPORTED TYPES                                *
+******************************************************************************/
+
+  /** nearest point of a range [in_begin, in_end) within a 2D radius.
+   *  Ties are resolved as a sequential scan would (the first point wins).
+   *  @param io_minDistSqr  in: distance a point must be under, out: distance of the nearest point found
+   *  @return index of the nearest point, -1 if no point is nearer than io_minDistSqr */
+  typedef int (*NearestKernel)(const float* in_x, const float* in_y, const float* in_z, int in_begin, int in_end,
+                               const CVec3& in_pos, float in_max2dRadSqr, float& io_minDistSqr);
+
+  /** points of a range [in_begin, in_end) within a 2D radius and under a 3D distance.
+   *  The points are returned in order.
+   *  @param out_sel      indices of the points (at least in_end - in_begin entries)
+   *  @param out_distSqr  3D distances of the points (at least in_end - in_begin entries)
+   *  @return number of points */
+  typedef int (*FilterKernel)(const float* in_x, const float* in_y, const float* in_z, int in_begin, int in_end,
+                              const CVec3& in_pos, float in_max2dRadSqr, float in_maxDistSqr, int* out_sel, float* out_distSqr);
+
+
+  /** decode quantized coordinates: out_v[i] = in_base + in_q[i] * in_step, i in [0, in_num) */
+  typedef void (*DecodeKernel)(const unsigned short* in_q, int in_num, float in_base, float in_step, float* out_v);
+
+
+  /** medians of the in_size x in_size windows along an image row (in_size odd, at most MEDIAN_KERNEL_MAX_SIZE):
+   *  out_row[c] = median of in_img[r * in_stride + c + dc], r and dc in [0, in_size), c in [0, in_num) */
+  typedef void (*MedianKernel)(const float* in_img, int in_stride, int in_size, int in_num, float* out_row);
+
+
+  /** a set of distance kernels */
+  struct CDistKernels
+  {
+    NearestKernel m_nearest;
+    FilterKernel m_filter;
+    DecodeKernel m_decode;
+    MedianKernel m_median;
+    const char* m_name;       ///< instruction set ("AVX2", "SSE" or "scalar")
+  };
+
+
+/******************************************************************************
+*                            EXPORTED FUNCTIONS                               *
+******************************************************************************/
+
+  /** scalar kernels (inline, for ranges too short for the vector kernels) */
+  inline int NearestScalar(const float* in_x, const float* in_y, const float* in_z, int in_begin, int in_end,
+                           const CVec3& in_pos, float in_max2dRadSqr, float& io_minDistSqr)
+  {
+    int l_best = -1;
+    for (int i = in_begin; i < in_end; ++i)
+    {
+      float dx = in_x[i] - in_pos.x, dy = in_y[i] - in_pos.y;
+      float l_dist2DSqr = dx * dx + dy * dy;
+      if (l_dist2DSqr > in_max2dRadSqr)
+        continue;
+      float dz = in_z[i] - in_pos.z;
+      float l_distSqr = l_dist2DSqr + dz * dz;
+      if (l_distSqr >= io_minDistSqr)
+        continue;
+      io_minDistSqr = l_distSqr;
+      l_best = i;
+    }
+    return l_best;
+  }
+
+
+  inline int FilterScalar(const float* in_x, const float* in_y, const float* in_z, int in_begin, int in_end,
+                          const CVec3& in_pos, float in_max2dRadSqr, float in_maxDistSqr, int* out_sel, float* out_distSqr)
+  {
+    int l_num = 0;
+    for (int i = in_begin; i < in_end; ++i)
+    {
+      float dx = in_x[i] - in_pos.x, dy = in_y[i] - in_pos.y;
+      float l_dist2DSqr = dx * dx + dy * dy;
+      if (l_dist2DSqr > in_max2dRadSqr)
+        continue;
+      float dz = in_z[i] - in_pos.z;
+      float l_distSqr = l_dist2DSqr + dz * dz;
+      if (l_distSqr >= in_maxDistSqr)
+        continue;
+      out_sel[l_num] = i;
+      out_distSqr[l_num] = l_distSqr;
+      l_num++;
+    }
+    return l_num;
+  }
+
+
+  inline void DecodeScalar(const unsigned short* in_q, int in_num, float in_base, float in_step, float* out_v)
+  {
+    for (int i = 0; i < in_num; ++i)
+      out_v[i] = in_base + in_q[i] * in_step;
+  }
+
+
+  /** median of in_num values (in_num odd) by forgetful selection: the minimum and maximum of the
+   *  first in_num/2 + 2 values cannot be the median. They are dropped and the next value is added,
+   *  until 3 values are left. Only min/max operations, so the vector kernels run the same steps.
+   *  The min/max take the second value when a value is NaN (as minps/maxps do), so all the kernels
+   *  give the same (unspecified) median for windows with NaNs.
+   *  io_v is reordered */
+  inline float SelectMedian(float* io_v, int in_num)
+  {
+    if (in_num < 3)
+      return io_v[0];
+    int l_lo = 0, l_hi = in_num / 2 + 1, l_next = l_hi + 1;
+    for (;;)
+    {
+      for (int i = l_lo + 1; i <= l_hi; ++i)    // minimum to l_lo
+      {
+        float a = io_v[l_lo], b = io_v[i];
+        io_v[l_lo] = (a < b) ? a : b;
+        io_v[i] = (a > b) ? a : b;
+      }
+      for (int i = l_lo + 1; i < l_hi; ++i)     // maximum to l_hi
+      {
+        float a = io_v[i], b = io_v[l_hi];
+        io_v[i] = (a < b) ? a : b;
+        io_v[l_hi] = (a > b) ? a : b;
+      }
+      if (l_next == in_num)
+        return io_v[l_lo + 1];
+      io_v[l_hi] = io_v[l_next++];
+      l_lo++;
+    }
+  }
+
+
+  inline void MedianScalar(const float* in_img, int in_stride, int in_size, int in_num, float* out_row)
+  {
+    float l_w[MEDIAN_KERNEL_MAX_SIZE * MEDIAN_KERNEL_MAX_SIZE];
+    for (int c = 0; c < in_num; ++c)
+    {
+      for (int r = 0; r < in_size; ++r)
+        for (int dc = 0; dc < in_size; ++dc)
+          l_w[r * in_size + dc] = in_img[r * in_stride + c + dc];
+      out_row[c] = SelectMedian(l_w, in_size * in_size);
+    }
+  }
+
+
+  /** the scalar kernels for points read through indices (point i is in_pts[in_id[i]]) */
+  inline int NearestRefScalar(const CVec3* in_pts, const int* in_id, int in_begin, int in_end,
+                              const CVec3& in_pos, float in_max2dRadSqr, float& io_minDistSqr)
+  {
+    int l_best = -1;
+    for (int i = in_begin; i < in_end; ++i)
+    {
+      const CVec3& l_pt = in_pts[in_id[i]];
+      float dx = l_pt.x - in_pos.x, dy = l_pt.y - in_pos.y;
+      float l_dist2DSqr = dx * dx + dy * dy;
+      if (l_dist2DSqr > in_max2dRadSqr)
+        continue;
+      float dz = l_pt.z - in_pos.z;
+      float l_distSqr = l_dist2DSqr + dz * dz;
+      if (l_distSqr >= io_minDistSqr)
+        continue;
+      io_minDistSqr = l_distSqr;
+      l_best = i;
+    }
+    return l_best;
+  }
+
+
+  inline int FilterRefScalar(const CVec3* in_pts, const int* in_id, int in_begin, int in_end,
+                             const CVec3& in_pos, float in_max2dRadSqr, float in_maxDistSqr, int* out_sel, float* out_distSqr)
+  {
+    int l_num = 0;
+    for (int i = in_begin; i < in_end; ++i)
+    {
+      const CVec3& l_pt = in_pts[in_id[i]];
+      float dx = l_pt.x - in_pos.x, dy = l_pt.y - in_pos.y;
+      float l_dist2DSqr = dx * dx + dy * dy;
+      if (l_dist2DSqr > in_max2dRadSqr)
+        continue;
+      float dz = l_pt.z - in_pos.z;
+      float l_distSqr = l_dist2DSqr + dz * dz;
+      if (l_distSqr >= in_maxDistSqr)
+        continue;
+      out_sel[l_num] = i;
+      out_distSqr[l_num] = l_distSqr;
+      l_num++;
+    }
+    return l_num;
+  }
+
+
+  /** the fastest kernels supported by the CPU (chosen once, on the first call) */
+  const CDistKernels& GetDistKernels();
+
+  /** the scalar kernels */
+  const CDistKernels& GetScalarDistKernels();
+
+  /** all the kernels supported by the CPU, fastest first (the scalar kernels last) */
+  std::vector<CDistKernels> GetSupportedDistKernels();
+
+} // namespace tpcl
+
+#endif
@@ -0,0 +1,709 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+// 
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+
+
+#include "KdTree.h"
+#include "common.h"
+#include "../include/ptCloud.h"
+#include <vector>
+#include <algorithm>    // std::nth_element
+#include <float.h>
+
+namespace tpcl{
+
+/******************************************************************************
+*                             INTERNAL CONSTANTS                              *
+******************************************************************************/
+
+  const int KD_LEAF_SIZE = 16;        ///< maximal number of points in a leaf
+  const int KD_PARALLEL_DEPTH = 6;    ///< the top levels are built serially, then 2^KD_PARALLEL_DEPTH subtrees in parallel
+  const int KD_MAX_STACK = 128;       ///< search stack (deeper than any median split tree)
+
+/******************************************************************************
+*                              INTERNAL CLASSES                               *
+******************************************************************************/
+
+/** node of the tree */
+struct CKdNode
+{
+  float m_min[3], m_max[3];   ///< bounding box of the node's points
+  int m_begin, m_end;         ///< the node's points: [m_begin, m_end)
+  int m_child;                ///< index of the first child (second child is m_child+1). -1 for leaves
+};
+
+
+/** subtree left to be built in parallel */
+struct CKdTask
+{
+  int m_node, m_begin, m_end;
+};
+
+
+/** data of the tree.
+ *  When built from a cloud (reference mode) only the point indices are kept, and the
+ *  positions are read from the cloud */
+struct CKdData
+{
+  std::vector<CKdNode> m_nodes;       ///< tree nodes (root is the first)
+  std::vector<float> m_x, m_y, m_z;   ///< positions of the points (in leaf order, empty in reference mode)
+  std::vector<void*> m_obj;           ///< objects associated with the points (in leaf order, empty in reference mode)
+  std::vector<int> m_id;              ///< index of the points (order of insertion / index in the cloud)
+  const CVec3* m_ref;                 ///< positions of the referenced cloud (0 if positions are copied)
+
+  std::vector<CVec3> m_addPts;        ///< points added since last build
+  std::vector<void*> m_addObj;        ///< objects added since last build
+  std::vector<int> m_addId;           ///< indices of the points added since last build
+  int m_nextId;                       ///< index of the next point added
+
+  CKdData() : m_ref(0), m_nextId(0) {}
+
+  /** position of a point (in leaf order) */
+  CVec3 Pos(int i) const  { return m_ref ? m_ref[m_id[i]] : CVec3(m_x[i], m_y[i], m_z[i]); }
+
+  /** object of a point (the position in the cloud in reference mode) */
+  void* Obj(int i) const  { return m_ref ? (void*)(m_ref + m_id[i]) : m_obj[i]; }
+};
+
+
+/** squared distance between a point and the 2D (x/y) projection of a node's box */
+inline float BoxDistSqr2D(const CKdNode& in_node, const CVec3& in_pos)
+{
+  float dx = MaxT(MaxT(in_node.m_min[0] - in_pos.x, in_pos.x - in_node.m_max[0]), 0.0f);
+  float dy = MaxT(MaxT(in_node.m_min[1] - in_pos.y, in_pos.y - in_node.m_max[1]), 0.0f);
+  return dx * dx + dy * dy;
+}
+
+/** squared distance between a point and a node's box */
+inline float BoxDistSqr(const CKdNode& in_node, const CVec3& in_pos)
+{
+  float dz = MaxT(MaxT(in_node.m_min[2] - in_pos.z, in_pos.z - in_node.m_max[2]), 0.0f);
+  return BoxDistSqr2D(in_node, in_pos) + dz * dz;
+}
+
+
+/** spread the lower 10 bits of a value to every 3rd bit (for Morton codes) */
+inline unsigned int SpreadBits3(unsigned int v)
+{
+  v &= 0x3FF;
+  v = (v | (v << 16)) & 0x030000FF;
+  v = (v | (v << 8)) & 0x0300F00F;
+  v = (v | (v << 4)) & 0x030C30C3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+
+/** order positions along a Morton (Z-order) curve of their bounding box, so that
+ *  consecutive queries visit the same nodes */
+static void MortonOrder(const CVec3* in_pts, int in_num, std::vector<std::pair<unsigned int, int> >& out_order)
+{
+  CVec3 l_min = in_pts[0], l_max = l_min;
+  for (int i = 1; i < in_num; ++i)
+  {
+    l_min = Min_ps(l_min, in_pts[i]);
+    l_max = Max_ps(l_max, in_pts[i]);
+  }
+  CVec3 l_ext = l_max - l_min;
+  float l_scale = 1023.0f / MaxT(MaxT(MaxT(l_ext.x, l_ext.y), l_ext.z), 1E-20f);
+  out_order.resize(in_num);
+  for (int i = 0; i < in_num; ++i)
+  {
+    CVec3 l_q = (in_pts[i] - l_min) * l_scale;
+    unsigned int l_code = SpreadBits3((unsigned int)l_q.x) | (SpreadBits3((unsigned int)l_q.y) << 1) | (SpreadBits3((unsigned int)l_q.z) << 2);
+    out_order[i] = std::make_pair(l_code, i);
+  }
+  std::sort(out_order.begin(), out_order.end());
+}
+
+
+/** build a subtree (recursive)
+ * @param in_pts        all points
+ * @param io_perm       order of the points, partitioned between nodes
+ * @param io_nodes      the nodes array. in_node must already be allocated
+ * @param in_depth      depth left before leaving the node as a task (ignored if out_tasks is 0)
+ * @param out_tasks     (optional) subtrees left to build */
+static void BuildSubtree(const CVec3* in_pts, int* io_perm, std::vector<CKdNode>& io_nodes, int in_node, 
+                         int in_begin, int in_end, int in_depth, std::vector<CKdTask>* out_tasks)
+{
+  // bounding box
+  CVec3 l_min = in_pts[io_perm[in_begin]], l_max = l_min;
+  for (int i = in_begin + 1; i < in_end; ++i)
+  {
+    l_min = Min_ps(l_min, in_pts[io_perm[i]]);
+    l_max = Max_ps(l_max, in_pts[io_perm[i]]);
+  }
+  CKdNode& l_node = io_nodes[in_node];
+  for (int a = 0; a < 3; ++a)
+  {
+    l_node.m_min[a] = l_min[a];
+    l_node.m_max[a] = l_max[a];
+  }
+  l_node.m_begin = in_begin;
+  l_node.m_end = in_end;
+  l_node.m_child = -1;
+
+  if (in_end - in_begin <= KD_LEAF_SIZE)
+    return;
+  if (out_tasks != 0 && in_depth == 0)
+  {
+    CKdTask l_task = { in_node, in_begin, in_end };
+    out_tasks->push_back(l_task);
+    return;
+  }
+
+  // split the longest axis at the median
+  CVec3 l_ext = l_max - l_min;
+  int l_axis = (l_ext.x >= l_ext.y && l_ext.x >= l_ext.z) ? 0 : (l_ext.y >= l_ext.z ? 1 : 2);
+  if (l_ext[l_axis] <= 0)
+    return;   // all points are the same - keep as a (large) leaf
+  int l_mid = (in_begin + in_end) / 2;
+  std::nth_element(io_perm + in_begin, io_perm + l_mid, io_perm + in_end,
+                   [in_pts, l_axis](int a, int b) { return in_pts[a][l_axis] < in_pts[b][l_axis]; });
+
+  int l_child = int(io_nodes.size());
+  io_nodes.resize(l_child + 2);
+  io_nodes[in_node].m_child = l_child;
+  BuildSubtree(in_pts, io_perm, io_nodes, l_child, in_begin, l_mid, in_depth - 1, out_tasks);
+  BuildSubtree(in_pts, io_perm, io_nodes, l_child + 1, l_mid, in_end, in_depth - 1, out_tasks);
+}
+
+
+/** build the whole tree
+ * @param out_perm      the points in leaf order */
+static void BuildTree(const CVec3* in_pts, int in_num, std::vector<CKdNode>& out_nodes, std::vector<int>& out_perm)
+{
+  out_perm.resize(in_num);
+  for (int i = 0; i < in_num; ++i)
+    out_perm[i] = i;
+
+  // top of the tree
+  std::vector<CKdTask> l_tasks;
+  out_nodes.resize(1);
+  BuildSubtree(in_pts, out_perm.data(), out_nodes, 0, 0, in_num, KD_PARALLEL_DEPTH, &l_tasks);
+
+  // subtrees
+  int l_numTasks = int(l_tasks.size());
+  std::vector< std::vector<CKdNode> > l_subtrees(l_numTasks);
+  #pragma omp parallel for schedule(dynamic)
+  for (int t = 0; t < l_numTasks; ++t)
+  {
+    l_subtrees[t].resize(1);
+    BuildSubtree(in_pts, out_perm.data(), l_subtrees[t], 0, l_tasks[t].m_begin, l_tasks[t].m_end, 0, 0);
+  }
+
+  // append the subtrees (the subtree's root replaces the task's node)
+  for (int t = 0; t < l_numTasks; ++t)
+  {
+    const std::vector<CKdNode>& l_sub = l_subtrees[t];
+    int l_shift = int(out_nodes.size()) - 1;
+    for (unsigned int n = 0; n < l_sub.size(); ++n)
+    {
+      CKdNode l_node = l_sub[n];
+      if (l_node.m_child >= 0)
+        l_node.m_child += l_shift;
+      if (n == 0)
+        out_nodes[l_tasks[t].m_node] = l_node;
+      else
+        out_nodes.push_back(l_node);
+    }
+  }
+}
+
+
+/** build the tree from points and store them (copied) in leaf order */
+static void BuildCopied(CKdData& io_data, const std::vector<CVec3>& in_pts, const std::vector<void*>& in_obj, const std::vector<int>& in_id)
+{
+  int l_num = int(in_pts.size());
+  std::vector<int> l_perm;
+  BuildTree(in_pts.data(), l_num, io_data.m_nodes, l_perm);
+
+  // store points in leaf order
+  io_data.m_x.resize(l_num);  io_data.m_y.resize(l_num);  io_data.m_z.resize(l_num);
+  io_data.m_obj.resize(l_num);  io_data.m_id.resize(l_num);
+  #pragma omp parallel for
+  for (int i = 0; i < l_num; ++i)
+  {
+    const CVec3& l_pt = in_pts[l_perm[i]];
+    io_data.m_x[i] = l_pt.x;  io_data.m_y[i] = l_pt.y;  io_data.m_z[i] = l_pt.z;
+    io_data.m_obj[i] = in_obj[l_perm[i]];
+    io_data.m_id[i] = in_id[l_perm[i]];
+  }
+}
+
+
+/** nearest point search
+ * @return    the nearest point (in leaf order), -1 if none */
+static int SearchNearest(const CKdData& in_data, const CVec3& in_pos, float in_max2DRadius, CVec3* out_pMinPt)
+{
+  int l_minI = -1;
+  CVec3 l_minPt(0, 0, 0);
+  float l_minDistSqr = 1E20f;
+  float max2dRadSqr = in_max2DRadius * in_max2DRadius;
+
+  int l_stack[KD_MAX_STACK];
+  int l_top = 0;
+  if (!in_data.m_nodes.empty())
+    l_stack[l_top++] = 0;
+  while (l_top > 0)
+  {
+    const CKdNode& l_node = in_data.m_nodes[l_stack[--l_top]];
+    if (BoxDistSqr2D(l_node, in_pos) > max2dRadSqr || BoxDistSqr(l_node, in_pos) >= l_minDistSqr)
+      continue;
+
+    if (l_node.m_child >= 0)
+    {
+      // visit the nearer child first (pushed last)
+      int l_near = l_node.m_child, l_far = l_node.m_child + 1;
+      if (BoxDistSqr(in_data.m_nodes[l_far], in_pos) < BoxDistSqr(in_data.m_nodes[l_near], in_pos))
+        SwapT(l_near, l_far);
+      l_stack[l_top++] = l_far;
+      l_stack[l_top++] = l_near;
+      continue;
+    }
+
+    // search the points in the leaf
+    for (int i = l_node.m_begin; i < l_node.m_end; ++i)
+    {
+      CVec3 l_pt = in_data.Pos(i);
+      float dx = l_pt.x - in_pos.x, dy = l_pt.y - in_pos.y;
+      float l_dist2DSqr = dx * dx + dy * dy;
+      if (l_dist2DSqr > max2dRadSqr)
+        continue;
+      float dz = l_pt.z - in_pos.z;
+      float l_distSqr = l_dist2DSqr + dz * dz;
+      if (l_distSqr >= l_minDistSqr)
+        continue;
+      l_minDistSqr = l_distSqr;
+      l_minPt = l_pt;
+      l_minI = i;
+    }
+  }
+
+  if (out_pMinPt != 0)
+    *out_pMinPt = l_minPt;
+  return l_minI;
+}
+
+
+/** collect the points in a 2D radius (objects and/or indices)
+ * @return    number of points collected */
+static int GatherNear(const CKdData& in_data, const CVec3& in_pos, float in_max2DRadius, int in_bufSize,
+                      void** out_obj, int* out_idx, CVec3* out_pos)
+{
+  int l_n = 0;    // number of objects
+  float max2dRadSqr = in_max2DRadius * in_max2DRadius;
+
+  int l_stack[KD_MAX_STACK];
+  int l_top = 0;
+  if (!in_data.m_nodes.empty())
+    l_stack[l_top++] = 0;
+  while (l_top > 0)
+  {
+    const CKdNode& l_node = in_data.m_nodes[l_stack[--l_top]];
+    if (BoxDistSqr2D(l_node, in_pos) > max2dRadSqr)
+      continue;
+
+    if (l_node.m_child >= 0)
+    {
+      l_stack[l_top++] = l_node.m_child + 1;
+      l_stack[l_top++] = l_node.m_child;
+      continue;
+    }
+
+    for (int i = l_node.m_begin; i < l_node.m_end; ++i)
+    {
+      CVec3 l_pt = in_data.Pos(i);
+      float dx = l_pt.x - in_pos.x, dy = l_pt.y - in_pos.y;
+      if (dx * dx + dy * dy > max2dRadSqr)
+        continue;
+      if (out_obj != 0)
+        out_obj[l_n] = in_data.Obj(i);
+      if (out_idx != 0)
+        out_idx[l_n] = in_data.m_id[i];
+      if (out_pos != 0)
+        out_pos[l_n] = l_pt;
+      if (++l_n >= in_bufSize)
+        return in_bufSize;
+    }
+  }
+  return l_n;
+}
+
+
+/******************************************************************************
+*                           EXPORTED CLASS METHODS                            *
+******************************************************************************/
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//                           CKdTree3D
+//
+///////////////////////////////////////////////////////////////////////////////
+/******************************************************************************
+*
+*: Method name: CKdTree3D
+*
+******************************************************************************/
+CKdTree3D::CKdTree3D (float res)
+{
+  m_data = new CKdData();
+  m_res = res;
+}
+
+/******************************************************************************
+*
+*: Method name: ~CKdTree3D
+*
+******************************************************************************/
+CKdTree3D::~CKdTree3D ()
+{
+  delete ((CKdData*)m_data);
+}
+
+
+/******************************************************************************
+*
+*: Method name: Add
+*
+******************************************************************************/
+void CKdTree3D::Add(const CVec3& in_pos, void* in_obj)
+{
+  CKdData* l_data = (CKdData*)m_data;
+  l_data->m_addPts.push_back(in_pos);
+  l_data->m_addObj.push_back(in_obj);
+  l_data->m_addId.push_back(l_data->m_nextId++);
+}
+
+
+/******************************************************************************
+*
+*: Method name: Build
+*
+* The top KD_PARALLEL_DEPTH levels are built serially, the remaining subtrees
+* are built in parallel (each into its own nodes array) and then appended.
+* Points of a referenced cloud are copied (the result is not in reference mode).
+******************************************************************************/
+void CKdTree3D::Build()
+{
+  CKdData* l_data = (CKdData*)m_data;
+  if (l_data->m_addPts.empty())
+    return;
+
+  // gather all points
+  int l_numOld = int(l_data->m_id.size());
+  int l_num = l_numOld + int(l_data->m_addPts.size());
+  std::vector<CVec3> l_pts(l_num);
+  std::vector<void*> l_obj(l_num);
+  std::vector<int> l_id(l_num);
+  for (int i = 0; i < l_numOld; ++i)
+  {
+    l_pts[i] = l_data->Pos(i);
+    l_obj[i] = l_data->Obj(i);
+    l_id[i] = l_data->m_id[i];
+  }
+  std::copy(l_data->m_addPts.begin(), l_data->m_addPts.end(), l_pts.begin() + l_numOld);
+  std::copy(l_data->m_addObj.begin(), l_data->m_addObj.end(), l_obj.begin() + l_numOld);
+  std::copy(l_data->m_addId.begin(), l_data->m_addId.end(), l_id.begin() + l_numOld);
+  l_data->m_addPts.clear();
+  l_data->m_addObj.clear();
+  l_data->m_addId.clear();
+
+  l_data->m_ref = 0;
+  BuildCopied(*l_data, l_pts, l_obj, l_id);
+}
+
+
+/******************************************************************************
+*
+*: Method name: Build (reference mode)
+*
+* Only the indices of the points are stored (in leaf order).
+******************************************************************************/
+void CKdTree3D::Build(const CPtCloud& in_pcl)
+{
+  CKdData* l_data = (CKdData*)m_data;
+  Clear();
+  if (in_pcl.m_numPts <= 0)
+    return;
+  BuildTree(in_pcl.m_pos, in_pcl.m_numPts, l_data->m_nodes, l_data->m_id);
+  l_data->m_ref = in_pcl.m_pos;
+  l_data->m_nextId = in_pcl.m_numPts;
+}
+
+
+/******************************************************************************
+*
+*: Method name: Append
+*
+* The tree is built again over the whole cloud.
+******************************************************************************/
+void CKdTree3D::Append(const CPtCloud& in_pcl)
+{
+  Build(in_pcl);
+}
+
+
+/******************************************************************************
+*
+*: Method name: DeleteWhenUnread
+*
+* Queries do not run in parallel with writers: no query reads the array.
+******************************************************************************/
+void CKdTree3D::DeleteWhenUnread(CVec3* in_array)
+{
+  delete[] in_array;
+}
+
+
+/******************************************************************************
+*
+*: Method name: FindNearest
+*
+******************************************************************************/
+void* CKdTree3D::FindNearest(const CVec3& in_pos, CVec3* out_pMinPt, float in_max2DRadius) const
+{
+  const CKdData& l_data = *(CKdData*)m_data;
+  int l_minI = SearchNearest(l_data, in_pos, MaxT(in_max2DRadius, 0.01f * m_res), out_pMinPt);
+  return l_minI < 0 ? 0 : l_data.Obj(l_minI);
+}
+
+
+/******************************************************************************
+*
+*: Method name: FindNearestIdx
+*
+******************************************************************************/
+int CKdTree3D::FindNearestIdx(const CVec3& in_pos, CVec3* out_pMinPt, float in_max2DRadius) const
+{
+  const CKdData& l_data = *(CKdData*)m_data;
+  int l_minI = SearchNearest(l_data, in_pos, MaxT(in_max2DRadius, 0.01f * m_res), out_pMinPt);
+  return l_minI < 0 ? -1 : l_data.m_id[l_minI];
+}
+
+
+/******************************************************************************
+*
+*: Method name: GetNear
+*
+******************************************************************************/
+int CKdTree3D::GetNear(const CVec3& in_pos, int in_bufSize, void** out_buf, CVec3* out_pos, float in_max2DRadius) const
+{
+  return GatherNear(*(CKdData*)m_data, in_pos, MaxT(in_max2DRadius, 0.01f * m_res), in_bufSize, out_buf, 0, out_pos);
+}
+
+
+/******************************************************************************
+*
+*: Method name: GetNearIdx
+*
+******************************************************************************/
+int CKdTree3D::GetNearIdx(const CVec3& in_pos, int in_bufSize, int* out_idx, CVec3* out_pos, float in_max2DRadius) const
+{
+  return GatherNear(*(CKdData*)m_data, in_pos, MaxT(in_max2DRadius, 0.01f * m_res), in_bufSize, 0, out_idx, out_pos);
+}
+
+
+/******************************************************************************
+*
+*: Method name: FindKNearest
+*
+* Queries are handled in Morton order (in parallel). Each query is a depth
+* first search visiting the nearer child first, and pruning nodes further than
+* the k-th neighbor found so far. The neighbors are kept sorted (insertion).
+******************************************************************************/
+void CKdTree3D::FindKNearest(const CVec3* in_queries, int in_numQueries, int in_k, int* out_idx, float* out_distSqr,
+                             float in_max2DRadius, CVec3* out_pos) const
+{
+  const CKdData& l_data = *(CKdData*)m_data;
+  if (in_numQueries <= 0 || in_k <= 0)
+    return;
+  float max2dRadSqr = (in_max2DRadius > 0) ? in_max2DRadius * in_max2DRadius : FLT_MAX;
+
+  static thread_local std::vector<std::pair<unsigned int, int> > l_order;   // (kept by the calling thread: repeated batches do not allocate)
+  MortonOrder(in_queries, in_numQueries, l_order);
+  const std::pair<unsigned int, int>* l_queryOrder = &l_order[0];   // (the other threads of the loop read the caller's order, not their own)
+
+  #pragma omp parallel for schedule(dynamic, 64)
+  for (int q = 0; q < in_numQueries; ++q)
+  {
+    int l_qi = l_queryOrder[q].second;
+    const CVec3& l_pos = in_queries[l_qi];
+    int* l_idx = out_idx + l_qi * in_k;
+    float* l_distSqr = out_distSqr + l_qi * in_k;
+    CVec3* l_pts = (out_pos != 0) ? out_pos + l_qi * in_k : 0;
+    int l_num = 0;
+
+    int l_stack[KD_MAX_STACK];
+    int l_top = 0;
+    if (!l_data.m_nodes.empty())
+      l_stack[l_top++] = 0;
+    while (l_top > 0)
+    {
+      const CKdNode& l_node = l_data.m_nodes[l_stack[--l_top]];
+      float l_worst = (l_num < in_k) ? FLT_MAX : l_distSqr[in_k - 1];
+      if (BoxDistSqr2D(l_node, l_pos) > max2dRadSqr || BoxDistSqr(l_node, l_pos) >= l_worst)
+        continue;
+
+      if (l_node.m_child >= 0)
+      {
+        int l_near = l_node.m_child, l_far = l_node.m_child + 1;
+        if (BoxDistSqr(l_data.m_nodes[l_far], l_pos) < BoxDistSqr(l_data.m_nodes[l_near], l_pos))
+          SwapT(l_near, l_far);
+        l_stack[l_top++] = l_far;
+        l_stack[l_top++] = l_near;
+        continue;
+      }
+
+      for (int i = l_node.m_begin; i < l_node.m_end; ++i)
+      {
+        CVec3 l_pt = l_data.Pos(i);
+        float dx = l_pt.x - l_pos.x, dy = l_pt.y - l_pos.y;
+        float l_dist2DSqr = dx * dx + dy * dy;
+        if (l_dist2DSqr > max2dRadSqr)
+          continue;
+        float dz = l_pt.z - l_pos.z;
+        float l_d = l_dist2DSqr + dz * dz;
+        if (l_num == in_k && l_d >= l_distSqr[in_k - 1])
+          continue;
+
+        // insert keeping the neighbors sorted
+        int j = (l_num < in_k) ? l_num++ : in_k - 1;
+        for (; j > 0 && l_distSqr[j - 1] > l_d; --j)
+        {
+          l_distSqr[j] = l_distSqr[j - 1];
+          l_idx[j] = l_idx[j - 1];
+          if (l_pts != 0)
+            l_pts[j] = l_pts[j - 1];
+        }
+        l_distSqr[j] = l_d;
+        l_idx[j] = l_data.m_id[i];
+        if (l_pts != 0)
+          l_pts[j] = l_pt;
+      }
+    }
+
+    // missing neighbors
+    for (int j = l_num; j < in_k; ++j)
+    {
+      l_idx[j] = -1;
+      l_distSqr[j] = FLT_MAX;
+      if (l_pts != 0)
+        l_pts[j] = CVec3(0, 0, 0);
+    }
+  }
+}
+
+
+/******************************************************************************
+*
+*: Method name: FindNearestApprox
+*
+* Each query descends to the nearer child only, and searches a single leaf.
+* The points that are not searched are in the children skipped on the way
+* down, and are at least as far as the nearest of their boxes (error bound).
+******************************************************************************/
+void CKdTree3D::FindNearestApprox(const CVec3* in_queries, int in_numQueries, int* out_idx, float* out_distSqr,
+                                  float in_max2DRadius, CVec3* out_pos, float* out_errBound) const
+{
+  const CKdData& l_data = *(CKdData*)m_data;
+  if (in_numQueries <= 0)
+    return;
+  float max2dRadSqr = (in_max2DRadius > 0) ? in_max2DRadius * in_max2DRadius : FLT_MAX;
+
+  static thread_local std::vector<std::pair<unsigned int, int> > l_order;   // (kept by the calling thread: repeated batches do not allocate)
+  MortonOrder(in_queries, in_numQueries, l_order);
+  const std::pair<unsigned int, int>* l_queryOrder = &l_order[0];   // (the other threads of the loop read the caller's order, not their own)
+
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (int i = 0; i < in_numQueries; ++i)
+  {
+    int q = l_queryOrder[i].second;
+    const CVec3& l_pos = in_queries[q];
+    int l_minI = -1;
+    float l_minDistSqr = FLT_MAX;
+    float l_skippedSqr = FLT_MAX;   // (squared) distance of the nearest box skipped
+
+    int l_node = l_data.m_nodes.empty() ? -1 : 0;
+    while (l_node >= 0 && l_data.m_nodes[l_node].m_child >= 0)
+    {
+      int l_near = l_data.m_nodes[l_node].m_child, l_far = l_near + 1;
+      if (BoxDistSqr(l_data.m_nodes[l_far], l_pos) < BoxDistSqr(l_data.m_nodes[l_near], l_pos))
+        SwapT(l_near, l_far);
+      if (BoxDistSqr2D(l_data.m_nodes[l_far], l_pos) <= max2dRadSqr)
+        l_skippedSqr = MinT(l_skippedSqr, BoxDistSqr(l_data.m_nodes[l_far], l_pos));
+      l_node = l_near;
+    }
+
+    // search the points in the leaf
+    if (l_node >= 0)
+    {
+      const CKdNode& l_leaf = l_data.m_nodes[l_node];
+      for (int j = l_leaf.m_begin; j < l_leaf.m_end; ++j)
+      {
+        CVec3 l_pt = l_data.Pos(j);
+        float dx = l_pt.x - l_pos.x, dy = l_pt.y - l_pos.y;
+        float l_dist2DSqr = dx * dx + dy * dy;
+        if (l_dist2DSqr > max2dRadSqr)
+          continue;
+        float dz = l_pt.z - l_pos.z;
+        float l_distSqr = l_dist2DSqr + dz * dz;
+        if (l_distSqr >= l_minDistSqr)
+          continue;
+        l_minDistSqr = l_distSqr;
+        l_minI = j;
+      }
+    }
+
+    out_idx[q] = (l_minI >= 0) ? l_data.m_id[l_minI] : -1;
+    out_distSqr[q] = l_minDistSqr;
+    if (out_pos != 0)
+      out_pos[q] = (l_minI >= 0) ? l_data.Pos(l_minI) : CVec3(0, 0, 0);
+    if (out_errBound != 0)
+    {
+      if (l_skippedSqr == FLT_MAX || (l_minI >= 0 && l_minDistSqr <= l_skippedSqr))
+        out_errBound[q] = 0;
+      else
+        out_errBound[q] = (l_minI >= 0) ? sqrtf(l_minDistSqr) - sqrtf(l_skippedSqr) : FLT_MAX;
+    }
+  }
+}
+
+
+/******************************************************************************
+*
+*: Method name: Clear data
+*
+******************************************************************************/
+void CKdTree3D::Clear()
+{
+  CKdData* l_data = (CKdData*)m_data;
+  l_data->m_nodes.clear();
+  l_data->m_x.clear();  l_data->m_y.clear();  l_data->m_z.clear();  l_data->m_obj.clear();  l_data->m_id.clear();
+  l_data->m_ref = 0;
+  l_data->m_addPts.clear();
+  l_data->m_addObj.clear();
+  l_data->m_addId.clear();
+  l_data->m_nextId = 0;
+}
+
+
+
+} // namespace tpcl
@@ -0,0 +1,129 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+// 
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+
+
+/******************************************************************************
+*
+*: Package Name: KdTree
+*
+*: Description: 3D k-d tree for nearest neighbor search
+*
+******************************************************************************/
+
+
+#ifndef __KD_TREE_H
+#define __KD_TREE_H
+
+#include "../../include/vec.h"
+#include "SpatialIndex.h"
+
+/******************************************************************************
+*                              EXPORTED CLASSES                               *
+******************************************************************************/
+
+namespace tpcl
+{
+
+  /**************************************************************************//**
+  *
+  * 3D k-d tree for nearest neighbor search
+  *
+  * An alternative to CSpatialHash2D for data with vertical structures: the hash
+  * bins only by x/y, so a column with many points at different heights is
+  * scanned linearly. The tree splits along z as well.
+  * Leaves hold buckets of points, points are stored in leaf order so a leaf is
+  * a contiguous range in memory.
+  * The tree is built (in parallel) by Build(), points added after Build() are
+  * only visible after the next Build().
+  * Build(const CPtCloud&) builds the tree over a cloud, keeping only the point
+  * indices (positions are read from the cloud).
+  *
+  ******************************************************************************/
+  class CKdTree3D : public ISpatialIndex
+  {
+  public:
+    /******************************************************************************
+    *                               Public methods                                *
+    ******************************************************************************/
+
+    /** add an object+position pair to the tree */
+    virtual void Add(const CVec3& in_pos, void* in_obj);
+
+    /** (re)build the tree from all added points */
+    virtual void Build();
+
+    /** index the points of a cloud without copying them (see ISpatialIndex::Build(const CPtCloud&)) */
+    virtual void Build(const CPtCloud& in_pcl);
+
+    /** index the points appended to the cloud (rebuilds the tree, see ISpatialIndex::Append()) */
+    virtual void Append(const CPtCloud& in_pcl);
+
+    /** delete[] an array (right away, see ISpatialIndex::DeleteWhenUnread()) */
+    virtual void DeleteWhenUnread(CVec3* in_array);
+
+    /** 
+     * Find nearest object (using its associated point)
+     * @param out_pMinPt (optional) closest point
+     * @param max2DRadius maximum 2D radius to search in  */
+    virtual void* FindNearest(const CVec3& in_pos, CVec3* out_pMinPt=0, float in_max2DRadius=0.0f) const;
+
+    /** Get all objects in 2D radius 
+     * @param out_buf        buffer to fill with objects
+     * @param max2DRadius   maximum 2D radius to search in  
+     * @return    nuumber of objects*/
+    virtual int GetNear(const CVec3& in_pos, int xi_bufSize, void** out_buf, CVec3* out_pos=0, float in_max2DRadius=0.0f) const;
+
+    /** Find nearest point, returns its index (-1 if none) */
+    virtual int FindNearestIdx(const CVec3& in_pos, CVec3* out_pMinPt=0, float in_max2DRadius=0.0f) const;
+
+    /** Get the indices of all points in 2D radius */
+    virtual int GetNearIdx(const CVec3& in_pos, int in_bufSize, int* out_idx, CVec3* out_pos=0, float in_max2DRadius=0.0f) const;
+
+    /** Find the k nearest points of many positions (see ISpatialIndex::FindKNearest) */
+    virtual void FindKNearest(const CVec3* in_queries, int in_numQueries, int in_k, int* out_idx, float* out_distSqr,
+                              float in_max2DRadius=0.0f, CVec3* out_pos=0) const;
+
+    /** Find an approximate nearest point of many positions (see ISpatialIndex::FindNearestApprox) */
+    virtual void FindNearestApprox(const CVec3* in_queries, int in_numQueries, int* out_idx, float* out_distSqr,
+                                   float in_max2DRadius=0.0f, CVec3* out_pos=0, float* out_errBound=0) const;
+
+    /** Clear data */
+    virtual void Clear();
+
+    /** constructor 
+     * @param res    resolution of the data (used for the minimal search radius, as in CSpatialHash2D) */
+    CKdTree3D (float res=0.1f);
+
+    /** destructor */
+    virtual ~CKdTree3D ();
+
+  protected:
+  /******************************************************************************
+  *                             Protected members                               *
+  ******************************************************************************/
+
+    void* m_data;     ///< tree nodes and points
+    float m_res;      ///< resolution of the data
+  };
+
+
+}// namespace tpcl
+#endif
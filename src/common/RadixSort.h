@@ -0,0 +1,111 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+// 
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+
+/******************************************************************************
+*
+*: Package Name: RadixSort
+*
+*: Title: parallel radix sort of integer keys (with the indices of the sorted items)
+*
+******************************************************************************/
+
+#ifndef __tpcl_RadixSort_H
+#define __tpcl_RadixSort_H
+
+
+#include "common.h"
+#include <vector>
+#include <algorithm>
+
+/******************************************************************************
+*                             EXPORTED CONSTANTS                              *
+******************************************************************************/
+
+namespace tpcl
+{
+  const int RADIX_BLOCKS = 64;                  ///< keys are divided to blocks, counted and scattered in parallel
+  const int RADIX_BITS = 11;                    ///< bits sorted in each pass
+  const int RADIX_SIZE = 1 << RADIX_BITS;
+
+/******************************************************************************
+*                            EXPORTED FUNCTIONS                               *
+******************************************************************************/
+
+  /** sort indices by their keys: parallel, stable LSD radix sort.
+   *  Each pass counts the digits per block of points, and each block scatters its
+   *  points to its own (precomputed) ranges
+   * @param io_keys       keys (sorted on return)
+   * @param io_idx        indices (permuted with the keys)
+   * @param in_numBits    number of significant bits in the keys */
+  template <typename K> void RadixSort(std::vector<K>& io_keys, std::vector<int>& io_idx, int in_numBits)
+  {
+    int l_num = int(io_keys.size());
+    int l_blockSize = (l_num + RADIX_BLOCKS - 1) / RADIX_BLOCKS;
+    std::vector<K> l_keys(l_num);
+    std::vector<int> l_idx(l_num);
+    std::vector<int> l_count(RADIX_BLOCKS * RADIX_SIZE);
+
+    for (int l_shift = 0; l_shift < in_numBits; l_shift += RADIX_BITS)
+    {
+      // count the digits of each block
+      #pragma omp parallel for
+      for (int b = 0; b < RADIX_BLOCKS; ++b)
+      {
+        int* l_c = &l_count[b * RADIX_SIZE];
+        std::fill(l_c, l_c + RADIX_SIZE, 0);
+        int l_end = MinT(l_num, (b + 1) * l_blockSize);
+        for (int i = b * l_blockSize; i < l_end; ++i)
+          l_c[(io_keys[i] >> l_shift) & (RADIX_SIZE - 1)]++;
+      }
+
+      // start of each (digit, block) range: digit major, so the sort stays stable
+      int l_sum = 0;
+      for (int d = 0; d < RADIX_SIZE; ++d)
+      {
+        for (int b = 0; b < RADIX_BLOCKS; ++b)
+        {
+          int l_c = l_count[b * RADIX_SIZE + d];
+          l_count[b * RADIX_SIZE + d] = l_sum;
+          l_sum += l_c;
+        }
+      }
+
+      // scatter
+      #pragma omp parallel for
+      for (int b = 0; b < RADIX_BLOCKS; ++b)
+      {
+        int* l_c = &l_count[b * RADIX_SIZE];
+        int l_end = MinT(l_num, (b + 1) * l_blockSize);
+        for (int i = b * l_blockSize; i < l_end; ++i)
+        {
+          int l_dst = l_c[(io_keys[i] >> l_shift) & (RADIX_SIZE - 1)]++;
+          l_keys[l_dst] = io_keys[i];
+          l_idx[l_dst] = io_idx[i];
+        }
+      }
+      io_keys.swap(l_keys);
+      io_idx.swap(l_idx);
+    }
+  }
+
+} // namespace tpcl
+
+#endif
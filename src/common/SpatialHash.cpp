@@ -20,10 +20,16 @@
 
 
 #include "SpatialHash.h"
+#include "DistKernels.h"
+#include "RadixSort.h"
 #include "common.h"
-#include <unordered_map>
+#include "../include/ptCloud.h"
 #include <vector>
 #include <algorithm>    // std::sort
+#include <atomic>
+#include <memory>     // std::shared_ptr
+#include <mutex>
+#include <float.h>
 
 namespace tpcl{
 
@@ -31,20 +37,17 @@ namespace tpcl{
 *                             INTERNAL CONSTANTS                              *
 ******************************************************************************/
 
-  const int MAX_SPIRAL_RANGE = 5;
-  const int SPIRAL_ARR_SIZE = (2*MAX_SPIRAL_RANGE+1) * (2 * MAX_SPIRAL_RANGE + 1);
+  const int BUILD_BLOCKS = 64;                  ///< points are divided to blocks for the parallel build
 
-  struct COffset
-  {
-    short dx, dy;
-    int distSqr;
-    bool operator<(const COffset& rhs) const { return distSqr < rhs.distSqr; }
-  };
+  const int RING_ROW_SEARCH = 4;                ///< from this ring on, the top/bottom rows of a ring are found by a binary search (not per cell)
+  const int SCAN_CHUNK = 256;                   ///< points filtered by a kernel call (size of the selection buffers)
 
-  // pattern for searching at increasing range
-  COffset* s_spiral = 0;
+  const int QUANT_MAX = 65535;                  ///< quantized coordinates are 16 bit
 
-  const float MAX_SPIRAL_DIST_SQR = MAX_SPIRAL_RANGE * MAX_SPIRAL_RANGE;
+  const int DELTA_FRACTION = 8;                 ///< appended points are kept in a delta layout while they are at most 1/DELTA_FRACTION of the built ones
+
+  const int READER_SLOTS = 64;                  ///< running queries are counted per slot (threads are spread over the slots)
+  const int CACHE_LINE = 64;
 
 
 /******************************************************************************
@@ -67,54 +70,827 @@ namespace tpcl{
 *                              INTERNAL CLASSES                               *
 ******************************************************************************/
 
-typedef TVec3<int> CInt3;
+// internal node for 2D hashing containing both position and object pointer (and the point index)
+struct Node2D {void* obj; CVec3 pt; int id;};
+
+/** points added since the last Build() */
+typedef std::vector<Node2D> CPending;
 
 
-// hash function for 2D as needed by hash_map
-class HashCompare2D
+/** key of a cell in the flat layout.
+ *  Row (y) major and biased so that the unsigned order of the keys is the (y,x) order of the cells,
+ *  i.e. a row of adjacent cells is a contiguous range of keys */
+inline unsigned long long CellKey(int in_x, int in_y)
 {
-public:
-  static const size_t bucket_size = 4;
-  static const size_t min_buckets = 8;
+  return (((unsigned long long)((unsigned int)in_y ^ 0x80000000u)) << 32) | ((unsigned int)in_x ^ 0x80000000u);
+}
+
+
+/** cell coordinates of a key (see CellKey) */
+inline void KeyCell(unsigned long long in_key, int& out_x, int& out_y)
+{
+  out_x = (int)((unsigned int)in_key ^ 0x80000000u);
+  out_y = (int)((unsigned int)(in_key >> 32) ^ 0x80000000u);
+}
+
+
+/** nearest point of float arrays (vector kernel unless the range is short) */
+inline int NearestOf(const CDistKernels& in_kernels, const float* in_x, const float* in_y, const float* in_z, int in_begin, int in_end,
+                     const CVec3& in_pos, float in_max2dRadSqr, float& io_minDistSqr)
+{
+  if (in_end - in_begin < DIST_KERNEL_MIN_PTS)
+    return NearestScalar(in_x, in_y, in_z, in_begin, in_end, in_pos, in_max2dRadSqr, io_minDistSqr);
+  return in_kernels.m_nearest(in_x, in_y, in_z, in_begin, in_end, in_pos, in_max2dRadSqr, io_minDistSqr);
+}
+
+
+/** points of float arrays within a 2D radius and under a 3D distance (vector kernel unless the range is short) */
+inline int FilterOf(const CDistKernels& in_kernels, const float* in_x, const float* in_y, const float* in_z, int in_begin, int in_end,
+                    const CVec3& in_pos, float in_max2dRadSqr, float in_maxDistSqr, int* out_sel, float* out_distSqr)
+{
+  if (in_end - in_begin < DIST_KERNEL_MIN_PTS)
+    return FilterScalar(in_x, in_y, in_z, in_begin, in_end, in_pos, in_max2dRadSqr, in_maxDistSqr, out_sel, out_distSqr);
+  return in_kernels.m_filter(in_x, in_y, in_z, in_begin, in_end, in_pos, in_max2dRadSqr, in_maxDistSqr, out_sel, out_distSqr);
+}
+
+
+/** Flat layout of the spatial hash.
+ *  Points are sorted by cell (cells are sorted by CellKey) and kept as a structure of arrays.
+ *  A cell is found using an open addressing table from its key to its index.
+ *  When built from a cloud (reference mode) only the point indices are kept, and the
+ *  positions are read from the cloud.
+ *  Positions may also be quantized (see Quantize()): x/y are 16 bit offsets from the corner of
+ *  the cell, z is 16 bit on a lattice of the cell. Quantized positions are decoded in chunks */
+struct CFlatCells
+{
+  std::vector<unsigned long long> m_keys;   ///< sorted keys of all non empty cells
+  std::vector<int> m_start;                 ///< points of cell i are [m_start[i], m_start[i+1])
+  std::vector<int> m_table;                 ///< open addressing table: cell key -> cell index (-1 = empty slot)
+  unsigned int m_tableMask;                 ///< table size - 1 (table size is a power of 2)
+
+  std::vector<float> m_x, m_y, m_z;         ///< positions of the points (empty in reference mode or if quantized)
+  std::vector<void*> m_obj;                 ///< objects associated with the points (empty in reference mode or if all are null)
+  std::vector<int> m_id;                    ///< index of the points (order of insertion / index in the cloud)
+  const CVec3* m_ref;                       ///< the referenced cloud (0 if positions are copied)
+
+  std::vector<unsigned short> m_qx, m_qy, m_qz;   ///< quantized positions (empty if not quantized)
+  std::vector<float> m_cellZ, m_cellZStep;        ///< z of quantized 0 and the z step, per cell
+  CVec3 m_origin;                                 ///< corner of cell (0,0)
+  float m_res, m_qStep;                           ///< cell size, quantized x/y step
+
+  CFlatCells() : m_tableMask(0), m_ref(0), m_origin(0, 0, 0), m_res(0), m_qStep(0) {}
+
+  int NumPts() const    { return (int)m_id.size(); }
+
+  bool Quantized() const  { return !m_qx.empty(); }
+
+  /** corner of a cell */
+  void CellCorner(int in_cell, float& out_x, float& out_y) const
+  {
+    int cx, cy;
+    KeyCell(m_keys[in_cell], cx, cy);
+    out_x = float(double(m_origin.x) + double(cx) * m_res);
+    out_y = float(double(m_origin.y) + double(cy) * m_res);
+  }
+
+  /** position of a point that is not quantized (copied or referenced) */
+  CVec3 RawPos(int i) const  { return m_ref ? m_ref[m_id[i]] : CVec3(m_x[i], m_y[i], m_z[i]); }
+
+  /** position of point i of cell in_cell */
+  CVec3 Pos(int in_cell, int i) const
+  {
+    if (Quantized())
+    {
+      float l_x, l_y;
+      CellCorner(in_cell, l_x, l_y);
+      return CVec3(l_x + m_qx[i] * m_qStep, l_y + m_qy[i] * m_qStep, m_cellZ[in_cell] + m_qz[i] * m_cellZStep[in_cell]);
+    }
+    return RawPos(i);
+  }
+
+  /** object of a point (the position in the cloud in reference mode) */
+  void* Obj(int i) const  { return m_ref ? (void*)(m_ref + m_id[i]) : (m_obj.empty() ? 0 : m_obj[i]); }
+
+  /** decode the quantized positions of the next chunk (at most SCAN_CHUNK points) of [io_pt, in_end)
+   * @param io_cell, io_pt    first point of the chunk and its cell (advanced to the next chunk)
+   * @return number of points decoded */
+  int Decode(const CDistKernels& in_kernels, int& io_cell, int& io_pt, int in_end, float* out_x, float* out_y, float* out_z) const
+  {
+    int n = 0;
+    while (n < SCAN_CHUNK && io_pt < in_end)
+    {
+      while (m_start[io_cell + 1] <= io_pt)
+        io_cell++;
+      float l_x, l_y;
+      CellCorner(io_cell, l_x, l_y);
+      int l_num = MinT(m_start[io_cell + 1], in_end) - io_pt;
+      l_num = MinT(l_num, SCAN_CHUNK - n);
+      DecodeKernel l_decode = (l_num < DIST_KERNEL_MIN_PTS) ? DecodeScalar : in_kernels.m_decode;
+      l_decode(&m_qx[io_pt], l_num, l_x, m_qStep, out_x + n);
+      l_decode(&m_qy[io_pt], l_num, l_y, m_qStep, out_y + n);
+      l_decode(&m_qz[io_pt], l_num, m_cellZ[io_cell], m_cellZStep[io_cell], out_z + n);
+      n += l_num;
+      io_pt += l_num;
+    }
+    return n;
+  }
+
+  /** nearest point of the cells [in_firstCell, in_lastCell) (see NearestKernel).
+   *  The vector kernels need float arrays: copied positions are scanned in place, quantized ones
+   *  are decoded first, and the referenced points are read through their indices
+   * @param out_pt    position of the point found
+   * @return index of the point found (-1 if none is nearer than io_minDistSqr) */
+  int Nearest(const CDistKernels& in_kernels, int in_firstCell, int in_lastCell, const CVec3& in_pos, float in_max2dRadSqr,
+              float& io_minDistSqr, CVec3& out_pt) const
+  {
+    int l_begin = m_start[in_firstCell], l_end = m_start[in_lastCell];
+    int l_best = -1;
+    if (Quantized())
+    {
+      float l_x[SCAN_CHUNK], l_y[SCAN_CHUNK], l_z[SCAN_CHUNK];
+      for (int l_cell = in_firstCell, l_pt = l_begin; l_pt < l_end; )
+      {
+        int l_first = l_pt;
+        int l_num = Decode(in_kernels, l_cell, l_pt, l_end, l_x, l_y, l_z);
+        int b = NearestOf(in_kernels, l_x, l_y, l_z, 0, l_num, in_pos, in_max2dRadSqr, io_minDistSqr);
+        if (b < 0)
+          continue;
+        l_best = l_first + b;
+        out_pt = CVec3(l_x[b], l_y[b], l_z[b]);
+      }
+      return l_best;
+    }
+    if (m_ref)
+      l_best = NearestRefScalar(m_ref, m_id.data(), l_begin, l_end, in_pos, in_max2dRadSqr, io_minDistSqr);
+    else
+      l_best = NearestOf(in_kernels, m_x.data(), m_y.data(), m_z.data(), l_begin, l_end, in_pos, in_max2dRadSqr, io_minDistSqr);
+    if (l_best >= 0)
+      out_pt = RawPos(l_best);
+    return l_best;
+  }
+
+  /** points of the next chunk (at most SCAN_CHUNK points) of [io_pt, in_end) within a 2D radius
+   *  and under a 3D distance (see FilterKernel)
+   * @param io_cell, io_pt    first point of the chunk and its cell (advanced to the next chunk)
+   * @param out_sel           indices of the points found
+   * @param out_pts           positions of the points found
+   * @return number of points found */
+  int Filter(const CDistKernels& in_kernels, int& io_cell, int& io_pt, int in_end, const CVec3& in_pos, float in_max2dRadSqr,
+             float in_maxDistSqr, int* out_sel, float* out_distSqr, CVec3* out_pts) const
+  {
+    int l_first = io_pt;
+    int l_num;
+    if (Quantized())
+    {
+      float l_x[SCAN_CHUNK], l_y[SCAN_CHUNK], l_z[SCAN_CHUNK];
+      int l_numPts = Decode(in_kernels, io_cell, io_pt, in_end, l_x, l_y, l_z);
+      l_num = FilterOf(in_kernels, l_x, l_y, l_z, 0, l_numPts, in_pos, in_max2dRadSqr, in_maxDistSqr, out_sel, out_distSqr);
+      for (int j = 0; j < l_num; ++j)
+      {
+        out_pts[j] = CVec3(l_x[out_sel[j]], l_y[out_sel[j]], l_z[out_sel[j]]);
+        out_sel[j] += l_first;
+      }
+      return l_num;
+    }
+
+    io_pt = MinT(io_pt + SCAN_CHUNK, in_end);
+    if (m_ref)
+      l_num = FilterRefScalar(m_ref, m_id.data(), l_first, io_pt, in_pos, in_max2dRadSqr, in_maxDistSqr, out_sel, out_distSqr);
+    else
+      l_num = FilterOf(in_kernels, m_x.data(), m_y.data(), m_z.data(), l_first, io_pt, in_pos, in_max2dRadSqr, in_maxDistSqr, out_sel, out_distSqr);
+    for (int j = 0; j < l_num; ++j)
+      out_pts[j] = RawPos(out_sel[j]);
+    return l_num;
+  }
+
+  /** quantize the positions of the points (copied or referenced).
+   *  x/y are offsets from the corner of the cell in steps of m_res / QUANT_MAX. z is on a lattice of
+   *  2 * in_tolerance (doubled until the z range of the cell fits in 16 bits) */
+  void Quantize(const CVec3& in_origin, float in_res, float in_tolerance)
+  {
+    int l_numCells = int(m_keys.size());
+    int l_num = NumPts();
+    m_origin = in_origin;
+    m_res = in_res;
+    m_qStep = in_res / QUANT_MAX;
+    m_qx.resize(l_num);  m_qy.resize(l_num);  m_qz.resize(l_num);
+    m_cellZ.resize(l_numCells);  m_cellZStep.resize(l_numCells);
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (int c = 0; c < l_numCells; ++c)
+    {
+      float l_x, l_y;
+      CellCorner(c, l_x, l_y);
+      float l_minZ = FLT_MAX, l_maxZ = -FLT_MAX;
+      for (int i = m_start[c]; i < m_start[c + 1]; ++i)
+      {
+        float z = RawPos(i).z;
+        l_minZ = MinT(l_minZ, z);
+        l_maxZ = MaxT(l_maxZ, z);
+      }
+      double l_zStep = 2.0 * in_tolerance;
+      double l_z = floor(l_minZ / l_zStep) * l_zStep;
+      while ((l_maxZ - l_z) / l_zStep > QUANT_MAX)
+      {
+        l_zStep *= 2;
+        l_z = floor(l_minZ / l_zStep) * l_zStep;
+      }
+      m_cellZ[c] = float(l_z);
+      m_cellZStep[c] = float(l_zStep);
+      for (int i = m_start[c]; i < m_start[c + 1]; ++i)
+      {
+        CVec3 l_pt = RawPos(i);
+        m_qx[i] = (unsigned short)MinT(MaxT(int(floor((double(l_pt.x) - l_x) / m_qStep + 0.5)), 0), QUANT_MAX);
+        m_qy[i] = (unsigned short)MinT(MaxT(int(floor((double(l_pt.y) - l_y) / m_qStep + 0.5)), 0), QUANT_MAX);
+        m_qz[i] = (unsigned short)MinT(MaxT(int(floor((double(l_pt.z) - l_z) / l_zStep + 0.5)), 0), QUANT_MAX);
+      }
+    }
+    std::vector<float>().swap(m_x);  std::vector<float>().swap(m_y);  std::vector<float>().swap(m_z);
+  }
+
+  /** first slot of a key in the table */
+  static unsigned int Slot(unsigned long long in_key)  { return (unsigned int)((in_key * 0x9E3779B97F4A7C15ULL) >> 32); }
+
+  /** get the index of a cell (-1 if the cell is empty) */
+  int FindCell(unsigned long long in_key) const
+  {
+    if (m_keys.empty())
+      return -1;
+    for (unsigned int l_slot = Slot(in_key) & m_tableMask; ; l_slot = (l_slot + 1) & m_tableMask)
+    {
+      int l_cell = m_table[l_slot];
+      if (l_cell < 0)
+        return -1;
+      if (m_keys[l_cell] == in_key)
+        return l_cell;
+    }
+  }
+
+  /** get the range of cells [out_first, out_last) in a row of cells [in_x0, in_x1] */
+  void FindRow(int in_x0, int in_x1, int in_y, int& out_first, int& out_last) const
+  {
+    out_first = int(std::lower_bound(m_keys.begin(), m_keys.end(), CellKey(in_x0, in_y)) - m_keys.begin());
+    out_last = int(std::upper_bound(m_keys.begin() + out_first, m_keys.end(), CellKey(in_x1, in_y)) - m_keys.begin());
+  }
 
-  size_t hash( const CInt3& n) const  {size_t l_Val = (2166136261U * n.x) ^ (16777619U * n.y); return l_Val;}
-  size_t operator() (const CInt3& v) const  {return hash(v);}
-  bool operator() ( const CInt3& lhs, const CInt3& rhs) const 
+  /** fill the cell table from m_keys */
+  void FillTable()
   {
-    return lhs.x==rhs.x && lhs.y == rhs.y;
+    unsigned int l_size = 16;
+    while (l_size < 2 * m_keys.size())
+      l_size <<= 1;
+    m_tableMask = l_size - 1;
+    m_table.assign(l_size, -1);
+    for (int c = 0; c < int(m_keys.size()); ++c)
+    {
+      unsigned int l_slot = Slot(m_keys[c]) & m_tableMask;
+      while (m_table[l_slot] >= 0)
+        l_slot = (l_slot + 1) & m_tableMask;
+      m_table[l_slot] = c;
+    }
+  }
+
+  /** create the cells from the cell keys of the points (counting sort).
+   * @param out_dst   the position of each point in the flat layout */
+  void SortCells(const std::vector<unsigned long long>& in_ptKeys, std::vector<int>& out_dst)
+  {
+    int l_num = int(in_ptKeys.size());
+
+    // sorted list of non empty cells
+    m_keys = in_ptKeys;
+    std::sort(m_keys.begin(), m_keys.end());
+    m_keys.erase(std::unique(m_keys.begin(), m_keys.end()), m_keys.end());
+    FillTable();
+
+    // count the points of each cell
+    int l_numCells = int(m_keys.size());
+    out_dst.resize(l_num);
+    m_start.assign(l_numCells + 1, 0);
+    for (int i = 0; i < l_num; ++i)
+    {
+      out_dst[i] = FindCell(in_ptKeys[i]);
+      m_start[out_dst[i] + 1]++;
+    }
+    for (int c = 0; c < l_numCells; ++c)
+      m_start[c + 1] += m_start[c];
+
+    // position of each point (stable)
+    std::vector<int> l_next(m_start.begin(), m_start.end() - 1);
+    for (int i = 0; i < l_num; ++i)
+      out_dst[i] = l_next[out_dst[i]]++;
+  }
+};
+
+
+/** state of a nearest neighbor search */
+struct CNearestSearch
+{
+  CVec3 m_pos;              ///< searched position
+  float m_max2dRadSqr;      ///< only points within this 2D radius are considered
+  float m_minDistSqr;       ///< distance of the nearest point found so far
+  const void* m_minObj;     ///< nearest object found so far
+  int m_minId;              ///< index of the nearest point found so far (-1 if none)
+  CVec3 m_minPt;            ///< nearest point found so far
+  const CDistKernels& m_kernels;
+
+  CNearestSearch(const CVec3& in_pos, float in_max2dRadSqr)
+    : m_pos(in_pos), m_max2dRadSqr(in_max2dRadSqr), m_minDistSqr(1E20f), m_minObj(0), m_minId(-1), m_kernels(GetDistKernels()) {}
+
+  /** distance a point must be under to be the nearest */
+  float WorstDistSqr() const { return m_minDistSqr; }
+
+  /** search a range of cells [in_firstCell, in_lastCell) in the flat layout */
+  void Scan(const CFlatCells& in_flat, int in_firstCell, int in_lastCell)
+  {
+    int l_best = in_flat.Nearest(m_kernels, in_firstCell, in_lastCell, m_pos, m_max2dRadSqr, m_minDistSqr, m_minPt);
+    if (l_best < 0)
+      return;
+    m_minObj = in_flat.Obj(l_best);
+    m_minId = in_flat.m_id[l_best];
   }
 };
 
 
-// internal node for 2D hashing containing both position and object pointer
-struct Node2D {void* obj; CVec3 pt;};
+/** state of a k nearest neighbors search.
+ *  The neighbors found so far are kept sorted by distance directly in the output arrays */
+struct CKNearestSearch
+{
+  CVec3 m_pos;              ///< searched position
+  float m_max2dRadSqr;      ///< only points within this 2D radius are considered
+  int m_k;                  ///< number of neighbors to find
+  int m_num;                ///< number of neighbors found so far
+  int* m_idx;               ///< indices of the neighbors found (m_k)
+  float* m_distSqr;         ///< distances of the neighbors found (m_k)
+  CVec3* m_pts;             ///< (optional) positions of the neighbors found (m_k)
+  const CDistKernels& m_kernels;
 
-// internal node for 1D hashimh containing both position and object pointer
-struct Node1D {void* obj; float pt;};
+  CKNearestSearch(const CVec3& in_pos, float in_max2dRadSqr, int in_k, int* out_idx, float* out_distSqr, CVec3* out_pts)
+    : m_pos(in_pos), m_max2dRadSqr(in_max2dRadSqr), m_k(in_k), m_num(0), m_idx(out_idx), m_distSqr(out_distSqr), m_pts(out_pts),
+      m_kernels(GetDistKernels()) {}
 
+  /** distance a point must be under to be inserted */
+  float WorstDistSqr() const { return m_num < m_k ? FLT_MAX : m_distSqr[m_k - 1]; }
 
-/** Each cell is hashed to an array of object+position pairs */
-typedef std::unordered_map<CInt3, std::vector<Node2D> , HashCompare2D, HashCompare2D> MapInt3;
+  /** insert a neighbor (keeping the order) */
+  void Insert(float in_distSqr, int in_id, const CVec3& in_pt)
+  {
+    int i = (m_num < m_k) ? m_num++ : m_k - 1;
+    for (; i > 0 && m_distSqr[i - 1] > in_distSqr; --i)
+    {
+      m_distSqr[i] = m_distSqr[i - 1];
+      m_idx[i] = m_idx[i - 1];
+      if (m_pts != 0)
+        m_pts[i] = m_pts[i - 1];
+    }
+    m_distSqr[i] = in_distSqr;
+    m_idx[i] = in_id;
+    if (m_pts != 0)
+      m_pts[i] = in_pt;
+  }
 
-  void FillSpiralOrder()
+  /** mark the missing neighbors */
+  void Finish()
   {
-    s_spiral = new COffset[SPIRAL_ARR_SIZE];
-    int n = 0;
-    for (int y = - MAX_SPIRAL_RANGE; y <= MAX_SPIRAL_RANGE; ++y)
+    for (int i = m_num; i < m_k; ++i)
+    {
+      m_idx[i] = -1;
+      m_distSqr[i] = FLT_MAX;
+      if (m_pts != 0)
+        m_pts[i] = CVec3(0, 0, 0);
+    }
+  }
+
+  /** search a range of cells [in_firstCell, in_lastCell) in the flat layout */
+  void Scan(const CFlatCells& in_flat, int in_firstCell, int in_lastCell)
+  {
+    // the kernel keeps the points nearer than the current worst neighbor, which can only shrink while inserting
+    int l_sel[SCAN_CHUNK];
+    float l_dist[SCAN_CHUNK];
+    CVec3 l_pts[SCAN_CHUNK];
+    int l_end = in_flat.m_start[in_lastCell];
+    for (int l_cell = in_firstCell, l_pt = in_flat.m_start[in_firstCell]; l_pt < l_end; )
+    {
+      int l_num = in_flat.Filter(m_kernels, l_cell, l_pt, l_end, m_pos, m_max2dRadSqr, WorstDistSqr(), l_sel, l_dist, l_pts);
+      for (int j = 0; j < l_num; ++j)
+        if (l_dist[j] < WorstDistSqr())
+          Insert(l_dist[j], in_flat.m_id[l_sel[j]], l_pts[j]);
+    }
+  }
+};
+
+
+/** collects the points in a 2D radius (objects and/or indices) */
+struct CNearGather
+{
+  CVec3 m_pos;              ///< searched position
+  float m_max2dRadSqr;      ///< only points within this 2D radius are collected
+  int m_bufSize;            ///< size of the output buffers
+  int m_num;                ///< number of points collected
+  void** m_obj;             ///< (optional) objects of the points
+  int* m_idx;               ///< (optional) indices of the points
+  CVec3* m_pts;             ///< (optional) positions of the points
+  const CDistKernels& m_kernels;
+
+  CNearGather(const CVec3& in_pos, float in_max2dRadSqr, int in_bufSize, void** out_obj, int* out_idx, CVec3* out_pts)
+    : m_pos(in_pos), m_max2dRadSqr(in_max2dRadSqr), m_bufSize(in_bufSize), m_num(0), m_obj(out_obj), m_idx(out_idx), m_pts(out_pts),
+      m_kernels(GetDistKernels()) {}
+
+  bool Full() const   { return m_num >= m_bufSize; }
+
+  /** collect point i of the flat layout */
+  void Collect(const CFlatCells& in_flat, int i, const CVec3& in_pt)
+  {
+    if (m_obj != 0)
+      m_obj[m_num] = in_flat.Obj(i);
+    if (m_idx != 0)
+      m_idx[m_num] = in_flat.m_id[i];
+    if (m_pts != 0)
+      m_pts[m_num] = in_pt;
+    m_num++;
+  }
+
+  /** collect from a range of cells [in_firstCell, in_lastCell) in the flat layout */
+  void Scan(const CFlatCells& in_flat, int in_firstCell, int in_lastCell)
+  {
+    int l_sel[SCAN_CHUNK];
+    float l_dist[SCAN_CHUNK];
+    CVec3 l_pts[SCAN_CHUNK];
+    int l_end = in_flat.m_start[in_lastCell];
+    for (int l_cell = in_firstCell, l_pt = in_flat.m_start[in_firstCell]; l_pt < l_end && !Full(); )
+    {
+      int l_num = in_flat.Filter(m_kernels, l_cell, l_pt, l_end, m_pos, m_max2dRadSqr, FLT_MAX, l_sel, l_dist, l_pts);
+      for (int j = 0; j < l_num && !Full(); ++j)
+        Collect(in_flat, l_sel[j], l_pts[j]);
+    }
+  }
+};
+
+
+/** search the cells at ring in_r around cell (in_cx,in_cy) - i.e. the cells at Chebyshev distance in_r.
+ *  The top and bottom rows of the ring are contiguous in the flat layout */
+template <class S> void SearchRing(const CFlatCells& in_flat, int in_cx, int in_cy, int in_r, S& io_search)
+{
+  if (in_r == 0)
+  {
+    int l_c = in_flat.FindCell(CellKey(in_cx, in_cy));
+    if (l_c >= 0)
+      io_search.Scan(in_flat, l_c, l_c + 1);
+  }
+  else if (in_flat.NumPts() > 0)
+  {
+    for (int l_side = -1; l_side <= 1; l_side += 2)
+    {
+      if (in_r < RING_ROW_SEARCH)
+      {
+        // short row: look up each cell
+        for (int x = in_cx - in_r; x <= in_cx + in_r; ++x)
+        {
+          int l_c = in_flat.FindCell(CellKey(x, in_cy + l_side * in_r));
+          if (l_c >= 0)
+            io_search.Scan(in_flat, l_c, l_c + 1);
+        }
+        continue;
+      }
+      int l_first, l_last;
+      in_flat.FindRow(in_cx - in_r, in_cx + in_r, in_cy + l_side * in_r, l_first, l_last);
+      if (l_first < l_last)
+        io_search.Scan(in_flat, l_first, l_last);
+    }
+    for (int y = in_cy - in_r + 1; y < in_cy + in_r; ++y)
     {
-      for (int x = - MAX_SPIRAL_RANGE; x <= MAX_SPIRAL_RANGE; ++x)
+      for (int x = in_cx - in_r; x <= in_cx + in_r; x += 2 * in_r)
       {
-        s_spiral[n].dx = x;
-        s_spiral[n].dy = y;
-        int ax = MaxT(abs(x) - 1, 0);
-        int ay = MaxT(abs(y) - 1, 0);
-        s_spiral[n].distSqr = ax * ax + ay * ay;
-        n++;
+        int l_c = in_flat.FindCell(CellKey(x, y));
+        if (l_c >= 0)
+          io_search.Scan(in_flat, l_c, l_c + 1);
       }
     }
-    std::sort(s_spiral, s_spiral + SPIRAL_ARR_SIZE);
+  }
+}
+
+
+/** search a single cell */
+template <class S> void SearchCell(const CFlatCells& in_flat, int in_x, int in_y, S& io_search)
+{
+  int l_c = in_flat.FindCell(CellKey(in_x, in_y));
+  if (l_c >= 0)
+    io_search.Scan(in_flat, l_c, l_c + 1);
+}
+
+
+/** expanding ring search: search rings of cells at increasing distance (never revisiting a cell),
+ *  until the next ring cannot hold a point nearer than the ones found (or is out of the radius).
+ *  Ring r is at least (r - 1 + in_border) cells away (in_border is the distance of the searched
+ *  position from the border of its cell, in cells)
+ * @param in_minR, in_maxR    rings that may hold points */
+template <class S> void SearchRings(const CFlatCells& in_flat, int in_cx, int in_cy, float in_border,
+                                    float in_res, int in_minR, int in_maxR, S& io_search)
+{
+  for (int r = in_minR; r <= in_maxR; ++r)
+  {
+    if (r > 0)
+    {
+      float l_ringDist = (r - 1 + in_border) * in_res;
+      float l_ringDistSqr = l_ringDist * l_ringDist;
+      if (!(l_ringDistSqr <= io_search.m_max2dRadSqr && l_ringDistSqr < io_search.WorstDistSqr()))
+        break;    // (also stops on a NaN position)
+    }
+    SearchRing(in_flat, in_cx, in_cy, r, io_search);
+  }
+}
+
+
+/** search all cells in a square of radius in_rad (cells) around cell (in_cx,in_cy).
+ *  A row of cells is contiguous in the flat layout */
+template <class S> void SearchSquare(const CFlatCells& in_flat, int in_cx, int in_cy, int in_rad, S& io_search)
+{
+  for (int y = -in_rad; y <= in_rad && in_flat.NumPts() > 0; y++)
+  {
+    int l_first, l_last;
+    in_flat.FindRow(in_cx - in_rad, in_cx + in_rad, in_cy + y, l_first, l_last);
+    if (l_first < l_last)
+      io_search.Scan(in_flat, l_first, l_last);
+  }
+}
+
+
+/** what the queries read: the flat layouts and the frame of their cells.
+ *  Points appended to a large layout go to a small delta layout (with the same cells), so that an
+ *  append sorts only the delta. The large layout is shared by the snapshots until the delta grows
+ *  past 1/DELTA_FRACTION of it and both are merged.
+ *  A snapshot is not changed once published (see CPublished) */
+struct CHashSnapshot
+{
+  std::shared_ptr<const CFlatCells> m_flat;   ///< the points of the last full build
+  CFlatCells m_delta;                         ///< the points appended since
+  CVec3 m_pivot;              ///< cells are relative to the pivot
+  CVec3 m_minBox, m_maxBox;   ///< bounding box of the points
+  float m_res, m_resInv;
+
+  CHashSnapshot(float in_res)
+    : m_flat(new CFlatCells()), m_pivot(0, 0, 0), m_minBox(0, 0, 0), m_maxBox(0, 0, 0), m_res(in_res), m_resInv(1.0f / in_res) {}
+
+  CHashSnapshot(float in_res, const CVec3& in_pivot, const CVec3& in_minBox, const CVec3& in_maxBox)
+    : m_flat(new CFlatCells()), m_pivot(in_pivot), m_minBox(in_minBox), m_maxBox(in_maxBox), m_res(in_res), m_resInv(1.0f / in_res) {}
+
+  int NumPts() const  { return m_flat->NumPts() + m_delta.NumPts(); }
+
+  /** the layouts: 0 - the full build, 1 - the delta */
+  const CFlatCells& Layout(int in_layout) const  { return (in_layout == 0) ? *m_flat : m_delta; }
+
+  /** convert a position to cell coordinates */
+  void GetCell(const CVec3& in_pos, int& out_x, int& out_y) const
+  {
+    CVec3 l_v = (in_pos - m_pivot) * m_resInv;
+    out_x = (int)floorf(l_v.x);
+    out_y = (int)floorf(l_v.y);
+  }
+
+  /** start of an expanding ring search around a position: its cell, its distance from the
+   *  cell's border (in cells), and the range of rings (around the cell) that hold cells of the bounding box */
+  void RingSearchStart(const CVec3& in_pos, int& out_cx, int& out_cy, float& out_border, int& out_minR, int& out_maxR) const
+  {
+    CVec3 l_f = (in_pos - m_pivot) * m_resInv;
+    float l_fx = floorf(l_f.x), l_fy = floorf(l_f.y);
+    out_cx = (int)l_fx;
+    out_cy = (int)l_fy;
+    l_fx = l_f.x - l_fx;
+    l_fy = l_f.y - l_fy;
+    out_border = MinT(MinT(l_fx, 1 - l_fx), MinT(l_fy, 1 - l_fy));
+
+    int l_minX, l_minY, l_maxX, l_maxY;
+    GetCell(m_minBox, l_minX, l_minY);
+    GetCell(m_maxBox, l_maxX, l_maxY);
+    out_minR = MaxT(MaxT(MaxT(l_minX - out_cx, out_cx - l_maxX), MaxT(l_minY - out_cy, out_cy - l_maxY)), 0);
+    out_maxR = MaxT(MaxT(out_cx - l_minX, l_maxX - out_cx), MaxT(out_cy - l_minY, l_maxY - out_cy));
+  }
+
+  /** expanding ring search (cells in radius are visited once, nearest first) */
+  template <class S> void SearchNearest(S& io_search) const
+  {
+    if (NumPts() == 0)
+      return;
+    int l_cx, l_cy, l_minR, l_maxR;
+    float l_border;
+    RingSearchStart(io_search.m_pos, l_cx, l_cy, l_border, l_minR, l_maxR);
+    SearchRings(*m_flat, l_cx, l_cy, l_border, m_res, l_minR, l_maxR, io_search);
+    if (m_delta.NumPts() > 0)   // (stops at the rings that cannot beat the points found in the full build)
+      SearchRings(m_delta, l_cx, l_cy, l_border, m_res, l_minR, l_maxR, io_search);
+  }
+
+  /** order of a batch of queries sorted by their cell (so that consecutive queries read the same cells)
+   * @param out_order   indices of the queries (in_numQueries) */
+  void SortByCell(const CVec3* in_queries, int in_numQueries, int* out_order) const
+  {
+    // kept by the calling thread: repeated batches (ICP iterations) do not allocate
+    static thread_local std::vector<std::pair<unsigned long long, int> > l_keys;
+    l_keys.resize(in_numQueries);
+    for (int i = 0; i < in_numQueries; ++i)
+    {
+      int cx, cy;
+      GetCell(in_queries[i], cx, cy);
+      l_keys[i] = std::make_pair(CellKey(cx, cy), i);
+    }
+    std::sort(l_keys.begin(), l_keys.end());
+    for (int i = 0; i < in_numQueries; ++i)
+      out_order[i] = l_keys[i].second;
+  }
+};
+
+
+/** number of queries running in the threads of a slot (padded so that slots do not share a cache line) */
+struct CReaderSlot
+{
+  std::atomic<int> m_active;
+  char m_pad[CACHE_LINE - sizeof(std::atomic<int>)];
+
+  CReaderSlot() : m_active(0) {}
+};
+
+
+/** slot of the calling thread (threads get slots round robin on their first query) */
+inline int ReaderSlot()
+{
+  static std::atomic<int> s_nextSlot(0);
+  static thread_local int s_slot = -1;
+  if (s_slot < 0)
+    s_slot = s_nextSlot.fetch_add(1) % READER_SLOTS;
+  return s_slot;
+}
+
+
+/** the published snapshot of the spatial hash and the snapshots it replaced.
+ *  Queries count themselves in their slot and then load the snapshot. A replaced snapshot is
+ *  deleted once each slot was seen without queries after the replacement: a query that started
+ *  later loads a newer snapshot (the counters and the snapshot pointer are sequentially consistent).
+ *  Memory read through the replaced snapshots (a referenced cloud) is released the same way.
+ *  Writers hold m_writeLock */
+struct CPublished
+{
+  /** a replaced snapshot, or memory to release once unread */
+  struct CRetired
+  {
+    const CHashSnapshot* m_snapshot;    ///< (0 for memory)
+    void (*m_release)(void*);           ///< releases m_arg (0 for a snapshot)
+    void* m_arg;
+    unsigned long long m_idleSlots;     ///< slots seen without queries since the replacement (bit per slot)
+  };
+
+  std::atomic<const CHashSnapshot*> m_current;
+  CReaderSlot m_readers[READER_SLOTS];
+  std::mutex m_writeLock;
+  std::vector<CRetired> m_retired;
+
+  CPublished(float in_res) : m_current(new CHashSnapshot(in_res)) {}
+
+  ~CPublished()
+  {
+    delete m_current.load();
+    for (unsigned int i = 0; i < m_retired.size(); ++i)
+      Release(m_retired[i]);
   }
 
+  /** replace the current snapshot (called by writers, holding m_writeLock) */
+  void Publish(const CHashSnapshot* in_snapshot)
+  {
+    CRetired l_retired = { m_current.exchange(in_snapshot), 0, 0, 0 };
+    m_retired.push_back(l_retired);
+    Reclaim();
+  }
+
+  /** release memory once no query that started before can be reading it (called by writers, holding m_writeLock) */
+  void Retire(void (*in_release)(void*), void* in_arg)
+  {
+    CRetired l_retired = { 0, in_release, in_arg, 0 };
+    m_retired.push_back(l_retired);
+    Reclaim();
+  }
+
+  static void Release(const CRetired& in_retired)
+  {
+    delete in_retired.m_snapshot;
+    if (in_retired.m_release != 0)
+      in_retired.m_release(in_retired.m_arg);
+  }
+
+  /** delete the replaced snapshots that no query can be reading */
+  void Reclaim()
+  {
+    for (unsigned int i = 0; i < m_retired.size(); )
+    {
+      CRetired& l_retired = m_retired[i];
+      for (int s = 0; s < READER_SLOTS; ++s)
+        if (m_readers[s].m_active.load() == 0)
+          l_retired.m_idleSlots |= 1ULL << s;
+      if (l_retired.m_idleSlots != ~0ULL)
+      {
+        ++i;
+        continue;
+      }
+      Release(l_retired);
+      l_retired = m_retired.back();
+      m_retired.pop_back();
+    }
+  }
+};
+
+
+/** a query's hold on the current snapshot (the snapshot is not deleted while it is held) */
+class CReadGuard
+{
+public:
+  CReadGuard(void* in_published)
+    : m_active(((CPublished*)in_published)->m_readers[ReaderSlot()].m_active)
+  {
+    m_active.fetch_add(1);
+    m_snapshot = ((CPublished*)in_published)->m_current.load();
+  }
+
+  ~CReadGuard()  { m_active.fetch_sub(1, std::memory_order_release); }
+
+  const CHashSnapshot& operator* () const   { return *m_snapshot; }
+  const CHashSnapshot* operator-> () const  { return m_snapshot; }
+
+private:
+  std::atomic<int>& m_active;
+  const CHashSnapshot* m_snapshot;
+};
+
+
+/** fill the flat layout (reference mode) from the cell keys of the points [in_first, in_first + keys).
+ *  Keys are relative to the cells bounding box: (y - in_minY) * in_width + (x - in_minX) */
+template <typename K> void FillFlatFromKeys(CFlatCells& io_flat, std::vector<K>& io_keys, int in_first, int in_minX, int in_minY,
+                                            unsigned long long in_width, int in_numBits)
+{
+  int l_num = int(io_keys.size());
+  std::vector<int>& l_id = io_flat.m_id;
+  l_id.resize(l_num);
+  #pragma omp parallel for
+  for (int i = 0; i < l_num; ++i)
+    l_id[i] = in_first + i;
+  RadixSort(io_keys, l_id, in_numBits);
+
+  // each run of equal keys is a cell
+  io_flat.m_keys.clear();
+  io_flat.m_start.clear();
+  for (int i = 0; i < l_num; ++i)
+  {
+    if (i > 0 && io_keys[i] == io_keys[i - 1])
+      continue;
+    unsigned long long l_key = io_keys[i];
+    io_flat.m_keys.push_back(CellKey(in_minX + int(l_key % in_width), in_minY + int(l_key / in_width)));
+    io_flat.m_start.push_back(i);
+  }
+  io_flat.m_start.push_back(l_num);
+  io_flat.FillTable();
+}
+
+
+/** append the points of a flat layout (positions, objects and indices) */
+static void GatherPoints(const CFlatCells& in_flat, std::vector<CVec3>& io_pts, std::vector<void*>& io_obj, std::vector<int>& io_id)
+{
+  for (int c = 0; c < int(in_flat.m_keys.size()); ++c)
+  {
+    for (int i = in_flat.m_start[c]; i < in_flat.m_start[c + 1]; ++i)
+    {
+      io_pts.push_back(in_flat.Pos(c, i));
+      io_obj.push_back(in_flat.Obj(i));
+      io_id.push_back(in_flat.m_id[i]);
+    }
+  }
+}
+
+
+/** bounding box of the points [in_first, in_end) of a cloud (per block, in parallel) */
+static void BoundingBox(const CVec3* in_pos, int in_first, int in_end, CVec3& out_minBox, CVec3& out_maxBox)
+{
+  int l_blockSize = (in_end - in_first + BUILD_BLOCKS - 1) / BUILD_BLOCKS;
+  std::vector<CVec3> l_blockMin(BUILD_BLOCKS, in_pos[in_first]), l_blockMax(BUILD_BLOCKS, in_pos[in_first]);
+  #pragma omp parallel for
+  for (int b = 0; b < BUILD_BLOCKS; ++b)
+  {
+    int l_end = MinT(in_end, in_first + (b + 1) * l_blockSize);
+    for (int i = in_first + b * l_blockSize; i < l_end; ++i)
+    {
+      l_blockMin[b] = Min_ps(l_blockMin[b], in_pos[i]);
+      l_blockMax[b] = Max_ps(l_blockMax[b], in_pos[i]);
+    }
+  }
+  out_minBox = out_maxBox = in_pos[in_first];
+  for (int b = 0; b < BUILD_BLOCKS; ++b)
+  {
+    out_minBox = Min_ps(out_minBox, l_blockMin[b]);
+    out_maxBox = Max_ps(out_maxBox, l_blockMax[b]);
+  }
+}
+
+
+/** release an array of positions (see CSpatialHash2D::DeleteWhenUnread()) */
+static void DeleteArray(void* in_array)
+{
+  delete[] (CVec3*)in_array;
+}
+
+
 /******************************************************************************
 *                           EXPORTED CLASS METHODS                            *
 ******************************************************************************/
@@ -134,11 +910,12 @@ typedef std::unordered_map<CInt3, std::vector<Node2D> , HashCompare2D, HashCompa
 ******************************************************************************/
 CSpatialHash2D::CSpatialHash2D (float res)
 {
-  m_data = new MapInt3();
+  m_data = new CPending();
+  m_published = new CPublished(res);
   m_res = res;
   m_resInv = (float)(1.0 / m_res);
-  if (s_spiral == 0)
-    FillSpiralOrder();
+  m_numPts = 0;
+  m_quantTolerance = 0;
 }
 
 /******************************************************************************
@@ -148,7 +925,8 @@ CSpatialHash2D::CSpatialHash2D (float res)
 ******************************************************************************/
 CSpatialHash2D::~CSpatialHash2D ()
 {
-  delete ((MapInt3*)m_data);
+  delete ((CPending*)m_data);
+  delete ((CPublished*)m_published);
 }
 
 
@@ -159,22 +937,155 @@ CSpatialHash2D::~CSpatialHash2D ()
 ******************************************************************************/
 void CSpatialHash2D::Add(const CVec3& in_pos, void* in_obj)
 {
-  MapInt3* l_data = (MapInt3*)m_data;
-  if (l_data->size() == 0)
+  CPublished* l_published = (CPublished*)m_published;
+  std::lock_guard<std::mutex> l_lock(l_published->m_writeLock);
+  CPending* l_data = (CPending*)m_data;
+  if (m_numPts == 0)
+  {
     m_pivot = in_pos;
+    m_minBox = m_maxBox = in_pos;
+  }
+  else
+  {
+    m_minBox = Min_ps(m_minBox, in_pos);
+    m_maxBox = Max_ps(m_maxBox, in_pos);
+  }
 
-  // convert coordinates to cell coordinates
-  CVec3 l_v = (in_pos - m_pivot) * m_resInv;
-  CInt3 l_cell = CInt3((int)l_v.x, (int)l_v.y, (int)l_v.z);
-
-  // add to cell
-  MapInt3::iterator l_it = l_data->find(l_cell);
-  if (l_it == l_data->end()) // empty cell? create list
-    (*l_data)[l_cell] = std::vector<Node2D>();
+  // (sorted into cells by the next Build())
   Node2D n;
   n.obj = in_obj;
   n.pt = in_pos;
-  (*l_data)[l_cell].push_back(n);
+  n.id = m_numPts++;
+  l_data->push_back(n);
+}
+
+
+/******************************************************************************
+*
+*: Method name: Build
+*
+* Creates a new flat layout from the points added since the last Build(), using
+* a counting sort on the cells, and publishes it. While they are few, the points
+* go to the delta layout (which is sorted again with them), otherwise all points
+* are sorted into a new full layout.
+* Points of a referenced cloud are copied (the result is not in reference mode).
+******************************************************************************/
+void CSpatialHash2D::Build()
+{
+  CPublished* l_published = (CPublished*)m_published;
+  std::lock_guard<std::mutex> l_lock(l_published->m_writeLock);
+  CPending* l_data = (CPending*)m_data;
+  if (l_data->empty())
+    return;
+  const CHashSnapshot* l_old = l_published->m_current.load();
+  const CFlatCells& l_oldFlat = *l_old->m_flat;
+  CHashSnapshot* l_snapshot = new CHashSnapshot(m_res, m_pivot, m_minBox, m_maxBox);
+  CFlatCells* l_flat = &l_snapshot->m_delta;
+  bool l_toDelta = (l_oldFlat.m_ref == 0) &&
+                   (l_old->m_delta.NumPts() + int(l_data->size())) * DELTA_FRACTION <= l_oldFlat.NumPts();
+  if (l_toDelta)
+    l_snapshot->m_flat = l_old->m_flat;
+  else
+    l_snapshot->m_flat.reset(l_flat = new CFlatCells());
+
+  // gather the points (previous layouts first, to keep the order of insertion)
+  std::vector<CVec3> l_pts;
+  std::vector<void*> l_obj;
+  std::vector<int> l_id;
+  l_pts.reserve(l_old->NumPts() + l_data->size());
+  l_obj.reserve(l_pts.capacity());
+  l_id.reserve(l_pts.capacity());
+  if (!l_toDelta)
+    GatherPoints(l_oldFlat, l_pts, l_obj, l_id);
+  GatherPoints(l_old->m_delta, l_pts, l_obj, l_id);
+  const CPending& nodes = *l_data;
+  for (unsigned int i = 0; i < nodes.size(); ++i)
+  {
+    l_pts.push_back(nodes[i].pt);
+    l_obj.push_back(nodes[i].obj);
+    l_id.push_back(nodes[i].id);
+  }
+  CPending().swap(*l_data);
+  int l_num = int(l_pts.size());
+  bool l_hasObj = false;
+  for (int i = 0; i < l_num && !l_hasObj; ++i)
+    l_hasObj = (l_obj[i] != 0);
+
+  // cell of each point
+  std::vector<unsigned long long> l_ptKeys(l_num);
+  for (int i = 0; i < l_num; ++i)
+  {
+    int cx, cy;
+    GetCell(l_pts[i], cx, cy);
+    l_ptKeys[i] = CellKey(cx, cy);
+  }
+
+  // sort the points by cell
+  std::vector<int> l_dst;
+  l_flat->SortCells(l_ptKeys, l_dst);
+  l_flat->m_x.resize(l_num);  l_flat->m_y.resize(l_num);  l_flat->m_z.resize(l_num);
+  l_flat->m_id.resize(l_num);
+  if (l_hasObj)
+    l_flat->m_obj.resize(l_num);
+  for (int i = 0; i < l_num; ++i)
+  {
+    int d = l_dst[i];
+    l_flat->m_x[d] = l_pts[i].x;  l_flat->m_y[d] = l_pts[i].y;  l_flat->m_z[d] = l_pts[i].z;
+    if (l_hasObj)
+      l_flat->m_obj[d] = l_obj[i];
+    l_flat->m_id[d] = l_id[i];
+  }
+  if (m_quantTolerance > 0)
+    l_flat->Quantize(m_pivot, m_res, m_quantTolerance);
+  l_published->Publish(l_snapshot);
+}
+
+
+/******************************************************************************
+*
+*: Method name: Build (reference mode)
+*
+******************************************************************************/
+void CSpatialHash2D::Build(const CPtCloud& in_pcl)
+{
+  std::lock_guard<std::mutex> l_lock(((CPublished*)m_published)->m_writeLock);
+  IndexCloud(in_pcl, false);
+}
+
+
+/******************************************************************************
+*
+*: Method name: Append
+*
+******************************************************************************/
+void CSpatialHash2D::Append(const CPtCloud& in_pcl)
+{
+  std::lock_guard<std::mutex> l_lock(((CPublished*)m_published)->m_writeLock);
+  IndexCloud(in_pcl, true);
+}
+
+
+/******************************************************************************
+*
+*: Method name: DeleteWhenUnread
+*
+******************************************************************************/
+void CSpatialHash2D::DeleteWhenUnread(CVec3* in_array)
+{
+  CallWhenUnread(DeleteArray, in_array);
+}
+
+
+/******************************************************************************
+*
+*: Method name: CallWhenUnread
+*
+******************************************************************************/
+void CSpatialHash2D::CallWhenUnread(void (*in_release)(void*), void* in_arg)
+{
+  CPublished* l_published = (CPublished*)m_published;
+  std::lock_guard<std::mutex> l_lock(l_published->m_writeLock);
+  l_published->Retire(in_release, in_arg);
 }
 
 
@@ -189,88 +1100,38 @@ void CSpatialHash2D::Add(const CVec3& in_pos, void* in_obj)
 
 void* CSpatialHash2D::FindNearest(const CVec3& in_pos, CVec3* out_pMinPt, float in_max2DRadius) const
 {
-  MapInt3* l_data = (MapInt3*)m_data;
-  const void* l_minObj = 0;
-  const CVec3* l_minPt = 0;
-  float l_minDistSqr = 1E20f;
   float s_epsilon = 0.01f * m_res;
   if (in_max2DRadius < s_epsilon)
     in_max2DRadius  = s_epsilon;
-  float max2dRadSqr = in_max2DRadius * in_max2DRadius;
-  // convert coordinates to cell coordinates
-  CVec3 l_v = (in_pos - m_pivot) * m_resInv;
-  CInt3 l_cell = CInt3((int)l_v.x, (int)l_v.y, (int)l_v.z);
-  int rad = int(ceil(in_max2DRadius * m_resInv));
-
-  // go over all cells in SPIRAL ORDER
-  for (int i=0; i<SPIRAL_ARR_SIZE; ++i)
-  {
-    // if the cell is further than found point get out
-    if (s_spiral[i].distSqr*m_res*m_res > l_minDistSqr)
-      break;
-
-    // get the cell
-    int dx = s_spiral[i].dx, dy = s_spiral[i].dy;
-    CInt3 l_c = CInt3(l_cell.x + dx, l_cell.y + dy, 0);
-    MapInt3::const_iterator l_it = l_data->find(l_c);
-    if (l_it == l_data->end())
-      continue; // empty cell
-
-    // search the objects in each cell
-    const std::vector<Node2D>& nodes = l_it->second;
-    for (unsigned int i = 0; i<nodes.size(); i++)
-    {
-      float l_dist2DSqr = DistSqr2D(nodes[i].pt, in_pos);
-      if (l_dist2DSqr > max2dRadSqr)
-        continue;
-      float l_distSqr = DistSqr(nodes[i].pt, in_pos);
-      if (l_distSqr >= l_minDistSqr)
-        continue;
-      l_minDistSqr = l_distSqr;
-      l_minObj = nodes[i].obj;
-      l_minPt = &(nodes[i].pt);
-    }
-  }
-  
-  // is the spiral enough?
-  if (l_minDistSqr < MAX_SPIRAL_DIST_SQR *  m_res * m_res)
-  {
-    if (out_pMinPt != 0)
-      *out_pMinPt = l_minPt == 0 ? CVec3(0, 0, 0) : *l_minPt;
-    return const_cast<void*>(l_minObj);
-  }
-
-  // go over all cells in range
-  for (int x=-rad; x<=rad; x++)
-  {
-    for (int y=-rad; y<=rad; y++)
-    {
-      CInt3 l_c = CInt3(int(l_cell.x + x), int(l_cell.y + y), 0);
-      MapInt3::const_iterator l_it = l_data->find(l_c);
-      if (l_it == l_data->end()) 
-        continue; // empty cell
-      const std::vector<Node2D>& nodes = l_it->second;
-      for (unsigned int i=0; i<nodes.size(); i++)
-      {
-        float l_dist2DSqr = DistSqr2D(nodes[i].pt, in_pos);
-        if (l_dist2DSqr > max2dRadSqr)
-          continue;
-        float l_distSqr = DistSqr(nodes[i].pt, in_pos);
-        if (l_distSqr >= l_minDistSqr)
-          continue;
-        l_minDistSqr = l_distSqr;
-        l_minObj  = nodes[i].obj;
-        l_minPt = &(nodes[i].pt);
-      }
-    }
-  }
+  CNearestSearch l_search(in_pos, in_max2DRadius * in_max2DRadius);
+  CReadGuard l_read(m_published);
+  l_read->SearchNearest(l_search);
 
   if (out_pMinPt != 0)
-    *out_pMinPt = l_minPt == 0 ? CVec3(0,0,0) : *l_minPt;
-  return const_cast<void*>(l_minObj);
+    *out_pMinPt = (l_search.m_minId >= 0) ? l_search.m_minPt : CVec3(0,0,0);
+  return const_cast<void*>(l_search.m_minObj);
 }
 
 
+/******************************************************************************
+*
+*: Method name: FindNearestIdx
+*
+******************************************************************************/
+int CSpatialHash2D::FindNearestIdx(const CVec3& in_pos, CVec3* out_pMinPt, float in_max2DRadius) const
+{
+  float s_epsilon = 0.01f * m_res;
+  if (in_max2DRadius < s_epsilon)
+    in_max2DRadius  = s_epsilon;
+  CNearestSearch l_search(in_pos, in_max2DRadius * in_max2DRadius);
+  CReadGuard l_read(m_published);
+  l_read->SearchNearest(l_search);
+
+  if (out_pMinPt != 0)
+    *out_pMinPt = (l_search.m_minId >= 0) ? l_search.m_minPt : CVec3(0,0,0);
+  return l_search.m_minId;
+}
+
 
 /******************************************************************************
 *
@@ -279,41 +1140,142 @@ void* CSpatialHash2D::FindNearest(const CVec3& in_pos, CVec3* out_pMinPt, float
 ******************************************************************************/
 int CSpatialHash2D::GetNear(const CVec3& in_pos, int in_bufSize, void** out_buf, CVec3* out_pos, float in_max2DRadius) const
 {
-  MapInt3* l_data = (MapInt3*)m_data;
-  int l_n = 0;    // number of objects
-  //float l_minDist = 1E10;
   float s_epsilon = 0.01f * m_res;
   if (in_max2DRadius < s_epsilon)
     in_max2DRadius  = s_epsilon;
-  float max2dRadSqr = in_max2DRadius * in_max2DRadius;
-  // convert coordinates to cell coordinates
-  CVec3 l_v = (in_pos - m_pivot) * m_resInv;
-  CInt3 l_cell = CInt3((int)l_v.x, (int)l_v.y, (int)l_v.z);
-  int rad = int(ceil(in_max2DRadius * m_resInv));
+  CNearGather l_gather(in_pos, in_max2DRadius * in_max2DRadius, in_bufSize, out_buf, 0, out_pos);
+  CReadGuard l_read(m_published);
+  int l_cx, l_cy;
+  l_read->GetCell(in_pos, l_cx, l_cy);
+  for (int l = 0; l < 2; ++l)
+    SearchSquare(l_read->Layout(l), l_cx, l_cy, int(ceil(in_max2DRadius * m_resInv)), l_gather);
+  return l_gather.m_num;
+}
+
+
+/******************************************************************************
+*
+*: Method name: GetNearIdx
+*
+******************************************************************************/
+int CSpatialHash2D::GetNearIdx(const CVec3& in_pos, int in_bufSize, int* out_idx, CVec3* out_pos, float in_max2DRadius) const
+{
+  float s_epsilon = 0.01f * m_res;
+  if (in_max2DRadius < s_epsilon)
+    in_max2DRadius  = s_epsilon;
+  CNearGather l_gather(in_pos, in_max2DRadius * in_max2DRadius, in_bufSize, 0, out_idx, out_pos);
+  CReadGuard l_read(m_published);
+  int l_cx, l_cy;
+  l_read->GetCell(in_pos, l_cx, l_cy);
+  for (int l = 0; l < 2; ++l)
+    SearchSquare(l_read->Layout(l), l_cx, l_cy, int(ceil(in_max2DRadius * m_resInv)), l_gather);
+  return l_gather.m_num;
+}
+
 
-  // go over all cells and objects in them to find the minimal distance
-  for (int x=-rad; x<=rad; x++)
+/******************************************************************************
+*
+*: Method name: FindKNearest
+*
+* Queries are sorted by cell so that consecutive queries (of a thread) touch
+* the same cells. Each query searches rings of cells at increasing distance and
+* stops once the next ring cannot hold a point closer than the k-th neighbor.
+******************************************************************************/
+void CSpatialHash2D::FindKNearest(const CVec3* in_queries, int in_numQueries, int in_k, int* out_idx, float* out_distSqr,
+                                  float in_max2DRadius, CVec3* out_pos) const
+{
+  if (in_numQueries <= 0 || in_k <= 0)
+    return;
+  float l_max2dRadSqr = (in_max2DRadius > 0) ? in_max2DRadius * in_max2DRadius : FLT_MAX;
+  CReadGuard l_read(m_published);   // (held by the calling thread for the whole batch)
+  const CHashSnapshot& l_snapshot = *l_read;
+
+  static thread_local std::vector<int> l_order;   // (kept by the calling thread, see SortByCell())
+  l_order.resize(in_numQueries);
+  l_snapshot.SortByCell(in_queries, in_numQueries, &l_order[0]);
+  const int* l_queryOrder = &l_order[0];          // (the other threads of the loop read the caller's order, not their own)
+
+  #pragma omp parallel for schedule(dynamic, 64)
+  for (int q = 0; q < in_numQueries; ++q)
   {
-    for (int y=-rad; y<=rad; y++)
+    int l_qi = l_queryOrder[q];
+    const CVec3& l_pos = in_queries[l_qi];
+    CKNearestSearch l_search(l_pos, l_max2dRadSqr, in_k, out_idx + l_qi * in_k, out_distSqr + l_qi * in_k,
+                             (out_pos != 0) ? out_pos + l_qi * in_k : 0);
+    l_snapshot.SearchNearest(l_search);
+    l_search.Finish();
+  }
+}
+
+
+/******************************************************************************
+*
+*: Method name: FindNearestApprox
+*
+* Searches the cell of each query and its 4 neighbors. The points that are not
+* searched are at least as far as the nearest diagonal cell, which gives the
+* error bound.
+******************************************************************************/
+void CSpatialHash2D::FindNearestApprox(const CVec3* in_queries, int in_numQueries, int* out_idx, float* out_distSqr,
+                                       float in_max2DRadius, CVec3* out_pos, float* out_errBound) const
+{
+  if (in_numQueries <= 0)
+    return;
+  float l_max2dRadSqr = (in_max2DRadius > 0) ? in_max2DRadius * in_max2DRadius : FLT_MAX;
+  static const int s_cross[5][2] = { {0, 0}, {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
+  CReadGuard l_read(m_published);   // (held by the calling thread for the whole batch)
+  const CHashSnapshot& l_snapshot = *l_read;
+
+  static thread_local std::vector<int> l_order;   // (kept by the calling thread, see SortByCell())
+  l_order.resize(in_numQueries);
+  l_snapshot.SortByCell(in_queries, in_numQueries, &l_order[0]);
+  const int* l_queryOrder = &l_order[0];          // (the other threads of the loop read the caller's order, not their own)
+
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (int i = 0; i < in_numQueries; ++i)
+  {
+    int q = l_queryOrder[i];
+    CNearestSearch l_search(in_queries[q], l_max2dRadSqr);
+    float l_searchedSqr = FLT_MAX;    // (squared) 2D distance within which all points were searched
+    if (l_snapshot.NumPts() > 0)
     {
-      CInt3 l_c = CInt3(int(l_cell.x + x), int(l_cell.y + y), 0);
-      MapInt3::const_iterator l_it = l_data->find(l_c);
-      if (l_it == l_data->end()) 
-        continue;   // empty cell
-      const std::vector<Node2D>& nodes = l_it->second;
-      for (unsigned int i=0; i<nodes.size(); i++)
-      {
-        float l_dist2DSqr = DistSqr2D(nodes[i].pt, in_pos);
-        if (l_dist2DSqr > max2dRadSqr)
-          continue;
-        out_buf[l_n] = nodes[i].obj;
-        out_pos[l_n++] = nodes[i].pt;
-        if (l_n >= in_bufSize)
-          return in_bufSize;
-      }
+      CVec3 l_f = (in_queries[q] - l_snapshot.m_pivot) * m_resInv;
+      float l_fx = floorf(l_f.x), l_fy = floorf(l_f.y);
+      int l_cx = (int)l_fx, l_cy = (int)l_fy;
+      for (int l = 0; l < 2; ++l)
+        for (int c = 0; c < 5; ++c)
+          SearchCell(l_snapshot.Layout(l), l_cx + s_cross[c][0], l_cy + s_cross[c][1], l_search);
+
+      float dx = MinT(l_f.x - l_fx, 1 - (l_f.x - l_fx)) * m_res;
+      float dy = MinT(l_f.y - l_fy, 1 - (l_f.y - l_fy)) * m_res;
+      l_searchedSqr = dx * dx + dy * dy;
+    }
+
+    bool l_found = (l_search.m_minId >= 0);
+    out_idx[q] = l_search.m_minId;
+    out_distSqr[q] = l_found ? l_search.m_minDistSqr : FLT_MAX;
+    if (out_pos != 0)
+      out_pos[q] = l_found ? l_search.m_minPt : CVec3(0, 0, 0);
+    if (out_errBound != 0)
+    {
+      if (l_searchedSqr >= l_max2dRadSqr || (l_found && l_search.m_minDistSqr <= l_searchedSqr))
+        out_errBound[q] = 0;
+      else
+        out_errBound[q] = l_found ? sqrtf(l_search.m_minDistSqr) - sqrtf(l_searchedSqr) : FLT_MAX;
     }
   }
-  return l_n;
+}
+
+
+/******************************************************************************
+*
+*: Method name: SetQuantization
+*
+******************************************************************************/
+void CSpatialHash2D::SetQuantization(float in_tolerance)
+{
+  std::lock_guard<std::mutex> l_lock(((CPublished*)m_published)->m_writeLock);
+  m_quantTolerance = MaxT(in_tolerance, 0.0f);
 }
 
 
@@ -324,8 +1286,114 @@ int CSpatialHash2D::GetNear(const CVec3& in_pos, int in_bufSize, void** out_buf,
 ******************************************************************************/
 void CSpatialHash2D::Clear()
 {
-  MapInt3* l_data = (MapInt3*)m_data;
-  l_data->clear();
+  CPublished* l_published = (CPublished*)m_published;
+  std::lock_guard<std::mutex> l_lock(l_published->m_writeLock);
+  CPending().swap(*(CPending*)m_data);
+  m_numPts = 0;
+  l_published->Publish(new CHashSnapshot(m_res));
+}
+
+
+/******************************************************************************
+*                             Protected methods                               *
+******************************************************************************/
+/******************************************************************************
+*
+*: Method name: IndexCloud
+*
+* Only the indices of the points are stored (sorted by cell).
+* The bounding box and the cell keys are computed in parallel, and the keys are
+* radix sorted (in parallel). Keys are relative to the bounding box of the
+* cells, so they usually fit in 32 bits.
+* Appending sorts only the points appended since the last full build (into the
+* delta layout), unless they are more than 1/DELTA_FRACTION of the built ones.
+******************************************************************************/
+void CSpatialHash2D::IndexCloud(const CPtCloud& in_pcl, bool in_append)
+{
+  CPublished* l_published = (CPublished*)m_published;
+  const CHashSnapshot* l_old = l_published->m_current.load();
+  const CFlatCells& l_oldFlat = *l_old->m_flat;
+  const CVec3* l_pos = in_pcl.m_pos;
+  int l_num = MaxT(in_pcl.m_numPts, 0);
+
+  // appending to the indexed cloud (same array, the indexed points are unchanged)
+  in_append = in_append && l_num > 0 && l_pos == l_oldFlat.m_ref && ((CPending*)m_data)->empty() && l_num >= m_numPts;
+  if (in_append && l_num == m_numPts)
+    return;
+  int l_first = 0;    // first point of the new layout (the full build holds the points before)
+  if (in_append && (l_num - l_oldFlat.NumPts()) * DELTA_FRACTION <= l_oldFlat.NumPts())
+    l_first = l_oldFlat.NumPts();
+
+  CPending().swap(*(CPending*)m_data);
+  m_numPts = l_num;
+  if (l_num == 0)
+  {
+    l_published->Publish(new CHashSnapshot(m_res));
+    return;
+  }
+
+  // bounding box
+  CVec3 l_minBox, l_maxBox;
+  BoundingBox(l_pos, l_first, l_num, l_minBox, l_maxBox);
+  if (l_first == 0)
+  {
+    m_pivot = l_pos[0];
+    m_minBox = l_minBox;
+    m_maxBox = l_maxBox;
+  }
+  else
+  {
+    m_minBox = Min_ps(m_minBox, l_minBox);
+    m_maxBox = Max_ps(m_maxBox, l_maxBox);
+  }
+
+  CHashSnapshot* l_snapshot = new CHashSnapshot(m_res, m_pivot, m_minBox, m_maxBox);
+  CFlatCells* l_flat = &l_snapshot->m_delta;
+  if (l_first > 0)
+    l_snapshot->m_flat = l_old->m_flat;
+  else
+    l_snapshot->m_flat.reset(l_flat = new CFlatCells());
+
+  // cells of the bounding box
+  int l_minX, l_minY, l_maxX, l_maxY;
+  GetCell(l_minBox, l_minX, l_minY);
+  GetCell(l_maxBox, l_maxX, l_maxY);
+  unsigned long long l_width = (unsigned long long)(l_maxX - l_minX) + 1;
+  unsigned long long l_numCells = l_width * ((unsigned long long)(l_maxY - l_minY) + 1);
+  int l_numBits = 1;
+  while (l_numBits < 64 && (1ULL << l_numBits) < l_numCells)
+    l_numBits++;
+
+  // cell key of each point, sorted
+  int l_numNew = l_num - l_first;
+  if (l_numBits <= 32)
+  {
+    std::vector<unsigned int> l_keys(l_numNew);
+    #pragma omp parallel for
+    for (int i = 0; i < l_numNew; ++i)
+    {
+      int cx, cy;
+      GetCell(l_pos[l_first + i], cx, cy);
+      l_keys[i] = (unsigned int)((cy - l_minY) * l_width + (cx - l_minX));
+    }
+    FillFlatFromKeys(*l_flat, l_keys, l_first, l_minX, l_minY, l_width, l_numBits);
+  }
+  else
+  {
+    std::vector<unsigned long long> l_keys(l_numNew);
+    #pragma omp parallel for
+    for (int i = 0; i < l_numNew; ++i)
+    {
+      int cx, cy;
+      GetCell(l_pos[l_first + i], cx, cy);
+      l_keys[i] = (unsigned long long)(cy - l_minY) * l_width + (cx - l_minX);
+    }
+    FillFlatFromKeys(*l_flat, l_keys, l_first, l_minX, l_minY, l_width, l_numBits);
+  }
+  l_flat->m_ref = l_pos;
+  if (m_quantTolerance > 0)
+    l_flat->Quantize(m_pivot, m_res, m_quantTolerance);
+  l_published->Publish(l_snapshot);
 }
 
 
@@ -32,6 +32,7 @@
 #define __SPATIAL_HASH_H
 
 #include "../../include/vec.h"
+#include "SpatialIndex.h"
 
 /******************************************************************************
 *                                   IMPORTED                                  *
@@ -44,41 +45,112 @@
 
 namespace tpcl
 {
-
   /**************************************************************************//**
   *
   * Spatial hashing for nearest neighbor search
   *
   * Meant for 2.5D searches.
   * Projected 2D space is divided into bins (i.e. bins ignore z). Nearwest neighbor
-  * searches each cell in a radius.
+  * searches rings of cells at increasing distance, stopping once a ring cannot
+  * hold a point nearer than the one found.
+  *
+  * Calling Build() moves the added points into a flat layout: points are sorted
+  * by cell (row by row) into one contiguous array, with a cell-offset table.
+  * Queries on the flat layout read adjacent memory instead of chasing a separate
+  * list per cell. The positions are kept as a structure of arrays and cells are
+  * scanned with the vector kernels of DistKernels.h (AVX2/SSE, chosen at run time).
+  * Build(const CPtCloud&) creates the flat layout directly from a cloud, keeping
+  * only the point indices (positions are read from the cloud).
+  * Points added later (Build() after Add(), or Append()) are sorted into a second,
+  * delta layout, which is merged into the main one once it holds more than 1/8
+  * of the points: an append costs about the size of the delta, not of the cloud.
+  *
+  * Optionally (SetQuantization()) the positions are stored as 16 bit offsets from
+  * the corner of their cell: 6 bytes a point instead of 12 (or instead of the
+  * cloud). Queries decode the cells they scan.
+  *
+  * Concurrency: the flat layout is an immutable snapshot. Build() and Clear() create
+  * a new snapshot and publish it, replacing the previous one.
+  * - queries (the const methods) read the current snapshot without locking, in any
+  *   number of threads, also while another thread calls Add(), Build(), etc.
+  *   A query sees either the old or the new snapshot, never a mix.
+  * - points added with Add() are seen by the queries after the next Build().
+  * - writers (Add(), Build(), Clear()) are serialized by a lock.
+  * - a replaced snapshot is deleted by a later writer (or the destructor) once no
+  *   query that started before the replacement is still running. The batched
+  *   queries hold their snapshot for the whole batch.
+  * - the destructor must not run concurrently with queries, and in reference mode
+  *   the cloud must stay valid while a snapshot of it may be read: a cloud that
+  *   moved is released with DeleteWhenUnread().
   *
   ******************************************************************************/
-  class CSpatialHash2D
+  class CSpatialHash2D : public ISpatialIndex
   {
   public:
     /******************************************************************************
     *                               Public methods                                *
     ******************************************************************************/
 
-    /** add an object+position pair to the spatial hash */
-    void Add(const CVec3& in_pos, void* in_obj);
+    /** add an object+position pair to the spatial hash.
+     *  The point is not seen by the queries until the next Build() (unlike the first versions
+     *  of this class, which searched added points right away): call Build() after adding */
+    virtual void Add(const CVec3& in_pos, void* in_obj);
+
+    /** move all added points into the flat (cell sorted) layout.
+     *  should be called once the bulk of the points was added and before querying */
+    virtual void Build();
+
+    /** index the points of a cloud without copying them (see ISpatialIndex::Build(const CPtCloud&)) */
+    virtual void Build(const CPtCloud& in_pcl);
+
+    /** index the points appended to the cloud (see ISpatialIndex::Append()).
+     *  Only the appended points are sorted (into the delta layout) */
+    virtual void Append(const CPtCloud& in_pcl);
+
+    /** delete[] an array once no query can read it (see ISpatialIndex::DeleteWhenUnread()) */
+    virtual void DeleteWhenUnread(CVec3* in_array);
+
+    /** call in_release(in_arg) once no query that started before the call is running, i.e. after
+     *  memory read by the replaced snapshots is no longer read (by a later writer or the destructor) */
+    void CallWhenUnread(void (*in_release)(void*), void* in_arg);
 
     /** 
      * Find nearest object (using its associated point)
      * @param out_pMinPt (optional) closest point
      * @param max2DRadius maximum 2D radius to search in  */
-    void* FindNearest(const CVec3& in_pos, CVec3* out_pMinPt=0, float in_max2DRadius=0.0f) const;
+    virtual void* FindNearest(const CVec3& in_pos, CVec3* out_pMinPt=0, float in_max2DRadius=0.0f) const;
 
 
     /** Get all objects in 2D radius 
      * @param out_buf        buffer to fill with objects
      * @param max2DRadius   maximum 2D radius to search in  
      * @return    nuumber of objects*/
-    int GetNear(const CVec3& in_pos, int xi_bufSize, void** out_buf, CVec3* out_pos=0, float in_max2DRadius=0.0f) const;
+    virtual int GetNear(const CVec3& in_pos, int xi_bufSize, void** out_buf, CVec3* out_pos=0, float in_max2DRadius=0.0f) const;
+
+    /** Find nearest point, returns its index (-1 if none) */
+    virtual int FindNearestIdx(const CVec3& in_pos, CVec3* out_pMinPt=0, float in_max2DRadius=0.0f) const;
+
+    /** Get the indices of all points in 2D radius */
+    virtual int GetNearIdx(const CVec3& in_pos, int in_bufSize, int* out_idx, CVec3* out_pos=0, float in_max2DRadius=0.0f) const;
+
+    /** Find the k nearest points of many positions (see ISpatialIndex::FindKNearest) */
+    virtual void FindKNearest(const CVec3* in_queries, int in_numQueries, int in_k, int* out_idx, float* out_distSqr,
+                              float in_max2DRadius=0.0f, CVec3* out_pos=0) const;
+
+    /** Find an approximate nearest point of many positions (see ISpatialIndex::FindNearestApprox) */
+    virtual void FindNearestApprox(const CVec3* in_queries, int in_numQueries, int* out_idx, float* out_distSqr,
+                                   float in_max2DRadius=0.0f, CVec3* out_pos=0, float* out_errBound=0) const;
+
+    /** store the positions quantized to 16 bits (from the next Build()).
+     *  x/y are kept to 1/131070 of the cell size. z is kept to in_tolerance, unless the z range of a
+     *  cell exceeds 131070 * in_tolerance (the tolerance of that cell is then doubled until it fits).
+     *  Positions returned by the queries are the decoded ones. A cloud indexed with
+     *  Build(const CPtCloud&) is then not read by the queries (objects still point into it).
+     * @param in_tolerance    maximum z error (0 = store the positions as floats) */
+    void SetQuantization(float in_tolerance);
 
     /** Clear data */
-    void Clear();
+    virtual void Clear();
 
     /** constructor */
     CSpatialHash2D (float res=0.1f);
@@ -91,14 +163,30 @@ namespace tpcl
   *                             Protected members                               *
   ******************************************************************************/
 
-    /** Each cell is hashed to an array of object+position pairs */
+    /** points added since the last Build() (not seen by the queries yet) */
     void* m_data; 
+
+    /** the published snapshot of the flat layout (read by the queries) */
+    void* m_published;
   
 #pragma warning (disable : 4251)
     float m_res, m_resInv;            ///< // internal "grid" resolution
-    CVec3 m_minBox, m_maxBox;   ///< bounding box size
+    CVec3 m_minBox, m_maxBox;   ///< bounding box size (of all added points, used by the writers)
+    int m_numPts;               ///< number of points added (index of the next point)
+    float m_quantTolerance;     ///< z tolerance of the quantized positions (0 if not quantized)
     CVec3 m_pivot;              ///< used internally to shift everything to be around (0,0,0)
 #pragma warning (default : 4251)
+
+    /** index the points of a cloud, or only the ones appended (called holding the write lock) */
+    void IndexCloud(const CPtCloud& in_pcl, bool in_append);
+
+    /** convert a position to cell coordinates (for the writers, queries use their snapshot) */
+    void GetCell(const CVec3& in_pos, int& out_x, int& out_y) const
+    {
+      CVec3 l_v = (in_pos - m_pivot) * m_resInv;
+      out_x = (int)floorf(l_v.x);
+      out_y = (int)floorf(l_v.y);
+    }
   };
 
   /******************************************************************************
@@ -0,0 +1,262 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+// 
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+
+
+#include "SpatialHashPyramid.h"
+#include "SpatialHash.h"
+#include "common.h"
+#include <vector>
+#include <atomic>
+
+namespace tpcl{
+
+/******************************************************************************
+*                             INTERNAL CONSTANTS                              *
+******************************************************************************/
+
+  const int PYRAMID_MAX_LEVELS = 16;        ///< cell size of the last level: at most 2^15 times the finest
+  const float PYRAMID_CELLS_PER_RADIUS = 2.0f;  ///< a query uses the coarsest level with at least this many cells in its radius
+
+/******************************************************************************
+*                              INTERNAL CLASSES                               *
+******************************************************************************/
+
+  typedef std::vector<CSpatialHash2D*> CHashLevels;
+
+  inline const CHashLevels& Levels(const void* in_levels)  { return *(const CHashLevels*)in_levels; }
+
+
+  /** an array read by all levels: deleted when the last level releases it */
+  struct CSharedArray
+  {
+    CVec3* m_array;
+    std::atomic<int> m_numRefs;     ///< levels that did not release it yet
+  };
+
+  static void ReleaseShared(void* in_shared)
+  {
+    CSharedArray* l_shared = (CSharedArray*)in_shared;
+    if (l_shared->m_numRefs.fetch_sub(1) > 1)
+      return;
+    delete[] l_shared->m_array;
+    delete l_shared;
+  }
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//                           CSpatialHashPyramid
+//
+///////////////////////////////////////////////////////////////////////////////
+/******************************************************************************
+*
+*: Method name: CSpatialHashPyramid
+*
+******************************************************************************/
+CSpatialHashPyramid::CSpatialHashPyramid (float res, int in_numLevels)
+{
+  m_res = res;
+  m_numLevels = MaxT(1, MinT(in_numLevels, PYRAMID_MAX_LEVELS));
+  CHashLevels* l_levels = new CHashLevels(m_numLevels);
+  for (int l = 0; l < m_numLevels; ++l)
+    (*l_levels)[l] = new CSpatialHash2D(GetLevelRes(l));
+  m_levels = l_levels;
+}
+
+/******************************************************************************
+*
+*: Method name: ~CSpatialHashPyramid
+*
+******************************************************************************/
+CSpatialHashPyramid::~CSpatialHashPyramid ()
+{
+  CHashLevels* l_levels = (CHashLevels*)m_levels;
+  for (int l = 0; l < m_numLevels; ++l)
+    delete (*l_levels)[l];
+  delete l_levels;
+}
+
+
+/******************************************************************************
+*
+*: Method name: GetLevel
+*
+******************************************************************************/
+int CSpatialHashPyramid::GetLevel(float in_max2DRadius) const
+{
+  int l_level = 0;
+  while (l_level + 1 < m_numLevels && GetLevelRes(l_level + 1) * PYRAMID_CELLS_PER_RADIUS <= in_max2DRadius)
+    l_level++;
+  return l_level;
+}
+
+
+/******************************************************************************
+*
+*: Method name: Add
+*
+******************************************************************************/
+void CSpatialHashPyramid::Add(const CVec3& in_pos, void* in_obj)
+{
+  const CHashLevels& l_levels = Levels(m_levels);
+  for (int l = 0; l < m_numLevels; ++l)
+    l_levels[l]->Add(in_pos, in_obj);
+}
+
+
+/******************************************************************************
+*
+*: Method name: Build
+*
+******************************************************************************/
+void CSpatialHashPyramid::Build()
+{
+  const CHashLevels& l_levels = Levels(m_levels);
+  for (int l = 0; l < m_numLevels; ++l)
+    l_levels[l]->Build();
+}
+
+
+/******************************************************************************
+*
+*: Method name: Build (reference mode)
+*
+******************************************************************************/
+void CSpatialHashPyramid::Build(const CPtCloud& in_pcl)
+{
+  const CHashLevels& l_levels = Levels(m_levels);
+  for (int l = 0; l < m_numLevels; ++l)
+    l_levels[l]->Build(in_pcl);
+}
+
+
+/******************************************************************************
+*
+*: Method name: Append
+*
+******************************************************************************/
+void CSpatialHashPyramid::Append(const CPtCloud& in_pcl)
+{
+  const CHashLevels& l_levels = Levels(m_levels);
+  for (int l = 0; l < m_numLevels; ++l)
+    l_levels[l]->Append(in_pcl);
+}
+
+
+/******************************************************************************
+*
+*: Method name: DeleteWhenUnread
+*
+******************************************************************************/
+void CSpatialHashPyramid::DeleteWhenUnread(CVec3* in_array)
+{
+  const CHashLevels& l_levels = Levels(m_levels);
+  CSharedArray* l_shared = new CSharedArray;
+  l_shared->m_array = in_array;
+  l_shared->m_numRefs = m_numLevels;
+  for (int l = 0; l < m_numLevels; ++l)
+    l_levels[l]->CallWhenUnread(ReleaseShared, l_shared);
+}
+
+
+/******************************************************************************
+*
+*: Method name: FindNearest
+*
+******************************************************************************/
+void* CSpatialHashPyramid::FindNearest(const CVec3& in_pos, CVec3* out_pMinPt, float in_max2DRadius) const
+{
+  return Levels(m_levels)[GetLevel(in_max2DRadius)]->FindNearest(in_pos, out_pMinPt, in_max2DRadius);
+}
+
+
+/******************************************************************************
+*
+*: Method name: FindNearestIdx
+*
+******************************************************************************/
+int CSpatialHashPyramid::FindNearestIdx(const CVec3& in_pos, CVec3* out_pMinPt, float in_max2DRadius) const
+{
+  return Levels(m_levels)[GetLevel(in_max2DRadius)]->FindNearestIdx(in_pos, out_pMinPt, in_max2DRadius);
+}
+
+
+/******************************************************************************
+*
+*: Method name: GetNear
+*
+******************************************************************************/
+int CSpatialHashPyramid::GetNear(const CVec3& in_pos, int in_bufSize, void** out_buf, CVec3* out_pos, float in_max2DRadius) const
+{
+  return Levels(m_levels)[GetLevel(in_max2DRadius)]->GetNear(in_pos, in_bufSize, out_buf, out_pos, in_max2DRadius);
+}
+
+
+/******************************************************************************
+*
+*: Method name: GetNearIdx
+*
+******************************************************************************/
+int CSpatialHashPyramid::GetNearIdx(const CVec3& in_pos, int in_bufSize, int* out_idx, CVec3* out_pos, float in_max2DRadius) const
+{
+  return Levels(m_levels)[GetLevel(in_max2DRadius)]->GetNearIdx(in_pos, in_bufSize, out_idx, out_pos, in_max2DRadius);
+}
+
+
+/******************************************************************************
+*
+*: Method name: FindKNearest
+*
+******************************************************************************/
+void CSpatialHashPyramid::FindKNearest(const CVec3* in_queries, int in_numQueries, int in_k, int* out_idx, float* out_distSqr,
+                                       float in_max2DRadius, CVec3* out_pos) const
+{
+  Levels(m_levels)[GetLevel(in_max2DRadius)]->FindKNearest(in_queries, in_numQueries, in_k, out_idx, out_distSqr, in_max2DRadius, out_pos);
+}
+
+
+/******************************************************************************
+*
+*: Method name: FindNearestApprox
+*
+******************************************************************************/
+void CSpatialHashPyramid::FindNearestApprox(const CVec3* in_queries, int in_numQueries, int* out_idx, float* out_distSqr,
+                                            float in_max2DRadius, CVec3* out_pos, float* out_errBound) const
+{
+  Levels(m_levels)[GetLevel(in_max2DRadius)]->FindNearestApprox(in_queries, in_numQueries, out_idx, out_distSqr, in_max2DRadius, out_pos, out_errBound);
+}
+
+
+/******************************************************************************
+*
+*: Method name: Clear data
+*
+******************************************************************************/
+void CSpatialHashPyramid::Clear()
+{
+  const CHashLevels& l_levels = Levels(m_levels);
+  for (int l = 0; l < m_numLevels; ++l)
+    l_levels[l]->Clear();
+}
+
+
+
+} // namespace tpcl
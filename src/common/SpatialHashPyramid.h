@@ -0,0 +1,147 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+// 
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+
+/******************************************************************************
+*
+*: Package Name: SpatialHashPyramid
+*
+*: Description: spatial hashes of several resolutions, queried at the
+*               resolution matching the search radius
+*
+******************************************************************************/
+
+
+#ifndef __SPATIAL_HASH_PYRAMID_H
+#define __SPATIAL_HASH_PYRAMID_H
+
+#include "../../include/vec.h"
+#include "SpatialIndex.h"
+
+/******************************************************************************
+*                              EXPORTED CLASSES                               *
+******************************************************************************/
+
+namespace tpcl
+{
+
+  /**************************************************************************//**
+  *
+  * Pyramid of spatial hashes for coarse to fine searches
+  *
+  * Holds a CSpatialHash2D per level, the cell size doubling from level to level
+  * (level 0 has the resolution given to the constructor).
+  * A query is answered by the coarsest level whose cells are at most half its
+  * radius (queries without a radius use level 0): small radii do not scan crowded
+  * cells and large radii do not scan many small cells.
+  * The finest resolution should be about the spacing of the points: the best cell
+  * size also depends on the density, and finer cells only add overhead.
+  *
+  * All levels index the same points with the same indices. Points added with Add()
+  * are copied into every level, Build(const CPtCloud&) stores only the point indices
+  * in each level.
+  * Each level publishes its own snapshots (see CSpatialHash2D): queries may run while
+  * points are added, but until all levels are updated a query sees the new points
+  * only if its level has them.
+  *
+  ******************************************************************************/
+  class CSpatialHashPyramid : public ISpatialIndex
+  {
+  public:
+    /******************************************************************************
+    *                               Public methods                                *
+    ******************************************************************************/
+
+    /** add an object+position pair to all levels */
+    virtual void Add(const CVec3& in_pos, void* in_obj);
+
+    /** build all levels (see CSpatialHash2D::Build()) */
+    virtual void Build();
+
+    /** index the points of a cloud without copying them (see ISpatialIndex::Build(const CPtCloud&)) */
+    virtual void Build(const CPtCloud& in_pcl);
+
+    /** index the points appended to the cloud in all levels (see ISpatialIndex::Append()) */
+    virtual void Append(const CPtCloud& in_pcl);
+
+    /** delete[] an array once no query of any level can read it (see ISpatialIndex::DeleteWhenUnread()) */
+    virtual void DeleteWhenUnread(CVec3* in_array);
+
+    /** 
+     * Find nearest object (using its associated point)
+     * @param out_pMinPt (optional) closest point
+     * @param max2DRadius maximum 2D radius to search in  */
+    virtual void* FindNearest(const CVec3& in_pos, CVec3* out_pMinPt=0, float in_max2DRadius=0.0f) const;
+
+    /** Get all objects in 2D radius 
+     * @param out_buf        buffer to fill with objects
+     * @param max2DRadius   maximum 2D radius to search in  
+     * @return    nuumber of objects*/
+    virtual int GetNear(const CVec3& in_pos, int xi_bufSize, void** out_buf, CVec3* out_pos=0, float in_max2DRadius=0.0f) const;
+
+    /** Find nearest point, returns its index (-1 if none) */
+    virtual int FindNearestIdx(const CVec3& in_pos, CVec3* out_pMinPt=0, float in_max2DRadius=0.0f) const;
+
+    /** Get the indices of all points in 2D radius */
+    virtual int GetNearIdx(const CVec3& in_pos, int in_bufSize, int* out_idx, CVec3* out_pos=0, float in_max2DRadius=0.0f) const;
+
+    /** Find the k nearest points of many positions (see ISpatialIndex::FindKNearest) */
+    virtual void FindKNearest(const CVec3* in_queries, int in_numQueries, int in_k, int* out_idx, float* out_distSqr,
+                              float in_max2DRadius=0.0f, CVec3* out_pos=0) const;
+
+    /** Find an approximate nearest point of many positions (see ISpatialIndex::FindNearestApprox).
+     *  The level searched is chosen by in_max2DRadius as for the other queries */
+    virtual void FindNearestApprox(const CVec3* in_queries, int in_numQueries, int* out_idx, float* out_distSqr,
+                                   float in_max2DRadius=0.0f, CVec3* out_pos=0, float* out_errBound=0) const;
+
+    /** Clear data */
+    virtual void Clear();
+
+    /** the level that answers the queries of a radius
+     * @param in_max2DRadius  2D search radius (0 = no limit: level 0) */
+    int GetLevel(float in_max2DRadius) const;
+
+    /** the cell size of a level */
+    float GetLevelRes(int in_level) const  { return m_res * float(1 << in_level); }
+
+    /** number of levels */
+    int GetNumLevels() const  { return m_numLevels; }
+
+    /** constructor 
+     * @param res           cell size of the finest level
+     * @param in_numLevels  number of levels (each has twice the cell size of the previous) */
+    CSpatialHashPyramid (float res=0.1f, int in_numLevels=4);
+
+    /** destructor */
+    virtual ~CSpatialHashPyramid ();
+
+  protected:
+  /******************************************************************************
+  *                             Protected members                               *
+  ******************************************************************************/
+
+    void* m_levels;     ///< the spatial hashes, finest first
+    float m_res;        ///< cell size of the finest level
+    int m_numLevels;    ///< number of levels
+  };
+
+
+}// namespace tpcl
+#endif
@@ -0,0 +1,46 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+// 
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+
+
+#include "SpatialIndex.h"
+#include "SpatialHash.h"
+#include "SpatialHashPyramid.h"
+#include "KdTree.h"
+
+namespace tpcl
+{
+
+  /******************************************************************************
+  *                            EXPORTED FUNCTIONS                               *
+  ******************************************************************************/
+
+  ISpatialIndex* CreateSpatialIndex(ESpatialIndexType in_type, float in_res)
+  {
+    switch (in_type)
+    {
+    case SPATIAL_INDEX_KDTREE_3D: return new CKdTree3D(in_res);
+    case SPATIAL_INDEX_HASH_2D:   return new CSpatialHash2D(in_res);
+    case SPATIAL_INDEX_HASH_PYRAMID: return new CSpatialHashPyramid(in_res);
+    }
+    return new CSpatialHash2D(in_res);
+  }
+
+} // namespace tpcl
@@ -0,0 +1,156 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+// 
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+
+/******************************************************************************
+*
+*: Package Name: SpatialIndex
+*
+*: Description: common interface of the nearest neighbor search structures
+*
+******************************************************************************/
+
+
+#ifndef __SPATIAL_INDEX_H
+#define __SPATIAL_INDEX_H
+
+#include "../../include/vec.h"
+
+/******************************************************************************
+*                              EXPORTED CLASSES                               *
+******************************************************************************/
+
+namespace tpcl
+{
+  struct CPtCloud;
+
+  /** types of spatial indices (see CreateSpatialIndex()) */
+  enum ESpatialIndexType : char
+  {
+    SPATIAL_INDEX_HASH_2D  = 1,   ///< CSpatialHash2D: 2.5D bins (ignores z). Best for mostly horizontal data
+    SPATIAL_INDEX_KDTREE_3D = 2,  ///< CKdTree3D: 3D k-d tree. Best for vertical structures (facades, canopies)
+    SPATIAL_INDEX_HASH_PYRAMID = 3, ///< CSpatialHashPyramid: 2.5D bins of several sizes. Best for queries of varying radii
+  };
+
+
+  /**************************************************************************//**
+  *
+  * Interface for nearest neighbor search structures
+  *
+  * Points (with associated objects) are added using Add(), Build() must be
+  * called before querying.
+  * Points are also identified by their index: the order in which they were added.
+  * Alternatively, Build(const CPtCloud&) indexes the points of a cloud without
+  * copying them: only point indices are kept and positions are read from the cloud.
+  * Radii are always 2D radii (i.e. search in a vertical cylinder), the nearest
+  * point is the nearest in 3D among the points in the cylinder.
+  *
+  * Queries (the const methods) may run in parallel with each other. Running them
+  * in parallel with Add(), Build(), etc. is only allowed by CSpatialHash2D.
+  *
+  ******************************************************************************/
+  class ISpatialIndex
+  {
+  public:
+    /** add an object+position pair to the index */
+    virtual void Add(const CVec3& in_pos, void* in_obj) = 0;
+
+    /** prepare the added points for querying */
+    virtual void Build() = 0;
+
+    /** index the points of a cloud without copying them (replaces any previous content).
+     *  Points are identified by their index in the cloud, and the objects returned by
+     *  FindNearest()/GetNear() point to the positions in the cloud.
+     *  The cloud positions must stay valid and unchanged while the index is used */
+    virtual void Build(const CPtCloud& in_pcl) = 0;
+
+    /** index the points appended to the cloud of the last Build(const CPtCloud&) (or Append()).
+     *  The cloud must have kept its array and its indexed points (e.g. appended in place while
+     *  there is room): otherwise, as after Add(), the whole cloud is indexed again */
+    virtual void Append(const CPtCloud& in_pcl) = 0;
+
+    /** delete[] an array of positions once no query can read it, e.g. the previous array of a
+     *  cloud that moved (call after indexing the new array). Indices that do not allow queries
+     *  in parallel with writers delete it right away */
+    virtual void DeleteWhenUnread(CVec3* in_array) = 0;
+
+    /** 
+     * Find nearest object (using its associated point)
+     * @param out_pMinPt (optional) closest point
+     * @param max2DRadius maximum 2D radius to search in  */
+    virtual void* FindNearest(const CVec3& in_pos, CVec3* out_pMinPt=0, float in_max2DRadius=0.0f) const = 0;
+
+    /** Get all objects in 2D radius 
+     * @param out_buf        buffer to fill with objects
+     * @param max2DRadius   maximum 2D radius to search in  
+     * @return    nuumber of objects*/
+    virtual int GetNear(const CVec3& in_pos, int xi_bufSize, void** out_buf, CVec3* out_pos=0, float in_max2DRadius=0.0f) const = 0;
+
+    /** Find nearest point (as FindNearest())
+     * @return    index of the nearest point (-1 if none) */
+    virtual int FindNearestIdx(const CVec3& in_pos, CVec3* out_pMinPt=0, float in_max2DRadius=0.0f) const = 0;
+
+    /** Get the indices of all points in 2D radius (as GetNear())
+     * @param out_idx       buffer to fill with point indices
+     * @return    number of points*/
+    virtual int GetNearIdx(const CVec3& in_pos, int in_bufSize, int* out_idx, CVec3* out_pos=0, float in_max2DRadius=0.0f) const = 0;
+
+    /** Find the k nearest points of many positions (in parallel).
+     *  Results of each query are sorted by distance. Missing neighbors (less than k
+     *  points in radius) get index -1.
+     * @param in_queries      positions to search for
+     * @param in_numQueries   number of positions
+     * @param in_k            number of neighbors per query
+     * @param out_idx         indices of the neighbors, in_k per query (in_numQueries*in_k)
+     * @param out_distSqr     squared 3D distances of the neighbors, in_k per query
+     * @param in_max2DRadius  maximum 2D radius to search in (0 = no limit)
+     * @param out_pos         (optional) positions of the neighbors, in_k per query */
+    virtual void FindKNearest(const CVec3* in_queries, int in_numQueries, int in_k, int* out_idx, float* out_distSqr,
+                              float in_max2DRadius=0.0f, CVec3* out_pos=0) const = 0;
+
+    /** Find an approximate nearest point of many positions (in parallel).
+     *  Only the points close to each position are searched (CSpatialHash2D: the cell of the
+     *  position and its 4 neighbors, CKdTree3D: the leaf nearest to the position), so the
+     *  point found may not be the nearest. Missing results get index -1.
+     * @param out_idx         indices of the points found (in_numQueries)
+     * @param out_distSqr     squared 3D distances of the points found
+     * @param in_max2DRadius  maximum 2D radius to search in (0 = no limit)
+     * @param out_pos         (optional) positions of the points found
+     * @param out_errBound    (optional) bound on the error: the nearest point is at most this much
+     *                        nearer than the point found (0 = exact result, FLT_MAX = unknown) */
+    virtual void FindNearestApprox(const CVec3* in_queries, int in_numQueries, int* out_idx, float* out_distSqr,
+                                   float in_max2DRadius=0.0f, CVec3* out_pos=0, float* out_errBound=0) const = 0;
+
+    /** Clear data */
+    virtual void Clear() = 0;
+
+    /** destructor */
+    virtual ~ISpatialIndex() {}
+  };
+
+
+  /** create a spatial index
+   * @param in_type     type of the index
+   * @param in_res      resolution of the index (cell size for hashes, of the finest level for pyramids) */
+  ISpatialIndex* CreateSpatialIndex(ESpatialIndexType in_type, float in_res);
+
+
+}// namespace tpcl
+#endif
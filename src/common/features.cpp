@@ -22,51 +22,111 @@
 #include <algorithm>
 #include "SpatialHash.h"
 #include "plane.h"
+#include "RadixSort.h"
+#include "DistKernels.h"
 #include "../include/ptCloud.h"
+#include <vector>
+#include <float.h>
+#include <limits.h>
 
 
 namespace tpcl
 {
-  /** 2D median filter. assums image width/height are power of 2.
-  *   edges are treated with cyclic indices.
+  /** index of an image row/column outside the image: cyclic, or mirrored (without repeating the edge). */
+  inline int WrapIndex(int in_index, int in_size, bool in_cyclic)
+  {
+    if (in_cyclic)
+      return ((in_index % in_size) + in_size) % in_size;
+    if (in_size == 1)
+      return 0;
+    while ((in_index < 0) || (in_index >= in_size))
+      in_index = (in_index < 0) ? -in_index : (2 * (in_size - 1) - in_index);
+    return in_index;
+  }
+
+
+  /** copy an image with in_half extra rows/columns on each side.
+  *   the extra pixels are filled cyclically, or by mirroring (without repeating the edge).
   * @param in_lineWidth                image width.
   * @param in_numlines                 image height.
-  * @param in_medFiltSize              median filter size.
+  * @param in_cyclicCols               columns are cyclic (e.g. azimuth), otherwise mirrored.
+  * @param in_cyclicRows               rows are cyclic, otherwise mirrored.
   * @param in_pts                      input image.
-  * @param out_ptsFiltered              2D median filtered image. assumes  out_ptsFiltered != in_pts*/
-  void Median2DPowOf2(int in_lineWidth, int in_numlines, int in_medFiltSize, float* in_pts, float* out_ptsFiltered)
+  * @param out_padded                  padded image ((in_lineWidth + 2*in_half) x (in_numlines + 2*in_half)). */
+  static void PadImage(int in_lineWidth, int in_numlines, int in_half, bool in_cyclicCols, bool in_cyclicRows,
+                       const float* in_pts, std::vector<float>& out_padded)
   {
-    int windowSize = in_medFiltSize*in_medFiltSize;
-    int half1DWindow = in_medFiltSize >> 1;
+    int l_stride = in_lineWidth + 2 * in_half;
+    std::vector<int> l_colOf(l_stride);
+    for (int col = -in_half; col < in_lineWidth + in_half; col++)
+      l_colOf[col + in_half] = WrapIndex(col, in_lineWidth, in_cyclicCols);
+
+    out_padded.resize(l_stride * (in_numlines + 2 * in_half));
+    #pragma omp parallel for
+    for (int row = -in_half; row < in_numlines + in_half; row++)
+    {
+      const float* l_src = in_pts + WrapIndex(row, in_numlines, in_cyclicRows) * in_lineWidth;
+      float* l_dst = &out_padded[(row + in_half) * l_stride];
+      for (int col = 0; col < l_stride; col++)
+        l_dst[col] = l_src[l_colOf[col]];
+    }
+  }
+
+
+  /** 2D median filter of a padded image (see PadImage).
+  *   windows up to MEDIAN_KERNEL_MAX_SIZE use the vector median kernels (several windows at a time),
+  *   larger windows are copied and partially sorted.
+  * @param in_medFiltSize              median filter size (odd).
+  * @param in_padded                   padded image (by in_medFiltSize/2 on each side).
+  * @param out_ptsFiltered              2D median filtered image. */
+  static void MedianOfPadded(int in_lineWidth, int in_numlines, int in_medFiltSize, const float* in_padded, float* out_ptsFiltered)
+  {
+    int l_stride = in_lineWidth + in_medFiltSize - 1;
+    if (in_medFiltSize <= MEDIAN_KERNEL_MAX_SIZE)
+    {
+      MedianKernel l_median = GetDistKernels().m_median;
+      #pragma omp parallel for
+      for (int row = 0; row < in_numlines; row++)
+        l_median(in_padded + row * l_stride, l_stride, in_medFiltSize, in_lineWidth, out_ptsFiltered + row * in_lineWidth);
+      return;
+    }
 
+    int windowSize = in_medFiltSize*in_medFiltSize;
     #pragma omp parallel
     {
-      float* window = new float[windowSize];
+      std::vector<float> window(windowSize);
       #pragma omp for
       for (int row = 0; row < in_numlines; row++)
       {
         for (int col = 0; col < in_lineWidth; col++)
         {
-          for (int winRow = -half1DWindow; winRow <= half1DWindow; winRow++)
-          {
-            for (int winCol = -half1DWindow; winCol <= half1DWindow; winCol++)
-            {
-              int cyclicRow = ((unsigned int)(row + winRow)) & (in_numlines - 1);
-              int cyclicCol = ((unsigned int)(col + winCol)) & (in_lineWidth - 1);
-              int index = (cyclicRow * in_lineWidth) + cyclicCol;
-              int winIndex = ((winRow + half1DWindow) * in_medFiltSize) + (winCol + half1DWindow);
-              window[winIndex] = in_pts[index];
-            }
-          }
-          std::nth_element(window, window + (windowSize >> 1), window + windowSize);
+          for (int winRow = 0; winRow < in_medFiltSize; winRow++)
+            for (int winCol = 0; winCol < in_medFiltSize; winCol++)
+              window[winRow * in_medFiltSize + winCol] = in_padded[(row + winRow) * l_stride + col + winCol];
+          std::nth_element(window.begin(), window.begin() + (windowSize >> 1), window.end());
           out_ptsFiltered[row*in_lineWidth + col] = window[windowSize >> 1];
         }
       }
-      delete[] window;
     }
   }
 
 
+  /** 2D median filter. assums image width/height are power of 2.
+  *   edges are treated with cyclic indices.
+  * @param in_lineWidth                image width.
+  * @param in_numlines                 image height.
+  * @param in_medFiltSize              median filter size.
+  * @param in_pts                      input image.
+  * @param out_ptsFiltered              2D median filtered image. assumes  out_ptsFiltered != in_pts*/
+  void Median2DPowOf2(int in_lineWidth, int in_numlines, int in_medFiltSize, float* in_pts, float* out_ptsFiltered)
+  {
+    int half1DWindow = in_medFiltSize >> 1;
+    std::vector<float> padded;
+    PadImage(in_lineWidth, in_numlines, half1DWindow, true, true, in_pts, padded);
+    MedianOfPadded(in_lineWidth, in_numlines, 2 * half1DWindow + 1, &padded[0], out_ptsFiltered);
+  }
+
+
   /** 2D median filter.
   *   edges are treated with mirroring.
   * @param in_lineWidth                image width.
@@ -83,77 +143,778 @@ namespace tpcl
     }
     else
     {
-      int windowSize = in_medFiltSize*in_medFiltSize;
       int half1DWindow = in_medFiltSize >> 1;
+      std::vector<float> padded;
+      PadImage(in_lineWidth, in_numlines, half1DWindow, false, false, in_pts, padded);
+      MedianOfPadded(in_lineWidth, in_numlines, 2 * half1DWindow + 1, &padded[0], out_ptsFiltered);
+    }
+  }
+
+
+
+  /** fill the empty pixels (0) of an image: from the closest pixel of their column,
+  *   or, in empty columns, from the closest non-empty column (cyclic).
+  * @param io_image                    image. assumes at least one pixel is not empty. */
+  static void FillHoles(int in_lineWidth, int in_numlines, float* io_image)
+  {
+    std::vector<char> emptyCol(in_lineWidth);
+    #pragma omp parallel
+    {
+      std::vector<int> above(in_numlines);
+      #pragma omp for
+      for (int col = 0; col < in_lineWidth; col++)
+      {
+        int last = -1;
+        for (int row = 0; row < in_numlines; row++)
+        {
+          if (io_image[row * in_lineWidth + col] != 0)
+            last = row;
+          above[row] = last;
+        }
+        emptyCol[col] = (last < 0);
+        int next = -1;
+        for (int row = in_numlines - 1; row >= 0; row--)
+        {
+          float& pixel = io_image[row * in_lineWidth + col];
+          if (pixel != 0)
+            next = row;
+          else if (last >= 0)
+          {
+            int src = ((above[row] < 0) || ((next >= 0) && (next - row < row - above[row]))) ? next : above[row];
+            pixel = io_image[src * in_lineWidth + col];
+          }
+        }
+      }
+    }
+
+    //columns without any pixel:
+    std::vector<int> srcCol(in_lineWidth, -1);
+    for (int dist = 1; dist <= in_lineWidth / 2; dist++)
+    {
+      bool done = true;
+      for (int col = 0; col < in_lineWidth; col++)
+      {
+        if (emptyCol[col] && (srcCol[col] < 0))
+        {
+          int left = WrapIndex(col - dist, in_lineWidth, true);
+          int right = WrapIndex(col + dist, in_lineWidth, true);
+          srcCol[col] = !emptyCol[left] ? left : (!emptyCol[right] ? right : -1);
+          done = done && (srcCol[col] >= 0);
+        }
+      }
+      if (done)
+        break;
+    }
+    #pragma omp parallel for
+    for (int row = 0; row < in_numlines; row++)
+      for (int col = 0; col < in_lineWidth; col++)
+        if (emptyCol[col])
+          io_image[row * in_lineWidth + col] = io_image[row * in_lineWidth + srcCol[col]];
+  }
+
+
+  const int NORMALS_BATCH_SIZE = 256;      // points per batch of k-NN queries in FillNormals
+  const int NORMALS_ROBUST_ITERATIONS = 4; // reweighting iterations of NORMALS_PCA_ROBUST
+
+
+  /** shape features from the eigenvalues of a covariance (in_l0 >= in_l1 >= in_l2, see CPtShape). */
+  inline void SetShape(double in_l0, double in_l1, double in_l2, CPtShape& out_shape)
+  {
+    in_l2 = std::max(in_l2, 0.0);
+    in_l1 = std::max(in_l1, in_l2);
+    double sum = in_l0 + in_l1 + in_l2;
+    out_shape.m_curvature = (sum > 0) ? float(in_l2 / sum) : 0.0f;
+    out_shape.m_planarity = (in_l0 > 0) ? float((in_l1 - in_l2) / in_l0) : 0.0f;
+    out_shape.m_linearity = (in_l0 > 0) ? float((in_l0 - in_l1) / in_l0) : 0.0f;
+  }
+
+
+  /** normal of a plane from the covariance of its points: the eigenvector of the smallest eigenvalue
+  *   (closed form: trigonometric eigenvalues, eigenvector from cross products).
+  * @param out_normal                  normalized normal (any direction).
+  * @param out_shape                   curvature, planarity and linearity of the points (also when there is no plane).
+  * @return                            false if there is no plane (collinear points). */
+  static bool PlaneOfCovariance(double xx, double xy, double xz, double yy, double yz, double zz, CVec3& out_normal, CPtShape& out_shape)
+  {
+    //eigenvalues of a symmetric 3x3 matrix:
+    double q = (xx + yy + zz) / 3;
+    double offDiag = xy * xy + xz * xz + yz * yz;
+    double p = sqrt(((xx - q) * (xx - q) + (yy - q) * (yy - q) + (zz - q) * (zz - q) + 2 * offDiag) / 6);
+    if (p <= q * 1e-12)
+    {
+      SetShape(q, q, q, out_shape);
+      return false;   // all directions are the same (e.g. a single repeated point)
+    }
+    double bxx = (xx - q) / p, byy = (yy - q) / p, bzz = (zz - q) / p;
+    double bxy = xy / p, bxz = xz / p, byz = yz / p;
+    double r = 0.5 * (bxx * (byy * bzz - byz * byz) - bxy * (bxy * bzz - byz * bxz) + bxz * (bxy * byz - byy * bxz));
+    r = std::min(std::max(r, -1.0), 1.0);
+    double phi = acos(r) / 3;
+    double largest = q + 2 * p * cos(phi);
+    double smallest = q + 2 * p * cos(phi + 2 * M_PI / 3);
+    SetShape(largest, 3 * q - largest - smallest, smallest, out_shape);
+
+    //eigenvector: the rows of (cov - smallest*I) are orthogonal to it, take the longest cross product.
+    double r0[3] = {xx - smallest, xy, xz};
+    double r1[3] = {xy, yy - smallest, yz};
+    double r2[3] = {xz, yz, zz - smallest};
+    double c01[3] = {r0[1] * r1[2] - r0[2] * r1[1], r0[2] * r1[0] - r0[0] * r1[2], r0[0] * r1[1] - r0[1] * r1[0]};
+    double c02[3] = {r0[1] * r2[2] - r0[2] * r2[1], r0[2] * r2[0] - r0[0] * r2[2], r0[0] * r2[1] - r0[1] * r2[0]};
+    double c12[3] = {r1[1] * r2[2] - r1[2] * r2[1], r1[2] * r2[0] - r1[0] * r2[2], r1[0] * r2[1] - r1[1] * r2[0]};
+    double d01 = c01[0] * c01[0] + c01[1] * c01[1] + c01[2] * c01[2];
+    double d02 = c02[0] * c02[0] + c02[1] * c02[1] + c02[2] * c02[2];
+    double d12 = c12[0] * c12[0] + c12[1] * c12[1] + c12[2] * c12[2];
+    const double* best = (d01 >= d02) ? ((d01 >= d12) ? c01 : c12) : ((d02 >= d12) ? c02 : c12);
+    double bestLenSqr = std::max(d01, std::max(d02, d12));
+    if (bestLenSqr <= largest * largest * 1e-12)
+      return false;   // collinear: the two smaller eigenvalues are both ~0
+    double invLen = 1.0 / sqrt(bestLenSqr);
+    out_normal = CVec3(float(best[0] * invLen), float(best[1] * invLen), float(best[2] * invLen));
+    return true;
+  }
+
+
+  /** normal of the least squares plane of points (see PlaneOfCovariance).
+  * @param in_weights                  optional: weight of each point (0 = all 1).
+  * @param out_normal                  normalized normal (any direction).
+  * @param out_center                  (weighted) centroid of the points.
+  * @param out_shape                   see PlaneOfCovariance.
+  * @return                            false if there is no plane (less than 3 points, or collinear points). */
+  static bool PlaneOfPointsPCA(int in_numPts, const CVec3* in_pts, const float* in_weights, CVec3& out_normal, CVec3& out_center,
+                               CPtShape& out_shape)
+  {
+    SetShape(0, 0, 0, out_shape);
+    if (in_numPts < 3)
+      return false;
+
+    double sumW = 0, cx = 0, cy = 0, cz = 0;
+    for (int j = 0; j < in_numPts; j++)
+    {
+      double w = in_weights ? in_weights[j] : 1.0;
+      sumW += w;
+      cx += w * in_pts[j].x;  cy += w * in_pts[j].y;  cz += w * in_pts[j].z;
+    }
+    if (sumW <= 0)
+      return false;
+    cx /= sumW;  cy /= sumW;  cz /= sumW;
+    out_center = CVec3(float(cx), float(cy), float(cz));
+
+    double xx = 0, xy = 0, xz = 0, yy = 0, yz = 0, zz = 0;
+    for (int j = 0; j < in_numPts; j++)
+    {
+      double w = in_weights ? in_weights[j] : 1.0;
+      double x = in_pts[j].x - cx, y = in_pts[j].y - cy, z = in_pts[j].z - cz;
+      xx += w * x * x;  xy += w * x * y;  xz += w * x * z;
+      yy += w * y * y;  yz += w * y * z;  zz += w * z * z;
+    }
+
+    return PlaneOfCovariance(xx / sumW, xy / sumW, xz / sumW, yy / sumW, yz / sumW, zz / sumW, out_normal, out_shape);
+  }
+
+
+  /** set the normal (pointing up) and the shape (if the cloud has shapes) of a point,
+  *   and optionally move the point to the plane (same x,y).
+  * @param in_found                    false: no plane was found, the normal is (0, 0, 1) (as with RanSaC).
+  * @param in_center                   a point on the plane. */
+  inline void StoreNormal(CPtCloud& io_pcl, int in_index, bool in_found, CVec3 in_normal, const CVec3& in_center, const CPtShape& in_shape,
+                          bool in_fixZ)
+  {
+    if (io_pcl.m_shape != 0)
+      io_pcl.m_shape[in_index] = in_shape;
+    if (!in_found)
+    {
+      io_pcl.m_normal[in_index] = CVec3(0, 0, 1);
+      return;
+    }
+    if (in_normal.z < 0)
+      in_normal = in_normal * -1.0f;
+    CVec3& pos = io_pcl.m_pos[in_index];
+    if (in_fixZ && (in_normal.z > 0))
+      pos.z = in_center.z - (in_normal.x * (pos.x - in_center.x) + in_normal.y * (pos.y - in_center.y)) / in_normal.z;
+    io_pcl.m_normal[in_index] = in_normal;
+  }
+
+
+  /** FillNormals with the NORMALS_PCA modes.
+  *   the points are queried in batches of consecutive points (each thread fills its own batch buffers).
+  * @param in_max2DRadius              maximum 2D radius of the neighbors.
+  * @param in_robust                   reweight the points by their distance from the plane (Cauchy weights, scale from the median distance). */
+  static void FillNormalsPCA(CPtCloud& io_pcl, float in_max2DRadius, const ISpatialIndex& in_index, bool in_fixZ, int in_k, bool in_robust)
+  {
+    int numBatches = (io_pcl.m_numPts + NORMALS_BATCH_SIZE - 1) / NORMALS_BATCH_SIZE;
 
-      #pragma omp parallel
+    #pragma omp parallel
+    {
+      std::vector<int> nearIdx(NORMALS_BATCH_SIZE * in_k);
+      std::vector<float> nearDistSqr(NORMALS_BATCH_SIZE * in_k);
+      std::vector<CVec3> nearPts(NORMALS_BATCH_SIZE * in_k);
+      std::vector<float> weights(in_k);
+      std::vector<float> planeDist(in_k);
+
+      #pragma omp for schedule(dynamic)
+      for (int batch = 0; batch < numBatches; batch++)
       {
-        //filter on center of image (without edges):
-        float* window = new float[windowSize];
-        #pragma omp for
-        for (int row = half1DWindow; row < in_numlines - half1DWindow; row++)
+        int first = batch * NORMALS_BATCH_SIZE;
+        int batchSize = std::min(NORMALS_BATCH_SIZE, io_pcl.m_numPts - first);
+        in_index.FindKNearest(io_pcl.m_pos + first, batchSize, in_k, &nearIdx[0], &nearDistSqr[0], in_max2DRadius, &nearPts[0]);
+
+        for (int i = 0; i < batchSize; i++)
         {
-          for (int col = half1DWindow; col < in_lineWidth - half1DWindow; col++)
+          const CVec3* pts = &nearPts[i * in_k];
+          int numNear = 0;
+          while ((numNear < in_k) && (nearIdx[i * in_k + numNear] >= 0))
+            numNear++;
+
+          CVec3 normal, center;
+          CPtShape shape;
+          bool found = PlaneOfPointsPCA(numNear, pts, 0, normal, center, shape);
+          for (int iter = 0; found && in_robust && (iter < NORMALS_ROBUST_ITERATIONS); iter++)
           {
-            for (int winRow = -half1DWindow; winRow <= half1DWindow; winRow++)
+            for (int j = 0; j < numNear; j++)
+              planeDist[j] = fabs(DotProd(normal, pts[j] - center));
+            std::copy(planeDist.begin(), planeDist.begin() + numNear, weights.begin());
+            std::nth_element(weights.begin(), weights.begin() + numNear / 2, weights.begin() + numNear);
+            float scale = 2.3849f * 1.4826f * weights[numNear / 2];   // (Cauchy constant x MAD to sigma)
+            if (scale <= 0)
+              break;   // most points are on the plane
+            for (int j = 0; j < numNear; j++)
+              weights[j] = 1.0f / (1.0f + (planeDist[j] / scale) * (planeDist[j] / scale));
+            CVec3 prevNormal = normal, prevCenter = center;
+            CPtShape prevShape = shape;
+            if (!PlaneOfPointsPCA(numNear, pts, &weights[0], normal, center, shape))
             {
-              for (int winCol = -half1DWindow; winCol <= half1DWindow; winCol++)
-              {
-                int index = ((row + winRow) * in_lineWidth) + (col + winCol);
-                int winIndex = ((winRow + half1DWindow) * in_medFiltSize) + (winCol + half1DWindow);
-                window[winIndex] = in_pts[index];
-              }
+              normal = prevNormal;
+              center = prevCenter;
+              shape = prevShape;
+              break;
             }
-            std::nth_element(window, window + (windowSize >> 1), window + windowSize);
-            out_ptsFiltered[row*in_lineWidth + col] = window[windowSize >> 1];
           }
+
+          StoreNormal(io_pcl, first + i, found, normal, center, shape, in_fixZ);
         }
-        delete[] window;
       }
+    }
+  }
 
 
-      //filter on edges of image:
-      float* window = new float[windowSize];
-      for (int row = 0; row < in_numlines; row++)
+  /** FillNormals with NORMALS_INTEGRAL_IMAGE: the plane of the points in a window of the scan's grid.
+  *   the sums of the coordinates and of their products are kept in an integral image, so each window costs
+  *   the same (4 lookups per sum). points at the origin (no return) are ignored.
+  *   windows are cut at the image borders, and are not cut at depth discontinuities.
+  * @param in_windowSize               window size (pixels, odd). */
+  static void FillNormalsIntegral(CPtCloud& io_pcl, int in_windowSize, bool in_fixZ)
+  {
+    const int numSums = 10;   // count, x, y, z, xx, xy, xz, yy, yz, zz
+    int lineWidth = io_pcl.m_lineWidth;
+    int numlines = io_pcl.m_numPts / lineWidth;
+    int stride = (lineWidth + 1) * numSums;
+    std::vector<double> integral(stride * (numlines + 1), 0.0);
+
+    //prefix sums of each row, then of each column:
+    #pragma omp parallel for
+    for (int row = 0; row < numlines; row++)
+    {
+      double* sums = &integral[(row + 1) * stride];
+      for (int col = 0; col < lineWidth; col++, sums += numSums)
       {
-        bool center = (row >= half1DWindow) && (row < in_numlines - half1DWindow);
+        const CVec3& pos = io_pcl.m_pos[row * lineWidth + col];
+        bool valid = (pos.x != 0) || (pos.y != 0) || (pos.z != 0);
+        double x = pos.x, y = pos.y, z = pos.z;
+        double pixel[numSums] = {1, x, y, z, x * x, x * y, x * z, y * y, y * z, z * z};
+        for (int k = 0; k < numSums; k++)
+          sums[numSums + k] = sums[k] + (valid ? pixel[k] : 0.0);
+      }
+    }
+    #pragma omp parallel for
+    for (int col = numSums; col < stride; col++)
+      for (int row = 1; row <= numlines; row++)
+        integral[row * stride + col] += integral[(row - 1) * stride + col];
 
-        for (int col = 0; col < in_lineWidth; col++)
+    int half = in_windowSize >> 1;
+    #pragma omp parallel for
+    for (int row = 0; row < numlines; row++)
+    {
+      int row0 = std::max(row - half, 0), row1 = std::min(row + half + 1, numlines);
+      for (int col = 0; col < lineWidth; col++)
+      {
+        int col0 = std::max(col - half, 0), col1 = std::min(col + half + 1, lineWidth);
+        const double* s00 = &integral[row0 * stride + col0 * numSums];
+        const double* s01 = &integral[row0 * stride + col1 * numSums];
+        const double* s10 = &integral[row1 * stride + col0 * numSums];
+        const double* s11 = &integral[row1 * stride + col1 * numSums];
+        double sums[numSums];
+        for (int k = 0; k < numSums; k++)
+          sums[k] = s11[k] - s10[k] - s01[k] + s00[k];
+
+        int index = row * lineWidth + col;
+        double count = sums[0];
+        bool found = false;
+        CVec3 normal, center;
+        CPtShape shape = {0, 0, 0};
+        if (count >= 3)
+        {
+          double cx = sums[1] / count, cy = sums[2] / count, cz = sums[3] / count;
+          center = CVec3(float(cx), float(cy), float(cz));
+          found = PlaneOfCovariance(sums[4] / count - cx * cx, sums[5] / count - cx * cy, sums[6] / count - cx * cz,
+                                    sums[7] / count - cy * cy, sums[8] / count - cy * cz, sums[9] / count - cz * cz, normal, shape);
+        }
+        StoreNormal(io_pcl, index, found, normal, center, shape, in_fixZ);
+      }
+    }
+  }
+
+
+  const int DOWNSAMPLE_BLOCKS = 64;   // points are divided to blocks for the parallel bounding box
+
+
+  /** number of voxels of the grid along an axis: ceil of the extent, at least 1 (the extent is clamped to 2^62
+  *   voxels: beyond that the float to integer conversion is undefined, and a float has no resolution left). */
+  inline unsigned long long VoxelDim(float in_ext)
+  {
+    const float MAX_DIM = 4.6e18f;
+    if (!(in_ext < MAX_DIM))
+      return (unsigned long long)MAX_DIM;
+    unsigned long long l_dim = (unsigned long long)ceilf(in_ext);
+    return (l_dim > 0) ? l_dim : 1;
+  }
+
+  /** voxel of a point along an axis (points on the far side of the grid are in the last voxel)
+  * @param in_v                       coordinate relative to the corner of the grid, in voxels (>= 0). */
+  inline unsigned long long VoxelIndex(float in_v, unsigned long long in_dim)
+  {
+    if (!(in_v < float(in_dim)))
+      return in_dim - 1;
+    return MinT((unsigned long long)in_v, in_dim - 1);
+  }
+
+
+  /** sort the points of a cloud by voxel (stable: the points of a voxel keep their order).
+  * @param in_min                     corner of the grid.
+  * @param in_dim                     number of voxels of the grid along x, y, z (see VoxelDim()).
+  * @param in_numBits                 number of bits in the voxel keys: dimX*dimY*dimZ <= 2^in_numBits.
+  * @param out_idx                    indices of the points sorted by voxel.
+  * @param out_start                  start of each voxel in out_idx (last entry: number of points). */
+  template <typename K> void SortByVoxel(const CPtCloud& in_pcl, const CVec3& in_min, float in_invVoxelSize,
+                                         const unsigned long long in_dim[3], int in_numBits,
+                                         std::vector<int>& out_idx, std::vector<int>& out_start)
+  {
+    int l_num = in_pcl.m_numPts;
+    std::vector<K> l_keys(l_num);
+    out_idx.resize(l_num);
+    unsigned long long l_dimXY = in_dim[0] * in_dim[1];
+    #pragma omp parallel for
+    for (int i = 0; i < l_num; i++)
+    {
+      CVec3 l_v = (in_pcl.m_pos[i] - in_min) * in_invVoxelSize;
+      l_keys[i] = K(VoxelIndex(l_v.z, in_dim[2]) * l_dimXY + VoxelIndex(l_v.y, in_dim[1]) * in_dim[0] + VoxelIndex(l_v.x, in_dim[0]));
+      out_idx[i] = i;
+    }
+    RadixSort(l_keys, out_idx, in_numBits);
+
+    out_start.clear();
+    for (int i = 0; i < l_num; i++)
+    {
+      if (i == 0 || l_keys[i] != l_keys[i - 1])
+        out_start.push_back(i);
+    }
+    out_start.push_back(l_num);
+  }
+
+
+  /** sort the points of a cloud by voxel when the voxel keys do not fit in 64 bits (tiny voxels in a large box):
+  *   a comparison sort of the (z, y, x) voxel indices, in the same order as SortByVoxel(). */
+  void SortByVoxelIndices(const CPtCloud& in_pcl, const CVec3& in_min, float in_invVoxelSize, const unsigned long long in_dim[3],
+                          std::vector<int>& out_idx, std::vector<int>& out_start)
+  {
+    int l_num = in_pcl.m_numPts;
+    std::vector<unsigned long long> l_voxel(3 * l_num);
+    out_idx.resize(l_num);
+    #pragma omp parallel for
+    for (int i = 0; i < l_num; i++)
+    {
+      CVec3 l_v = (in_pcl.m_pos[i] - in_min) * in_invVoxelSize;
+      l_voxel[3 * i + 0] = VoxelIndex(l_v.z, in_dim[2]);
+      l_voxel[3 * i + 1] = VoxelIndex(l_v.y, in_dim[1]);
+      l_voxel[3 * i + 2] = VoxelIndex(l_v.x, in_dim[0]);
+      out_idx[i] = i;
+    }
+    const unsigned long long* l_voxels = l_voxel.data();
+    std::stable_sort(out_idx.begin(), out_idx.end(), [l_voxels](int a, int b)
+    {
+      return std::lexicographical_compare(l_voxels + 3 * a, l_voxels + 3 * a + 3, l_voxels + 3 * b, l_voxels + 3 * b + 3);
+    });
+
+    out_start.clear();
+    for (int i = 0; i < l_num; i++)
+    {
+      if (i == 0 || !std::equal(l_voxels + 3 * out_idx[i], l_voxels + 3 * out_idx[i] + 3, l_voxels + 3 * out_idx[i - 1]))
+        out_start.push_back(i);
+    }
+    out_start.push_back(l_num);
+  }
+
+
+  /** average color of points (per 8 bit channel).
+  * @param in_idx                     indices of the points.
+  * @param in_num                     number of points. */
+  CColor AverageColor(const CColor* in_color, const int* in_idx, int in_num)
+  {
+    unsigned long long l_sum[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < in_num; i++)
+    {
+      CColor l_c = in_color[in_idx[i]];
+      for (int ch = 0; ch < 4; ch++)
+        l_sum[ch] += (l_c >> (8 * ch)) & 0xFF;
+    }
+    CColor l_avg = 0;
+    for (int ch = 0; ch < 4; ch++)
+      l_avg |= CColor((l_sum[ch] + in_num / 2) / in_num) << (8 * ch);
+    return l_avg;
+  }
+
+
+
+  /** voxel grid filter: a point for each occupied voxel (see Features::DownSample and Features::VoxelCentroids).
+  *   The points are sorted by voxel, then each voxel is reduced (in parallel).
+  * @param out_numVoxelPts            (optional) number of points in each voxel.
+  * @param out_cov                    (optional) covariance of the points of each voxel (6 floats a voxel). */
+  void VoxelGridFilter(const CPtCloud& in_pcl, CPtCloud& out_pcl, float in_voxelSize, EDownSampleMode in_mode,
+                       int* out_numVoxelPts, float* out_cov)
+  {
+    int l_num = in_pcl.m_numPts;
+    if (l_num <= 0)
+    {
+      out_pcl.m_numPts = 0;
+      return;
+    }
+    const CVec3* l_pos = in_pcl.m_pos;
+    float InvVoxelSize = 1.0f / in_voxelSize;
+
+    //find min/max x/y/z (per block):
+    int l_blockSize = (l_num + DOWNSAMPLE_BLOCKS - 1) / DOWNSAMPLE_BLOCKS;
+    std::vector<CVec3> l_blockMin(DOWNSAMPLE_BLOCKS, l_pos[0]), l_blockMax(DOWNSAMPLE_BLOCKS, l_pos[0]);
+    #pragma omp parallel for
+    for (int b = 0; b < DOWNSAMPLE_BLOCKS; b++)
+    {
+      int l_end = MinT(l_num, (b + 1) * l_blockSize);
+      for (int ptrIndex = b * l_blockSize; ptrIndex < l_end; ptrIndex++)
+      {
+        l_blockMin[b] = Min_ps(l_blockMin[b], l_pos[ptrIndex]);
+        l_blockMax[b] = Max_ps(l_blockMax[b], l_pos[ptrIndex]);
+      }
+    }
+    CVec3 l_bbox[2] = { l_pos[0], l_pos[0] };
+    for (int b = 0; b < DOWNSAMPLE_BLOCKS; b++)
+    {
+      l_bbox[0] = Min_ps(l_bbox[0], l_blockMin[b]);
+      l_bbox[1] = Max_ps(l_bbox[1], l_blockMax[b]);
+    }
+
+    //voxels of the grid (only used for the keys, the grid is never allocated):
+    CVec3 l_ext = (l_bbox[1] - l_bbox[0]) * InvVoxelSize;
+    unsigned long long l_dim[3] = { VoxelDim(l_ext.x), VoxelDim(l_ext.y), VoxelDim(l_ext.z) };
+    int l_numBits = 65;   // bits of the voxel keys (65: the number of voxels does not fit in 64 bits)
+    if (l_dim[0] <= ULLONG_MAX / l_dim[1] && l_dim[0] * l_dim[1] <= ULLONG_MAX / l_dim[2])
+    {
+      unsigned long long l_numVoxels = l_dim[0] * l_dim[1] * l_dim[2];
+      l_numBits = 1;
+      while (l_numBits < 64 && (1ULL << l_numBits) < l_numVoxels)
+        l_numBits++;
+    }
+
+    //sort the points by voxel:
+    std::vector<int> l_idx, l_start;
+    if (l_numBits <= 32)
+      SortByVoxel<unsigned int>(in_pcl, l_bbox[0], InvVoxelSize, l_dim, l_numBits, l_idx, l_start);
+    else if (l_numBits <= 64)
+      SortByVoxel<unsigned long long>(in_pcl, l_bbox[0], InvVoxelSize, l_dim, l_numBits, l_idx, l_start);
+    else
+      SortByVoxelIndices(in_pcl, l_bbox[0], InvVoxelSize, l_dim, l_idx, l_start);
+    int outputSize = int(l_start.size()) - 1;
+
+    //output voxels in the order of their first point (first in the voxel, as the sort is stable):
+    std::vector<int> l_voxelOf(l_num, -1);
+    #pragma omp parallel for
+    for (int voxel = 0; voxel < outputSize; voxel++)
+      l_voxelOf[l_idx[l_start[voxel]]] = voxel;
+    std::vector<int> l_order;
+    l_order.reserve(outputSize);
+    for (int ptrIndex = 0; ptrIndex < l_num; ptrIndex++)
+    {
+      if (l_voxelOf[ptrIndex] >= 0)
+        l_order.push_back(l_voxelOf[ptrIndex]);
+    }
+
+    //a point for each voxel (into buffers: out_pcl may be in_pcl):
+    bool l_color = (in_pcl.m_color != 0) && (out_pcl.m_color != 0);
+    bool l_normal = (in_pcl.m_normal != 0) && (out_pcl.m_normal != 0);
+    std::vector<CVec3> l_outPos(outputSize), l_outNormal(l_normal ? outputSize : 0);
+    std::vector<CColor> l_outColor(l_color ? outputSize : 0);
+    std::vector<int> l_outNumPts(out_numVoxelPts ? outputSize : 0);
+    std::vector<float> l_outCov(out_cov ? 6 * outputSize : 0);
+    #pragma omp parallel for
+    for (int outIndex = 0; outIndex < outputSize; outIndex++)
+    {
+      int voxel = l_order[outIndex];
+      const int* l_voxelPts = &l_idx[l_start[voxel]];
+      int l_numVoxelPts = l_start[voxel + 1] - l_start[voxel];
+      int l_first = l_voxelPts[0];
+
+      if (out_numVoxelPts)
+        l_outNumPts[outIndex] = l_numVoxelPts;
+
+      if (in_mode == DOWNSAMPLE_CENTROID)
+      {
+        // (sums relative to the first point: keeps the precision far from the origin)
+        CVec3 l_sum(0, 0, 0), l_sumNormal(0, 0, 0);
+        float l_sumSqr[6] = { 0, 0, 0, 0, 0, 0 };   // xx, xy, xz, yy, yz, zz
+        for (int i = 0; i < l_numVoxelPts; i++)
         {
-          if (center && (col >= half1DWindow)) //not working on the center again
+          CVec3 l_d = l_pos[l_voxelPts[i]] - l_pos[l_first];
+          l_sum += l_d;
+          if (out_cov)
           {
-            col = in_lineWidth - half1DWindow;
-            center = false;
+            l_sumSqr[0] += l_d.x * l_d.x;  l_sumSqr[1] += l_d.x * l_d.y;  l_sumSqr[2] += l_d.x * l_d.z;
+            l_sumSqr[3] += l_d.y * l_d.y;  l_sumSqr[4] += l_d.y * l_d.z;  l_sumSqr[5] += l_d.z * l_d.z;
           }
+          if (l_normal)
+            l_sumNormal += in_pcl.m_normal[l_voxelPts[i]];
+        }
+        float l_inv = 1.0f / l_numVoxelPts;
+        CVec3 l_mean = l_sum * l_inv;
+        l_outPos[outIndex] = l_pos[l_first] + l_mean;
+        if (out_cov)
+        {
+          float* l_cov = &l_outCov[6 * outIndex];
+          l_cov[0] = l_sumSqr[0] * l_inv - l_mean.x * l_mean.x;
+          l_cov[1] = l_sumSqr[1] * l_inv - l_mean.x * l_mean.y;
+          l_cov[2] = l_sumSqr[2] * l_inv - l_mean.x * l_mean.z;
+          l_cov[3] = l_sumSqr[3] * l_inv - l_mean.y * l_mean.y;
+          l_cov[4] = l_sumSqr[4] * l_inv - l_mean.y * l_mean.z;
+          l_cov[5] = l_sumSqr[5] * l_inv - l_mean.z * l_mean.z;
+        }
+        if (l_normal)
+        {
+          float l_length = Length(l_sumNormal);
+          l_outNormal[outIndex] = (l_length > 0) ? l_sumNormal * (1.0f / l_length) : in_pcl.m_normal[l_first];
+        }
+        if (l_color)
+          l_outColor[outIndex] = AverageColor(in_pcl.m_color, l_voxelPts, l_numVoxelPts);
+        continue;
+      }
 
-          for (int winRow = -half1DWindow; winRow <= half1DWindow; winRow++)
+      int l_kept = l_first;
+      if (in_mode == DOWNSAMPLE_CLOSEST)
+      {
+        CVec3 l_v = (l_pos[l_first] - l_bbox[0]) * InvVoxelSize;
+        CVec3 l_corner(float(VoxelIndex(l_v.x, l_dim[0])), float(VoxelIndex(l_v.y, l_dim[1])), float(VoxelIndex(l_v.z, l_dim[2])));
+        CVec3 l_center = l_bbox[0] + (l_corner + CVec3(0.5f, 0.5f, 0.5f)) * in_voxelSize;
+        float l_minDistSqr = FLT_MAX;
+        for (int i = 0; i < l_numVoxelPts; i++)
+        {
+          float l_distSqr = DistSqr(l_pos[l_voxelPts[i]], l_center);
+          if (l_distSqr < l_minDistSqr)
           {
-            for (int winCol = -half1DWindow; winCol <= half1DWindow; winCol++)
-            {
-              int indexRow = row + winRow;
-              indexRow = (indexRow < 0) ? -indexRow :
-                ((indexRow >= in_numlines) ? (2 * (in_numlines - 1) - indexRow) :
-                  indexRow);
-
-              int indexCol = col + winCol;
-              indexCol = (indexCol < 0) ? -indexCol :
-                ((indexCol >= in_lineWidth) ? (2 * (in_lineWidth - 1) - indexCol) :
-                  indexCol);
-
-              int index = (indexRow * in_lineWidth) + indexCol;
-              int winIndex = ((winRow + half1DWindow) * in_medFiltSize) + (winCol + half1DWindow);
-              window[winIndex] = in_pts[index];
-            }
+            l_minDistSqr = l_distSqr;
+            l_kept = l_voxelPts[i];
           }
-          std::nth_element(window, window + (windowSize >> 1), window + windowSize);
-          out_ptsFiltered[row*in_lineWidth + col] = window[windowSize >> 1];
         }
       }
-      delete[] window;
+      l_outPos[outIndex] = l_pos[l_kept];
+      if (l_normal)
+        l_outNormal[outIndex] = in_pcl.m_normal[l_kept];
+      if (l_color)
+        l_outColor[outIndex] = in_pcl.m_color[l_kept];
+    }
+
+    std::copy(l_outPos.begin(), l_outPos.end(), out_pcl.m_pos);
+    std::copy(l_outNormal.begin(), l_outNormal.end(), out_pcl.m_normal);
+    std::copy(l_outColor.begin(), l_outColor.end(), out_pcl.m_color);
+    std::copy(l_outNumPts.begin(), l_outNumPts.end(), out_numVoxelPts);
+    std::copy(l_outCov.begin(), l_outCov.end(), out_cov);
+    out_pcl.m_numPts = outputSize;
+  }
+
+
+
+  /******************************************************************************
+  *
+  *: Class name: CRangeDenoiser
+  *
+  ******************************************************************************/
+
+  /** ring buffers of CRangeDenoiser.
+  *   row r of the scan is kept in slot (r % number of slots) of each ring. */
+  struct CDenoiseRings
+  {
+    int m_width;                          // points in a row
+    int m_half0, m_half1;                 // half sizes of the range median and of the flags median
+    float m_noiseTh;
+
+    std::vector<float> m_range;           // ranges of the last 2*m_half0+1 rows (columns padded by mirroring)
+    std::vector<float> m_window;          // rows of a range median window (mirrored at the scan's top/bottom)
+    std::vector<float> m_median;          // range median of a row
+    std::vector<unsigned char> m_flags;   // 1 where the range is near the median, last 2*m_half1+1 rows
+    std::vector<int> m_colSum;            // flags of a window per column (padded by mirroring)
+    std::vector<CVec3> m_pos, m_normal;   // points of the rows not emitted yet (latency+1 rows)
+    std::vector<CColor> m_color;
+    bool m_hasColor, m_hasNormal;
+
+    int m_numRows;                        // rows added
+    int m_numFlagRows;                    // rows with flags
+    int m_numEmitted;                     // rows emitted
+
+    int RangeStride() const               { return m_width + 2 * m_half0; }
+    int NumPtsRows() const                { return m_half0 + m_half1 + 1; }
+
+    /** compute the flags of row in_row (in_numRows: rows of the scan seen for mirroring) */
+    void FlagRow(int in_row, int in_numRows)
+    {
+      int l_size = 2 * m_half0 + 1;
+      int l_stride = RangeStride();
+      for (int winRow = 0; winRow < l_size; winRow++)
+      {
+        int l_src = WrapIndex(in_row - m_half0 + winRow, in_numRows, false) % l_size;
+        std::copy(&m_range[l_src * l_stride], &m_range[l_src * l_stride] + l_stride, &m_window[winRow * l_stride]);
+      }
+      MedianOfPadded(m_width, 1, l_size, &m_window[0], &m_median[0]);
+
+      const float* l_range = &m_range[(in_row % l_size) * l_stride + m_half0];
+      unsigned char* l_flags = &m_flags[(in_row % (2 * m_half1 + 1)) * m_width];
+      for (int col = 0; col < m_width; col++)
+        l_flags[col] = (fabsf(m_median[col] - l_range[col]) < m_noiseTh) ? 1 : 0;
+    }
+
+    /** append the points of row in_row that are flagged, and are in a majority of flagged points
+    *   (the median of the flags) */
+    int EmitRow(int in_row, int in_numRows, CPtCloud& io_pcl)
+    {
+      int l_size = 2 * m_half1 + 1;
+      std::fill(m_colSum.begin(), m_colSum.end(), 0);
+      for (int winRow = 0; winRow < l_size; winRow++)
+      {
+        int l_src = WrapIndex(in_row - m_half1 + winRow, in_numRows, false) % l_size;
+        const unsigned char* l_flags = &m_flags[l_src * m_width];
+        for (int col = 0; col < m_width + 2 * m_half1; col++)
+          m_colSum[col] += l_flags[WrapIndex(col - m_half1, m_width, false)];
+      }
+
+      const unsigned char* l_flags = &m_flags[(in_row % l_size) * m_width];
+      int l_slot = (in_row % NumPtsRows()) * m_width;
+      int l_sum = 0;
+      for (int col = 0; col < l_size - 1; col++)
+        l_sum += m_colSum[col];
+      int outputSize = io_pcl.m_numPts;
+      for (int col = 0; col < m_width; col++)
+      {
+        l_sum += m_colSum[col + l_size - 1];
+        if (l_flags[col] && (2 * l_sum > l_size * l_size))
+        {
+          io_pcl.m_pos[outputSize] = m_pos[l_slot + col];
+          if (m_hasColor && (io_pcl.m_color != 0))
+            io_pcl.m_color[outputSize] = m_color[l_slot + col];
+          if (m_hasNormal && (io_pcl.m_normal != 0))
+            io_pcl.m_normal[outputSize] = m_normal[l_slot + col];
+          outputSize++;
+        }
+        l_sum -= m_colSum[col];
+      }
+      int l_numEmitted = outputSize - io_pcl.m_numPts;
+      io_pcl.m_numPts = outputSize;
+      return l_numEmitted;
+    }
+  };
+
+
+  CRangeDenoiser::CRangeDenoiser(int in_lineWidth, int in_windowSize, float in_noiseTh)
+  {
+    CDenoiseRings* l_rings = new CDenoiseRings;
+    l_rings->m_width = in_lineWidth;
+    l_rings->m_half0 = in_windowSize >> 1;
+    l_rings->m_half1 = std::max(in_windowSize - 2, 1) >> 1;
+    l_rings->m_noiseTh = in_noiseTh;
+
+    int l_size0 = 2 * l_rings->m_half0 + 1, l_size1 = 2 * l_rings->m_half1 + 1;
+    l_rings->m_range.resize(l_size0 * l_rings->RangeStride());
+    l_rings->m_window.resize(l_size0 * l_rings->RangeStride());
+    l_rings->m_median.resize(in_lineWidth);
+    l_rings->m_flags.resize(l_size1 * in_lineWidth);
+    l_rings->m_colSum.resize(in_lineWidth + 2 * l_rings->m_half1);
+    l_rings->m_pos.resize(l_rings->NumPtsRows() * in_lineWidth);
+    l_rings->m_normal.resize(l_rings->NumPtsRows() * in_lineWidth);
+    l_rings->m_color.resize(l_rings->NumPtsRows() * in_lineWidth);
+    m_data = l_rings;
+    Reset();
+  }
+
+
+  CRangeDenoiser::~CRangeDenoiser()
+  {
+    delete (CDenoiseRings*)m_data;
+  }
+
+
+  int CRangeDenoiser::AddRow(const CVec3* in_pos, const CColor* in_color, const CVec3* in_normal, CPtCloud& io_pcl)
+  {
+    CDenoiseRings& l_rings = *(CDenoiseRings*)m_data;
+    int l_width = l_rings.m_width;
+    int l_row = l_rings.m_numRows++;
+
+    //keep the ranges (columns mirrored) and the points:
+    float* l_range = &l_rings.m_range[(l_row % (2 * l_rings.m_half0 + 1)) * l_rings.RangeStride()];
+    for (int col = 0; col < l_rings.RangeStride(); col++)
+      l_range[col] = Length(in_pos[WrapIndex(col - l_rings.m_half0, l_width, false)]);
+    int l_slot = (l_row % l_rings.NumPtsRows()) * l_width;
+    std::copy(in_pos, in_pos + l_width, &l_rings.m_pos[l_slot]);
+    l_rings.m_hasColor = (in_color != 0);
+    if (l_rings.m_hasColor)
+      std::copy(in_color, in_color + l_width, &l_rings.m_color[l_slot]);
+    l_rings.m_hasNormal = (in_normal != 0);
+    if (l_rings.m_hasNormal)
+      std::copy(in_normal, in_normal + l_width, &l_rings.m_normal[l_slot]);
+
+    //flag the rows whose median window is complete, emit the rows whose flags window is complete:
+    int l_numEmitted = 0;
+    while (l_rings.m_numFlagRows + l_rings.m_half0 < l_rings.m_numRows)
+      l_rings.FlagRow(l_rings.m_numFlagRows++, l_rings.m_numRows);
+    while (l_rings.m_numEmitted + l_rings.m_half1 < l_rings.m_numFlagRows)
+      l_numEmitted += l_rings.EmitRow(l_rings.m_numEmitted++, l_rings.m_numFlagRows, io_pcl);
+    return l_numEmitted;
+  }
+
+
+  int CRangeDenoiser::EndScan(CPtCloud& io_pcl)
+  {
+    CDenoiseRings& l_rings = *(CDenoiseRings*)m_data;
+    int l_numEmitted = 0;
+    while (l_rings.m_numEmitted < l_rings.m_numRows)
+    {
+      // (a flag row overwrites the oldest one: the rows needing it are emitted first)
+      if (l_rings.m_numFlagRows < l_rings.m_numRows)
+        l_rings.FlagRow(l_rings.m_numFlagRows++, l_rings.m_numRows);
+      while ((l_rings.m_numEmitted < l_rings.m_numRows) &&
+             ((l_rings.m_numEmitted + l_rings.m_half1 < l_rings.m_numFlagRows) || (l_rings.m_numFlagRows == l_rings.m_numRows)))
+        l_numEmitted += l_rings.EmitRow(l_rings.m_numEmitted++, l_rings.m_numRows, io_pcl);
     }
+    Reset();
+    return l_numEmitted;
   }
 
 
+  void CRangeDenoiser::Reset()
+  {
+    CDenoiseRings& l_rings = *(CDenoiseRings*)m_data;
+    l_rings.m_numRows = l_rings.m_numFlagRows = l_rings.m_numEmitted = 0;
+    l_rings.m_hasColor = l_rings.m_hasNormal = false;
+  }
+
+
+  int CRangeDenoiser::GetLatency() const
+  {
+    const CDenoiseRings& l_rings = *(const CDenoiseRings*)m_data;
+    return l_rings.m_half0 + l_rings.m_half1;
+  }
+
 
   /******************************************************************************
   *
@@ -179,11 +940,21 @@ namespace tpcl
   *: Method name: FindNormal
   *
   ******************************************************************************/
-  void Features::FillNormals(CPtCloud& io_pcl, float in_radius, CSpatialHash2D* in_pclHash, bool in_fixZ)
+  void Features::FillNormals(CPtCloud& io_pcl, float in_radius, ISpatialIndex* in_pclHash, bool in_fixZ, ENormalMode in_mode, int in_numNeighbors)
   {
     const int bufSize = 100;
     bool gotHashed = in_pclHash != NULL;
 
+    //organized scan: neighbors are implicit in the grid.
+    if ((in_mode == NORMALS_INTEGRAL_IMAGE) && (io_pcl.m_type == PCL_TYPE_SINGLE_ORIGIN_SCAN) && (io_pcl.m_lineWidth > 0))
+    {
+      int windowSize = 3;
+      while (windowSize * windowSize < in_numNeighbors)
+        windowSize += 2;
+      FillNormalsIntegral(io_pcl, windowSize, in_fixZ);
+      return;
+    }
+
     //if didn't get global hashed point cloud - create one from the point cloud for whoch the normals are found:
     if (!gotHashed)
     {
@@ -192,11 +963,20 @@ namespace tpcl
       {
         in_pclHash->Add(io_pcl.m_pos[Index], NULL);
       }
+      in_pclHash->Build();
+    }
+
+    if (in_mode != NORMALS_RANSAC)
+    {
+      FillNormalsPCA(io_pcl, in_radius * 2, *in_pclHash, in_fixZ, in_numNeighbors, in_mode == NORMALS_PCA_ROBUST);
+      if (!gotHashed)
+        delete in_pclHash;
+      return;
     }
 
     #pragma omp parallel
     {
-    void* unsuedBuf[bufSize];
+    int unsuedBuf[bufSize];
       CVec3 closePts[bufSize];
     int numOfClose = 0;
 
@@ -206,7 +986,14 @@ namespace tpcl
         float radius = in_radius * 2;
         //get close points:
 
-        numOfClose = in_pclHash->GetNear(io_pcl.m_pos[ptIndex], bufSize, unsuedBuf, closePts, radius);
+        numOfClose = in_pclHash->GetNearIdx(io_pcl.m_pos[ptIndex], bufSize, unsuedBuf, closePts, radius);
+
+        //local shape of the same points:
+        if (io_pcl.m_shape != 0)
+        {
+          CVec3 pcaNormal, pcaCenter;
+          PlaneOfPointsPCA(numOfClose, closePts, 0, pcaNormal, pcaCenter, io_pcl.m_shape[ptIndex]);
+        }
 
         //find plane:
         CPlane approxPlane;
@@ -294,72 +1081,113 @@ namespace tpcl
   }
 
 
-  void Features::DenoiseRangeOfPointCloud()
+  void Features::DenoiseRangeOfPointCloud(const CPtCloud& in_pcl, CPtCloud& out_pcl, int in_windowSize, float in_noiseTh, float in_angleRes,
+                                          const CVec3& in_origin)
   {
-
-  }
-
-
-  void Features::DownSample(const CPtCloud& in_pcl, CPtCloud& out_pcl, float in_voxelSize)
-  {
-    float InvVoxelSize = 1.0f / in_voxelSize;
-
-    //find min/max x/y/z:
-    CVec3 l_bbox[2] = { in_pcl.m_pos[0], in_pcl.m_pos[0] };
-    for (int ptrIndex = 1; ptrIndex < in_pcl.m_numPts; ptrIndex++)
+    int half0 = in_windowSize >> 1;
+    int half1 = std::max(in_windowSize - 2, 1) >> 1;
+    int numPts = in_pcl.m_numPts;
+    if (numPts == 0)
     {
-      l_bbox[0] = Min_ps(l_bbox[0], in_pcl.m_pos[ptrIndex]);
-      l_bbox[1] = Max_ps(l_bbox[1], in_pcl.m_pos[ptrIndex]);
+      out_pcl.m_numPts = 0;
+      return;
     }
 
-    //create downsampling vector:
-    int Mx = int(ceil((l_bbox[1].x - l_bbox[0].x) * InvVoxelSize));
-    int My = int(ceil((l_bbox[1].y - l_bbox[0].y) * InvVoxelSize));
-    int Mz = int(ceil((l_bbox[1].z - l_bbox[0].z) * InvVoxelSize));
-    int Mxy = Mx*My;
-    unsigned int Mxyz = Mxy * Mz;
+    //azimuth column, elevation and range of each point:
+    std::vector<int>& cellOf = m_cellOf;
+    std::vector<float>& elevationOf = m_elevationOf;
+    std::vector<float>& rangeOf = m_rangeOf;
+    cellOf.resize(numPts);
+    elevationOf.resize(numPts);
+    rangeOf.resize(numPts);
+    int lineWidth = int(ceil(2.0f * float(M_PI) / in_angleRes));
+    #pragma omp parallel for
+    for (int ptIndex = 0; ptIndex < numPts; ptIndex++)
+    {
+      CVec3 pos = in_pcl.m_pos[ptIndex] - in_origin;
+      float azimuth = atan2(pos.y, pos.x);
+      elevationOf[ptIndex] = atan2(pos.z, sqrt(pos.x*pos.x + pos.y*pos.y));
+      rangeOf[ptIndex] = Length(pos);
+      cellOf[ptIndex] = std::min(int((azimuth + float(M_PI)) / in_angleRes), lineWidth - 1);
+    }
 
-    bool* VisitedVoxel = new bool[Mxyz];
-    memset(VisitedVoxel, false, Mxyz * sizeof(bool));
+    //rows cover only the elevations of the points:
+    float minElevation = *std::min_element(elevationOf.begin(), elevationOf.end());
+    float maxElevation = *std::max_element(elevationOf.begin(), elevationOf.end());
+    int numlines = int((maxElevation - minElevation) / in_angleRes) + 1;
+    #pragma omp parallel for
+    for (int ptIndex = 0; ptIndex < numPts; ptIndex++)
+    {
+      int row = std::min(int((elevationOf[ptIndex] - minElevation) / in_angleRes), numlines - 1);
+      cellOf[ptIndex] += row * lineWidth;
+    }
 
-    int outputSize = 0;
-    for (int ptrIndex = 0; ptrIndex < in_pcl.m_numPts; ptrIndex++)
+    //range image: closest range in each cell.
+    int numCells = lineWidth * numlines;
+    std::vector<float>& rangeImage = m_rangeImage;
+    rangeImage.assign(numCells, 0.0f);
+    for (int ptIndex = 0; ptIndex < numPts; ptIndex++)
     {
-      float x = in_pcl.m_pos[ptrIndex].x;
-      float y = in_pcl.m_pos[ptrIndex].y;
-      float z = in_pcl.m_pos[ptrIndex].z;
+      float& range = rangeImage[cellOf[ptIndex]];
+      if ((range == 0) || (rangeOf[ptIndex] < range))
+        range = rangeOf[ptIndex];
+    }
+
+    //cells without points (e.g. between the sensor's lines) take the range of the closest cell, so they don't outvote the points.
+    FillHoles(lineWidth, numlines, &rangeImage[0]);
 
-      //find point's voxel index:
-      int xInd = int(floor((x - l_bbox[0].x) * InvVoxelSize));
-      int yInd = int(floor((y - l_bbox[0].y) * InvVoxelSize));
-      int zInd = int(floor((z - l_bbox[0].z) * InvVoxelSize));
+    //same filters as DenoiseRange. azimuth is cyclic, elevation is mirrored.
+    std::vector<float>& padded = m_padded;
+    std::vector<float>& distFiltered = m_distFiltered;
+    distFiltered.resize(numCells);
+    PadImage(lineWidth, numlines, half0, true, false, &rangeImage[0], padded);
+    MedianOfPadded(lineWidth, numlines, 2 * half0 + 1, &padded[0], &distFiltered[0]);
 
-      if (xInd == Mx) xInd--;
-      if (yInd == My) yInd--;
-      if (zInd == Mz) zInd--;
+    #pragma omp parallel for
+    for (int index = 0; index < numCells; index++)
+      distFiltered[index] = (fabs(distFiltered[index] - rangeImage[index]) < in_noiseTh) ? 1.0f : 0.0f;
 
-      unsigned int index = zInd*Mxy + yInd*Mx + xInd;
+    float* threshFiltered = &distFiltered[0];
+    if (half1 > 0)
+    {
+      threshFiltered = &rangeImage[0];   // (range image no longer needed)
+      PadImage(lineWidth, numlines, half1, true, false, &distFiltered[0], padded);
+      MedianOfPadded(lineWidth, numlines, 2 * half1 + 1, &padded[0], threshFiltered);
+    }
 
-      //if we haven't filled this voxel with a point yet, add current point:
-      if (!VisitedVoxel[index])
+    //points keep the result of their cell:
+    int outputSize = 0;
+    for (int ptIndex = 0; ptIndex < numPts; ptIndex++)
+    {
+      int index = cellOf[ptIndex];
+      if ((distFiltered[index] == 1) && (threshFiltered[index] == 1))
       {
-        out_pcl.m_pos[outputSize] = in_pcl.m_pos[ptrIndex];
+        out_pcl.m_pos[outputSize] = in_pcl.m_pos[ptIndex];
         if ((in_pcl.m_color != 0) && (out_pcl.m_color != 0))
-          out_pcl.m_color[outputSize] = in_pcl.m_color[ptrIndex];
+          out_pcl.m_color[outputSize] = in_pcl.m_color[ptIndex];
         if ((in_pcl.m_normal != 0) && (out_pcl.m_normal != 0))
-          out_pcl.m_normal[outputSize] = in_pcl.m_normal[ptrIndex];
+          out_pcl.m_normal[outputSize] = in_pcl.m_normal[ptIndex];
         outputSize++;
-
-        VisitedVoxel[index] = true;
       }
     }
-    delete[] VisitedVoxel;
 
     out_pcl.m_numPts = outputSize;
   }
 
 
-  float Features::RMSEofRegistration(CSpatialHash2D* in_pcl1, const CPtCloud& in_pcl2, float in_max2DRadius, const CMat4& in_Rt)
+  void Features::DownSample(const CPtCloud& in_pcl, CPtCloud& out_pcl, float in_voxelSize, EDownSampleMode in_mode)
+  {
+    VoxelGridFilter(in_pcl, out_pcl, in_voxelSize, in_mode, 0, 0);
+  }
+
+
+  void Features::VoxelCentroids(const CPtCloud& in_pcl, CPtCloud& out_pcl, float in_voxelSize, int* out_numVoxelPts, float* out_cov)
+  {
+    VoxelGridFilter(in_pcl, out_pcl, in_voxelSize, DOWNSAMPLE_CENTROID, out_numVoxelPts, out_cov);
+  }
+
+
+  float Features::RMSEofRegistration(ISpatialIndex* in_pcl1, const CPtCloud& in_pcl2, float in_max2DRadius, const CMat4& in_Rt)
   {
     double RMSE = 0;
     float outPenalty = in_max2DRadius*in_max2DRadius*1.5f;
@@ -375,7 +1203,7 @@ namespace tpcl
 
       // search for match
       float dist = outPenalty;
-      if (in_pcl1->FindNearest(transformedPt, &closestPt, in_max2DRadius))
+      if (in_pcl1->FindNearestIdx(transformedPt, &closestPt, in_max2DRadius) >= 0)
       {
         dist = DistSqr(transformedPt, closestPt);
       }
@@ -25,6 +25,7 @@
 
 #include "../../include/iFeatures.h"
 #include "../../include/vec.h"
+#include <vector>
 
 /******************************************************************************
 *                        INCOMPLETE CLASS DECLARATIONS                        *
@@ -33,6 +34,7 @@
 namespace tpcl
 {
   class  CRegDictionary;         // registration Dictionary
+  typedef unsigned int CColor;
 
   /******************************************************************************
   *                              EXPORTED CLASSES                               *
@@ -59,11 +61,19 @@ namespace tpcl
     /** finds the normalized normals for the input points from the global hashed point cloud.
     *   optional: fix z value of input points to z in the point's xy from the estimated plane around that point.
     *   also, updates the z value of the points to be on the found plane.
-    * @param io_pcl            input: points where to look for the normal. output: filled with the normals. pos updated to be on plane with the same x,y.
+    *   if io_pcl has shapes (m_shape), they are filled from the covariance of the same neighbors.
+    * @param io_pcl            input: points where to look for the normal. output: filled with the normals (and shapes). pos updated to be on plane with the same x,y.
     * @param in_radius         radius around input point to get global points for the plane estimation (from which the also the normals are calculated).
     * @param in_pclHash        input hashed global point cloud. if NULL input points are hashed and considered the global point cloud.
-    * @param in_fixZ           if true z value of input points are fixed according to the plane estimated around them. if false output points = input points. */
-    virtual void FillNormals(CPtCloud& io_pcl, float in_radius =10.0f, CSpatialHash2D* in_pclHash = 0, bool in_fixZ = false);
+    * @param in_fixZ           if true z value of input points are fixed according to the plane estimated around them. if false output points = input points.
+    * @param in_mode           NORMALS_RANSAC: RanSaC plane of the points in the radius.
+    *                          NORMALS_PCA(_ROBUST): least squares plane of the in_numNeighbors nearest points in the radius, queried in batches.
+    *                          NORMALS_INTEGRAL_IMAGE: for PCL_TYPE_SINGLE_ORIGIN_SCAN, least squares plane of the points in a window of the grid
+    *                          (smallest odd square with at least in_numNeighbors pixels). in_radius and in_pclHash are not used.
+    *                          other clouds use NORMALS_PCA.
+    * @param in_numNeighbors   number of nearest neighbors for the NORMALS_PCA modes. */
+    virtual void FillNormals(CPtCloud& io_pcl, float in_radius =10.0f, ISpatialIndex* in_pclHash = 0, bool in_fixZ = false,
+                             ENormalMode in_mode = NORMALS_RANSAC, int in_numNeighbors = 20);
 
 
     /** denose by range an xyz image and return a denoised point cloud.
@@ -74,18 +84,44 @@ namespace tpcl
     virtual void DenoiseRange(const CPtCloud& in_pcl, CPtCloud& out_pcl, int in_windowSize, float in_noiseTh);
 
 
-    /** TODO: !!empty function!!
-    denose by range a point cloud. */
-    virtual void DenoiseRangeOfPointCloud();
+    /** denose by range an unordered point cloud (e.g. PCL_TYPE_FUSED).
+    *   the points are binned by azimuth/elevation (around in_origin) to a range image of the closest range in each cell,
+    *   which is filtered as in DenoiseRange. points keep the result of their cell.
+    *   empty cells take the range of the closest cell with points (first in their column).
+    *   supports in_pts = out_pts. the range image buffers are kept for the next call (not reentrant).
+    * @param in_pcl                      input point cloud.
+    * @param out_pcl                      denoised point cloud. assumes buffer size at least as in_pts's size.
+    * @param in_windowSize             median filter size for the range imgae.
+    * @param in_noiseTh     max distance between point and median filter's result.
+    * @param in_angleRes    azimuth/elevation size of a cell in the range image (radians). should be about the angular spacing of the points.
+    * @param in_origin      center of the projection (e.g. the sensor's position), in the coordinates of in_pcl. */
+    virtual void DenoiseRangeOfPointCloud(const CPtCloud& in_pcl, CPtCloud& out_pcl, int in_windowSize, float in_noiseTh, float in_angleRes,
+                                          const CVec3& in_origin);
 
 
     /** downsample a point cloud. Divides to grid from minXYZ (of pts) to max XYZ, of size m_voxelSize.
-    *  If more than one point in same grid index, takes first one encountered.
+    *  If more than one point in same grid index, in_mode chooses the point kept (default: first one encountered).
+    *  Output points are in the order of the first point of their voxel.
     *  supports in_pts = out_pts. assumes size of out_pts >= in_numPts.
+    *  Memory is proportional to the number of points (not to the grid size).
     * @param in_pcl                 input point cloud.
     * @param out_pcl                 downsampled point cloud.
-    * @param in_voxelSize           size of a voxel in grid. assums bigger than 0. */
-    virtual void DownSample(const CPtCloud& in_pcl, CPtCloud& out_pcl, float in_voxelSize);
+    * @param in_voxelSize           size of a voxel in grid. assums bigger than 0.
+    * @param in_mode                point kept for each voxel (see EDownSampleMode). */
+    virtual void DownSample(const CPtCloud& in_pcl, CPtCloud& out_pcl, float in_voxelSize,
+                            EDownSampleMode in_mode = DOWNSAMPLE_FIRST);
+
+
+    /** voxel grid filter: the centroid of each voxel (see DOWNSAMPLE_CENTROID), with the averaged
+    *  (renormalized) normal and the averaged color when both clouds have them.
+    *  supports in_pts = out_pts. assumes size of out_pts >= in_numPts.
+    * @param in_pcl                 input point cloud.
+    * @param out_pcl                 centroids, in the order of the first point of their voxel.
+    * @param in_voxelSize           size of a voxel in grid. assums bigger than 0.
+    * @param out_numVoxelPts        optional: number of points in each voxel. assumes size >= in_numPts.
+    * @param out_cov                optional: covariance of each voxel's points (xx, xy, xz, yy, yz, zz). assumes size >= 6*in_numPts. */
+    virtual void VoxelCentroids(const CPtCloud& in_pcl, CPtCloud& out_pcl, float in_voxelSize,
+                                int* out_numVoxelPts = 0, float* out_cov = 0);
 
 
     /** calculates the RMSE of a registration.
@@ -96,7 +132,7 @@ namespace tpcl
     * @param in_pcl2         2nd point cloud.
     * @param in_Rt           registration from 2nd point cloud to main. 
     * return                 RMSE of registration. */
-    virtual float RMSEofRegistration(CSpatialHash2D* in_pcl1, const CPtCloud& in_pcl2, float in_max2DRadius, const CMat4& in_Rt);
+    virtual float RMSEofRegistration(ISpatialIndex* in_pcl1, const CPtCloud& in_pcl2, float in_max2DRadius, const CMat4& in_Rt);
 
 
     /** finds the rotation matrix so that the new z axis will be in the normal direction. to be used: x_rotated = R * x.
@@ -104,6 +140,78 @@ namespace tpcl
     * @param Xo_RotateMat       output rotation matrix.
     * @param Xi_Pos             optional: input vector to replace the default vector in output CMat4, which is (0, 0, 0).*/
     virtual void CalcRotateMatZaxisToNormal(const CVec3& Xi_Normal, CMat4& Xo_RotateMat, const CVec3& Xi_Pos = CVec3(0, 0, 0));
+
+  private:
+    // range image of DenoiseRangeOfPointCloud (kept between calls):
+    std::vector<int> m_cellOf;              // cell of each point
+    std::vector<float> m_elevationOf;       // elevation of each point
+    std::vector<float> m_rangeOf;           // range of each point
+    std::vector<float> m_rangeImage;        // closest range in each cell
+    std::vector<float> m_padded;            // padded image of the median filters
+    std::vector<float> m_distFiltered;      // range median, then near-median flags
+  };
+
+
+  /******************************************************************************
+  *                             EXPORTED FUNCTIONS                              *
+  ******************************************************************************/
+
+  /** 2D median filter. edges are treated with cyclic indices.
+  * @param in_medFiltSize              median filter size (even sizes use the next odd size).
+  * @param out_ptsFiltered             2D median filtered image. assumes out_ptsFiltered != in_pts */
+  void Median2DPowOf2(int in_lineWidth, int in_numlines, int in_medFiltSize, float* in_pts, float* out_ptsFiltered);
+
+  /** 2D median filter. edges are treated with mirroring (see Median2DPowOf2). */
+  void Median2D(int in_lineWidth, int in_numlines, int in_medFiltSize, float* in_pts, float* out_ptsFiltered);
+
+
+  /******************************************************************************
+  *
+  *: Class name: CRangeDenoiser
+  *
+  *: Abstract: streaming version of Features::DenoiseRange.
+  *
+  ******************************************************************************/
+
+  /** denoise a PCL_TYPE_SINGLE_ORIGIN_SCAN scan row by row, as the rows arrive from the sensor.
+  *   Gives the same points as Features::DenoiseRange on the whole scan.
+  *   Only the rows needed by the median windows are kept (in ring buffers): a row is emitted
+  *   GetLatency() rows after it was added. All buffers are allocated by the constructor. */
+  class CRangeDenoiser
+  {
+  public:
+    /** Constructor
+    * @param in_lineWidth                number of points in a row.
+    * @param in_windowSize               median filter size for the range image (as in Features::DenoiseRange).
+    * @param in_noiseTh                  max distance between point and median filter's result. */
+    CRangeDenoiser(int in_lineWidth, int in_windowSize, float in_noiseTh);
+
+    /** destructor */
+    ~CRangeDenoiser();
+
+    /** add the next row of the scan. the denoised points of the rows that are complete are appended to io_pcl.
+    * @param in_pos                      positions of the row (line width points).
+    * @param in_color                    optional: colors of the row.
+    * @param in_normal                   optional: normals of the row.
+    * @param io_pcl                      denoised points are appended from io_pcl.m_numPts (colors/normals if it has them).
+    *                                    at most a row is appended: assumes room for io_pcl.m_numPts + line width points.
+    * return                            number of points appended. */
+    int AddRow(const CVec3* in_pos, const CColor* in_color, const CVec3* in_normal, CPtCloud& io_pcl);
+
+    /** end of the scan: appends the denoised points of the remaining rows, and starts a new scan.
+    * @param io_pcl                      as in AddRow. at most GetLatency() rows are appended:
+    *                                    assumes room for io_pcl.m_numPts + GetLatency() * line width points.
+    * return                            number of points appended. */
+    int EndScan(CPtCloud& io_pcl);
+
+    /** drop the rows of the current scan (without emitting them) */
+    void Reset();
+
+    /** number of rows added after a row before it is emitted */
+    int GetLatency() const;
+
+  private:
+    void* m_data;   ///< ring buffers
   };
  
 
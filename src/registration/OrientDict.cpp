@@ -21,7 +21,7 @@
 
 #include "OrientDict.h"
 #include "features.h"
-#include "SpatialHash.h"
+#include "SpatialIndex.h"
 #include "common.h"
 #include "tran.h"
 #include <complex>
@@ -67,13 +67,13 @@ namespace tpcl
   }
 
 
-  COrientedGrid::COrientedGrid(float in_voxelSize)
+  COrientedGrid::COrientedGrid(float in_voxelSize, ESpatialIndexType in_indexType)
   {
     m_pclMain.m_color = NULL;    m_pclMain.m_normal = NULL;    m_pclMain.m_type = PCL_TYPE_FUSED;
     initMembers();
     m_voxelSize = in_voxelSize;
-    m_mainHashed = new CSpatialHash2D(m_voxelSize);
-    ((CSpatialHash2D*)(m_mainHashed))->Clear();
+    m_indexType = in_indexType;
+    m_mainHashed = CreateSpatialIndex(m_indexType, m_voxelSize);
   }
 
 
@@ -117,7 +117,7 @@ namespace tpcl
 
   void COrientedGrid::DeleteGrid()
   {
-    delete m_mainHashed;
+    delete (ISpatialIndex*)m_mainHashed;
     delete[] m_pclMain.m_pos;
     delete[] m_Orient;
   }
@@ -127,13 +127,13 @@ namespace tpcl
   {
     DeleteGrid();
 
-    m_mainHashed = new CSpatialHash2D(m_voxelSize);
-    ((CSpatialHash2D*)(m_mainHashed))->Clear();
+    m_mainHashed = CreateSpatialIndex(m_indexType, m_voxelSize);
 
     m_pclMain.m_pos = NULL;
     m_Orient = NULL;
 
     m_pclMain.m_numPts = 0;
+    m_pclCapacity = 0;
     m_size = 0;
     m_minBBox = CVec3(0, 0, 0);
     m_maxBBox = CVec3(0, 0, 0);
@@ -149,10 +149,20 @@ namespace tpcl
 
   void COrientedGrid::PointCloudUpdate(const CPtCloud& in_pcl, CVec3& out_minBox, CVec3& out_maxBox)
   {
-    CSpatialHash2D& mainHashed = *((CSpatialHash2D*)(m_mainHashed));
+    ISpatialIndex& mainHashed = *((ISpatialIndex*)(m_mainHashed));
 
+    //the index reads the main cloud in place: points are appended in place while there is room, otherwise
+    //the cloud moves to an array of twice the size (the old one is released once the index does not read it):
     int totalPts = m_pclMain.m_numPts + in_pcl.m_numPts;
-    resizeArray(m_pclMain.m_pos, m_pclMain.m_numPts, totalPts);
+    CVec3* oldPos = NULL;
+    if (totalPts > m_pclCapacity)
+    {
+      m_pclCapacity = MaxT(totalPts, 2 * m_pclCapacity);
+      oldPos = m_pclMain.m_pos;
+      m_pclMain.m_pos = new CVec3[m_pclCapacity];
+      if (m_pclMain.m_numPts > 0)
+        memcpy(m_pclMain.m_pos, oldPos, m_pclMain.m_numPts * sizeof(CVec3));
+    }
 
     out_minBox = out_maxBox = in_pcl.m_pos[0];
     for (int ptrIndex = 0; ptrIndex < in_pcl.m_numPts; ptrIndex++)
@@ -160,11 +170,14 @@ namespace tpcl
       m_pclMain.m_pos[m_pclMain.m_numPts] = in_pcl.m_pos[ptrIndex];
       m_pclMain.m_numPts++;
 
-      mainHashed.Add(in_pcl.m_pos[ptrIndex], (void*)(1));
       out_minBox = Min_ps(out_minBox, in_pcl.m_pos[ptrIndex]);
       out_maxBox = Max_ps(out_maxBox, in_pcl.m_pos[ptrIndex]);
     }
     //at end of for loop: m_pclMain.m_numPts = totalPts;
+    //index the new points (the whole cloud if it moved):
+    mainHashed.Append(m_pclMain);
+    if (oldPos != NULL)
+      mainHashed.DeleteWhenUnread(oldPos);
 
     m_minBBox = Min_ps(out_minBox, m_minBBox);;
     m_maxBBox = Max_ps(out_maxBox, m_maxBBox);;
@@ -174,7 +187,7 @@ namespace tpcl
   int COrientedGrid::ViewpointGridUpdate(float in_d_grid, float in_d_sensor, CVec3& in_minBox, CVec3& in_maxBox)
   {
     Features feat;
-    CSpatialHash2D& mainHashed = *((CSpatialHash2D*)(m_mainHashed));
+    ISpatialIndex& mainHashed = *((ISpatialIndex*)(m_mainHashed));
 
     float invGridRes = 1.0f / in_d_grid;
 
@@ -194,7 +207,7 @@ namespace tpcl
       {
         CVec3 pos(in_minBox.x + xGrid*in_d_grid, in_minBox.y + yGrid*in_d_grid, 0);
         CVec3 closest;
-        if (mainHashed.FindNearest(pos, &closest, in_d_grid))
+        if (mainHashed.FindNearestIdx(pos, &closest, in_d_grid) >= 0)
           pos.z = closest.z;
         else
           pos.z = in_minBox.z;
@@ -204,7 +217,7 @@ namespace tpcl
 
     //find normals:
     const float maxDistForPlane = 4;// m_voxelSize * 2;
-    feat.FillNormals(gridPositions, maxDistForPlane, &mainHashed, true);
+    feat.FillNormals(gridPositions, maxDistForPlane, &mainHashed, true, NORMALS_PCA_ROBUST);
 
     int preSize = m_size;
     m_size += gridPositions.m_numPts;
@@ -239,14 +252,73 @@ namespace tpcl
   }
 
 
+  int COrientedGrid::CropGrid(const CVec3& in_minBox, const CVec3& in_maxBox)
+  {
+    ISpatialIndex& mainHashed = *((ISpatialIndex*)(m_mainHashed));
+
+    //compact main cloud into a new array of the new size (the index may still be read with the old one) and update its bounding box:
+    int numPts = 0;
+    for (int ptrIndex = 0; ptrIndex < m_pclMain.m_numPts; ptrIndex++)
+    {
+      const CVec3& pos = m_pclMain.m_pos[ptrIndex];
+      if (pos.x >= in_minBox.x && pos.y >= in_minBox.y && pos.x <= in_maxBox.x && pos.y <= in_maxBox.y)
+        numPts++;
+    }
+    CVec3* oldPos = m_pclMain.m_pos;
+    m_pclMain.m_pos = new CVec3[numPts];
+    m_pclCapacity = numPts;
+    numPts = 0;
+    for (int ptrIndex = 0; ptrIndex < m_pclMain.m_numPts; ptrIndex++)
+    {
+      const CVec3& pos = oldPos[ptrIndex];
+      if (pos.x < in_minBox.x || pos.y < in_minBox.y || pos.x > in_maxBox.x || pos.y > in_maxBox.y)
+        continue;
+      if (numPts == 0)
+        m_minBBox = m_maxBBox = pos;
+      m_minBBox = Min_ps(m_minBBox, pos);
+      m_maxBBox = Max_ps(m_maxBBox, pos);
+      m_pclMain.m_pos[numPts++] = pos;
+    }
+    if (numPts == 0)
+      m_minBBox = m_maxBBox = CVec3(0, 0, 0);
+    m_pclMain.m_numPts = numPts;
+
+    //index the main cloud again, then release the old array:
+    mainHashed.Build(m_pclMain);
+    mainHashed.DeleteWhenUnread(oldPos);
+
+    //compact grid:
+    int size = 0;
+    for (int index = 0; index < m_size; index++)
+    {
+      if (GridPointInBox(index, in_minBox, in_maxBox))
+        m_Orient[size++] = m_Orient[index];
+    }
+    resizeArray(m_Orient, size, size);
+    m_size = size;
+
+    return m_size;
+  }
+
+
   /******************************************************************************
   *                             Protected methods                               *
   ******************************************************************************/
+  bool COrientedGrid::GridPointInBox(int in_index, const CVec3& in_minBox, const CVec3& in_maxBox) const
+  {
+    //grid point's location is the translation of its orientation:
+    const CMat4& orient = m_Orient[in_index];
+    return (orient.m[3][0] >= in_minBox.x) && (orient.m[3][1] >= in_minBox.y) && (orient.m[3][0] <= in_maxBox.x) && (orient.m[3][1] <= in_maxBox.y);
+  }
+
+
   void COrientedGrid::initMembers()
   {
     m_pclMain.m_numPts = 0;
     m_pclMain.m_pos = NULL;
+    m_pclCapacity = 0;
     m_voxelSize = 0.5;
+    m_indexType = SPATIAL_INDEX_HASH_2D;
     m_Orient = NULL;
     m_size = 0;
     m_mainHashed = NULL;
@@ -273,7 +345,8 @@ namespace tpcl
   }
 
 
-  CRegDictionary::CRegDictionary(float in_voxelSize, float in_r_max, float in_r_min, int in_descWidth, int in_descHeight) : COrientedGrid(in_voxelSize)
+  CRegDictionary::CRegDictionary(float in_voxelSize, float in_r_max, float in_r_min, int in_descWidth, int in_descHeight,
+                                 ESpatialIndexType in_indexType) : COrientedGrid(in_voxelSize, in_indexType)
   {
     m_descriptors = NULL;
     m_descriptorsDFT = NULL;
@@ -345,6 +418,34 @@ namespace tpcl
   }
 
 
+  void CRegDictionary::CropDictionary(const CVec3& in_minBox, const CVec3& in_maxBox)
+  {
+    //compact descriptors (same order as the grid compaction), deleting those of removed entries:
+    if (m_descriptors != NULL)
+    {
+      int size = 0;
+      for (int dicIndex = 0; dicIndex < m_size; dicIndex++)
+      {
+        if (GridPointInBox(dicIndex, in_minBox, in_maxBox))
+        {
+          m_descriptors[size] = m_descriptors[dicIndex];
+          m_descriptorsDFT[size] = m_descriptorsDFT[dicIndex];
+          size++;
+        }
+        else
+        {
+          delete[] m_descriptors[dicIndex];
+          delete[] m_descriptorsDFT[dicIndex];
+        }
+      }
+      resizeArray(m_descriptors, size, size);
+      resizeArray(m_descriptorsDFT, size, size);
+    }
+
+    CropGrid(in_minBox, in_maxBox);
+  }
+
+
   void CRegDictionary::PCL2descriptor(const CPtCloud& in_pcl, float* out_RangeImage)
   {
     int totalDescSize = m_descHeight * m_descWidth;
@@ -23,6 +23,7 @@
 
 #include "../../include/vec.h"
 #include "../include/ptCloud.h"
+#include "SpatialIndex.h"
 
   /******************************************************************************
   *                        INCOMPLETE CLASS DECLARATIONS                        *
@@ -53,9 +54,10 @@ namespace tpcl
   {
   public:
     /** Constructor 
-    * @param in_voxelSize   the voxel size parameter of the hashed main point cloud. */
+    * @param in_voxelSize   the voxel size parameter of the hashed main point cloud.
+    * @param in_indexType   type of spatial index used for the main point cloud. */
     COrientedGrid();
-    COrientedGrid(float in_voxelSize);
+    COrientedGrid(float in_voxelSize, ESpatialIndexType in_indexType = SPATIAL_INDEX_HASH_2D);
 
     /** destructor */
     ~COrientedGrid(); 
@@ -118,12 +120,22 @@ namespace tpcl
     * return                  the previous size of the grid. */
     int PointCloudAndGridUpdate(const CPtCloud& in_pcl, float in_d_grid, float in_d_sensor);
 
+    /** removes the main cloud points and the grid points outside a 2D (x/y) box.
+    *   the main cloud and the grid are compacted (releasing memory) and the main cloud is hashed again.
+    *   the old main cloud array is released once the index (which other threads may query) does not read it.
+    * @param in_minBox        minimum of the box to keep.
+    * @param in_maxBox        maximum of the box to keep.
+    * return                  the new size of the grid. */
+    int CropGrid(const CVec3& in_minBox, const CVec3& in_maxBox);
+
   protected:
     CPtCloud m_pclMain;       ///< main point cloud.
+    int m_pclCapacity;        ///< number of points m_pclMain.m_pos has room for.
     void* m_mainHashed;         ///< a hashed copy of the original point cloud.
 
     int m_size;                 ///< number of entries (grid points) in the grid.
     float m_voxelSize;          ///< the voxel size parameter of the hashed main point cloud.
+    ESpatialIndexType m_indexType;  ///< type of spatial index used for the main point cloud.
     CMat4* m_Orient;       ///< location and normal orientation per grid point (created from the main point cloud).
     CVec3 m_minBBox;        ///< minimum of boounding box of accumulated main point cloud.
     CVec3 m_maxBBox;        ///< maximum of boounding box of accumulated main point cloud.
@@ -131,6 +143,9 @@ namespace tpcl
     /** Set default values to members. */
     void initMembers();
 
+    /** is a grid point inside a 2D (x/y) box. */
+    bool GridPointInBox(int in_index, const CVec3& in_minBox, const CVec3& in_maxBox) const;
+
   };
 
 
@@ -157,9 +172,11 @@ namespace tpcl
     * @param in_r_max       maximum distance from grid point for descriptor creation.
     * @param in_r_min       minimum distance from grid point for descriptor creation.
     * @param in_descWidth   descriptor's width.
-    * @param in_descHeight  descriptor's Height. */
+    * @param in_descHeight  descriptor's Height.
+    * @param in_indexType   type of spatial index used for the main point cloud. */
     CRegDictionary();
-    CRegDictionary(float in_voxelSize, float in_r_max, float in_r_min, int in_descWidth, int in_descHeight);
+    CRegDictionary(float in_voxelSize, float in_r_max, float in_r_min, int in_descWidth, int in_descHeight,
+                   ESpatialIndexType in_indexType = SPATIAL_INDEX_HASH_2D);
 
     /** destructor */
     ~CRegDictionary();
@@ -194,6 +211,11 @@ namespace tpcl
     * @param in_d_sensor      final location of the grid points is set to be in_d_sensor above ground detected from the main cloud. */
     void DictionaryUpdate(const CPtCloud& in_pcl, float in_d_grid, float in_d_sensor);
 
+    /** removes the main cloud points, and the dictionary entries (with their descriptors) outside a 2D (x/y) box.
+    * @param in_minBox        minimum of the box to keep.
+    * @param in_maxBox        maximum of the box to keep. */
+    void CropDictionary(const CVec3& in_minBox, const CVec3& in_maxBox);
+
 
     /** Convert a point cloud into the entry's descriptor - range image, a polar map of distance around the entry's grid point.
     * @param in_pcl          point cloud.
@@ -246,6 +268,7 @@ namespace tpcl
     using COrientedGrid::DeleteAndSetVoxelSize;
     using COrientedGrid::PointCloudUpdate;
     using COrientedGrid::ViewpointGridUpdate;
+    using COrientedGrid::CropGrid;
   };
 
 
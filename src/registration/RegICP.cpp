@@ -1,27 +1,29 @@
 #include "RegICP.h"
-#include "SpatialHash.h"
+#include "SpatialIndex.h"
+#include "features.h"
+#include "AbsOrient.h"
 #include "common.h"
 #include <vector>
+#include <algorithm>  // nth_element
+#include <string.h>   // memcpy
 #include "../../include/vec.h"
 #include "../include/ptCloud.h"
 
-#define SIGN(a,b) ((b) >= 0.0 ? fabs(a) : -fabs(a))
-
-
 namespace tpcl
 {
   /** Try to find match in point cloud for another point.
-  * Currently we match by finding closest point within a given threshold radius ("inliers")
+  * We match by finding closest point within a given threshold radius ("inliers").
+  * (the point-to-plane metrics use the normals of the matches, see FindMatches())
   * @param in_pcl1    	    Spatial hashing of main point cloud.
   * @param in_p2            a point from 2nd point cloud.
-  * @param in_normal        !!curently not used!! - normal of the point to which we want to find a match.
+  * @param in_distThreshold inlier distance.
   * @param out_match         match found.
-  * @param indist           inline distance. 
+  * @param out_dist         distance to the match.
   * return                  true if a match was found, flase otherwise*/
-  bool MatchPoint(const CSpatialHash2D& in_pcl1, const CVec3& in_p2, const CVec3& in_normal, const double in_distThreshold, CVec3& out_match, double& out_dist)
+  bool MatchPoint(const ISpatialIndex& in_pcl1, const CVec3& in_p2, const double in_distThreshold, CVec3& out_match, double& out_dist)
   {
-    // go over retrieved list (if size = 0, return false), check if closer than in_distThreshold, update out_match if better normal match. return true.
-    if (in_pcl1.FindNearest(in_p2, &out_match, float(in_distThreshold))) // search nearest neighbor
+    // nearest neighbor within in_distThreshold (if none, return false).
+    if (in_pcl1.FindNearestIdx(in_p2, &out_match, float(in_distThreshold)) >= 0) // search nearest neighbor
     {
       // check if it is an inlier
       out_dist = Dist(in_p2, out_match);
@@ -33,493 +35,556 @@ namespace tpcl
   }
 
 
-  /** calculates pythagoras output = sqrt(a^2 + b^2) */
-  double pythag(double a, double b)
-  {
-    double absa, absb;
-    absa = fabs(a);
-    absb = fabs(b);
-    if (absa > absb)
-      return double(absa*sqrt(1.0 + pow(absb / absa, 2)));
-    else
-      return double((absb == 0.0 ? 0.0 : absb*sqrt(1.0 + pow(absa / absb, 2))));
-  }
+  typedef TVec3<double> CVec3D;
 
+  const int ICP_SUM_BLOCK_SIZE = 256;   // points per block of the sums of PerformIter (the blocks are summed pairwise)
 
-  // build bidiagonal form of using Householder reduction
-  void BiDiag(double io_U[3][3], double out_W[3], double out_V[3][3], double rv1[4])
+  /** weighting of the matches of an iteration (see ICP::SetRobustKernel(), ICP::SetTrimming()) */
+  struct CRobustParams
   {
-    // Householder reduction to bidiagonal form.
-    int i, j, k;
-    double f, g = 0, h, s;
+    EICPKernel m_kernel;
+    double m_scale;           ///< scale of the kernel
+    float m_trimFraction;     ///< fraction of the farthest matches rejected
+  };
 
-    for (i = 0; i<3; i++)
+  /** weight of a match by its residual (see EICPKernel) */
+  inline double KernelWeight(const CRobustParams& in_params, double in_res)
+  {
+    double r = fabs(in_res) / in_params.m_scale;
+    switch (in_params.m_kernel)
     {
-      rv1[i] = g;
-      g = s = 0.0;
-
-      // act on columns
-      for (k = i; k<3; k++)
-        s += io_U[k][i] * io_U[k][i];
-      if (s)
-      {
-        f = io_U[i][i];
-        g = -SIGN(sqrt(s), f);
-        h = f*g - s;
-        io_U[i][i] = f - g;
-        for (j = i + 1; j<3; j++)
-        {
-          for (s = 0.0, k = i; k<3; k++)
-            s += io_U[k][i] * io_U[k][j];
-          f = s / h;
-          for (k = i; k<3; k++)
-            io_U[k][j] += f*io_U[k][i];
-        }
-      }
-      out_W[i] = g;
+    case ICP_KERNEL_HUBER:   return (r <= 1) ? 1.0 : 1.0 / r;
+    case ICP_KERNEL_TUKEY:   return (r < 1) ? (1 - r * r) * (1 - r * r) : 0.0;
+    case ICP_KERNEL_CAUCHY:  return 1.0 / (1 + r * r);
+    default:                 return 1.0;
+    }
+  }
 
-      // act on rows
-      g = s = 0.0;
-      for (k = i + 1; k < 3; k++)
-        s += io_U[i][k] * io_U[i][k];
-      if (s)
+  /** sums over the matched points of a block of the 2nd cloud.
+   *  Raw moments of the points relative to a reference point: PerformIter corrects them for the centers at the end */
+  struct CMatchSums
+  {
+    double m_sum1[3];     ///< sum of the matches in the main cloud
+    double m_sum2[3];     ///< sum of the transformed points
+    double m_cross[9];    ///< sum of p2 * p1^T (row major)
+    double m_sqr2;        ///< sum of |p2|^2
+    double m_err;         ///< sum of the distances of the scored matches
+    double m_bound;       ///< sum of the error bounds of the approximate matches
+    double m_weight;      ///< sum of the weights of the matches (the sums of points are weighted)
+    int m_numMatches;     ///< number of points used for the registration
+    int m_numScored;      ///< number of points within the score distance
+
+    void Clear() { memset(this, 0, sizeof(CMatchSums)); }
+
+    void Add(const CMatchSums& in_sums)
+    {
+      for (int i = 0; i < 3; i++)
       {
-        f = io_U[i][i + 1];
-        g = -SIGN(sqrt(s), f);
-        h = f*g - s;
-        io_U[i][i + 1] = f - g;
-        for (k = i + 1; k<3; k++)
-          rv1[k] = io_U[i][k] / h;
-        for (j = i + 1; j<3; j++)
-        {
-          for (s = 0.0, k = i + 1; k<3; k++)
-            s += io_U[j][k] * io_U[i][k];
-          for (k = i + 1; k<3; k++)
-            io_U[j][k] += s*rv1[k];
-        }
+        m_sum1[i] += in_sums.m_sum1[i];
+        m_sum2[i] += in_sums.m_sum2[i];
       }
+      for (int i = 0; i < 9; i++)
+        m_cross[i] += in_sums.m_cross[i];
+      m_sqr2 += in_sums.m_sqr2;
+      m_err += in_sums.m_err;
+      m_bound += in_sums.m_bound;
+      m_weight += in_sums.m_weight;
+      m_numMatches += in_sums.m_numMatches;
+      m_numScored += in_sums.m_numScored;
     }
+  };
 
-    // Accumulation of right-hand transformations.
-    out_V[2][2] = 1.0;
-    g = rv1[2];
-    for (i = 2; i >= 0; i--)
+  /** sums over the matched points of a block of the 2nd cloud for the point-to-plane metrics.
+   *  The normal equations are linearized about a reference point: PerformIterPlane moves them to the center at the end */
+  struct CPlaneSums
+  {
+    double m_A[6][6];     ///< sum of w * J * J^T (upper triangle)
+    double m_b[6];        ///< sum of -w * J * residual
+    double m_sum[3];      ///< sum of the matched points
+    double m_sqr;         ///< sum of |p|^2 of the matched points
+    double m_err;         ///< sum of the distances of the scored matches
+    double m_bound;       ///< sum of the error bounds of the approximate matches
+    int m_numMatches;     ///< number of points used for the registration
+    int m_numScored;      ///< number of points within the score distance
+
+    void Clear() { memset(this, 0, sizeof(CPlaneSums)); }
+
+    void Add(const CPlaneSums& in_sums)
     {
-      if (g)
+      for (int r = 0; r < 6; r++)
       {
-        for (j = i + 1; j<3; j++)
-          out_V[j][i] = (io_U[i][j] / io_U[i][i + 1]) / g;   // Double division to avoid possible underflow.
-        for (j = i + 1; j<3; j++)
-        {
-          for (s = 0.0, k = i + 1; k<3; k++)
-            s += io_U[i][k] * out_V[k][j];
-          for (k = i + 1; k<3; k++)
-            out_V[k][j] += s*out_V[k][i];
-        }
+        for (int c = r; c < 6; c++)
+          m_A[r][c] += in_sums.m_A[r][c];
+        m_b[r] += in_sums.m_b[r];
       }
-      for (j = i + 1; j<3; j++)
-        out_V[i][j] = out_V[j][i] = 0.0;
-      out_V[i][i] = 1.0;
-      g = rv1[i];
+      for (int i = 0; i < 3; i++)
+        m_sum[i] += in_sums.m_sum[i];
+      m_sqr += in_sums.m_sqr;
+      m_err += in_sums.m_err;
+      m_bound += in_sums.m_bound;
+      m_numMatches += in_sums.m_numMatches;
+      m_numScored += in_sums.m_numScored;
     }
+  };
 
-    // Accumulation of left-hand transformations.
-    for (i = 2; i >= 0; i--)
+  /** pairwise (tree) summation of the sums of blocks: the rounding error grows with log(blocks).
+   *  the blocks are summed in place
+   * @return          the total (cleared if there are no blocks) */
+  template <class S> S SumBlocks(S* io_blocks, int in_numBlocks)
+  {
+    for (int l_step = 1; l_step < in_numBlocks; l_step *= 2)
+      for (int b = 0; b + l_step < in_numBlocks; b += 2 * l_step)
+        io_blocks[b].Add(io_blocks[b + l_step]);
+    S l_sums;
+    if (in_numBlocks > 0)
+      l_sums = io_blocks[0];
+    else
+      l_sums.Clear();
+    return l_sums;
+  }
+
+  /** buffers of the ICP iterations: one entry per point of the 2nd cloud.
+   *  Kept by ICP, so iterations (and registrations of clouds that are not larger) do not allocate */
+  struct CICPBuffers
+  {
+    std::vector<CVec3> m_transformed;     ///< points of the 2nd cloud transformed by R|t
+    std::vector<CVec3> m_nearest;         ///< their nearest points in the main cloud
+    std::vector<int> m_nearestIdx;        ///< indices of the nearest points (-1 = no match or not an inlier)
+    std::vector<float> m_nearestDistSqr;  ///< squared distances of the nearest points
+    std::vector<float> m_errBound;        ///< error bounds of approximate matches
+    std::vector<CMatchSums> m_blockSums;  ///< sums of each block of ICP_SUM_BLOCK_SIZE points
+    std::vector<CPlaneSums> m_planeSums;  ///< sums of each block of ICP_SUM_BLOCK_SIZE points (point-to-plane metrics)
+    std::vector<float> m_trimDistSqr;     ///< squared distances of the matches (partially sorted when trimming)
+
+    /** size the buffers for a cloud (std::vector keeps its capacity when shrinking) */
+    void Resize(int in_numPts)
     {
-      g = out_W[i];
-      for (j = i + 1; j<3; j++)
-        io_U[i][j] = 0.0;
-      if (g)
-      {
-        g = 1.0 / g;
-        for (j = i + 1; j<3; j++)
-        {
-          for (s = 0.0, k = i + 1; k<3; k++)
-            s += io_U[k][i] * io_U[k][j];
-          f = (s / io_U[i][i])*g;
-          for (k = i; k<3; k++)
-            io_U[k][j] += f*io_U[k][i];
-        }
-        for (j = i; j<3; j++)
-          io_U[j][i] *= g;
-      }
-      else
-        for (j = i; j<3; j++)
-          io_U[j][i] = 0.0;
-      ++io_U[i][i];
+      m_blockSums.resize((in_numPts + ICP_SUM_BLOCK_SIZE - 1) / ICP_SUM_BLOCK_SIZE);
+      m_planeSums.resize(m_blockSums.size());
+      m_transformed.resize(in_numPts);
+      m_nearest.resize(in_numPts);
+      m_nearestIdx.resize(in_numPts);
+      m_nearestDistSqr.resize(in_numPts);
+      m_errBound.resize(in_numPts);
+      m_trimDistSqr.resize(in_numPts);
     }
+  };
+
+
+  /** transform the points of the 2nd cloud by R|t and find their nearest neighbors in the main cloud (one batched query)
+   * @param in_approx       use approximate nearest neighbors (see ISpatialIndex::FindNearestApprox)
+   * @param io_buffers      buffers sized for the 2nd cloud (see CICPBuffers::Resize()) */
+  void FindMatches(const ISpatialIndex& in_pcl1, const CPtCloud& in_pcl2, const CMat4& in_Rt, float in_distThreshold, bool in_approx,
+                   CICPBuffers& io_buffers)
+  {
+    int l_numPts = in_pcl2.m_numPts;
+    CVec3* l_transformed = l_numPts > 0 ? &io_buffers.m_transformed[0] : 0;
+    #pragma omp parallel for
+    for (int i = 0; i < l_numPts; i++)
+      MultiplyVectorRightSidePlusOffset(in_Rt, in_pcl2.m_pos[i], l_transformed[i]);
+    if (l_numPts > 0 && in_approx)
+      in_pcl1.FindNearestApprox(l_transformed, l_numPts, &io_buffers.m_nearestIdx[0], &io_buffers.m_nearestDistSqr[0], in_distThreshold,
+                                &io_buffers.m_nearest[0], &io_buffers.m_errBound[0]);
+    else if (l_numPts > 0)
+      in_pcl1.FindKNearest(l_transformed, l_numPts, 1, &io_buffers.m_nearestIdx[0], &io_buffers.m_nearestDistSqr[0], in_distThreshold,
+                           &io_buffers.m_nearest[0]);
   }
 
 
+  /** squared distance up to which matches are kept when the farthest ones are trimmed
+   * @param in_maxDistSqr   matches at this (squared) distance or farther are rejected anyway
+   * @return                the distance of the farthest kept match, in_maxDistSqr if none is trimmed */
+  float TrimmedDistSqr(CICPBuffers& io_buffers, int in_numPts, float in_maxDistSqr, float in_trimFraction)
+  {
+    if (!(in_trimFraction > 0))
+      return in_maxDistSqr;
+    float* l_distSqr = in_numPts > 0 ? &io_buffers.m_trimDistSqr[0] : 0;
+    int l_num = 0;
+    for (int i = 0; i < in_numPts; i++)
+      if (io_buffers.m_nearestIdx[i] >= 0 && io_buffers.m_nearestDistSqr[i] < in_maxDistSqr)
+        l_distSqr[l_num++] = io_buffers.m_nearestDistSqr[i];
+    int l_keep = int(ceil((1 - in_trimFraction) * l_num));
+    if (l_keep <= 0 || l_keep >= l_num)
+      return in_maxDistSqr;
+    std::nth_element(l_distSqr, l_distSqr + l_keep - 1, l_distSqr + l_num);
+    return l_distSqr[l_keep - 1];
+  }
+
 
-  // compute the SVD of a 3x3 matrix
-  bool svd3x3(const double in_M[3][3], double out_U[3][3], double out_W[3], double out_V[3][3])
+  /** compose an iteration's change with R|t: R|t = R_|t_ * R|t
+   * @param in_center       center of the matched points
+   * @param in_spread       RMS distance of the matched points from their center
+   * @param out_pointShift  how far the change moves the matched points (see PerformIter())
+   * @return                size of the change (rotation and translation lengths) */
+  double ComposeChange(const CMat4& in_RChange, const CVec3& in_tChange, const CVec3& in_center, double in_spread,
+                       CMat4& io_Rt, double& out_pointShift)
   {
-    double w[3];
-    double rv1[3];
+    // the center of the matched points moves by RChange*center + tChange - center. |RChange - I| = 2*sqrt(2)*sin(angle/2)
+    CMat4 RChange = in_RChange;
+    CVec3 R_mut; MultiplyVectorRightSide(RChange, in_center, R_mut);
+    double l_rotDiff = 0;
+    for (int r = 0; r < 3; ++r)
+      for (int c = 0; c < 3; ++c)
+      {
+        double d = RChange.m[r][c] - ((r == c) ? 1.0 : 0.0);
+        l_rotDiff += d * d;
+      }
+    out_pointShift = Length(R_mut + in_tChange - in_center) + sqrt(l_rotDiff * 0.5) * in_spread;
 
-    int flag, i, its, j, jj, k, nm;
-    double c, f, g, h, s, x, y, z;
+    io_Rt = RChange * io_Rt;
+    CVec3 t(io_Rt.m[3][0], io_Rt.m[3][1], io_Rt.m[3][2]);
+    MultiplyVectorRightSide(RChange, t, R_mut);
+    t = R_mut + in_tChange;
+    io_Rt.m[3][0] = t.x;    io_Rt.m[3][1] = t.y;    io_Rt.m[3][2] = t.z; io_Rt.m[3][3] = 1;
 
-    for (i = 0; i < 9; ++i)
-      out_U[0][i] = in_M[0][i];
+    // return max delta in parameters
+    RChange.m[3][0] = in_tChange.x;    RChange.m[3][1] = in_tChange.y;    RChange.m[3][2] = in_tChange.z;
+    double length_mat, length_vec;
+    Lengths(RChange, length_mat, length_vec);
+    return length_mat + length_vec;
+  }
+
+
+  /** error bound of an iteration's approximate matches: their average error bound, plus the search radius
+   *  for the fraction of the points left unmatched (an approximate query may miss a neighbor within the radius)
+   * @return                0 if the matches are exact */
+  double ApproxError(bool in_approx, double in_sumBound, int in_numMatches, int in_numUnmatched, int in_numPts, double in_radius)
+  {
+    if (!in_approx || in_numPts <= 0)
+      return 0;
+    double l_bound = (in_numMatches > 0) ? in_sumBound / in_numMatches : 0;
+    return l_bound + in_radius * in_numUnmatched / in_numPts;
+  }
 
-    // convert to bidiagonal form
-    BiDiag(out_U, w, out_V, rv1);
 
-    // claculate scale of stuff
-    double anorm = fabs(w[0]) + fabs(rv1[0]);
-    anorm = MaxT(anorm, fabs(w[1]) + fabs(rv1[1]));
-    anorm = MaxT(anorm, fabs(w[2]) + fabs(rv1[2]));
+  /** one ICP iteration
+   * @param in_approx       use approximate nearest neighbors (see ISpatialIndex::FindNearestApprox)
+   * @param in_robust       weighting and trimming of the matches
+   * @param io_buffers      buffers sized for the 2nd cloud (see CICPBuffers::Resize())
+   * @param out_pointShift  how far the iteration moved the matched points: shift of their center
+   *                        plus the rotation at their RMS distance from the center
+   * @param out_approxError average error bound of the approximate matches (0 if exact) */
+  void PerformIter(ISpatialIndex& in_pcl1, const CPtCloud& in_pcl2, CMat4& io_Rt, const float in_regRes, bool in_approx,
+                   const CRobustParams& in_robust, CICPBuffers& io_buffers,
+                   double& out_transformationChange, double& out_PreviousFitnessScore, double& out_pointShift, double& out_approxError)
+  {
+    //double l_distThreshold = 2 * in_regRes;
+    double l_scoreDistThreshold = 2 * in_regRes;
+    double l_regDistThreshold = 2 * in_regRes;   //l_regDistThreshold <= l_scoreDistThreshold
 
-    // Diagonalization of the bidiagonal form: Loop over singular values
-    for (k = 2; k >= 0; k--)
+    // transform the points according to R|t and find all nearest neighbors in one batched query
+    int l_numPts = in_pcl2.m_numPts;
+    FindMatches(in_pcl1, in_pcl2, io_Rt, float(l_scoreDistThreshold), in_approx, io_buffers);
+    const CVec3* l_transformed = l_numPts > 0 ? &io_buffers.m_transformed[0] : 0;
+    const CVec3* l_nearest = l_numPts > 0 ? &io_buffers.m_nearest[0] : 0;
+    const int* l_nearestIdx = l_numPts > 0 ? &io_buffers.m_nearestIdx[0] : 0;
+    const float* l_nearestDistSqr = l_numPts > 0 ? &io_buffers.m_nearestDistSqr[0] : 0;
+    const float* l_errBound = l_numPts > 0 ? &io_buffers.m_errBound[0] : 0;
+    CMatchSums* l_blockSums = l_numPts > 0 ? &io_buffers.m_blockSums[0] : 0;
+    int l_numBlocks = (l_numPts + ICP_SUM_BLOCK_SIZE - 1) / ICP_SUM_BLOCK_SIZE;
+    float l_trimDistSqr = TrimmedDistSqr(io_buffers, l_numPts, float(l_regDistThreshold * l_regDistThreshold), in_robust.m_trimFraction);
+
+    // the points are summed relative to a point of the cloud, so that the raw moments stay small even
+    // for far away (e.g. geo-referenced) coordinates
+    CVec3 l_ref = l_numPts > 0 ? l_transformed[0] : CVec3(0, 0, 0);
+
+    // one pass over the correspondences: sums of each block of points
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int b = 0; b < l_numBlocks; b++)
     {
-      // and over allowed iterations.
-      for (its = 0; its<30; its++)
+      CMatchSums& l_sums = l_blockSums[b];
+      l_sums.Clear();
+      int l_end = MinT(l_numPts, (b + 1) * ICP_SUM_BLOCK_SIZE);
+      for (int i = b * ICP_SUM_BLOCK_SIZE; i < l_end; i++)
       {
-        flag = 1;
-        int l;
-        // Test for splitting.
-        for (l = k; l >= 0; l--)
-        {
-          nm = l - 1;
-          if ((double)(fabs(rv1[l]) + anorm) == anorm)
-          {
-            flag = 0;
-            break;
-          }
-          if ((double)(fabs(w[nm]) + anorm) == anorm)
-          {
-            break;
-          }
-        }
-        if (flag)
-        {
-          c = 0.0; // Cancellation of rv1[l], if l > 1.
-          s = 1.0;
-          for (i = l; i <= k; i++)
-          {
-            f = s*rv1[i];
-            rv1[i] = c*rv1[i];
-            if ((double)(fabs(f) + anorm) == anorm)
-              break;
-            g = w[i];
-            h = pythag(f, g);
-            w[i] = h;
-            h = 1.0 / h;
-            c = g*h;
-            s = -f*h;
-            for (j = 0; j<3; j++)
-            {
-              y = out_U[j][nm];
-              z = out_U[j][i];
-              out_U[j][nm] = y*c + z*s;
-              out_U[j][i] = z*c - y*s;
-            }
-          }
-        }
-        z = w[k];
-        if (l == k)
-        { // Convergence.
-          if (z<0.0)
-          { // Singular value is made nonnegative.
-            w[k] = -z;
-            for (j = 0; j<3; j++)
-              out_V[j][k] = -out_V[j][k];
-          }
-          break;
-        }
-        if (its == 29)
-          return false; // No convergence
-        x = w[l]; // Shift from bottom 2-by-2 minor.
-        nm = k - 1;
-        y = w[nm];
-        g = rv1[nm];
-        h = rv1[k];
-        f = ((y - z)*(y + z) + (g - h)*(g + h)) / (2.f*h*y);
-        g = pythag(f, 1.0);
-        f = ((x - z)*(x + z) + h*((y / (f + SIGN(g, f))) - h)) / x;
-        c = s = 1.0; // Next QR transformation:
-        for (j = l; j <= nm; j++)
+        // nearest neighbor must be an inlier
+        if (l_nearestIdx[i] < 0)
+          continue;   // no nearest point within radius
+        double l_dist = sqrt(double(l_nearestDistSqr[i]));
+        if (!(l_dist < l_scoreDistThreshold))
+          continue;
+
+        l_sums.m_err += Dist(l_transformed[i], l_nearest[i]);
+        l_sums.m_numScored++;
+
+        if (!(l_dist < l_regDistThreshold) || l_nearestDistSqr[i] > l_trimDistSqr)
+          continue;
+
+        if (in_approx)
+          l_sums.m_bound += l_errBound[i];
+        double w = KernelWeight(in_robust, l_dist);
+        CVec3 pt1 = l_nearest[i] - l_ref;
+        CVec3 pt2 = l_transformed[i] - l_ref;
+        double p1[3] = { pt1.x, pt1.y, pt1.z };
+        double p2[3] = { w * pt2.x, w * pt2.y, w * pt2.z };   // (weighted)
+        for (int r = 0; r < 3; r++)
         {
-          i = j + 1;
-          g = rv1[i];
-          y = w[i];
-          h = s*g;
-          g = c*g;
-          z = pythag(f, h);
-          rv1[j] = z;
-          c = f / z;
-          s = h / z;
-          f = x*c + g*s;
-          g = g*c - x*s;
-          h = y*s;
-          y *= c;
-          for (jj = 0; jj<3; jj++)
-          {
-            x = out_V[jj][j];
-            z = out_V[jj][i];
-            out_V[jj][j] = x*c + z*s;
-            out_V[jj][i] = z*c - x*s;
-          }
-          z = pythag(f, h);
-          w[j] = z; // Rotation can be arbitrary if z = 0.
-          if (z)
-          {
-            z = 1.0 / z;
-            c = f*z;
-            s = h*z;
-          }
-          f = c*g + s*y;
-          x = c*y - s*g;
-          for (jj = 0; jj<3; jj++)
-          {
-            y = out_U[jj][j];
-            z = out_U[jj][i];
-            out_U[jj][j] = y*c + z*s;
-            out_U[jj][i] = z*c - y*s;
-          }
+          l_sums.m_sum1[r] += w * p1[r];
+          l_sums.m_sum2[r] += p2[r];
+          for (int c = 0; c < 3; c++)
+            l_sums.m_cross[3 * r + c] += p2[r] * p1[c];
         }
-        rv1[l] = 0.0;
-        rv1[k] = f;
-        w[k] = x;
+        l_sums.m_sqr2 += p2[0] * pt2.x + p2[1] * pt2.y + p2[2] * pt2.z;
+        l_sums.m_weight += w;
+        l_sums.m_numMatches++;
       }
     }
 
-    // sort singular values and corresponding columns of u and v
-    // by decreasing magnitude. Also, signs of corresponding columns are
-    // flipped so as to maximize the number of positive elements.
-    int s2;
-    double   sw;
-    double su[3];
-    double sv[3];
-    for (i = 1; i<3; i++)
-    {
-      sw = w[i];
-      for (k = 0; k<3; k++)
-        su[k] = out_U[k][i];
-      for (k = 0; k<3; k++)
-        sv[k] = out_V[k][i];
-      j = i;
-      while (w[j - 1] < sw)
-      {
-        w[j] = w[j - 1];
-        for (k = 0; k<3; k++)
-          out_U[k][j] = out_U[k][j - 1];
-        for (k = 0; k<3; k++)
-          out_V[k][j] = out_V[k][j - 1];
-        j -= 1;
-        if (j < 1) break;
-      }
-      w[j] = sw;
-      for (k = 0; k<3; k++)
-        out_U[k][j] = su[k];
-      for (k = 0; k<3; k++)
-        out_V[k][j] = sv[k];
-    }
+    // pairwise (tree) summation of the blocks
+    CMatchSums l_sums = SumBlocks(l_blockSums, l_numBlocks);
 
-    // flip signs
-    for (k = 0; k<3; k++)
+    // compute center of mass (weighted average) from sums
+    //TODO: see if matchSize == 0 -> Zero points were matched with current registration
+    int matchSize = l_sums.m_numMatches;
+    double l_weight = l_sums.m_weight;
+    out_PreviousFitnessScore = l_sums.m_err / l_sums.m_numScored;
+    out_approxError = ApproxError(in_approx, l_sums.m_bound, matchSize, l_numPts - l_sums.m_numScored, l_numPts, l_scoreDistThreshold);
+    if (matchSize > 0 && !(l_weight > 0))
     {
-      s2 = 0;
-      for (i = 0; i<3; i++)
-        if (out_U[i][k] < 0.0)
-          s2++;
-      for (j = 0; j<3; j++)
-        if (out_V[j][k] < 0.0)
-          s2++;
-      if (s2 > 3)
-      {
-        for (i = 0; i<3; i++)
-          out_U[i][k] = -out_U[i][k];
-        for (j = 0; j<3; j++)
-          out_V[j][k] = -out_V[j][k];
-      }
+      out_transformationChange = out_pointShift = 0;   // all the matches have zero weight (ICP_KERNEL_TUKEY)
+      return;
     }
-
-    // create vector and copy singular values
+    CVec3D l_massCenter1(l_sums.m_sum1[0], l_sums.m_sum1[1], l_sums.m_sum1[2]);   // (relative to l_ref)
+    CVec3D l_massCenter2(l_sums.m_sum2[0], l_sums.m_sum2[1], l_sums.m_sum2[2]);
+    l_massCenter1 /= l_weight;
+    l_massCenter2 /= l_weight;
+    CVec3 l_massCenter1f = CVec3(float(l_massCenter1.x), float(l_massCenter1.y), float(l_massCenter1.z)) + l_ref;
+    CVec3 l_massCenter2f = CVec3(float(l_massCenter2.x), float(l_massCenter2.y), float(l_massCenter2.z)) + l_ref;
+
+    // relative rotation from the moments of the points about their centers: sum((p2-c2)(p1-c1)^T) = sum(p2 p1^T) - n c2 c1^T
+    double c1[3] = { l_massCenter1.x, l_massCenter1.y, l_massCenter1.z };
+    double c2[3] = { l_massCenter2.x, l_massCenter2.y, l_massCenter2.z };
+    double H[9];
     for (int r = 0; r < 3; r++)
-      out_W[r] = w[r];
-    return true;
+      for (int c = 0; c < 3; c++)
+        H[3 * r + c] = l_sums.m_cross[3 * r + c] - l_weight * c2[r] * c1[c];
+    // (weighted) sum of squared distances of the matched points from their center
+    double l_spreadSqr = MaxT(0.0, l_sums.m_sqr2 - l_weight * (c2[0] * c2[0] + c2[1] * c2[1] + c2[2] * c2[2]));
+
+    // (identity if the rotation is not unique, e.g. all matches on a line)
+    CMat4 RChange;
+    AbsoluteOrientation(H, RChange);
+
+    CVec3 R_mut; MultiplyVectorRightSide(RChange, l_massCenter2f, R_mut);
+    CVec3 tChange = l_massCenter1f - R_mut;
+
+    // (the center of the matched points moves to l_massCenter1f)
+    double l_spread = (matchSize > 0) ? sqrt(l_spreadSqr / l_weight) : 0;
+    out_transformationChange = ComposeChange(RChange, tChange, l_massCenter2f, l_spread, io_Rt, out_pointShift);
   }
 
 
-  bool svd3x3(double* in_M, CMat4& out_U, CMat4& out_W, CMat4& out_V)
+  /** solve A*x = b for a symmetric positive semi-definite 6x6 matrix (LDL^T decomposition).
+   *  directions that A does not constrain (tiny pivots, e.g. sliding along a single plane) get no change. */
+  void SolveSymmetric6x6(const double in_A[6][6], const double in_b[6], double out_x[6])
   {
-    const int M1size = 3;
-    double M[M1size][M1size] = { 0 };
-    double U[M1size][M1size] = { 0 };
-    double W[M1size] = { 0 };
-    double V[M1size][M1size] = { 0 };
+    double L[6][6] = { { 0 } };
+    double D[6], invD[6];
+    double l_maxDiag = 0;
+    for (int i = 0; i < 6; i++)
+      l_maxDiag = MaxT(l_maxDiag, in_A[i][i]);
 
-    for (int row = 0; row < M1size; row++)
+    for (int j = 0; j < 6; j++)
     {
-      for (int col = 0; col < M1size; col++)
+      D[j] = in_A[j][j];
+      for (int k = 0; k < j; k++)
+        D[j] -= L[j][k] * L[j][k] * D[k];
+      invD[j] = (D[j] > 1e-12 * l_maxDiag) ? 1.0 / D[j] : 0.0;
+      L[j][j] = 1;
+      for (int i = j + 1; i < 6; i++)
       {
-        M[row][col] = in_M[row*M1size + col];
+        double v = in_A[i][j];
+        for (int k = 0; k < j; k++)
+          v -= L[i][k] * L[j][k] * D[k];
+        L[i][j] = v * invD[j];
       }
     }
-    bool convergence = svd3x3(M, U, W, V);
 
-    if (convergence)
+    double y[6];
+    for (int i = 0; i < 6; i++)
     {
-      for (int row = 0; row < M1size; row++)
-      {
-        for (int col = 0; col < M1size; col++)
-        {
-          out_U.m[row][col] = (float)U[row][col];
-          out_W.m[row][col] = 0.f;
-          out_V.m[row][col] = (float)V[row][col];
-        }
-        out_W.m[row][row] = (float)W[row];
-      }
+      y[i] = in_b[i];
+      for (int k = 0; k < i; k++)
+        y[i] -= L[i][k] * y[k];
+    }
+    for (int i = 5; i >= 0; i--)
+    {
+      out_x[i] = y[i] * invD[i];
+      for (int k = i + 1; k < 6; k++)
+        out_x[i] -= L[k][i] * out_x[k];
+    }
+  }
+
 
-      for (int i = 0; i < M1size; ++i)
+  /** rotation matrix of a rotation vector (axis * angle) */
+  CMat4 RotationFromVector(const CVec3D& in_rot)
+  {
+    double l_angle = Length(in_rot);
+    double s = (l_angle > 1e-12) ? sin(l_angle) / l_angle : 1.0;
+    double c = (l_angle > 1e-12) ? (1 - cos(l_angle)) / (l_angle * l_angle) : 0.5;
+    double K[3][3] = { { 0, -in_rot.z, in_rot.y }, { in_rot.z, 0, -in_rot.x }, { -in_rot.y, in_rot.x, 0 } };
+    CMat4 R; MatrixIdentity(&R);
+    for (int r = 0; r < 3; ++r)
+      for (int col = 0; col < 3; ++col)
       {
-        out_U.m[M1size][i] = out_U.m[i][M1size] = 0.f;
-        out_W.m[M1size][i] = out_W.m[i][M1size] = 0.f;
-        out_V.m[M1size][i] = out_V.m[i][M1size] = 0.f;
+        double K2 = K[r][0] * K[0][col] + K[r][1] * K[1][col] + K[r][2] * K[2][col];
+        R.m[r][col] = float(((r == col) ? 1.0 : 0.0) + s * K[r][col] + c * K2);
       }
-      out_U.m[M1size][M1size] = out_W.m[3][3] = out_V.m[M1size][M1size] = 1.f;
-    }
-
-    return convergence;
+    return R;
   }
 
 
-  typedef TVec3<double> CVec3D;
-
-  void PerformIter(CSpatialHash2D& in_pcl1, const CPtCloud& in_pcl2, CMat4& io_Rt, const float in_regRes, double& out_transformationChange, double& out_PreviousFitnessScore)
+  /** one point-to-plane ICP iteration: minimizes the distances of the points from the planes of their matches
+   *  (linearized rotation about the center of the matches, 6x6 normal equations).
+   *  parameters and outputs are as in PerformIter(). The kernel weights the distances from the planes.
+   * @param in_normals1     normals of the main cloud points (by point index)
+   * @param in_symmetric    use the average of the normals of both points (if the 2nd cloud has normals) */
+  void PerformIterPlane(ISpatialIndex& in_pcl1, const CVec3* in_normals1, const CPtCloud& in_pcl2, CMat4& io_Rt, const float in_regRes,
+                        bool in_approx, bool in_symmetric, const CRobustParams& in_robust, CICPBuffers& io_buffers,
+                        double& out_transformationChange, double& out_PreviousFitnessScore, double& out_pointShift, double& out_approxError)
   {
-    //double l_distThreshold = 2 * in_regRes;
     double l_scoreDistThreshold = 2 * in_regRes;
-    double l_regDistThreshold = 2 * in_regRes;   //l_regDistThreshold <= l_scoreDistThreshold
-    double l_accError = 0;
-    // extract matrix and translation vector
-    CVec3D l_massCenter1(0, 0 ,0), l_massCenter2(0, 0, 0);  // center of masses for both clouds (as doubles)
-    CVec3 l_massCenter1f, l_massCenter2f;   // center of masses in floats
-    int matchSize = 0;
-    int accErrorSize = 0;
-
-    double H[9] = { 0 };
-
-    #pragma omp parallel
+    bool l_symmetric = in_symmetric && (in_pcl2.m_normal != 0);
+
+    int l_numPts = in_pcl2.m_numPts;
+    FindMatches(in_pcl1, in_pcl2, io_Rt, float(l_scoreDistThreshold), in_approx, io_buffers);
+    const CVec3* l_transformed = l_numPts > 0 ? &io_buffers.m_transformed[0] : 0;
+    const CVec3* l_nearest = l_numPts > 0 ? &io_buffers.m_nearest[0] : 0;
+    const int* l_nearestIdx = l_numPts > 0 ? &io_buffers.m_nearestIdx[0] : 0;
+    const float* l_nearestDistSqr = l_numPts > 0 ? &io_buffers.m_nearestDistSqr[0] : 0;
+    const float* l_errBound = l_numPts > 0 ? &io_buffers.m_errBound[0] : 0;
+    CPlaneSums* l_blockSums = l_numPts > 0 ? &io_buffers.m_planeSums[0] : 0;
+    int l_numBlocks = (l_numPts + ICP_SUM_BLOCK_SIZE - 1) / ICP_SUM_BLOCK_SIZE;
+
+    float l_trimDistSqr = TrimmedDistSqr(io_buffers, l_numPts, float(l_scoreDistThreshold * l_scoreDistThreshold), in_robust.m_trimFraction);
+
+    // the rotation is linearized about a point of the cloud (so that the sums stay small even for far away
+    // coordinates). Moving it to the center of the matches (see below) only changes the rotation rows of J
+    CVec3 l_ref = l_numPts > 0 ? l_transformed[0] : CVec3(0, 0, 0);
+
+    // one pass over the correspondences: sums of each block of points
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int b = 0; b < l_numBlocks; b++)
     {
-      CVec3D partialMC1(0, 0, 0), partialMC2(0, 0, 0);
-      double partialH[9] = { 0 };
-      CVec3* pts1Matched = new CVec3[in_pcl2.m_numPts];
-      CVec3* pts2Matched = new CVec3[in_pcl2.m_numPts]; //and transformed.
-      int numPts = 0;
-
-      // establish correspondences
-      #pragma omp for reduction(+:matchSize, accErrorSize, l_accError)
-      for (int i = 0; i<in_pcl2.m_numPts; i++)
+      CPlaneSums& l_sums = l_blockSums[b];
+      l_sums.Clear();
+      int l_end = MinT(l_numPts, (b + 1) * ICP_SUM_BLOCK_SIZE);
+      for (int i = b * ICP_SUM_BLOCK_SIZE; i < l_end; i++)
       {
-        // transform point according to R|t
-        MultiplyVectorRightSidePlusOffset(io_Rt, in_pcl2.m_pos[i], pts2Matched[numPts]);
-
-
-        // search nearest neighbor
-        CVec3 normal(0, 0, 1);
-        double l_dist;
-        if (!MatchPoint(in_pcl1, pts2Matched[numPts], normal, l_scoreDistThreshold, pts1Matched[numPts], l_dist))
-          continue;   // no nearest point within radius
-        
-        l_accError += Dist(pts2Matched[numPts], pts1Matched[numPts]);
-        accErrorSize++;
-
-        if (!(l_dist < l_regDistThreshold))
+        if (l_nearestIdx[i] < 0 || !(l_nearestDistSqr[i] < l_scoreDistThreshold * l_scoreDistThreshold))
           continue;
+        l_sums.m_err += sqrt(double(l_nearestDistSqr[i]));
+        l_sums.m_numScored++;
+        if (l_nearestDistSqr[i] > l_trimDistSqr)
+          continue;   // trimmed
 
-        partialMC1 += CVec3D(pts1Matched[numPts].x, pts1Matched[numPts].y, pts1Matched[numPts].z);
-        partialMC2 += CVec3D(pts2Matched[numPts].x, pts2Matched[numPts].y, pts2Matched[numPts].z);
-
-        matchSize++;
-        numPts++;
-      }
-
-      #pragma omp critical
-      {
-        l_massCenter1 += partialMC1;
-        l_massCenter2 += partialMC2;
-      }
-
-      #pragma omp barrier 
-      // compute center of mass (average) from sums
-      #pragma omp master
-      {
-        //TODO: see if matchSize == 0 -> Zero points were matched with current registration
+        CVec3 n = in_normals1[l_nearestIdx[i]];
+        if (l_symmetric)
+        {
+          CVec3 n2; MultiplyVectorRightSide(io_Rt, in_pcl2.m_normal[i], n2);
+          if (DotProd(n, n2) < 0)
+            n2 = n2 * -1.0f;
+          n += n2;
+          Normalize(n);
+        }
 
-        out_PreviousFitnessScore = l_accError / accErrorSize;
-        l_massCenter1 /= (double)matchSize;
-        l_massCenter2 /= (double)matchSize;
-        l_massCenter1f = CVec3(float(l_massCenter1.x), float(l_massCenter1.y), float(l_massCenter1.z));
-        l_massCenter2f = CVec3(float(l_massCenter2.x), float(l_massCenter2.y), float(l_massCenter2.z));
+        // residual and its derivatives by (rotation vector, translation)
+        CVec3 p = l_transformed[i] - l_ref;
+        double l_res = DotProd(l_transformed[i] - l_nearest[i], n);
+        CVec3 pxn = CrossProd(p, n);
+        double J[6] = { pxn.x, pxn.y, pxn.z, n.x, n.y, n.z };
+        double w = KernelWeight(in_robust, l_res);
+        for (int r = 0; r < 6; r++)
+        {
+          for (int c = r; c < 6; c++)
+            l_sums.m_A[r][c] += w * J[r] * J[c];
+          l_sums.m_b[r] -= w * J[r] * l_res;
+        }
+        l_sums.m_sum[0] += p.x;
+        l_sums.m_sum[1] += p.y;
+        l_sums.m_sum[2] += p.z;
+        l_sums.m_sqr += double(LengthSqr(p));
+        if (in_approx)
+          l_sums.m_bound += l_errBound[i];
+        l_sums.m_numMatches++;
       }
-      #pragma omp barrier
+    }
 
-      // subtract center of mass
-      //#pragma omp for 
-      for (int i = 0; i < numPts; i++)
-      {
-        pts1Matched[i] -= l_massCenter1f;
-        pts2Matched[i] -= l_massCenter2f;
-      }
+    // pairwise (tree) summation of the blocks
+    CPlaneSums l_sums = SumBlocks(l_blockSums, l_numBlocks);
+    int matchSize = l_sums.m_numMatches;
+    out_PreviousFitnessScore = (l_sums.m_numScored > 0) ? l_sums.m_err / l_sums.m_numScored : 0;
+    out_approxError = ApproxError(in_approx, l_sums.m_bound, matchSize, l_numPts - l_sums.m_numScored, l_numPts, l_scoreDistThreshold);
+    if (matchSize < 6)
+    {
+      out_transformationChange = out_pointShift = 0;   // not enough matches to constrain R|t
+      return;
+    }
 
-      // compute relative rotation matrix R and translation vector t
-      for (int i = 0; i < numPts; i++)
+    // center of the matches (the linearization point of the rotation), relative to l_ref
+    CVec3D l_center(l_sums.m_sum[0], l_sums.m_sum[1], l_sums.m_sum[2]);
+    l_center /= (double)matchSize;
+    CVec3 l_centerf = CVec3(float(l_center.x), float(l_center.y), float(l_center.z)) + l_ref;
+    double l_spread = sqrt(MaxT(l_sums.m_sqr / matchSize - LengthSqr(l_center), 0.0));
+
+    // about the center the rotation rows of J are (p - c) x n = p x n - c x n: J = T * J_ref with
+    // T = [I -[c]x; 0 I], so A = T * A_ref * T^T and b = T * b_ref
+    double A[6][6], b[6];
+    for (int r = 0; r < 6; r++)
+      for (int c = 0; c < 6; c++)
+        A[r][c] = (c >= r) ? l_sums.m_A[r][c] : l_sums.m_A[c][r];
+    double T[6][6] = { { 0 } };
+    for (int r = 0; r < 6; r++)
+      T[r][r] = 1;
+    T[0][4] =  l_center.z;  T[0][5] = -l_center.y;
+    T[1][3] = -l_center.z;  T[1][5] =  l_center.x;
+    T[2][3] =  l_center.y;  T[2][4] = -l_center.x;
+    double TA[6][6];
+    for (int r = 0; r < 6; r++)
+    {
+      b[r] = 0;
+      for (int c = 0; c < 6; c++)
       {
-        partialH[0] += double(pts2Matched[i].x * pts1Matched[i].x); partialH[1] += double(pts2Matched[i].x * pts1Matched[i].y); partialH[2] += double(pts2Matched[i].x * pts1Matched[i].z);
-        partialH[3] += double(pts2Matched[i].y * pts1Matched[i].x); partialH[4] += double(pts2Matched[i].y * pts1Matched[i].y); partialH[5] += double(pts2Matched[i].y * pts1Matched[i].z);
-        partialH[6] += double(pts2Matched[i].z * pts1Matched[i].x); partialH[7] += double(pts2Matched[i].z * pts1Matched[i].y); partialH[8] += double(pts2Matched[i].z * pts1Matched[i].z);
+        TA[r][c] = 0;
+        for (int k = 0; k < 6; k++)
+          TA[r][c] += T[r][k] * A[k][c];
+        b[r] += T[r][c] * l_sums.m_b[c];
       }
-
-      #pragma omp critical
+    }
+    for (int r = 0; r < 6; r++)
+      for (int c = 0; c < 6; c++)
       {
-        H[0] += partialH[0]; H[1] += partialH[1]; H[2] += partialH[2];
-        H[3] += partialH[3]; H[4] += partialH[4]; H[5] += partialH[5];
-        H[6] += partialH[6]; H[7] += partialH[7]; H[8] += partialH[8];
+        A[r][c] = 0;
+        for (int k = 0; k < 6; k++)
+          A[r][c] += TA[r][k] * T[c][k];
       }
 
-      delete[] pts1Matched;
-      delete[] pts2Matched;
-    } // omp
+    double x[6];
+    SolveSymmetric6x6(A, b, x);
 
-    CMat4 U, W, V;
-    svd3x3(H, U, W, V);
-
-    CMat4 TranU; Transpose(U, TranU);
-    CMat4 RChange = V * TranU;
-
-    double det = MatrixDeterminant(&RChange);
-    // fix improper matrix problem
-    if (det<0) {
-      CMat4 B; MatrixIdentity(&B);
-      B.m[2][2] = float(det);
-      RChange = V*B*TranU;
-    }
-
-    CVec3 R_mut; MultiplyVectorRightSide(RChange, l_massCenter2f, R_mut);
-    CVec3 tChange = l_massCenter1f - R_mut;
-
-    // compose: R|t = R_|t_ * R|t
-    io_Rt = RChange * io_Rt;
-    CVec3 t(io_Rt.m[3][0], io_Rt.m[3][1], io_Rt.m[3][2]);
-    MultiplyVectorRightSide(RChange, t, R_mut);
-    t = R_mut + tChange;
-    io_Rt.m[3][0] = t.x;    io_Rt.m[3][1] = t.y;    io_Rt.m[3][2] = t.z; io_Rt.m[3][3] = 1;
+    // p -> center + R*(p - center) + t
+    CMat4 RChange = RotationFromVector(CVec3D(x[0], x[1], x[2]));
+    CVec3 R_mut; MultiplyVectorRightSide(RChange, l_centerf, R_mut);
+    CVec3 tChange = l_centerf - R_mut + CVec3(float(x[3]), float(x[4]), float(x[5]));
+    out_transformationChange = ComposeChange(RChange, tChange, l_centerf, l_spread, io_Rt, out_pointShift);
+  }
 
-    // return max delta in parameters
-    RChange.m[3][0] = tChange.x;    RChange.m[3][1] = tChange.y;    RChange.m[3][2] = tChange.z;
-    double length_mat, length_vec;
-    Lengths(RChange, length_mat, length_vec);
 
-    out_transformationChange = length_mat + length_vec;
+  /** one ICP iteration with the given metric (point-to-point if there are no normals) */
+  void Iterate(ISpatialIndex& in_pcl1, const CVec3* in_normals1, EICPMetric in_metric, const CPtCloud& in_pcl2, CMat4& io_Rt, const float in_regRes,
+               bool in_approx, const CRobustParams& in_robust, CICPBuffers& io_buffers,
+               double& out_transformationChange, double& out_PreviousFitnessScore, double& out_pointShift, double& out_approxError)
+  {
+    if (in_metric == ICP_POINT_TO_POINT || in_normals1 == 0)
+      PerformIter(in_pcl1, in_pcl2, io_Rt, in_regRes, in_approx, in_robust, io_buffers,
+                  out_transformationChange, out_PreviousFitnessScore, out_pointShift, out_approxError);
+    else
+      PerformIterPlane(in_pcl1, in_normals1, in_pcl2, io_Rt, in_regRes, in_approx, in_metric == ICP_SYMMETRIC, in_robust, io_buffers,
+                       out_transformationChange, out_PreviousFitnessScore, out_pointShift, out_approxError);
   }
 
 
-  double FinalError(CSpatialHash2D& in_pcl1, const CPtCloud& in_pcl2, const CMat4& in_Rt, const double in_scoreDistThreshold)
+  double FinalError(ISpatialIndex& in_pcl1, const CPtCloud& in_pcl2, const CMat4& in_Rt, const double in_scoreDistThreshold)
   {
     double l_accError = 0;
     int accErrorSize = 0;
@@ -533,9 +598,8 @@ namespace tpcl
       // transform point according to R|t
       MultiplyVectorRightSidePlusOffset(in_Rt, in_pcl2.m_pos[i], transformedPt);
       // search for match
-      CVec3 normal(0, 0, 1);
       double dist;
-      if (!MatchPoint(in_pcl1, transformedPt, normal, in_scoreDistThreshold, closestPt, dist))
+      if (!MatchPoint(in_pcl1, transformedPt, in_scoreDistThreshold, closestPt, dist))
         continue;
       l_accError += Dist(transformedPt, closestPt);
       accErrorSize++;
@@ -557,36 +621,108 @@ namespace tpcl
     initMembers();
   }
 
-  ICP::ICP(float in_regRes)
+  ICP::ICP(float in_regRes, ESpatialIndexType in_indexType)
   {
-    initMembers();
-    m_regRes = in_regRes;
+    initMembers(in_regRes, in_indexType);
   }
 
   ICP::~ICP()
   {
+    delete (CICPBuffers*)m_iterBuffers;
     if (!m_outsourceMainPC)
       delete m_mainHashed;
+    delete[] m_mainPcl.m_pos;
+    delete[] m_mainPcl.m_normal;
   }
 
   void ICP::SetMainPtCloud(const CPtCloud& in_pcl, bool in_append)
   {
     if (m_outsourceMainPC)
     {
-      m_mainHashed = new CSpatialHash2D(m_regRes);
+      m_mainHashed = CreateSpatialIndex(m_indexType, m_regRes);
       m_outsourceMainPC = false;
     }
     
-    if (!in_append)
-      m_mainHashed->Clear();
+    // copy the points (the index only keeps point indices into the copy, and reads the positions in place).
+    // Appended points are copied in place while there is room, otherwise the points move to arrays of
+    // twice the size and the old positions are released once the index does not read them
+    int l_numOld = in_append ? m_mainPcl.m_numPts : 0;
+    int l_num = l_numOld + in_pcl.m_numPts;
+    int l_numNormals = in_append ? m_numMainNormals : 0;   // (normals are kept for the leading points that have them)
+    bool l_newNormals = (in_pcl.m_normal != 0) && (l_numNormals == l_numOld);
+    CVec3* l_oldPos = 0;
+    if (!in_append || l_num > m_mainCapacity)
+    {
+      m_mainCapacity = in_append ? MaxT(l_num, 2 * m_mainCapacity) : l_num;
+      l_oldPos = m_mainPcl.m_pos;
+      m_mainPcl.m_pos = new CVec3[m_mainCapacity];
+      if (l_numOld > 0)
+        memcpy(m_mainPcl.m_pos, l_oldPos, l_numOld * sizeof(CVec3));
+      CVec3* l_oldNormal = m_mainPcl.m_normal;
+      m_mainPcl.m_normal = 0;
+      if (l_numNormals > 0 || l_newNormals)
+      {
+        m_mainPcl.m_normal = new CVec3[m_mainCapacity];
+        if (l_numNormals > 0)
+          memcpy(m_mainPcl.m_normal, l_oldNormal, l_numNormals * sizeof(CVec3));
+      }
+      delete[] l_oldNormal;
+    }
+    else if (l_newNormals && m_mainPcl.m_normal == 0)
+      m_mainPcl.m_normal = new CVec3[m_mainCapacity];
+    if (in_pcl.m_numPts > 0)
+      memcpy(m_mainPcl.m_pos + l_numOld, in_pcl.m_pos, in_pcl.m_numPts * sizeof(CVec3));
+    if (l_newNormals && in_pcl.m_numPts > 0)
+      memcpy(m_mainPcl.m_normal + l_numOld, in_pcl.m_normal, in_pcl.m_numPts * sizeof(CVec3));
+    m_mainPcl.m_numPts = l_num;
+    m_numMainNormals = l_newNormals ? l_num : l_numNormals;
+
+    // index the new points (all of them if they moved)
+    m_mainHashed->Append(m_mainPcl);
+    if (l_oldPos != 0)
+      m_mainHashed->DeleteWhenUnread(l_oldPos);
+  }
 
-    for (int ptrIndex = 0; ptrIndex < in_pcl.m_numPts; ptrIndex++)
+  void ICP::CropMainPtCloud(const CVec3& in_minBox, const CVec3& in_maxBox)
+  {
+    // an outside index is cropped by its owner
+    if (m_outsourceMainPC)
+      return;
+
+    // compact the main cloud into new arrays of the new size (the index may still be read with the old
+    // positions), index it again and release the old positions once the index does not read them
+    int l_num = 0;
+    for (int i = 0; i < m_mainPcl.m_numPts; i++)
+    {
+      const CVec3& l_pt = m_mainPcl.m_pos[i];
+      if (l_pt.x >= in_minBox.x && l_pt.y >= in_minBox.y && l_pt.x <= in_maxBox.x && l_pt.y <= in_maxBox.y)
+        l_num++;
+    }
+    CVec3* l_oldPos = m_mainPcl.m_pos;
+    CVec3* l_oldNormal = m_mainPcl.m_normal;
+    m_mainPcl.m_pos = new CVec3[l_num];
+    m_mainPcl.m_normal = (m_numMainNormals > 0) ? new CVec3[l_num] : 0;
+    l_num = 0;
+    int l_numNormals = 0;
+    for (int i = 0; i < m_mainPcl.m_numPts; i++)
     {
-      m_mainHashed->Add(in_pcl.m_pos[ptrIndex], (void*)(1));
+      const CVec3& l_pt = l_oldPos[i];
+      if (l_pt.x >= in_minBox.x && l_pt.y >= in_minBox.y && l_pt.x <= in_maxBox.x && l_pt.y <= in_maxBox.y)
+      {
+        if (i < m_numMainNormals)
+          m_mainPcl.m_normal[l_numNormals++] = l_oldNormal[i];
+        m_mainPcl.m_pos[l_num++] = l_pt;
+      }
     }
+    delete[] l_oldNormal;
+    m_mainPcl.m_numPts = m_mainCapacity = l_num;
+    m_numMainNormals = l_numNormals;
+
+    m_mainHashed->Build(m_mainPcl);
+    m_mainHashed->DeleteWhenUnread(l_oldPos);
   }
 
-  void ICP::SetMainPtCloud(CSpatialHash2D* in_mainHashed)
+  void ICP::SetMainPtCloud(ISpatialIndex* in_mainHashed, const CVec3* in_normals)
   {
     if (!m_outsourceMainPC)
     {
@@ -595,6 +731,35 @@ namespace tpcl
 
     m_mainHashed = in_mainHashed;
     m_outsourceMainPC = true;
+    m_outsourceNormals = in_normals;
+    delete[] m_mainPcl.m_pos;
+    delete[] m_mainPcl.m_normal;
+    m_mainPcl.m_pos = m_mainPcl.m_normal = 0;
+    m_mainPcl.m_numPts = m_numMainNormals = m_mainCapacity = 0;
+  }
+
+
+  void ICP::SetMetric(EICPMetric in_metric)
+  {
+    m_metric = in_metric;
+  }
+
+
+  void ICP::SetRobustKernel(EICPKernel in_kernel, float in_scale)
+  {
+    m_kernel = in_kernel;
+    m_kernelScale = in_scale;
+  }
+
+
+  void ICP::SetTrimming(float in_trimFraction)
+  {
+    m_trimFraction = MinT(MaxT(in_trimFraction, 0.0f), 0.99f);
+  }
+
+  void ICP::SetApproxMatching(bool in_approx)
+  {
+    m_approxMatching = in_approx;
   }
 
 
@@ -623,19 +788,34 @@ namespace tpcl
 
     double l_transformationEpsilon = 0.75 * m_regRes;
     double l_fitnessEpsilon = 0.2 * m_regRes;
+    double l_shiftEpsilon = 0.01 * m_regRes;   // the last iteration hardly moved the points
 
     double l_transformationChange;
     double l_PreviousFitnessScore;
-
-    PerformIter(*m_mainHashed, in_pcl, out_registration, m_regRes, l_transformationChange, l_PreviousFitnessScore);
-    bool converged = (l_PreviousFitnessScore < l_fitnessEpsilon) || (l_transformationChange <= l_transformationEpsilon);
+    double l_pointShift, l_approxError;
+
+    // with approximate matching, while the transformation is far off the approximate matches are as good as the
+    // exact ones. Once an iteration moves the points less than the error of the approximate matches, switch
+    // to exact ones. Convergence is only accepted on exact matches
+    bool l_approx = m_approxMatching;
+    CICPBuffers& l_buffers = *(CICPBuffers*)m_iterBuffers;
+    l_buffers.Resize(in_pcl.m_numPts);
+    const CVec3* l_normals = (m_metric != ICP_POINT_TO_POINT) ? UpdateMainNormals() : 0;
+    // far off, the residuals are mostly misalignment: the matches are weighted and trimmed only with the exact matches
+    CRobustParams l_robust = { m_kernel, (m_kernelScale > 0) ? m_kernelScale : m_regRes, m_trimFraction };
+    CRobustParams l_unweighted = { ICP_KERNEL_NONE, 1.0, 0.0f };
+    Iterate(*m_mainHashed, l_normals, m_metric, in_pcl, out_registration, m_regRes, l_approx, l_approx ? l_unweighted : l_robust, l_buffers, l_transformationChange, l_PreviousFitnessScore, l_pointShift, l_approxError);
+    bool converged = (l_PreviousFitnessScore < l_fitnessEpsilon) || (l_transformationChange <= l_transformationEpsilon) || (l_pointShift < l_shiftEpsilon);
 
     int l_iterLeft = 150;
-    while (!converged)
+    while (!converged || (l_approx && l_iterLeft > 0))
     {
-      PerformIter(*m_mainHashed, in_pcl, out_registration, m_regRes, l_transformationChange, l_PreviousFitnessScore);
+      if (converged || l_pointShift < l_approxError)
+        l_approx = false;
+      Iterate(*m_mainHashed, l_normals, m_metric, in_pcl, out_registration, m_regRes, l_approx, l_approx ? l_unweighted : l_robust, l_buffers, l_transformationChange, l_PreviousFitnessScore, l_pointShift, l_approxError);
       l_iterLeft--;
-      converged = (l_PreviousFitnessScore < l_fitnessEpsilon) || (l_transformationChange < l_transformationEpsilon) || (l_iterLeft == 0);
+      converged = (l_PreviousFitnessScore < l_fitnessEpsilon) || (l_transformationChange < l_transformationEpsilon) ||
+                  (l_pointShift < l_shiftEpsilon) || (l_iterLeft == 0);
     }
 
     return float(FinalError(*m_mainHashed, in_pcl, out_registration, 5 * m_regRes));
@@ -646,12 +826,49 @@ namespace tpcl
   *                             Protected methods                               *
   ******************************************************************************/
 
-  void ICP::initMembers()
+  void ICP::initMembers(float in_regRes, ESpatialIndexType in_indexType)
   {
-    m_regRes = 0.5;
-    m_mainHashed = new CSpatialHash2D(m_regRes);
+    m_regRes = in_regRes;
+    m_indexType = in_indexType;
+    m_mainHashed = CreateSpatialIndex(m_indexType, m_regRes);
     m_mainHashed->Clear();
     m_outsourceMainPC = false;
+    m_numMainNormals = 0;
+    m_mainCapacity = 0;
+    m_outsourceNormals = 0;
+    m_metric = ICP_POINT_TO_POINT;
+    m_kernel = ICP_KERNEL_NONE;
+    m_kernelScale = 0;
+    m_trimFraction = 0;
+    m_approxMatching = false;
+    m_iterBuffers = new CICPBuffers;
+  }
+
+
+  const CVec3* ICP::UpdateMainNormals()
+  {
+    if (m_outsourceMainPC)
+      return m_outsourceNormals;
+    if (m_mainPcl.m_numPts == 0)
+      return 0;
+
+    if (m_numMainNormals < m_mainPcl.m_numPts)
+    {
+      if (m_numMainNormals == 0)
+      {
+        delete[] m_mainPcl.m_normal;
+        m_mainPcl.m_normal = new CVec3[m_mainCapacity];
+      }
+
+      // the points added without normals (their neighbors are searched in the whole main cloud)
+      CPtCloud l_added;
+      l_added.m_pos = m_mainPcl.m_pos + m_numMainNormals;
+      l_added.m_normal = m_mainPcl.m_normal + m_numMainNormals;
+      l_added.m_numPts = m_mainPcl.m_numPts - m_numMainNormals;
+      Features().FillNormals(l_added, m_regRes, m_mainHashed, false, NORMALS_PCA);
+      m_numMainNormals = m_mainPcl.m_numPts;
+    }
+    return m_mainPcl.m_normal;
   }
 
 } //namespace tpcl
\ No newline at end of file
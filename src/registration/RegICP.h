@@ -11,6 +11,8 @@
 #define __tpcl_register_icp_H
 
 #include "../include/registration.h"
+#include "../include/ptCloud.h"
+#include "SpatialIndex.h"
 
 /******************************************************************************
 *                        INCOMPLETE CLASS DECLARATIONS                        *
@@ -21,7 +23,24 @@ struct CMat4;
 
 namespace tpcl
 {
-  class CSpatialHash2D;
+  class ISpatialIndex;
+
+  /** distance minimized by ICP */
+  enum EICPMetric : char
+  {
+    ICP_POINT_TO_POINT = 0,   ///< distance between matched points (closed form, SVD)
+    ICP_POINT_TO_PLANE = 1,   ///< distance from the plane of the matched main cloud point (needs main cloud normals)
+    ICP_SYMMETRIC      = 2,   ///< as ICP_POINT_TO_PLANE, with the average normal of both points (if the secondary cloud has normals)
+  };
+
+  /** weight of a match by its residual r (M-estimator), with scale k */
+  enum EICPKernel : char
+  {
+    ICP_KERNEL_NONE   = 0,   ///< all matches within the registration threshold have the same weight
+    ICP_KERNEL_HUBER  = 1,   ///< 1 up to k, k/r beyond
+    ICP_KERNEL_TUKEY  = 2,   ///< (1 - (r/k)^2)^2 up to k, 0 beyond
+    ICP_KERNEL_CAUCHY = 3,   ///< 1 / (1 + (r/k)^2)
+  };
 
   /******************************************************************************
   *                              EXPORTED CLASSES                               *
@@ -39,26 +58,58 @@ namespace tpcl
   {
   public:
     /** Constructor 
-    * @param in_regThresh         set registration threshold. */
+    * @param in_regThresh         set registration threshold.
+    * @param in_indexType         type of spatial index used for the main point cloud. */
     ICP();
-    ICP(float in_regRes);
+    ICP(float in_regRes, ESpatialIndexType in_indexType = SPATIAL_INDEX_HASH_2D);
 
     /** destructor */
     virtual ~ICP();
 
     /** Set main cloud point.
     * Registration of secondary cloud points are done against this cloud using RegisterCloud()
-    * @param in_pcl           point cloud.
+    * @param in_pcl           point cloud. its normals (if any) are kept for the point-to-plane metrics.
     * @param in_append        if true, append points to the existing cloud
     */
     void SetMainPtCloud(const CPtCloud& in_pcl, bool in_append = false);
 
+    /** Crop main cloud point: remove the points outside a 2D (x/y) box.
+    * Does nothing for a main cloud given by SetMainPtCloud(ISpatialIndex*): crop it through its owner.
+    * @param in_minBox        minimum of the box to keep.
+    * @param in_maxBox        maximum of the box to keep.
+    */
+    void CropMainPtCloud(const CVec3& in_minBox, const CVec3& in_maxBox);
+
     /** Set main cloud point.
     * Registration of secondary cloud points are done against this cloud using RegisterCloud()
     * expects data to be available whenever registration is called!
     * @param in_mainHashed    pointer to an already hashed point cloud. deletes any local main point cloud. expects data to be available whenever registration is called.
+    * @param in_normals       optional: normals of the hashed points (by point index), for the point-to-plane metrics.
+    *                         without them registration is point-to-point.
     */
-    void SetMainPtCloud(CSpatialHash2D* in_mainHashed);
+    void SetMainPtCloud(ISpatialIndex* in_mainHashed, const CVec3* in_normals = 0);
+
+    /** Set the distance minimized (default: ICP_POINT_TO_POINT).
+    * Normals of main cloud points that were set without normals are estimated (from their k nearest neighbors) on the next registration.
+    * @param in_metric            see EICPMetric. */
+    void SetMetric(EICPMetric in_metric);
+
+    /** Set the weighting of the matches (default: ICP_KERNEL_NONE).
+    * The residual is the distance between the matched points (ICP_POINT_TO_POINT) or from the plane (other metrics).
+    * @param in_kernel            see EICPKernel.
+    * @param in_scale             scale k of the kernel. 0 = the registration resolution. */
+    void SetRobustKernel(EICPKernel in_kernel, float in_scale = 0);
+
+    /** Set the fraction of the matches rejected in each iteration: the farthest ones (default: 0).
+    * The rejected matches still count in the fitness score.
+    * @param in_trimFraction      fraction in [0, 1), e.g. 0.1 for partial overlap or moving objects. */
+    void SetTrimming(float in_trimFraction);
+
+    /** Use approximate nearest neighbors while the registration is far off (default: false).
+    * The iterations switch to exact matches once they move the points less than the error bound of the
+    * approximate matches (including the fraction of points they left unmatched); convergence is accepted on exact matches only.
+    * @param in_approx            if true, start with approximate matches (see ISpatialIndex::FindNearestApprox). */
+    void SetApproxMatching(bool in_approx);
 
     /** Get hashed main point cloud.
     * return         pointer to hashed main point cloud. */
@@ -69,7 +120,9 @@ namespace tpcl
     void setRegistrationResolution(float in_regRes);
 
     /** Get registration for a secondary point cloud against the main cloud
-    * The second cloud is not stored
+    * The second cloud is not stored.
+    * Not reentrant: the iterations use buffers kept by the ICP object, so concurrent registrations need an ICP each
+    * (they may share the main cloud's index, see SetMainPtCloud(ISpatialIndex*)).
     * @param out_registration      best registration found.
     * @param in_pcl               secondary point cloud.
     * @param in_estimatedOrient   estimation of registration, if 0 then estimation is identity.
@@ -79,12 +132,27 @@ namespace tpcl
 
 
   protected:
-    CSpatialHash2D* m_mainHashed;   ///< a hashed copy of the main point cloud.
+    ISpatialIndex* m_mainHashed;    ///< a hashed index of the main point cloud.
+    CPtCloud m_mainPcl;             ///< copy of the main point cloud (positions and normals), referenced by m_mainHashed.
+    int m_numMainNormals;           ///< number of leading points of m_mainPcl with normals (the rest are estimated when needed).
+    int m_mainCapacity;             ///< number of points the arrays of m_mainPcl have room for.
+    const CVec3* m_outsourceNormals;///< normals of the outside hashed main point cloud (optional).
+    EICPMetric m_metric;            ///< distance minimized.
+    EICPKernel m_kernel;            ///< weighting of the matches.
+    float m_kernelScale;            ///< scale of m_kernel (0 = m_regRes).
+    float m_trimFraction;           ///< fraction of the farthest matches rejected in each iteration.
+    bool m_approxMatching;          ///< if true, the first iterations use approximate matches.
+    void* m_iterBuffers;            ///< buffers of the iterations, reused by all registrations (so RegisterCloud() is not reentrant).
     bool m_outsourceMainPC;         ///< if true then hashed main point cloud used if given from outside (and will not be changed).
     float m_regRes;                 ///< resolution of registration wanted.
+    ESpatialIndexType m_indexType;  ///< type of spatial index created for the main point cloud.
 
     /** Set default values to members. */
-    void initMembers();
+    void initMembers(float in_regRes = 0.5f, ESpatialIndexType in_indexType = SPATIAL_INDEX_HASH_2D);
+
+    /** Get the normals of the main cloud points, estimating the missing ones.
+    * @return         normals by point index, 0 if not available (outside hashed main cloud without normals). */
+    const CVec3* UpdateMainNormals();
   };
 
 } // namespace tpcl
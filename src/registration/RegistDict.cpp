@@ -23,7 +23,7 @@
 #include "OrientDict.h"
 #include "features.h"
 #include "RegICP.h"
-#include "SpatialHash.h"
+#include "SpatialIndex.h"
 #include <complex>
 #include "tran.h"
 #include "common.h"
@@ -51,8 +51,10 @@ namespace tpcl
     int m_medFiltSize0;           // deniseing median filter size for the range imgae.
     int m_medFiltSize1;           // deniseing median filter size for the thresh image.
     float m_distFromMedianThresh; // max distance between point and median filter's result.
+    float m_denoiseAngleRes;      // range image resolution (radians) for denoising unordered clouds.
     float m_r_max;                // maximum distance from grid point to be included in the descriptor creation.
     float m_r_min;                // minimum distance from grid point to be included in the descriptor creation.
+    ESpatialIndexType m_spatialIndex; // spatial index of the main cloud (3D k-d tree is better for vertical structures).
 
     CRegOptions() { SetDefaults(); }
     
@@ -69,8 +71,10 @@ namespace tpcl
       m_medFiltSize0 = 7;
       m_medFiltSize1 = 5;
       m_distFromMedianThresh = 0.03f;
+      m_denoiseAngleRes = float(2 * M_PI) / (m_lineWidth * 5);
       m_r_max = 60;
       m_r_min = 2;
+      m_spatialIndex = SPATIAL_INDEX_HASH_2D;
     }
   };
 
@@ -79,12 +83,13 @@ namespace tpcl
   *: Class name: CCoarseRegister
   *
   ******************************************************************************/
-  CCoarseRegister::CCoarseRegister()
+  CCoarseRegister::CCoarseRegister(ESpatialIndexType in_indexType)
   {
     m_opts = new CRegOptions;
     CRegOptions* optsP = (CRegOptions*)m_opts;
+    optsP->m_spatialIndex = in_indexType;
 
-    m_dictionary = new CRegDictionary(optsP->m_voxelSizeGlobal, optsP->m_r_max, optsP->m_r_min, optsP->m_lineWidth, optsP->m_numlines);
+    m_dictionary = new CRegDictionary(optsP->m_voxelSizeGlobal, optsP->m_r_max, optsP->m_r_min, optsP->m_lineWidth, optsP->m_numlines, optsP->m_spatialIndex);
   }
 
 
@@ -127,6 +132,13 @@ namespace tpcl
   }
 
 
+  void CCoarseRegister::CropMainPtCloud(const CVec3& in_minBox, const CVec3& in_maxBox)
+  {
+    CRegDictionary* dictionaryP = (CRegDictionary*)m_dictionary;
+    dictionaryP->CropDictionary(in_minBox, in_maxBox);
+  }
+
+
   void* CCoarseRegister::getMainHashedPtr()
   {
     return ((CRegDictionary*)m_dictionary)->getMainHashedPtr();
@@ -148,18 +160,17 @@ namespace tpcl
     //preprocess local cloud:
     if (in_pcl.m_type == PCL_TYPE_SINGLE_ORIGIN_SCAN)
       feat.DenoiseRange(in_pcl, ptsPrePro, optsP->m_medFiltSize0, optsP->m_distFromMedianThresh);
-    //else
-    //{
-    //  float res = float(2 * M_PI) / (128 * 5);
-    //  Features::DenoiseRangeOfPointCloud(in_pcl, ptsPrePro, optsP->m_medFiltSize0, optsP->m_medFiltSize1, optsP->m_distFromMedianThresh, res);
-    //}
+    else
+      feat.DenoiseRangeOfPointCloud(in_pcl, ptsPrePro, optsP->m_medFiltSize0, optsP->m_distFromMedianThresh, optsP->m_denoiseAngleRes,
+                                    CVec3(0, 0, 0));   // (the local cloud is around its origin, as for its descriptor below)
 
     feat.DownSample(ptsPrePro, ptsPrePro, optsP->m_voxelSizeLocal);
 
     //get registration candidates from dictinary:
     int NumOfCandidates = SecondaryPointCloudRegistrationCandidates(ptsPrePro, maxCandidates, grades, candRegistrations, in_estimatedOrient);
 
-    feat.DownSample(ptsPrePro, ptsPrePro, 2);
+    // (centroids: no aliasing of the voxel grid in the ICP cost)
+    feat.DownSample(ptsPrePro, ptsPrePro, 2, DOWNSAMPLE_CENTROID);
 
     //find final registration:
     float bestGrade = GetRegistrationFromListOfCandidates(NumOfCandidates, ptsPrePro, candRegistrations, out_registration);
@@ -285,7 +296,7 @@ namespace tpcl
     #pragma omp parallel for
     for (int cand = 0; cand < in_NumOfCandidates; cand++)
     {
-      CandRMSEs[cand] = feat.RMSEofRegistration((CSpatialHash2D*)(getMainHashedPtr()), in_pcl, 4 * optsP->m_voxelSizeGlobal, in_registrations[cand]);
+      CandRMSEs[cand] = feat.RMSEofRegistration((ISpatialIndex*)(getMainHashedPtr()), in_pcl, 4 * optsP->m_voxelSizeGlobal, in_registrations[cand]);
     }
 
     //TODO: finish RMSE candidate filter
@@ -306,7 +317,7 @@ namespace tpcl
 
     ////select best registration of candidates according to ICP registration:
     ICP icpRegistration(1.5f * optsP->m_voxelSizeGlobal);
-    icpRegistration.SetMainPtCloud((CSpatialHash2D*)getMainHashedPtr());
+    icpRegistration.SetMainPtCloud((ISpatialIndex*)getMainHashedPtr());
     double bestGrade = DBL_MAX;
     for (int fCand = 0; fCand < fNumOfCand; fCand++)
     {
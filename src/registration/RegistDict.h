@@ -24,6 +24,7 @@
 
 #include "../include/registration.h"
 #include "../include/vec.h"
+#include "SpatialIndex.h"
 
 namespace tpcl
 {
@@ -49,8 +50,12 @@ namespace tpcl
   class CCoarseRegister : public IRegister
   {
   public:
-    /** Constructor */
-    CCoarseRegister();
+    /** Constructor
+    * @param in_indexType         type of spatial index used for the main point cloud (and by its ICP refinements).
+    *                             SPATIAL_INDEX_HASH_PYRAMID gives each search radius (ICP stages, candidate RMSE) a fitting cell size,
+    *                             but its levels are updated one after the other: while appending, queries of different
+    *                             radii may see the new points or not. */
+    CCoarseRegister(ESpatialIndexType in_indexType = SPATIAL_INDEX_HASH_2D);
 
     /** destructor */
     virtual ~CCoarseRegister(); 
@@ -68,6 +73,12 @@ namespace tpcl
     */
     void SetMainPtCloud(const CPtCloud& in_pcl, bool in_append = false);
 
+    /** Crop main cloud point: remove the points outside a 2D (x/y) box.
+    * @param in_minBox        minimum of the box to keep.
+    * @param in_maxBox        maximum of the box to keep.
+    */
+    void CropMainPtCloud(const CVec3& in_minBox, const CVec3& in_maxBox);
+
     /** Get hashed main point cloud.
     * @param return         pointer to hashed main point cloud. */
     void* getMainHashedPtr();
@@ -0,0 +1,577 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+//
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+// Benchmark: the rotation solver of the ICP iterations.
+// Times the closed-form quaternion solver (AbsoluteOrientation) against the
+// generic 3x3 SVD (svd3x3 with the reflection fix), and checks the rotations
+// against an exact reference on random, planar and noisy matched points.
+// usage: BenchAbsOrient [number of solves (millions)]
+
+#include "../include/common.h"
+#include "../src/common/AbsOrient.h"
+#include <chrono>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace tpcl;
+
+#define SIGN(a,b) ((b) >= 0.0 ? fabs(a) : -fabs(a))
+
+
+/** seconds since an earlier time */
+static double SecondsSince(const std::chrono::steady_clock::time_point& in_start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - in_start).count();
+}
+
+
+static double Random(double in_min, double in_max)
+{
+  return in_min + (in_max - in_min) * rand() / RAND_MAX;
+}
+
+
+/** random rotation (from a random unit quaternion) */
+static void RandomRotation(double out_R[3][3])
+{
+  double q[4], l_len = 0;
+  for (int i = 0; i < 4; i++)
+  {
+    q[i] = Random(-1, 1);
+    l_len += q[i] * q[i];
+  }
+  l_len = sqrt(l_len);
+  double w = q[0] / l_len, x = q[1] / l_len, y = q[2] / l_len, z = q[3] / l_len;
+  double R[3][3] = { { w * w + x * x - y * y - z * z, 2 * (x * y - w * z), 2 * (x * z + w * y) },
+                     { 2 * (x * y + w * z), w * w - x * x + y * y - z * z, 2 * (y * z - w * x) },
+                     { 2 * (x * z - w * y), 2 * (y * z + w * x), w * w - x * x - y * y + z * z } };
+  for (int r = 0; r < 3; r++)
+    for (int c = 0; c < 3; c++)
+      out_R[r][c] = R[r][c];
+}
+
+
+/** cross-covariance of matched points: a random cloud a (flattened by in_flat, 0 = planar) and b = R*a + noise */
+static void RandomCrossCovariance(double in_flat, double in_noise, double out_H[9])
+{
+  const int l_numPts = 50;
+  double R[3][3];
+  RandomRotation(R);
+  double a[l_numPts][3], b[l_numPts][3];
+  double ca[3] = { 0 }, cb[3] = { 0 };
+  for (int i = 0; i < l_numPts; i++)
+  {
+    a[i][0] = Random(-10, 10);
+    a[i][1] = Random(-10, 10);
+    a[i][2] = in_flat * Random(-10, 10);
+    for (int r = 0; r < 3; r++)
+    {
+      b[i][r] = R[r][0] * a[i][0] + R[r][1] * a[i][1] + R[r][2] * a[i][2] + in_noise * Random(-1, 1);
+      ca[r] += a[i][r] / l_numPts;
+      cb[r] += b[i][r] / l_numPts;
+    }
+  }
+  for (int k = 0; k < 9; k++)
+    out_H[k] = 0;
+  for (int i = 0; i < l_numPts; i++)
+    for (int r = 0; r < 3; r++)
+      for (int c = 0; c < 3; c++)
+        out_H[3 * r + c] += (a[i][r] - ca[r]) * (b[i][c] - cb[c]);
+}
+
+
+/** calculates pythagoras output = sqrt(a^2 + b^2) */
+static double pythag(double a, double b)
+{
+  double absa, absb;
+  absa = fabs(a);
+  absb = fabs(b);
+  if (absa > absb)
+    return double(absa*sqrt(1.0 + pow(absb / absa, 2)));
+  else
+    return double((absb == 0.0 ? 0.0 : absb*sqrt(1.0 + pow(absa / absb, 2))));
+}
+
+
+// build bidiagonal form of using Householder reduction
+static void BiDiag(double io_U[3][3], double out_W[3], double out_V[3][3], double rv1[4])
+{
+  // Householder reduction to bidiagonal form.
+  int i, j, k;
+  double f, g = 0, h, s;
+
+  for (i = 0; i<3; i++)
+  {
+    rv1[i] = g;
+    g = s = 0.0;
+
+    // act on columns
+    for (k = i; k<3; k++)
+      s += io_U[k][i] * io_U[k][i];
+    if (s)
+    {
+      f = io_U[i][i];
+      g = -SIGN(sqrt(s), f);
+      h = f*g - s;
+      io_U[i][i] = f - g;
+      for (j = i + 1; j<3; j++)
+      {
+        for (s = 0.0, k = i; k<3; k++)
+          s += io_U[k][i] * io_U[k][j];
+        f = s / h;
+        for (k = i; k<3; k++)
+          io_U[k][j] += f*io_U[k][i];
+      }
+    }
+    out_W[i] = g;
+
+    // act on rows
+    g = s = 0.0;
+    for (k = i + 1; k < 3; k++)
+      s += io_U[i][k] * io_U[i][k];
+    if (s)
+    {
+      f = io_U[i][i + 1];
+      g = -SIGN(sqrt(s), f);
+      h = f*g - s;
+      io_U[i][i + 1] = f - g;
+      for (k = i + 1; k<3; k++)
+        rv1[k] = io_U[i][k] / h;
+      for (j = i + 1; j<3; j++)
+      {
+        for (s = 0.0, k = i + 1; k<3; k++)
+          s += io_U[j][k] * io_U[i][k];
+        for (k = i + 1; k<3; k++)
+          io_U[j][k] += s*rv1[k];
+      }
+    }
+  }
+
+  // Accumulation of right-hand transformations.
+  out_V[2][2] = 1.0;
+  g = rv1[2];
+  for (i = 2; i >= 0; i--)
+  {
+    if (g)
+    {
+      for (j = i + 1; j<3; j++)
+        out_V[j][i] = (io_U[i][j] / io_U[i][i + 1]) / g;   // Double division to avoid possible underflow.
+      for (j = i + 1; j<3; j++)
+      {
+        for (s = 0.0, k = i + 1; k<3; k++)
+          s += io_U[i][k] * out_V[k][j];
+        for (k = i + 1; k<3; k++)
+          out_V[k][j] += s*out_V[k][i];
+      }
+    }
+    for (j = i + 1; j<3; j++)
+      out_V[i][j] = out_V[j][i] = 0.0;
+    out_V[i][i] = 1.0;
+    g = rv1[i];
+  }
+
+  // Accumulation of left-hand transformations.
+  for (i = 2; i >= 0; i--)
+  {
+    g = out_W[i];
+    for (j = i + 1; j<3; j++)
+      io_U[i][j] = 0.0;
+    if (g)
+    {
+      g = 1.0 / g;
+      for (j = i + 1; j<3; j++)
+      {
+        for (s = 0.0, k = i + 1; k<3; k++)
+          s += io_U[k][i] * io_U[k][j];
+        f = (s / io_U[i][i])*g;
+        for (k = i; k<3; k++)
+          io_U[k][j] += f*io_U[k][i];
+      }
+      for (j = i; j<3; j++)
+        io_U[j][i] *= g;
+    }
+    else
+      for (j = i; j<3; j++)
+        io_U[j][i] = 0.0;
+    ++io_U[i][i];
+  }
+}
+
+
+
+/** singular value decomposition M = U * diag(W) * V^T (Golub-Kahan, from Numerical Recipes).
+ *  The singular values are sorted by decreasing magnitude.
+ * @return          false if the QR iterations did not converge */
+static bool svd3x3(const double in_M[3][3], double out_U[3][3], double out_W[3], double out_V[3][3])
+{
+  double w[3];
+  double rv1[3];
+
+  int flag, i, its, j, jj, k, nm;
+  double c, f, g, h, s, x, y, z;
+
+  for (i = 0; i < 9; ++i)
+    out_U[0][i] = in_M[0][i];
+
+  // convert to bidiagonal form
+  BiDiag(out_U, w, out_V, rv1);
+
+  // claculate scale of stuff
+  double anorm = fabs(w[0]) + fabs(rv1[0]);
+  anorm = MaxT(anorm, fabs(w[1]) + fabs(rv1[1]));
+  anorm = MaxT(anorm, fabs(w[2]) + fabs(rv1[2]));
+
+  // Diagonalization of the bidiagonal form: Loop over singular values
+  for (k = 2; k >= 0; k--)
+  {
+    // and over allowed iterations.
+    for (its = 0; its<30; its++)
+    {
+      flag = 1;
+      int l;
+      // Test for splitting.
+      for (l = k; l >= 0; l--)
+      {
+        nm = l - 1;
+        if ((double)(fabs(rv1[l]) + anorm) == anorm)
+        {
+          flag = 0;
+          break;
+        }
+        if ((double)(fabs(w[nm]) + anorm) == anorm)
+        {
+          break;
+        }
+      }
+      if (flag)
+      {
+        c = 0.0; // Cancellation of rv1[l], if l > 1.
+        s = 1.0;
+        for (i = l; i <= k; i++)
+        {
+          f = s*rv1[i];
+          rv1[i] = c*rv1[i];
+          if ((double)(fabs(f) + anorm) == anorm)
+            break;
+          g = w[i];
+          h = pythag(f, g);
+          w[i] = h;
+          h = 1.0 / h;
+          c = g*h;
+          s = -f*h;
+          for (j = 0; j<3; j++)
+          {
+            y = out_U[j][nm];
+            z = out_U[j][i];
+            out_U[j][nm] = y*c + z*s;
+            out_U[j][i] = z*c - y*s;
+          }
+        }
+      }
+      z = w[k];
+      if (l == k)
+      { // Convergence.
+        if (z<0.0)
+        { // Singular value is made nonnegative.
+          w[k] = -z;
+          for (j = 0; j<3; j++)
+            out_V[j][k] = -out_V[j][k];
+        }
+        break;
+      }
+      if (its == 29)
+        return false; // No convergence
+      x = w[l]; // Shift from bottom 2-by-2 minor.
+      nm = k - 1;
+      y = w[nm];
+      g = rv1[nm];
+      h = rv1[k];
+      f = ((y - z)*(y + z) + (g - h)*(g + h)) / (2.f*h*y);
+      g = pythag(f, 1.0);
+      f = ((x - z)*(x + z) + h*((y / (f + SIGN(g, f))) - h)) / x;
+      c = s = 1.0; // Next QR transformation:
+      for (j = l; j <= nm; j++)
+      {
+        i = j + 1;
+        g = rv1[i];
+        y = w[i];
+        h = s*g;
+        g = c*g;
+        z = pythag(f, h);
+        rv1[j] = z;
+        c = f / z;
+        s = h / z;
+        f = x*c + g*s;
+        g = g*c - x*s;
+        h = y*s;
+        y *= c;
+        for (jj = 0; jj<3; jj++)
+        {
+          x = out_V[jj][j];
+          z = out_V[jj][i];
+          out_V[jj][j] = x*c + z*s;
+          out_V[jj][i] = z*c - x*s;
+        }
+        z = pythag(f, h);
+        w[j] = z; // Rotation can be arbitrary if z = 0.
+        if (z)
+        {
+          z = 1.0 / z;
+          c = f*z;
+          s = h*z;
+        }
+        f = c*g + s*y;
+        x = c*y - s*g;
+        for (jj = 0; jj<3; jj++)
+        {
+          y = out_U[jj][j];
+          z = out_U[jj][i];
+          out_U[jj][j] = y*c + z*s;
+          out_U[jj][i] = z*c - y*s;
+        }
+      }
+      rv1[l] = 0.0;
+      rv1[k] = f;
+      w[k] = x;
+    }
+  }
+
+  // sort singular values and corresponding columns of u and v
+  // by decreasing magnitude. Also, signs of corresponding columns are
+  // flipped so as to maximize the number of positive elements.
+  int s2;
+  double   sw;
+  double su[3];
+  double sv[3];
+  for (i = 1; i<3; i++)
+  {
+    sw = w[i];
+    for (k = 0; k<3; k++)
+      su[k] = out_U[k][i];
+    for (k = 0; k<3; k++)
+      sv[k] = out_V[k][i];
+    j = i;
+    while (w[j - 1] < sw)
+    {
+      w[j] = w[j - 1];
+      for (k = 0; k<3; k++)
+        out_U[k][j] = out_U[k][j - 1];
+      for (k = 0; k<3; k++)
+        out_V[k][j] = out_V[k][j - 1];
+      j -= 1;
+      if (j < 1) break;
+    }
+    w[j] = sw;
+    for (k = 0; k<3; k++)
+      out_U[k][j] = su[k];
+    for (k = 0; k<3; k++)
+      out_V[k][j] = sv[k];
+  }
+
+  // flip signs
+  for (k = 0; k<3; k++)
+  {
+    s2 = 0;
+    for (i = 0; i<3; i++)
+      if (out_U[i][k] < 0.0)
+        s2++;
+    for (j = 0; j<3; j++)
+      if (out_V[j][k] < 0.0)
+        s2++;
+    if (s2 > 3)
+    {
+      for (i = 0; i<3; i++)
+        out_U[i][k] = -out_U[i][k];
+      for (j = 0; j<3; j++)
+        out_V[j][k] = -out_V[j][k];
+    }
+  }
+
+  // create vector and copy singular values
+  for (int r = 0; r < 3; r++)
+    out_W[r] = w[r];
+  return true;
+}
+
+
+/** as above, M row major (3x3), U, W and V as 4x4 matrices (the rest is identity) */
+static bool svd3x3(double* in_M, CMat4& out_U, CMat4& out_W, CMat4& out_V)
+{
+  const int M1size = 3;
+  double M[M1size][M1size] = { 0 };
+  double U[M1size][M1size] = { 0 };
+  double W[M1size] = { 0 };
+  double V[M1size][M1size] = { 0 };
+
+  for (int row = 0; row < M1size; row++)
+  {
+    for (int col = 0; col < M1size; col++)
+    {
+      M[row][col] = in_M[row*M1size + col];
+    }
+  }
+  bool convergence = svd3x3(M, U, W, V);
+
+  if (convergence)
+  {
+    for (int row = 0; row < M1size; row++)
+    {
+      for (int col = 0; col < M1size; col++)
+      {
+        out_U.m[row][col] = (float)U[row][col];
+        out_W.m[row][col] = 0.f;
+        out_V.m[row][col] = (float)V[row][col];
+      }
+      out_W.m[row][row] = (float)W[row];
+    }
+
+    for (int i = 0; i < M1size; ++i)
+    {
+      out_U.m[M1size][i] = out_U.m[i][M1size] = 0.f;
+      out_W.m[M1size][i] = out_W.m[i][M1size] = 0.f;
+      out_V.m[M1size][i] = out_V.m[i][M1size] = 0.f;
+    }
+    out_U.m[M1size][M1size] = out_W.m[3][3] = out_V.m[M1size][M1size] = 1.f;
+  }
+
+  return convergence;
+}
+
+
+/** the solver used by ICP before: R = V * U^T, the last axis flipped if that is a reflection */
+static void RotationBySVD(double* in_H, CMat4& out_R)
+{
+  CMat4 U, W, V;
+  svd3x3(in_H, U, W, V);
+  CMat4 TranU; Transpose(U, TranU);
+  out_R = V * TranU;
+  float l_det = MatrixDeterminant(&out_R);
+  if (l_det < 0)
+  {
+    CMat4 B; MatrixIdentity(&B);
+    B.m[2][2] = l_det;
+    out_R = V * B * TranU;
+  }
+}
+
+
+/** exact reference (double): R = V * D * U^T, D flips the axis of the smallest singular value if needed */
+static void ReferenceRotation(const double in_H[9], double out_R[3][3])
+{
+  double M[3][3], U[3][3], W[3], V[3][3];
+  for (int r = 0; r < 3; r++)
+    for (int c = 0; c < 3; c++)
+      M[r][c] = in_H[3 * r + c];
+  svd3x3(M, U, W, V);
+  double l_det = 0;
+  for (int pass = 0; pass < 2; pass++)
+  {
+    for (int r = 0; r < 3; r++)
+      for (int c = 0; c < 3; c++)
+        out_R[r][c] = V[r][0] * U[c][0] + V[r][1] * U[c][1] + V[r][2] * U[c][2];
+    l_det = out_R[0][0] * (out_R[1][1] * out_R[2][2] - out_R[1][2] * out_R[2][1]) -
+            out_R[0][1] * (out_R[1][0] * out_R[2][2] - out_R[1][2] * out_R[2][0]) +
+            out_R[0][2] * (out_R[1][0] * out_R[2][1] - out_R[1][1] * out_R[2][0]);
+    if (l_det > 0)
+      break;
+    int l_min = (W[0] < W[1]) ? ((W[0] < W[2]) ? 0 : 2) : ((W[1] < W[2]) ? 1 : 2);
+    for (int r = 0; r < 3; r++)
+      V[r][l_min] = -V[r][l_min];
+  }
+}
+
+
+/** angle (radians) between a rotation and the reference (from |R - ref|, which is accurate for small angles) */
+static double AngleTo(const CMat4& in_R, const double in_ref[3][3])
+{
+  double l_diffSqr = 0;
+  for (int r = 0; r < 3; r++)
+    for (int c = 0; c < 3; c++)
+      l_diffSqr += (in_R.m[r][c] - in_ref[r][c]) * (in_R.m[r][c] - in_ref[r][c]);
+  double l_sin = sqrt(l_diffSqr / 8);
+  return 2 * asin(l_sin > 1 ? 1 : l_sin);
+}
+
+
+int main(int argc, char** argv)
+{
+  int l_numSolves = int(((argc > 1) ? atof(argv[1]) : 2.0) * 1000000);
+  srand(1);
+
+  // accuracy: random, planar and noisy points (the noise makes some SVD solutions reflections)
+  const char* l_names[4] = { "random", "planar", "noisy", "very noisy" };
+  double l_flat[4] = { 1, 0, 1, 0.1 };
+  double l_noise[4] = { 0.01, 0.01, 3, 20 };
+  double l_maxHornErr = 0;
+  for (int t = 0; t < 4; t++)
+  {
+    double l_maxHorn = 0, l_maxSVD = 0;
+    for (int i = 0; i < 10000; i++)
+    {
+      double H[9], l_ref[3][3];
+      RandomCrossCovariance(l_flat[t], l_noise[t], H);
+      ReferenceRotation(H, l_ref);
+      CMat4 l_horn, l_svd;
+      AbsoluteOrientation(H, l_horn);
+      RotationBySVD(H, l_svd);
+      double l_angle = AngleTo(l_horn, l_ref);
+      l_maxHorn = (l_angle > l_maxHorn) ? l_angle : l_maxHorn;
+      l_angle = AngleTo(l_svd, l_ref);
+      l_maxSVD = (l_angle > l_maxSVD) ? l_angle : l_maxSVD;
+    }
+    printf("%-10s max error (radians): quaternion %.2e, SVD %.2e\n", l_names[t], l_maxHorn, l_maxSVD);
+    l_maxHornErr = (l_maxHorn > l_maxHornErr) ? l_maxHorn : l_maxHornErr;
+  }
+
+  // points on a line: the rotation around the line is free
+  double l_line[9] = { 4, 0, 0, 0, 0, 0, 0, 0, 0 };
+  CMat4 l_R;
+  bool l_lineOk = !AbsoluteOrientation(l_line, l_R);
+  printf("points on a line reported: %s\n", l_lineOk ? "yes" : "no");
+
+  // timing
+  const int l_numInputs = 1024;
+  std::vector<double> l_inputs(9 * l_numInputs);
+  for (int i = 0; i < l_numInputs; i++)
+    RandomCrossCovariance(1, 0.1, &l_inputs[9 * i]);
+
+  double l_sum = 0;
+  std::chrono::steady_clock::time_point l_start = std::chrono::steady_clock::now();
+  for (int i = 0; i < l_numSolves; i++)
+  {
+    RotationBySVD(&l_inputs[9 * (i % l_numInputs)], l_R);
+    l_sum += l_R.m[0][0];
+  }
+  double l_svdTime = SecondsSince(l_start);
+
+  l_start = std::chrono::steady_clock::now();
+  for (int i = 0; i < l_numSolves; i++)
+  {
+    AbsoluteOrientation(&l_inputs[9 * (i % l_numInputs)], l_R);
+    l_sum -= l_R.m[0][0];
+  }
+  double l_hornTime = SecondsSince(l_start);
+  printf("SVD:        %.1f ns per rotation\n", l_svdTime * 1e9 / l_numSolves);
+  printf("quaternion: %.1f ns per rotation (x%.1f)   (checksum %.3f)\n", l_hornTime * 1e9 / l_numSolves, l_svdTime / l_hornTime, l_sum);
+
+  return (l_maxHornErr < 1e-5 && l_lineOk) ? 0 : 1;
+}
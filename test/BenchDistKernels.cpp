@@ -0,0 +1,233 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+// 
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+// Benchmark: the distance kernels of the spatial hash.
+// Times the vector kernels chosen for this CPU against the scalar kernels on
+// ranges of different lengths (the points of a cell, or of a row of cells),
+// and checks that both give the same results.
+// Also checks the median kernels of every kernel set supported by the CPU, and the
+// 2D median filters (cyclic and mirrored edges), against std::nth_element.
+// usage: BenchDistKernels
+
+#include "../src/common/DistKernels.h"
+#include "../src/common/features.h"
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <string.h>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace tpcl;
+
+
+/** seconds since an earlier time */
+static double SecondsSince(const std::chrono::steady_clock::time_point& in_start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - in_start).count();
+}
+
+
+/** run the kernels over many ranges of a given length
+ * @return checksum of the results */
+static long long RunKernels(const CDistKernels& in_kernels, const std::vector<float>& in_x, const std::vector<float>& in_y,
+                           const std::vector<float>& in_z, int in_len, double& out_nearestTime, double& out_filterTime)
+{
+  const int l_numPts = (int)in_x.size();
+  const int l_reps = 20000000 / in_len;
+  const CVec3 l_pos(5, 5, 5);
+  std::vector<int> l_sel(in_len);
+  std::vector<float> l_dist(in_len);
+  long long l_sum = 0;
+
+  std::chrono::steady_clock::time_point l_start = std::chrono::steady_clock::now();
+  for (int r = 0; r < l_reps; ++r)
+  {
+    int l_begin = (r * 13) % (l_numPts - in_len);
+    float l_minDistSqr = 1E20f;
+    l_sum += in_kernels.m_nearest(&in_x[0], &in_y[0], &in_z[0], l_begin, l_begin + in_len, l_pos, 4.0f, l_minDistSqr);
+  }
+  out_nearestTime = SecondsSince(l_start);
+
+  l_start = std::chrono::steady_clock::now();
+  for (int r = 0; r < l_reps; ++r)
+  {
+    int l_begin = (r * 13) % (l_numPts - in_len);
+    int l_num = in_kernels.m_filter(&in_x[0], &in_y[0], &in_z[0], l_begin, l_begin + in_len, l_pos, 4.0f, 9.0f, &l_sel[0], &l_dist[0]);
+    for (int j = 0; j < l_num; ++j)
+      l_sum += l_sel[j];
+  }
+  out_filterTime = SecondsSince(l_start);
+  return l_sum;
+}
+
+
+/** median of each window by std::nth_element (see MedianKernel) */
+static void ReferenceMedian(const float* in_img, int in_stride, int in_size, int in_num, float* out_row)
+{
+  std::vector<float> l_w(in_size * in_size);
+  for (int c = 0; c < in_num; ++c)
+  {
+    for (int r = 0; r < in_size; ++r)
+      for (int dc = 0; dc < in_size; ++dc)
+        l_w[r * in_size + dc] = in_img[r * in_stride + c + dc];
+    std::nth_element(l_w.begin(), l_w.begin() + l_w.size() / 2, l_w.end());
+    out_row[c] = l_w[l_w.size() / 2];
+  }
+}
+
+
+/** check the median kernels of every supported kernel set: against std::nth_element on an image
+ *  with many equal values, and against the scalar kernel (bit for bit) on an image with NaNs.
+ *  The rows have all the lengths up to 37, so the vector loops end with every tail length.
+ * @return number of kernels/sizes with different results */
+static int CheckMedianKernels()
+{
+  const int l_stride = 64, l_maxNum = 37;
+  std::vector<float> l_img(l_stride * MEDIAN_KERNEL_MAX_SIZE), l_nanImg(l_img.size());
+  for (size_t i = 0; i < l_img.size(); ++i)
+  {
+    l_img[i] = (float)(rand() % 20) - 5.0f;
+    l_nanImg[i] = (rand() % 8 == 0) ? std::numeric_limits<float>::quiet_NaN() : l_img[i];
+  }
+
+  std::vector<CDistKernels> l_kernels = GetSupportedDistKernels();
+  std::vector<float> l_out(l_maxNum), l_ref(l_maxNum);
+  int l_numDiff = 0;
+  for (size_t k = 0; k < l_kernels.size(); ++k)
+  {
+    for (int l_size = 1; l_size <= MEDIAN_KERNEL_MAX_SIZE; l_size += 2)
+    {
+      bool l_same = true;
+      for (int l_num = 1; l_num <= l_maxNum; ++l_num)
+      {
+        l_kernels[k].m_median(&l_img[0], l_stride, l_size, l_num, &l_out[0]);
+        ReferenceMedian(&l_img[0], l_stride, l_size, l_num, &l_ref[0]);
+        l_same = l_same && std::equal(l_out.begin(), l_out.begin() + l_num, l_ref.begin());
+
+        l_kernels[k].m_median(&l_nanImg[0], l_stride, l_size, l_num, &l_out[0]);
+        GetScalarDistKernels().m_median(&l_nanImg[0], l_stride, l_size, l_num, &l_ref[0]);
+        l_same = l_same && (memcmp(&l_out[0], &l_ref[0], l_num * sizeof(float)) == 0);
+      }
+      printf("median %-6s %dx%d: %s\n", l_kernels[k].m_name, l_size, l_size, l_same ? "ok" : "DIFFERENT");
+      if (!l_same)
+        l_numDiff++;
+    }
+  }
+  return l_numDiff;
+}
+
+
+/** index of a pixel outside the image: cyclic, or mirrored without repeating the edge */
+static int RefIndex(int in_index, int in_size, bool in_cyclic)
+{
+  if (in_cyclic)
+    return ((in_index % in_size) + in_size) % in_size;
+  if (in_size == 1)
+    return 0;
+  while ((in_index < 0) || (in_index >= in_size))
+    in_index = (in_index < 0) ? -in_index : (2 * (in_size - 1) - in_index);
+  return in_index;
+}
+
+
+/** check Median2DPowOf2 (cyclic edges) and Median2D (mirrored edges) against std::nth_element.
+ *  sizes up to 11 (the larger windows are not filtered by the kernels), and images smaller than the windows.
+ * @return number of images/sizes with different results */
+static int CheckMedian2D()
+{
+  const int l_dims[][2] = { { 16, 8 }, { 13, 7 }, { 4, 2 }, { 1, 5 } };
+  int l_numDiff = 0;
+  for (int d = 0; d < 4; ++d)
+  {
+    const int l_width = l_dims[d][0], l_height = l_dims[d][1];
+    std::vector<float> l_img(l_width * l_height), l_out(l_img.size()), l_ref(l_img.size());
+    for (size_t i = 0; i < l_img.size(); ++i)
+      l_img[i] = (float)(rand() % 20);
+
+    for (int l_cyclic = 0; l_cyclic < 2; ++l_cyclic)
+    {
+      for (int l_filtSize = 1; l_filtSize <= 11; ++l_filtSize)
+      {
+        if (l_cyclic)
+          Median2DPowOf2(l_width, l_height, l_filtSize, &l_img[0], &l_out[0]);
+        else
+          Median2D(l_width, l_height, l_filtSize, &l_img[0], &l_out[0]);
+
+        // even sizes filter with the next odd size
+        int l_half = l_filtSize / 2, l_size = 2 * l_half + 1;
+        std::vector<float> l_w(l_size * l_size);
+        for (int row = 0; row < l_height; ++row)
+          for (int col = 0; col < l_width; ++col)
+          {
+            for (int dr = -l_half; dr <= l_half; ++dr)
+              for (int dc = -l_half; dc <= l_half; ++dc)
+                l_w[(dr + l_half) * l_size + dc + l_half] =
+                  l_img[RefIndex(row + dr, l_height, l_cyclic != 0) * l_width + RefIndex(col + dc, l_width, l_cyclic != 0)];
+            std::nth_element(l_w.begin(), l_w.begin() + l_w.size() / 2, l_w.end());
+            l_ref[row * l_width + col] = l_w[l_w.size() / 2];
+          }
+        if (l_out != l_ref)
+        {
+          printf("median 2D %dx%d %s, size %d: DIFFERENT\n", l_width, l_height, l_cyclic ? "cyclic" : "mirrored", l_filtSize);
+          l_numDiff++;
+        }
+      }
+    }
+  }
+  printf("2D medians (cyclic and mirrored edges) with different results: %d\n", l_numDiff);
+  return l_numDiff;
+}
+
+
+int main()
+{
+  const int l_numPts = 4096;
+  std::vector<float> l_x(l_numPts), l_y(l_numPts), l_z(l_numPts);
+  srand(1);
+  for (int i = 0; i < l_numPts; ++i)
+  {
+    l_x[i] = 10.0f * rand() / RAND_MAX;
+    l_y[i] = 10.0f * rand() / RAND_MAX;
+    l_z[i] = 10.0f * rand() / RAND_MAX;
+  }
+
+  const CDistKernels& l_best = GetDistKernels();
+  const CDistKernels& l_scalar = GetScalarDistKernels();
+  printf("kernels: %s\n", l_best.m_name);
+  printf("points   nearest: %-6s  scalar     filter: %-6s  scalar\n", l_best.m_name, l_best.m_name);
+
+  int l_numDiff = 0;
+  for (int l_len = 4; l_len <= 1024; l_len *= 4)
+  {
+    double l_nearest1, l_filter1, l_nearest2, l_filter2;
+    long long l_sum1 = RunKernels(l_best, l_x, l_y, l_z, l_len, l_nearest1, l_filter1);
+    long long l_sum2 = RunKernels(l_scalar, l_x, l_y, l_z, l_len, l_nearest2, l_filter2);
+    printf("%6d   %13.3f  %6.3f     %12.3f  %6.3f\n", l_len, l_nearest1, l_nearest2, l_filter1, l_filter2);
+    if (l_sum1 != l_sum2)
+      l_numDiff++;
+  }
+  printf("ranges with different results: %d\n", l_numDiff);
+
+  l_numDiff += CheckMedianKernels();
+  l_numDiff += CheckMedian2D();
+  return l_numDiff == 0 ? 0 : 1;
+}
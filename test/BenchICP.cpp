@@ -0,0 +1,216 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+//
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+// Benchmark: memory allocations of ICP registrations.
+// Registers the same scan several times against a synthetic scene (as the
+// registration of several candidate orientations does) and counts the heap
+// allocations made during each registration. After the first registration
+// the iterations reuse the buffers of the ICP and should not allocate.
+// The average time is compared with registrations by new ICP objects (on the
+// same index), which allocate their buffers again.
+// usage: BenchICP [number of scan points (thousands)]
+
+#include "../include/ptCloud.h"
+#include "../src/registration/RegICP.h"
+#include <chrono>
+#include <new>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace tpcl;   // (CVec3 and CMat4 are qualified: RegICP.h also declares global ones)
+
+
+// count all allocations (replaces the global operator new and all the forms of operator delete)
+static size_t s_numAllocs = 0;
+static size_t s_allocBytes = 0;
+
+void* operator new(size_t in_size)
+{
+  s_numAllocs++;
+  s_allocBytes += in_size;
+  void* l_ptr = malloc(in_size > 0 ? in_size : 1);
+  if (l_ptr == 0)
+    abort();
+  return l_ptr;
+}
+
+void* operator new[](size_t in_size)
+{
+  return operator new(in_size);
+}
+
+void operator delete(void* in_ptr) throw()
+{
+  free(in_ptr);
+}
+
+void operator delete[](void* in_ptr) throw()
+{
+  free(in_ptr);
+}
+
+#if defined(__cpp_sized_deallocation) || (defined(_MSC_VER) && _MSC_VER >= 1900)
+void operator delete(void* in_ptr, size_t) throw()
+{
+  free(in_ptr);
+}
+
+void operator delete[](void* in_ptr, size_t) throw()
+{
+  free(in_ptr);
+}
+#endif
+
+#if defined(__cpp_aligned_new)
+// over-aligned types: the pointer returned by malloc is kept just before the aligned block
+void* operator new(size_t in_size, std::align_val_t in_align)
+{
+  size_t l_align = (size_t(in_align) > sizeof(void*)) ? size_t(in_align) : sizeof(void*);
+  s_numAllocs++;
+  s_allocBytes += in_size;
+  char* l_raw = (char*)malloc(in_size + l_align + sizeof(void*));
+  if (l_raw == 0)
+    abort();
+  char* l_ptr = (char*)((size_t(l_raw) + sizeof(void*) + l_align - 1) & ~(l_align - 1));
+  ((void**)l_ptr)[-1] = l_raw;
+  return l_ptr;
+}
+
+void* operator new[](size_t in_size, std::align_val_t in_align)
+{
+  return operator new(in_size, in_align);
+}
+
+void operator delete(void* in_ptr, std::align_val_t) throw()
+{
+  if (in_ptr != 0)
+    free(((void**)in_ptr)[-1]);
+}
+
+void operator delete[](void* in_ptr, std::align_val_t in_align) throw()
+{
+  operator delete(in_ptr, in_align);
+}
+
+void operator delete(void* in_ptr, size_t, std::align_val_t in_align) throw()
+{
+  operator delete(in_ptr, in_align);
+}
+
+void operator delete[](void* in_ptr, size_t, std::align_val_t in_align) throw()
+{
+  operator delete(in_ptr, in_align);
+}
+#endif
+
+
+/** seconds since an earlier time */
+static double SecondsSince(const std::chrono::steady_clock::time_point& in_start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - in_start).count();
+}
+
+
+/** height of the synthetic scene: smooth terrain with blocks */
+static float SceneHeight(float x, float y)
+{
+  float z = 3.0f * sinf(x * 0.05f) * cosf(y * 0.07f);
+  if ((int(x / 10) + int(y / 10)) % 3 == 0)
+    z += 2.0f;
+  return z;
+}
+
+
+/** random points of the scene inside a square, moved by a rotation around Z and a translation */
+static void FillCloud(CPtCloud& io_pcl, int in_numPts, float in_min, float in_size, float in_angle, const tpcl::CVec3& in_trans)
+{
+  io_pcl.m_numPts = in_numPts;
+  io_pcl.m_pos = new tpcl::CVec3[in_numPts];
+  float l_cos = cosf(in_angle), l_sin = sinf(in_angle);
+  for (int i = 0; i < in_numPts; ++i)
+  {
+    float x = in_min + in_size * rand() / RAND_MAX;
+    float y = in_min + in_size * rand() / RAND_MAX;
+    float z = SceneHeight(x, y);
+    io_pcl.m_pos[i] = tpcl::CVec3(l_cos * x - l_sin * y, l_sin * x + l_cos * y, z) + in_trans;
+  }
+}
+
+
+int main(int argc, char** argv)
+{
+  int l_numPts = int(((argc > 1) ? atof(argv[1]) : 100.0) * 1000);
+  const float l_res = 0.5f;
+  const int l_numRegistrations = 10;
+
+  srand(1);
+  CPtCloud l_scene, l_scan;
+  FillCloud(l_scene, 10 * l_numPts, 0.0f, 200.0f, 0.0f, tpcl::CVec3(0, 0, 0));
+  FillCloud(l_scan, l_numPts, 40.0f, 120.0f, 0.03f, tpcl::CVec3(1.2f, -0.8f, 0.3f));
+  printf("scene points: %d, scan points: %d, resolution: %.2f\n", l_scene.m_numPts, l_scan.m_numPts, l_res);
+
+  ICP l_icp(l_res);
+  l_icp.SetMainPtCloud(l_scene);
+
+  // before: each registration by a new ICP (on the same index), which sizes its buffers again
+  double l_coldTime = 0;
+  for (int i = 0; i < l_numRegistrations; ++i)
+  {
+    ICP l_coldIcp(l_res);
+    l_coldIcp.SetMainPtCloud((ISpatialIndex*)l_icp.getMainHashedPtr());
+    tpcl::CMat4 l_registration;
+    std::chrono::steady_clock::time_point l_start = std::chrono::steady_clock::now();
+    l_coldIcp.RegisterCloud(l_scan, l_registration);
+    l_coldTime += SecondsSince(l_start);
+  }
+
+  // after: the registrations reuse the buffers of the ICP
+  size_t l_maxLaterAllocs = 0;
+  double l_warmTime = 0;
+  for (int i = 0; i < l_numRegistrations; ++i)
+  {
+    tpcl::CMat4 l_registration;
+    size_t l_numAllocs = s_numAllocs, l_allocBytes = s_allocBytes;
+    std::chrono::steady_clock::time_point l_start = std::chrono::steady_clock::now();
+    float l_err = l_icp.RegisterCloud(l_scan, l_registration);
+    double l_time = SecondsSince(l_start);
+    l_numAllocs = s_numAllocs - l_numAllocs;
+    l_allocBytes = s_allocBytes - l_allocBytes;
+    if (i > 0)
+    {
+      l_warmTime += l_time;
+      if (l_numAllocs > l_maxLaterAllocs)
+        l_maxLaterAllocs = l_numAllocs;
+    }
+    printf("registration %2d: %.3f sec, error %.4f, %d allocations (%d KB)\n", i, l_time, l_err, int(l_numAllocs), int(l_allocBytes / 1024));
+  }
+  printf("max allocations after the first registration: %d\n", int(l_maxLaterAllocs));
+  if (l_numRegistrations > 1)
+  {
+    double l_before = l_coldTime / l_numRegistrations, l_after = l_warmTime / (l_numRegistrations - 1);
+    printf("average registration: %.3f sec with new buffers, %.3f sec with reused buffers (x%.2f)\n",
+           l_before, l_after, l_before / l_after);
+  }
+
+  delete[] l_scene.m_pos;
+  delete[] l_scan.m_pos;
+  return l_maxLaterAllocs == 0 ? 0 : 1;
+}
@@ -0,0 +1,213 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+// 
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+// Benchmark: the streaming range denoiser (CRangeDenoiser).
+// Feeds scans row by row and checks that the points (positions, colors and
+// normals, in order) are the ones of Features::DenoiseRange on the whole scan,
+// for scans of 64x2048, 5x64 and 2x7 points and windows 1 to 9. Each call
+// appends to a cloud with only the room documented by AddRow/EndScan.
+// Then times both on the large scan.
+// usage: BenchRangeDenoiser
+
+#include "../include/ptCloud.h"
+#include "../src/common/features.h"
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace tpcl;
+
+
+/** seconds since an earlier time */
+static double SecondsSince(const std::chrono::steady_clock::time_point& in_start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - in_start).count();
+}
+
+
+/** a cloud with its arrays */
+struct CTestCloud
+{
+  std::vector<CVec3> m_pos, m_normal;
+  std::vector<CColor> m_color;
+
+  void Resize(int in_numPts)
+  {
+    m_pos.resize(in_numPts);
+    m_normal.resize(in_numPts);
+    m_color.resize(in_numPts);
+  }
+
+  /** the cloud, with room for all the arrays' points and in_numPts points in it */
+  CPtCloud Cloud(int in_numPts)
+  {
+    CPtCloud l_pcl;
+    l_pcl.m_numPts = in_numPts;
+    l_pcl.m_pos = m_pos.empty() ? 0 : &m_pos[0];
+    l_pcl.m_normal = m_normal.empty() ? 0 : &m_normal[0];
+    l_pcl.m_color = m_color.empty() ? 0 : &m_color[0];
+    return l_pcl;
+  }
+
+  /** append the first in_num points of another cloud */
+  void Append(const CTestCloud& in_cloud, int in_num)
+  {
+    m_pos.insert(m_pos.end(), in_cloud.m_pos.begin(), in_cloud.m_pos.begin() + in_num);
+    m_normal.insert(m_normal.end(), in_cloud.m_normal.begin(), in_cloud.m_normal.begin() + in_num);
+    m_color.insert(m_color.end(), in_cloud.m_color.begin(), in_cloud.m_color.begin() + in_num);
+  }
+};
+
+
+/** a scan of a noisy wall: rows of elevations, columns of azimuths. some ranges are outliers,
+ *  some repeat the previous one (equal ranges in the median windows) */
+static void RandomScan(CTestCloud& out_scan, int in_numlines, int in_lineWidth)
+{
+  out_scan.Resize(in_numlines * in_lineWidth);
+  float l_range = 10.0f;
+  for (int row = 0; row < in_numlines; row++)
+  {
+    for (int col = 0; col < in_lineWidth; col++)
+    {
+      int index = row * in_lineWidth + col;
+      float l_az = 6.2831853f * col / in_lineWidth, l_el = 0.5f * row / in_numlines - 0.25f;
+      int l_kind = rand() % 16;
+      if (l_kind == 0)
+        l_range = 1.0f + 30.0f * rand() / RAND_MAX;           // outlier
+      else if (l_kind > 2)
+        l_range = 10.0f + 2.0f * sinf(3 * l_az) + 0.05f * rand() / RAND_MAX;
+      out_scan.m_pos[index] = CVec3(l_range * cosf(l_el) * cosf(l_az), l_range * cosf(l_el) * sinf(l_az), l_range * sinf(l_el));
+      out_scan.m_normal[index] = CVec3(cosf(l_az), sinf(l_az), 0);
+      out_scan.m_color[index] = (CColor)rand();
+    }
+  }
+}
+
+
+/** denoise a scan row by row. each call appends to a cloud with the room documented by AddRow/EndScan
+ * @return false if a call appended more points than documented */
+static bool DenoiseByRows(CRangeDenoiser& io_denoiser, CTestCloud& in_scan, int in_lineWidth, CTestCloud& out_pcl)
+{
+  int l_numlines = (int)in_scan.m_pos.size() / in_lineWidth;
+  CTestCloud l_rows;
+  l_rows.Resize(std::max(1, io_denoiser.GetLatency()) * in_lineWidth);
+  bool l_inRoom = true;
+  for (int row = 0; row < l_numlines; row++)
+  {
+    CPtCloud l_pcl = l_rows.Cloud(0);
+    int index = row * in_lineWidth;
+    int l_num = io_denoiser.AddRow(&in_scan.m_pos[index], &in_scan.m_color[index], &in_scan.m_normal[index], l_pcl);
+    l_inRoom = l_inRoom && (l_num == l_pcl.m_numPts) && (l_num <= in_lineWidth);
+    out_pcl.Append(l_rows, l_num);
+  }
+  CPtCloud l_pcl = l_rows.Cloud(0);
+  int l_num = io_denoiser.EndScan(l_pcl);
+  l_inRoom = l_inRoom && (l_num == l_pcl.m_numPts) && (l_num <= io_denoiser.GetLatency() * in_lineWidth);
+  out_pcl.Append(l_rows, l_num);
+  return l_inRoom;
+}
+
+
+/** compare the denoiser to Features::DenoiseRange on a scan, for windows 1 to 9
+ * @return number of windows with different results */
+static int CheckScan(int in_numlines, int in_lineWidth)
+{
+  CTestCloud l_scan;
+  RandomScan(l_scan, in_numlines, in_lineWidth);
+  CPtCloud l_in = l_scan.Cloud(in_numlines * in_lineWidth);
+  l_in.m_type = PCL_TYPE_SINGLE_ORIGIN_SCAN;
+  l_in.m_lineWidth = in_lineWidth;
+
+  Features l_features;
+  int l_numDiff = 0;
+  for (int l_windowSize = 1; l_windowSize <= 9; l_windowSize++)
+  {
+    CTestCloud l_expected;
+    l_expected.Resize(in_numlines * in_lineWidth);
+    CPtCloud l_expectedPcl = l_expected.Cloud(0);
+    l_features.DenoiseRange(l_in, l_expectedPcl, l_windowSize, 0.5f);
+    l_expected.Resize(l_expectedPcl.m_numPts);
+
+    // twice: the second scan checks that EndScan starts a new one
+    CRangeDenoiser l_denoiser(in_lineWidth, l_windowSize, 0.5f);
+    bool l_same = true;
+    for (int l_pass = 0; l_pass < 2; l_pass++)
+    {
+      CTestCloud l_out;
+      bool l_inRoom = DenoiseByRows(l_denoiser, l_scan, in_lineWidth, l_out);
+      l_same = l_same && l_inRoom && (l_out.m_pos.size() == l_expected.m_pos.size());
+      for (size_t i = 0; l_same && (i < l_out.m_pos.size()); i++)
+        l_same = (l_out.m_pos[i] == l_expected.m_pos[i]) && (l_out.m_color[i] == l_expected.m_color[i]) &&
+                 (l_out.m_normal[i] == l_expected.m_normal[i]);
+    }
+    printf("scan %4dx%-5d window %d: %7d points  %s\n", in_numlines, in_lineWidth, l_windowSize,
+           (int)l_expected.m_pos.size(), l_same ? "ok" : "DIFFERENT");
+    if (!l_same)
+      l_numDiff++;
+  }
+  return l_numDiff;
+}
+
+
+int main()
+{
+  srand(1);
+  int l_numDiff = CheckScan(64, 2048) + CheckScan(5, 64) + CheckScan(2, 7);
+  printf("windows with different results: %d\n", l_numDiff);
+
+  // times of the whole scan, and of the rows as they arrive
+  const int l_numlines = 64, l_lineWidth = 2048, l_reps = 20;
+  CTestCloud l_scan, l_expected;
+  RandomScan(l_scan, l_numlines, l_lineWidth);
+  l_expected.Resize(l_numlines * l_lineWidth);
+  CPtCloud l_in = l_scan.Cloud(l_numlines * l_lineWidth);
+  l_in.m_type = PCL_TYPE_SINGLE_ORIGIN_SCAN;
+  l_in.m_lineWidth = l_lineWidth;
+  Features l_features;
+  CRangeDenoiser l_denoiser(l_lineWidth, 5, 0.5f);
+
+  std::chrono::steady_clock::time_point l_start = std::chrono::steady_clock::now();
+  for (int r = 0; r < l_reps; r++)
+  {
+    CPtCloud l_out = l_expected.Cloud(0);
+    l_features.DenoiseRange(l_in, l_out, 5, 0.5f);
+  }
+  double l_wholeTime = SecondsSince(l_start) / l_reps;
+
+  l_start = std::chrono::steady_clock::now();
+  for (int r = 0; r < l_reps; r++)
+  {
+    CPtCloud l_out = l_expected.Cloud(0);
+    for (int row = 0; row < l_numlines; row++)
+    {
+      int index = row * l_lineWidth;
+      l_denoiser.AddRow(&l_scan.m_pos[index], &l_scan.m_color[index], &l_scan.m_normal[index], l_out);
+    }
+    l_denoiser.EndScan(l_out);
+  }
+  double l_rowsTime = SecondsSince(l_start) / l_reps;
+  printf("scan %dx%d window 5:  DenoiseRange %.3f ms  CRangeDenoiser %.3f ms\n", l_numlines, l_lineWidth,
+         1000 * l_wholeTime, 1000 * l_rowsTime);
+
+  return l_numDiff == 0 ? 0 : 1;
+}
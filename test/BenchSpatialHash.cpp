@@ -0,0 +1,103 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+//
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+// Benchmark: building the spatial hash of a large cloud.
+// Compares adding the points one by one (Add() + Build()) with the bulk build
+// from a cloud (Build(const CPtCloud&)), and checks that both give the same
+// nearest neighbors.
+// usage: BenchSpatialHash [number of points (millions)]
+
+#include "../include/ptCloud.h"
+#include "../src/common/SpatialHash.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace tpcl;
+
+
+/** seconds since an earlier time */
+static double SecondsSince(const std::chrono::steady_clock::time_point& in_start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - in_start).count();
+}
+
+
+/** a synthetic 2.5D scan: terrain with some vertical structures */
+static void FillCloud(CPtCloud& io_pcl, int in_numPts)
+{
+  io_pcl.m_numPts = in_numPts;
+  io_pcl.m_pos = new CVec3[in_numPts];
+  srand(1);
+  const float l_size = 2000.0f;   // meters
+  for (int i = 0; i < in_numPts; ++i)
+  {
+    float x = l_size * rand() / RAND_MAX;
+    float y = l_size * rand() / RAND_MAX;
+    float z = 5.0f * sinf(x * 0.01f) * cosf(y * 0.013f);
+    if (i % 10 == 0)
+      z += 10.0f * rand() / RAND_MAX;   // walls, trees
+    io_pcl.m_pos[i] = CVec3(x, y, z);
+  }
+}
+
+
+int main(int argc, char** argv)
+{
+  int l_numPts = int(((argc > 1) ? atof(argv[1]) : 5.0) * 1000000);
+  const float l_res = 0.5f;
+
+  CPtCloud l_pcl;
+  FillCloud(l_pcl, l_numPts);
+  printf("points: %d, cell size: %.2f\n", l_numPts, l_res);
+
+  // one by one
+  std::chrono::steady_clock::time_point l_start = std::chrono::steady_clock::now();
+  CSpatialHash2D l_added(l_res);
+  for (int i = 0; i < l_numPts; ++i)
+    l_added.Add(l_pcl.m_pos[i], (void*)(1));
+  double l_addTime = SecondsSince(l_start);
+  l_added.Build();
+  double l_addBuildTime = SecondsSince(l_start);
+  printf("Add() + Build():        %.3f sec (Add %.3f, Build %.3f)\n", l_addBuildTime, l_addTime, l_addBuildTime - l_addTime);
+
+  // bulk
+  l_start = std::chrono::steady_clock::now();
+  CSpatialHash2D l_bulk(l_res);
+  l_bulk.Build(l_pcl);
+  double l_bulkTime = SecondsSince(l_start);
+  printf("Build(const CPtCloud&): %.3f sec (x%.1f)\n", l_bulkTime, l_addBuildTime / l_bulkTime);
+
+  // both must find the same points
+  int l_numDiff = 0;
+  for (int q = 0; q < 100000; ++q)
+  {
+    CVec3 l_pos = l_pcl.m_pos[(q * 7919) % l_numPts] + CVec3(0.3f, -0.2f, 0.1f);
+    CVec3 l_pt1, l_pt2;
+    int l_idx1 = l_added.FindNearestIdx(l_pos, &l_pt1, 2.0f);
+    int l_idx2 = l_bulk.FindNearestIdx(l_pos, &l_pt2, 2.0f);
+    if (l_idx1 != l_idx2 && DistSqr(l_pos, l_pt1) != DistSqr(l_pos, l_pt2))
+      l_numDiff++;
+  }
+  printf("queries with different results: %d\n", l_numDiff);
+
+  delete[] l_pcl.m_pos;
+  return l_numDiff == 0 ? 0 : 1;
+}
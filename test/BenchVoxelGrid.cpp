@@ -0,0 +1,373 @@
+//
+// Copyright (c) 2016-2017 Geosim Ltd.
+//
+// Written by Ramon Axelrod       ramon.axelrod@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+// Benchmark: the voxel grid filter (DownSample and VoxelCentroids).
+// Checks the first point output against the original grid implementation
+// (order, positions, colors, normals; in place and not), the centroids,
+// counts and covariances against a reference computed in double, and a
+// grid whose number of voxels does not fit in 64 bits. Then times both
+// implementations.
+// usage: BenchVoxelGrid [number of points (millions)]
+
+#include "../include/common.h"
+#include "../include/ptCloud.h"
+#include "../src/common/features.h"
+#include <chrono>
+#include <map>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace tpcl;
+
+
+/** seconds since an earlier time */
+static double SecondsSince(const std::chrono::steady_clock::time_point& in_start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - in_start).count();
+}
+
+
+/** a cloud with its arrays */
+struct CTestCloud
+{
+  std::vector<CVec3> m_pos, m_normal;
+  std::vector<CColor> m_color;
+
+  void Resize(int in_numPts)
+  {
+    m_pos.resize(in_numPts);
+    m_normal.resize(in_numPts);
+    m_color.resize(in_numPts);
+  }
+
+  /** the cloud (colors and normals are optional) */
+  CPtCloud Cloud(bool in_attributes)
+  {
+    CPtCloud l_pcl;
+    l_pcl.m_numPts = (int)m_pos.size();
+    l_pcl.m_pos = m_pos.empty() ? 0 : &m_pos[0];
+    l_pcl.m_normal = (in_attributes && !m_normal.empty()) ? &m_normal[0] : 0;
+    l_pcl.m_color = (in_attributes && !m_color.empty()) ? &m_color[0] : 0;
+    return l_pcl;
+  }
+};
+
+
+/** random points in a box, with random normals and colors
+ * @param in_step       if > 0: the coordinates are multiples of in_step (points on the voxel borders) */
+static void RandomCloud(CTestCloud& out_cloud, int in_numPts, const CVec3& in_min, const CVec3& in_size, float in_step)
+{
+  out_cloud.Resize(in_numPts);
+  for (int i = 0; i < in_numPts; i++)
+  {
+    float l_c[3];
+    for (int a = 0; a < 3; a++)
+    {
+      float l_t = float(rand()) / RAND_MAX;
+      l_c[a] = (&in_size.x)[a] * l_t;
+      if (in_step > 0)
+        l_c[a] = floorf(l_c[a] / in_step + 0.5f) * in_step;
+      l_c[a] += (&in_min.x)[a];
+    }
+    out_cloud.m_pos[i] = CVec3(l_c[0], l_c[1], l_c[2]);
+    CVec3 l_normal(float(rand()) / RAND_MAX - 0.5f, float(rand()) / RAND_MAX - 0.5f, 1.0f);
+    Normalize(l_normal);
+    out_cloud.m_normal[i] = l_normal;
+    out_cloud.m_color[i] = CColor(rand() & 0xFFFF) | (CColor(rand() & 0xFFFF) << 16);
+  }
+}
+
+
+/** Features::DownSample before the voxel keys were sorted: a visited flag for every voxel of the grid
+ *  (only the dimensions are kept at least 1, so that flat clouds are defined). */
+static void OriginalDownSample(const CPtCloud& in_pcl, CPtCloud& out_pcl, float in_voxelSize)
+{
+  float InvVoxelSize = 1.0f / in_voxelSize;
+
+  //find min/max x/y/z:
+  CVec3 l_bbox[2] = { in_pcl.m_pos[0], in_pcl.m_pos[0] };
+  for (int ptrIndex = 1; ptrIndex < in_pcl.m_numPts; ptrIndex++)
+  {
+    l_bbox[0] = Min_ps(l_bbox[0], in_pcl.m_pos[ptrIndex]);
+    l_bbox[1] = Max_ps(l_bbox[1], in_pcl.m_pos[ptrIndex]);
+  }
+
+  //create downsampling vector:
+  int Mx = MaxT(int(ceil((l_bbox[1].x - l_bbox[0].x) * InvVoxelSize)), 1);
+  int My = MaxT(int(ceil((l_bbox[1].y - l_bbox[0].y) * InvVoxelSize)), 1);
+  int Mz = MaxT(int(ceil((l_bbox[1].z - l_bbox[0].z) * InvVoxelSize)), 1);
+  int Mxy = Mx*My;
+  unsigned int Mxyz = Mxy * Mz;
+
+  bool* VisitedVoxel = new bool[Mxyz];
+  memset(VisitedVoxel, false, Mxyz * sizeof(bool));
+
+  int outputSize = 0;
+  for (int ptrIndex = 0; ptrIndex < in_pcl.m_numPts; ptrIndex++)
+  {
+    float x = in_pcl.m_pos[ptrIndex].x;
+    float y = in_pcl.m_pos[ptrIndex].y;
+    float z = in_pcl.m_pos[ptrIndex].z;
+
+    //find point's voxel index:
+    int xInd = int(floor((x - l_bbox[0].x) * InvVoxelSize));
+    int yInd = int(floor((y - l_bbox[0].y) * InvVoxelSize));
+    int zInd = int(floor((z - l_bbox[0].z) * InvVoxelSize));
+
+    if (xInd == Mx) xInd--;
+    if (yInd == My) yInd--;
+    if (zInd == Mz) zInd--;
+
+    unsigned int index = zInd*Mxy + yInd*Mx + xInd;
+
+    //if we haven't filled this voxel with a point yet, add current point:
+    if (!VisitedVoxel[index])
+    {
+      out_pcl.m_pos[outputSize] = in_pcl.m_pos[ptrIndex];
+      if ((in_pcl.m_color != 0) && (out_pcl.m_color != 0))
+        out_pcl.m_color[outputSize] = in_pcl.m_color[ptrIndex];
+      if ((in_pcl.m_normal != 0) && (out_pcl.m_normal != 0))
+        out_pcl.m_normal[outputSize] = in_pcl.m_normal[ptrIndex];
+      outputSize++;
+
+      VisitedVoxel[index] = true;
+    }
+  }
+  delete[] VisitedVoxel;
+
+  out_pcl.m_numPts = outputSize;
+}
+
+
+/** reference grouping: the points of each voxel (voxels in the order of their first point).
+ *  Same voxels as OriginalDownSample, by (x, y, z) index instead of a grid, so any grid size works */
+static void ReferenceVoxels(const CPtCloud& in_pcl, float in_voxelSize, std::vector<std::vector<int> >& out_voxels)
+{
+  float InvVoxelSize = 1.0f / in_voxelSize;
+  CVec3 l_min = in_pcl.m_pos[0], l_max = in_pcl.m_pos[0];
+  for (int i = 1; i < in_pcl.m_numPts; i++)
+  {
+    l_min = Min_ps(l_min, in_pcl.m_pos[i]);
+    l_max = Max_ps(l_max, in_pcl.m_pos[i]);
+  }
+  double l_dim[3];
+  for (int a = 0; a < 3; a++)
+    l_dim[a] = MaxT(ceil(double(((&l_max.x)[a] - (&l_min.x)[a]) * InvVoxelSize)), 1.0);
+
+  std::map<std::vector<double>, int> l_voxelOf;
+  out_voxels.clear();
+  for (int i = 0; i < in_pcl.m_numPts; i++)
+  {
+    std::vector<double> l_key(3);
+    for (int a = 0; a < 3; a++)
+      l_key[a] = MinT(floor(double(((&in_pcl.m_pos[i].x)[a] - (&l_min.x)[a]) * InvVoxelSize)), l_dim[a] - 1);
+    std::map<std::vector<double>, int>::iterator l_it = l_voxelOf.find(l_key);
+    if (l_it == l_voxelOf.end())
+    {
+      l_it = l_voxelOf.insert(std::make_pair(l_key, (int)out_voxels.size())).first;
+      out_voxels.push_back(std::vector<int>());
+    }
+    out_voxels[l_it->second].push_back(i);
+  }
+}
+
+
+/** first point output of DownSample against the original implementation, out of place and in place
+ * @return          number of differences */
+static int CheckFirstPoints(IFeatures& in_features, CTestCloud& in_cloud, float in_voxelSize, const char* in_name)
+{
+  int l_num = (int)in_cloud.m_pos.size();
+  CPtCloud l_in = in_cloud.Cloud(true);
+
+  CTestCloud l_expected, l_out, l_inPlace = in_cloud;
+  l_expected.Resize(l_num);
+  l_out.Resize(l_num);
+  CPtCloud l_expectedPcl = l_expected.Cloud(true), l_outPcl = l_out.Cloud(true), l_inPlacePcl = l_inPlace.Cloud(true);
+  OriginalDownSample(l_in, l_expectedPcl, in_voxelSize);
+  in_features.DownSample(l_in, l_outPcl, in_voxelSize);
+  in_features.DownSample(l_inPlacePcl, l_inPlacePcl, in_voxelSize);
+
+  int l_numDiff = 0;
+  const CPtCloud* l_results[2] = { &l_outPcl, &l_inPlacePcl };
+  for (int r = 0; r < 2; r++)
+  {
+    const CPtCloud& l_res = *l_results[r];
+    if (l_res.m_numPts != l_expectedPcl.m_numPts)
+    {
+      printf("  %s%s: %d voxels instead of %d\n", in_name, r ? " (in place)" : "", l_res.m_numPts, l_expectedPcl.m_numPts);
+      l_numDiff++;
+      continue;
+    }
+    for (int i = 0; i < l_res.m_numPts; i++)
+    {
+      if (l_res.m_pos[i] != l_expectedPcl.m_pos[i] || l_res.m_color[i] != l_expectedPcl.m_color[i] || l_res.m_normal[i] != l_expectedPcl.m_normal[i])
+      {
+        if (l_numDiff++ < 5)
+          printf("  %s%s: voxel %d differs\n", in_name, r ? " (in place)" : "", i);
+      }
+    }
+  }
+  printf("%-28s first points: %7d voxels, %s\n", in_name, l_expectedPcl.m_numPts, l_numDiff ? "DIFFERENT" : "same as the original");
+  return l_numDiff;
+}
+
+
+/** centroids, counts, covariances, averaged colors and normals of VoxelCentroids against a reference in double
+ * @return          number of differences */
+static int CheckCentroids(IFeatures& in_features, CTestCloud& in_cloud, float in_voxelSize, const char* in_name)
+{
+  int l_num = (int)in_cloud.m_pos.size();
+  CPtCloud l_in = in_cloud.Cloud(true);
+  std::vector<std::vector<int> > l_voxels;
+  ReferenceVoxels(l_in, in_voxelSize, l_voxels);
+
+  CTestCloud l_out;
+  l_out.Resize(l_num);
+  CPtCloud l_outPcl = l_out.Cloud(true);
+  std::vector<int> l_counts(l_num);
+  std::vector<float> l_cov(6 * l_num);
+  in_features.VoxelCentroids(l_in, l_outPcl, in_voxelSize, &l_counts[0], &l_cov[0]);
+
+  // (the centroids are summed in float relative to the first point of the voxel)
+  double l_posTol = 1e-5 * in_voxelSize, l_covTol = 1e-4 * in_voxelSize * in_voxelSize;
+  int l_numDiff = 0;
+  if (l_outPcl.m_numPts != (int)l_voxels.size())
+  {
+    printf("  %s: %d centroids instead of %d\n", in_name, l_outPcl.m_numPts, (int)l_voxels.size());
+    return 1;
+  }
+  for (int v = 0; v < (int)l_voxels.size(); v++)
+  {
+    const std::vector<int>& l_pts = l_voxels[v];
+    int n = (int)l_pts.size();
+    double l_mean[3] = { 0, 0, 0 }, l_sqr[6] = { 0, 0, 0, 0, 0, 0 }, l_channels[4] = { 0, 0, 0, 0 };
+    CVec3 l_normal(0, 0, 0);
+    const CVec3& l_first = in_cloud.m_pos[l_pts[0]];
+    for (int i = 0; i < n; i++)
+    {
+      const CVec3& p = in_cloud.m_pos[l_pts[i]];
+      double d[3] = { double(p.x) - l_first.x, double(p.y) - l_first.y, double(p.z) - l_first.z };
+      for (int a = 0; a < 3; a++)
+        l_mean[a] += d[a] / n;
+      l_sqr[0] += d[0] * d[0] / n;  l_sqr[1] += d[0] * d[1] / n;  l_sqr[2] += d[0] * d[2] / n;
+      l_sqr[3] += d[1] * d[1] / n;  l_sqr[4] += d[1] * d[2] / n;  l_sqr[5] += d[2] * d[2] / n;
+      l_normal += in_cloud.m_normal[l_pts[i]];
+      for (int ch = 0; ch < 4; ch++)
+        l_channels[ch] += (in_cloud.m_color[l_pts[i]] >> (8 * ch)) & 0xFF;
+    }
+    double l_expCov[6] = { l_sqr[0] - l_mean[0] * l_mean[0], l_sqr[1] - l_mean[0] * l_mean[1], l_sqr[2] - l_mean[0] * l_mean[2],
+                           l_sqr[3] - l_mean[1] * l_mean[1], l_sqr[4] - l_mean[1] * l_mean[2], l_sqr[5] - l_mean[2] * l_mean[2] };
+    Normalize(l_normal);
+    CColor l_color = 0;
+    for (int ch = 0; ch < 4; ch++)
+      l_color |= CColor((unsigned long long)(l_channels[ch] + n / 2) / n) << (8 * ch);
+
+    bool l_ok = (l_counts[v] == n) && (l_outPcl.m_color[v] == l_color) && (Dist(l_outPcl.m_normal[v], l_normal) < 1e-4f);
+    const CVec3& l_centroid = l_outPcl.m_pos[v];
+    double l_got[3] = { double(l_centroid.x) - l_first.x, double(l_centroid.y) - l_first.y, double(l_centroid.z) - l_first.z };
+    for (int a = 0; a < 3; a++)
+      l_ok = l_ok && fabs(l_got[a] - l_mean[a]) <= l_posTol + 1e-7 * fabs((&l_first.x)[a]);
+    for (int k = 0; k < 6; k++)
+      l_ok = l_ok && fabs(l_cov[6 * v + k] - l_expCov[k]) <= l_covTol;
+    if (!l_ok && l_numDiff++ < 5)
+      printf("  %s: centroid %d differs (%d points, got %d)\n", in_name, v, n, l_counts[v]);
+  }
+  printf("%-28s centroids:    %7d voxels, %s\n", in_name, (int)l_voxels.size(), l_numDiff ? "DIFFERENT" : "same as the reference");
+  return l_numDiff;
+}
+
+
+/** a grid of more than 2^64 voxels (tiny voxels in a large box): DownSample against the reference grouping
+ * @return          number of differences */
+static int CheckHugeGrid(IFeatures& in_features)
+{
+  CTestCloud l_cloud;
+  RandomCloud(l_cloud, 20000, CVec3(-1e6f, -1e6f, -1e5f), CVec3(2e6f, 2e6f, 2e5f), 0);
+  for (int i = 0; i < 1000; i++)   // duplicates: voxels of several points
+    l_cloud.m_pos[20000 - 1000 + i] = l_cloud.m_pos[i * 7];
+  const float l_voxelSize = 1e-4f;
+  CPtCloud l_in = l_cloud.Cloud(true);
+  std::vector<std::vector<int> > l_voxels;
+  ReferenceVoxels(l_in, l_voxelSize, l_voxels);
+
+  CTestCloud l_out;
+  l_out.Resize(l_in.m_numPts);
+  CPtCloud l_outPcl = l_out.Cloud(true);
+  in_features.DownSample(l_in, l_outPcl, l_voxelSize);
+
+  int l_numDiff = (l_outPcl.m_numPts != (int)l_voxels.size()) ? 1 : 0;
+  for (int v = 0; v < (int)l_voxels.size() && !l_numDiff; v++)
+    if (l_outPcl.m_pos[v] != l_cloud.m_pos[l_voxels[v][0]] || l_outPcl.m_color[v] != l_cloud.m_color[l_voxels[v][0]])
+      l_numDiff++;
+  printf("%-28s first points: %7d voxels, %s\n", "2^64+ voxels", l_outPcl.m_numPts, l_numDiff ? "DIFFERENT" : "same as the reference");
+  return l_numDiff;
+}
+
+
+int main(int argc, char** argv)
+{
+  int l_numPts = int(((argc > 1) ? atof(argv[1]) : 2.0) * 1000000);
+  Features l_features;
+  int l_numDiff = 0;
+
+  srand(1);
+  struct CCase { const char* m_name; int m_numPts; CVec3 m_min, m_size; float m_step, m_voxelSize; };
+  const CCase l_cases[] = {
+    { "random",                   50000, CVec3(0, 0, 0),          CVec3(50, 50, 10),   0,     0.5f  },
+    { "far from the origin",      50000, CVec3(6.5e5f, 3.2e6f, 80), CVec3(100, 100, 20), 0,     1.0f  },
+    { "points on voxel borders",  50000, CVec3(-10, -10, 0),      CVec3(20, 20, 4),    0.25f, 0.5f  },
+    { "flat (z = 0)",             20000, CVec3(0, 0, 0),          CVec3(30, 30, 0),    0,     0.3f  },
+    { "single voxel",              1000, CVec3(1, 1, 1),          CVec3(0.1f, 0.1f, 0.1f), 0, 1.0f  },
+    { "one point a voxel",        20000, CVec3(0, 0, 0),          CVec3(5, 5, 1),      0,     0.01f },
+  };
+  for (int c = 0; c < int(sizeof(l_cases) / sizeof(l_cases[0])); c++)
+  {
+    const CCase& l_case = l_cases[c];
+    CTestCloud l_cloud;
+    RandomCloud(l_cloud, l_case.m_numPts, l_case.m_min, l_case.m_size, l_case.m_step);
+    l_numDiff += CheckFirstPoints(l_features, l_cloud, l_case.m_voxelSize, l_case.m_name);
+    l_numDiff += CheckCentroids(l_features, l_cloud, l_case.m_voxelSize, l_case.m_name);
+  }
+  l_numDiff += CheckHugeGrid(l_features);
+
+  // timing
+  CTestCloud l_cloud, l_out;
+  RandomCloud(l_cloud, l_numPts, CVec3(0, 0, 0), CVec3(200, 200, 20), 0);
+  l_out.Resize(l_numPts);
+  CPtCloud l_in = l_cloud.Cloud(true), l_outPcl = l_out.Cloud(true);
+  const float l_voxelSize = 0.2f;
+  std::chrono::steady_clock::time_point l_start = std::chrono::steady_clock::now();
+  OriginalDownSample(l_in, l_outPcl, l_voxelSize);
+  double l_originalTime = SecondsSince(l_start);
+  l_start = std::chrono::steady_clock::now();
+  l_features.DownSample(l_in, l_outPcl, l_voxelSize);
+  double l_time = SecondsSince(l_start);
+  l_start = std::chrono::steady_clock::now();
+  l_features.VoxelCentroids(l_in, l_outPcl, l_voxelSize);
+  double l_centroidTime = SecondsSince(l_start);
+  printf("%d points, %d voxels: original %.3f sec, DownSample %.3f sec, VoxelCentroids %.3f sec\n",
+         l_numPts, l_outPcl.m_numPts, l_originalTime, l_time, l_centroidTime);
+
+  printf("%s\n", l_numDiff ? "FAILED" : "all results match");
+  return l_numDiff == 0 ? 0 : 1;
+}